@@ -187,6 +187,23 @@ static inline unsigned long __cmpxchg(volatile void *ptr, unsigned long old,
 #define cmpxchg(ptr, o, n)                                              \
 	((__typeof__(*(ptr)))__cmpxchg((ptr), (unsigned long)(o),           \
                                    (unsigned long)(n), sizeof(*(ptr))))
+
+/* atomic_dec_if_positive() return the old value - 1, @v is only
+ * decremented if the result is not negative
+ */
+static inline int atomic_dec_if_positive(atomic_t *v)
+{
+    int c = atomic_read(v), old;
+
+    while (c > 0) {
+        old = __sync_val_compare_and_swap(&v->counter, c, c - 1);
+        if (old == c)
+            break;
+        c = old;
+    }
+
+    return c - 1;
+}
 #endif  /* for user space only */
 
 #endif
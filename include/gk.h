@@ -66,7 +66,10 @@
 #define GK_MDS2MDS_GB         0x000000008000000a /* gossip bitmap */
 #define GK_MDS2MDS_GF         0x000000008000000b /* gossip ft info */
 #define GK_MDS2MDS_GR         0x000000008000000c /* gossip rdir */
+#define GK_MDS2MDS_REPL       0x000000008000000d /* replication log */
+#define GK_MDS2MDS_MIGRATE    0x000000008000000e /* namespace migration */
 #define GK_MDS2MDS_BRANCH     0x000000008000000f /* branch commands */
+#define GK_MDS2MDS_HANDOFF    0x0000000080000011 /* ring join handoff */
 #define GK_MDS_HA             0x0000000080000010 /* ha request */
 #define GK_MDS_RECOVERY       0x0000000080000020 /* recovery analyse
                                                     * request */
@@ -126,6 +129,12 @@
 #define GK_R2_PROFILE         0x0000000040000023 /* gather profile */
 #define GK_R2_INFO            0x0000000040000024 /* get info */
 #define GK_R2_GETASITE        0x0000000040000026 /* get active site */
+#define GK_R2_JOIN            0x0000000040000027 /* join the MDS ring */
+#define GK_R2_OWNER           0x0000000040000028 /* namespace owners */
+
+/* GK_R2_OWNER ops in tx.arg0 */
+#define GK_OWNER_SET          0 /* a namespace is moved, arg1 is the owner */
+#define GK_OWNER_SYNC         1 /* all the moved namespaces of a site */
 
 /* ROOT/RING to * */
 #define GK_FR2_RU             0x0000000041000000 /* ring updates to all
@@ -133,6 +142,11 @@
 #define GK_FR2_AU             0x0000000042000000 /* address table updates to
                                                     * all sites */
 
+/* R2 register group id, only group GK_GID_RING MDSes may join the consistent
+ * hash ring w/ an explicit GK_R2_JOIN */
+#define GK_GID_RING           0
+#define GK_GID_REPLICA        1
+
 /* * to OSD */
 #define GK_OSD_READ           0x0000000010000001 /* object read */
 #define GK_OSD_WRITE          0x0000000010000002 /* object write */
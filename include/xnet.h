@@ -49,6 +49,10 @@ struct xnet_msg_tx
 
 #define XNET_NEED_RESEND        0x0100 /* otherwise, return on send err */
 #define XNET_FWD                0x0200 /* forwarded msg */
+#define XNET_RESERVED_USED      0x0400 /* tx.reserved carries request
+                                        * data, do not pad the fd */
+#define XNET_DEADLINE           0x0800 /* tx.err of the request carries
+                                        * the budget in ms */
 
 #define XNET_PTRESTORE          0x8000 /* temp flag for xnet-simple pointer
                                         * restore */
@@ -97,6 +101,8 @@ struct xnet_msg
     void *private;
 
     atomic_t ref;
+    u64 qts;                    /* queued timestamp in us, receiver only */
+    u64 deadline;               /* absolute deadline in us, receiver only */
 #ifdef USE_XNET_SIMPLE
     sem_t event;
     time_t ts;
@@ -160,6 +166,7 @@ struct xnet_conf
     u32 enable_resend:1;
     u32 pause:1;
     u32 use_rpy_cache:1;
+    int reactors;               /* # of receive reactors */
 };
 #else
 struct xnet_context *xnet_register_type(u8, struct xnet_type_ops *);
@@ -173,6 +180,9 @@ int xnet_unregister_type(struct xnet_context *);
 struct xnet_msg *xnet_alloc_msg(u8 alloc_flag);
 void xnet_free_msg(struct xnet_msg *);
 void xnet_raw_free_msg(struct xnet_msg *);
+void *xnet_buf_alloc(size_t size, int alloc_flag);
+void xnet_buf_free(void *buf, int alloc_flag);
+void xnet_pool_drain(void);
 
 int xnet_msg_add_sdata(struct xnet_msg *, void *, u32);
 int xnet_msg_add_rdata(struct xnet_msg *, void *, u32);
@@ -189,6 +199,7 @@ int xnet_send(struct xnet_context *xc, struct xnet_msg *m);
 #define xnet_msg_set_site(m, id) ((m)->tx.dsite_id = id)
 
 void xnet_set_magic(u8 magic);
+void xnet_set_reactors(int nr);
 
 static inline 
 void xnet_msg_fill_cmd(struct xnet_msg *m, u64 cmd, u64 arg0, u64 arg1) 
@@ -222,6 +233,16 @@ void xnet_msg_set_err(struct xnet_msg *msg, int err)
     msg->tx.err = err;
 }
 
+/* xnet_msg_set_budget() tell the receiver that the request is abandoned
+ * after @ms, it may drop the request w/ -ETIMEDOUT then
+ */
+static inline
+void xnet_msg_set_budget(struct xnet_msg *msg, u32 ms)
+{
+    msg->tx.flag |= XNET_DEADLINE;
+    msg->tx.err = ms;
+}
+
 static inline
 void xnet_msg_fill_reqno(struct xnet_msg *msg, u64 reqno)
 {
@@ -28,8 +28,13 @@ struct xnet_prof
 {
     atomic64_t msg_alloc;
     atomic64_t msg_free;
+    atomic64_t msg_cache_hit;   /* msg_alloc served by the msg pool */
+    atomic64_t buf_alloc;
+    atomic64_t buf_cache_hit;   /* buf_alloc served by the buffer pools */
     atomic64_t inbytes;
     atomic64_t outbytes;
+    atomic64_t recvs;           /* # of recv() syscalls */
+    atomic64_t inmsgs;          /* # of received messages */
 
     atomic64_t active_links;
 };
@@ -0,0 +1,91 @@
+/**
+ * Copyright (c) 2019 Ma Can <ml.macana@gmail.com>
+ *                           <macan@iie.ac.cn>
+ *
+ * Armed with EMACS.
+ * Time-stamp: <2019-10-12 10:21:37 macan>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "gk.h"
+#include "lib.h"
+
+/* Bloom filter over precomputed 64-bit hash values.
+ *
+ * The k probe positions are derived from the two 32-bit halves of the
+ * hash (Kirsch-Mitzenmacher double hashing), so callers hash the key
+ * exactly once. Bits are only ever set, concurrent adders and testers
+ * need no lock.
+ */
+
+int bloom_init(struct bloom_filter *bf, u64 nbits, int k)
+{
+    u64 size;
+
+    if (!nbits || k <= 0)
+        return -EINVAL;
+
+    /* round up to power of 2 to use mask instead of modulo */
+    size = 1UL << (fls64(nbits - 1) + 1);
+    if (size < 64)
+        size = 64;
+    bf->bits = xhugealloc(size >> 3);
+    if (!bf->bits) {
+        gk_err(lib, "xhugealloc() bloom filter bits (%ld) failed\n", size);
+        return -ENOMEM;
+    }
+    bf->mask = size - 1;
+    bf->k = k;
+
+    return 0;
+}
+
+void bloom_destroy(struct bloom_filter *bf)
+{
+    if (bf->bits)
+        xhugefree(bf->bits, (bf->mask + 1) >> 3);
+    bf->bits = NULL;
+}
+
+void bloom_add(struct bloom_filter *bf, u64 hash)
+{
+    u64 h1 = hash & 0xffffffff, h2 = hash >> 32, bit;
+    int i;
+
+    for (i = 0; i < bf->k; i++) {
+        bit = (h1 + i * h2) & bf->mask;
+        /* avoid dirtying the cache line if the bit is already set */
+        if (!(bf->bits[bit >> 6] & (1UL << (bit & 63))))
+            __sync_fetch_and_or(&bf->bits[bit >> 6], 1UL << (bit & 63));
+    }
+}
+
+/* bloom_test() return 0 if the hash is definitely not in the set
+ */
+int bloom_test(struct bloom_filter *bf, u64 hash)
+{
+    u64 h1 = hash & 0xffffffff, h2 = hash >> 32, bit;
+    int i;
+
+    for (i = 0; i < bf->k; i++) {
+        bit = (h1 + i * h2) & bf->mask;
+        if (!(bf->bits[bit >> 6] & (1UL << (bit & 63))))
+            return 0;
+    }
+
+    return 1;
+}
@@ -331,6 +331,12 @@ static inline u64 gk_hash_nsht(void *key, int keylen)
     return __murmurhash64a((const void *)key, keylen, 0xab90175de9084);
 }
 
+/* placement on the consistent hash ring, independent of gk_hash_nsht() */
+static inline u64 gk_hash_chring(void *key, int keylen)
+{
+    return __murmurhash64a((const void *)key, keylen, 0x71c3b8e2d0f5a649);
+}
+
 static inline u64 gk_hash_ns(void *key, int keylen)
 {
 #if 0
@@ -0,0 +1,219 @@
+/**
+ * Copyright (c) 2019 Ma Can <ml.macana@gmail.com>
+ *                           <macan@iie.ac.cn>
+ *
+ * Armed with EMACS.
+ * Time-stamp: <2019-10-22 15:06:41 macan>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "gk.h"
+#include "lib.h"
+#include <sys/mman.h>
+
+/* Huge page backed memory for big index arrays (hash buckets, bloom
+ * bits), which are accessed at random and miss the TLB on 4KB pages.
+ *
+ * Arrays >= HUGEMEM_MIN are mmap()ed in 2MB units: explicit huge pages
+ * (MAP_HUGETLB) first, then a 2MB aligned anonymous map w/
+ * MADV_HUGEPAGE for the transparent huge pages. Smaller ones come from
+ * xzalloc(), as rounding them up would waste more than they save. The
+ * memory is zeroed, xhugefree() must be called w/ the same size.
+ */
+
+#define HUGEMEM_PAGE    (2UL * 1024 * 1024)
+#define HUGEMEM_MIN     HUGEMEM_PAGE
+
+int hugemem_mode = HUGEMEM_AUTO;
+static int hugemem_no_hugetlb = 0; /* no huge page reserved */
+
+static inline
+size_t __hugemem_round(size_t size)
+{
+    return (size + HUGEMEM_PAGE - 1) & ~(HUGEMEM_PAGE - 1);
+}
+
+void *xhugealloc(size_t size)
+{
+    void *p;
+    char *q;
+    size_t len;
+
+    if (size < HUGEMEM_MIN)
+        return xzalloc(size);
+
+    len = __hugemem_round(size);
+    if (hugemem_mode == HUGEMEM_AUTO && !hugemem_no_hugetlb) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            return p;
+        /* do not retry, the pool does not refill itself */
+        hugemem_no_hugetlb = 1;
+        gk_info(lib, "no hugetlb pages (%d), use transparent huge pages\n",
+                errno);
+    }
+
+    /* over map by one huge page to align the start */
+    p = mmap(NULL, len + HUGEMEM_PAGE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        gk_err(lib, "mmap() %ld bytes failed w/ %d\n", len, errno);
+        return NULL;
+    }
+    q = (char *)(((unsigned long)p + HUGEMEM_PAGE - 1) & ~(HUGEMEM_PAGE - 1));
+    if (q > (char *)p)
+        munmap(p, q - (char *)p);
+    munmap(q + len, (char *)p + HUGEMEM_PAGE - q);
+
+    if (madvise(q, len, hugemem_mode == HUGEMEM_OFF ?
+                MADV_NOHUGEPAGE : MADV_HUGEPAGE))
+        gk_debug(lib, "madvise() %ld bytes failed w/ %d\n", len, errno);
+
+    return q;
+}
+
+void xhugefree(void *p, size_t size)
+{
+    if (!p)
+        return;
+    if (size < HUGEMEM_MIN) {
+        xfree(p);
+        return;
+    }
+    munmap(p, __hugemem_round(size));
+}
+
+#ifdef UNIT_TEST
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+/* Random bucket walks over a ns_ht_size like table, 4KB vs huge pages,
+ * w/ the dTLB load misses if the PMU is visible.
+ */
+struct bucket
+{
+    struct hlist_head h;
+    xlock_t lock;
+};
+
+static int __perf_open(void)
+{
+    struct perf_event_attr pe;
+
+    memset(&pe, 0, sizeof(pe));
+    pe.size = sizeof(pe);
+    pe.type = PERF_TYPE_HW_CACHE;
+    pe.config = PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+/* __anon_huge_kb() return the THP backed anonymous memory in KB
+ */
+static long __anon_huge_kb(void)
+{
+    char line[256];
+    long kb = -1;
+    FILE *f;
+
+    f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(f);
+
+    return kb;
+}
+
+static void __run(char *name, long nr, long ops)
+{
+    struct bucket *b;
+    struct timeval begin, end;
+    u64 seed = 0x9e3779b97f4a7c15UL, misses = 0, sum = 0;
+    long i;
+    int fd;
+
+    b = xhugealloc(nr * sizeof(*b));
+    if (!b) {
+        printf("%s: alloc failed\n", name);
+        return;
+    }
+    for (i = 0; i < nr; i++) {
+        INIT_HLIST_HEAD(&b[i].h);
+        xlock_init(&b[i].lock);
+    }
+
+    fd = __perf_open();
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    gettimeofday(&begin, NULL);
+    for (i = 0; i < ops; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        xlock_lock(&b[seed % nr].lock);
+        sum += hlist_empty(&b[seed % nr].h);
+        xlock_unlock(&b[seed % nr].lock);
+    }
+    gettimeofday(&end, NULL);
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+            misses = 0;
+        close(fd);
+    }
+
+    printf("%-8s %ld buckets: %.1f Mops/s, dTLB load misses %s%.3f/op, "
+           "AnonHugePages %ld kB\n",
+           name, nr, ops / ((end.tv_sec - begin.tv_sec) * 1e6 +
+                            (end.tv_usec - begin.tv_usec)),
+           fd >= 0 ? "" : "(n/a) ", fd >= 0 ? (double)misses / ops : 0.0,
+           __anon_huge_kb());
+    xhugefree(b, nr * sizeof(*b));
+    if (sum > ops)
+        printf("impossible\n");
+}
+
+int main(int argc, char *argv[])
+{
+    long nr = 2 * 1024 * 1024, ops = 50000000;
+
+    if (argc > 1)
+        nr = atol(argv[1]);
+    if (argc > 2)
+        ops = atol(argv[2]);
+
+    hugemem_mode = HUGEMEM_OFF;
+    __run("4KB", nr, ops);
+    hugemem_mode = HUGEMEM_AUTO;
+    __run("huge", nr, ops);
+
+    return 0;
+}
+#endif
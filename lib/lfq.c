@@ -0,0 +1,291 @@
+/**
+ * Copyright (c) 2019 Ma Can <ml.macana@gmail.com>
+ *                           <macan@iie.ac.cn>
+ *
+ * Armed with EMACS.
+ * Time-stamp: <2019-10-24 11:27:05 macan>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "gk.h"
+#include "lib.h"
+
+/* Bounded lock-free MPMC queue (D. Vyukov's array queue).
+ *
+ * Cell i carries a sequence number: seq == pos means free for the
+ * producer at pos, seq == pos + 1 means filled for the consumer at pos.
+ * A producer (consumer) claims its position w/ one CAS on the tail
+ * (head), then publishes the cell by storing the next sequence. A
+ * consumer may claim a run of filled cells w/ one CAS, which is the
+ * batched dequeue.
+ */
+
+int lfq_init(struct lfq *q, u32 size)
+{
+    u64 i, n;
+
+    if (size < 2)
+        size = 2;
+    n = 1UL << (fls64(size - 1) + 1);
+    q->cells = xmalloc(n * sizeof(struct lfq_cell));
+    if (!q->cells) {
+        gk_err(lib, "xmalloc() %ld lfq cells failed\n", n);
+        return -ENOMEM;
+    }
+    for (i = 0; i < n; i++) {
+        q->cells[i].seq = i;
+        q->cells[i].data = NULL;
+    }
+    q->mask = n - 1;
+    q->tail = 0;
+    q->head = 0;
+
+    return 0;
+}
+
+void lfq_destroy(struct lfq *q)
+{
+    xfree(q->cells);
+    q->cells = NULL;
+}
+
+/* lfq_enqueue() return 0 or -EAGAIN if the queue is full
+ */
+int lfq_enqueue(struct lfq *q, void *data)
+{
+    struct lfq_cell *c;
+    u64 pos, seq;
+    long diff;
+
+    pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        c = &q->cells[pos & q->mask];
+        seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -EAGAIN;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    c->data = data;
+    __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* lfq_dequeue_batch() pop up to @nr entries into @out, return the # of
+ * entries popped
+ */
+int lfq_dequeue_batch(struct lfq *q, void **out, int nr)
+{
+    struct lfq_cell *c;
+    u64 pos, seq;
+    int i, n;
+
+    pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    for (;;) {
+        /* count the filled run from pos */
+        for (n = 0; n < nr; n++) {
+            c = &q->cells[(pos + n) & q->mask];
+            seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+            if (seq != pos + n + 1)
+                break;
+        }
+        if (!n) {
+            c = &q->cells[pos & q->mask];
+            seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+            if ((long)seq - (long)(pos + 1) < 0)
+                return 0;       /* empty */
+            /* another consumer moved on, retry */
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&q->head, &pos, pos + n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+    for (i = 0; i < n; i++) {
+        c = &q->cells[(pos + i) & q->mask];
+        out[i] = c->data;
+        __atomic_store_n(&c->seq, pos + i + q->mask + 1, __ATOMIC_RELEASE);
+    }
+
+    return n;
+}
+
+#ifdef UNIT_TEST
+/* P producers and C consumers pass N items through the lfq w/ batched
+ * dequeue and suppressed wakeups, then through a mutex protected list
+ * w/ a semaphore post per item (the old spool queue).
+ */
+struct item
+{
+    struct list_head list;
+};
+
+static struct lfq q;
+static LIST_HEAD(lq);
+static xlock_t lq_lock = XLOCK_INITIALIZER;
+static sem_t sem;
+static atomic_t sleepers;
+static atomic64_t consumed, wakeups;
+static long total;
+static int use_lfq;
+
+static void __wake(void)
+{
+    /* take a sleeper token, its owner is (or will be) in sem_wait() */
+    if (atomic_read(&sleepers) > 0 &&
+        atomic_dec_if_positive(&sleepers) >= 0) {
+        atomic64_inc(&wakeups);
+        sem_post(&sem);
+    }
+}
+
+static void *producer(void *arg)
+{
+    struct item *it = arg;
+    long i, n = (long)it->list.next;
+
+    for (i = 0; i < n; i++) {
+        if (use_lfq) {
+            while (lfq_enqueue(&q, it))
+                sched_yield();
+            __sync_synchronize();
+            __wake();
+        } else {
+            xlock_lock(&lq_lock);
+            list_add_tail(&(it + 1 + i)->list, &lq);
+            xlock_unlock(&lq_lock);
+            atomic64_inc(&wakeups);
+            sem_post(&sem);
+        }
+    }
+
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    void *batch[16];
+    struct item *it;
+    int n;
+
+    while (atomic64_read(&consumed) < total) {
+        if (use_lfq) {
+            n = lfq_dequeue_batch(&q, batch, 16);
+            if (n) {
+                atomic64_add(n, &consumed);
+                continue;
+            }
+            atomic_inc(&sleepers);
+            __sync_synchronize();
+            n = lfq_dequeue_batch(&q, batch, 16);
+            if (n) {
+                atomic64_add(n, &consumed);
+                /* retract the token, or eat the post bound to it */
+                if (atomic_dec_if_positive(&sleepers) < 0)
+                    sem_wait(&sem);
+                continue;
+            }
+            sem_wait(&sem);
+        } else {
+            sem_wait(&sem);
+            it = NULL;
+            xlock_lock(&lq_lock);
+            if (!list_empty(&lq)) {
+                it = list_first_entry(&lq, struct item, list);
+                list_del_init(&it->list);
+            }
+            xlock_unlock(&lq_lock);
+            if (it)
+                atomic64_inc(&consumed);
+        }
+    }
+
+    return NULL;
+}
+
+static void __run(int P, int C, long N)
+{
+    pthread_t pt[P + C];
+    struct item *its[P];
+    struct timeval begin, end;
+    double us;
+    int i;
+
+    atomic64_set(&consumed, 0);
+    atomic64_set(&wakeups, 0);
+    atomic_set(&sleepers, 0);
+    sem_init(&sem, 0, 0);
+    total = N;
+
+    gettimeofday(&begin, NULL);
+    for (i = 0; i < C; i++)
+        pthread_create(&pt[P + i], NULL, consumer, NULL);
+    for (i = 0; i < P; i++) {
+        its[i] = xzalloc((N / P + 1) * sizeof(struct item));
+        its[i]->list.next = (void *)(N / P);
+        pthread_create(&pt[i], NULL, producer, its[i]);
+    }
+    for (i = 0; i < P; i++)
+        pthread_join(pt[i], NULL);
+    /* wake all the consumers up */
+    for (i = 0; i < C; i++)
+        sem_post(&sem);
+    for (i = 0; i < C; i++)
+        pthread_join(pt[P + i], NULL);
+    gettimeofday(&end, NULL);
+
+    us = (end.tv_sec - begin.tv_sec) * 1e6 + (end.tv_usec - begin.tv_usec);
+    printf("%-10s %dP/%dC: %.2f Mops/s, %.3f wakeups/op\n",
+           use_lfq ? "lfq+batch" : "list+sem", P, C, N / us,
+           (double)atomic64_read(&wakeups) / N);
+    for (i = 0; i < P; i++)
+        xfree(its[i]);
+    sem_destroy(&sem);
+}
+
+int main(int argc, char *argv[])
+{
+    int P = 1, C = 4;
+    long N = 4000000;
+
+    if (argc > 1)
+        P = atoi(argv[1]);
+    if (argc > 2)
+        C = atoi(argv[2]);
+    if (argc > 3)
+        N = atol(argv[3]);
+    N = N / P * P;
+
+    lfq_init(&q, 4096);
+    use_lfq = 0;
+    __run(P, C, N);
+    use_lfq = 1;
+    __run(P, C, N);
+    lfq_destroy(&q);
+
+    return 0;
+}
+#endif
@@ -321,6 +321,101 @@ int brt_loop_on_ranges(void **rootp, void *arg,
 /* crc32.c */
 u32 crc32c(u32 crc, const u8 *data, unsigned int length);
 
+/* bloom.c: bloom filter on 64-bit hash values */
+struct bloom_filter
+{
+    u64 *bits;
+    u64 mask;                   /* # of bits - 1, power of 2 */
+    int k;                      /* # of probes */
+};
+
+int bloom_init(struct bloom_filter *bf, u64 nbits, int k);
+void bloom_destroy(struct bloom_filter *bf);
+void bloom_add(struct bloom_filter *bf, u64 hash);
+int bloom_test(struct bloom_filter *bf, u64 hash);
+
+/* ring.c: consistent hash ring w/ virtual nodes */
+struct chring_point
+{
+    u64 point;
+    u64 site_id;
+};
+
+struct chring
+{
+    xrwlock_t rwlock;
+    u64 version;                /* bumped on each membership change */
+    int vnodes;                 /* # of points per site */
+    int nsite, npoint;
+    u64 *sites;                 /* sorted member list */
+    struct chring_point *points; /* sorted by point */
+};
+
+/* the wire format, see chring_pack() */
+struct chring_tx
+{
+    u64 version;
+    u32 vnodes;
+    u32 nsite;
+    u64 sites[0];
+};
+
+int chring_init(struct chring *r, int vnodes);
+void chring_destroy(struct chring *r);
+int chring_add_site(struct chring *r, u64 site_id);
+int chring_del_site(struct chring *r, u64 site_id);
+u64 chring_lookup(struct chring *r, u64 hash);
+int chring_get_sites(struct chring *r, u64 **sites);
+int chring_pack(struct chring *r, void **data, int *len);
+int chring_unpack(struct chring *r, void *data, int len);
+
+/* hugemem.c: huge page backed big arrays */
+#define HUGEMEM_OFF     0       /* 4KB pages */
+#define HUGEMEM_AUTO    1       /* hugetlb, then transparent huge pages */
+extern int hugemem_mode;
+
+void *xhugealloc(size_t size);
+void xhugefree(void *p, size_t size);
+
+/* lfq.c: bounded lock-free MPMC queue */
+struct lfq_cell
+{
+    u64 seq;
+    void *data;
+};
+
+struct lfq
+{
+    struct lfq_cell *cells;
+    u64 mask;
+    u64 tail __attribute__((aligned(64))); /* next enqueue position */
+    u64 head __attribute__((aligned(64))); /* next dequeue position */
+} __attribute__((aligned(64)));
+
+int lfq_init(struct lfq *q, u32 size);
+void lfq_destroy(struct lfq *q);
+int lfq_enqueue(struct lfq *q, void *data);
+int lfq_dequeue_batch(struct lfq *q, void **out, int nr);
+
+static inline int lfq_empty(struct lfq *q)
+{
+    return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) ==
+        __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+/* numa.c: NUMA topology and thread/memory placement */
+struct numa_topo
+{
+    int nr;                     /* # of nodes w/ CPUs */
+    int *id;                    /* node ids, may be sparse */
+    cpu_set_t *cpus;            /* CPUs of each node */
+};
+
+int numa_topo_init(struct numa_topo *nt);
+void numa_topo_destroy(struct numa_topo *nt);
+int numa_topo_bind(struct numa_topo *nt, int idx);
+int numa_addr_node(void *addr);
+
 /* lmdb */
 #include "lmdb.h"
 
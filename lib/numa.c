@@ -0,0 +1,183 @@
+/**
+ * Copyright (c) 2019 Ma Can <ml.macana@gmail.com>
+ *                           <macan@iie.ac.cn>
+ *
+ * Armed with EMACS.
+ * Time-stamp: <2019-10-21 09:52:17 macan>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "gk.h"
+#include "lib.h"
+#include <sys/syscall.h>
+
+/* NUMA topology and placement w/o libnuma.
+ *
+ * The nodes and their CPUs are read from sysfs, memory placement goes
+ * through the raw set_mempolicy() and get_mempolicy() syscalls. A thread
+ * bound to a node runs on its CPUs and allocates from it first, thus the
+ * per-thread malloc arenas of the thread stay on the node. W/o the sysfs
+ * tree there is one node owning all the CPUs.
+ */
+
+#define NUMA_SYSFS      "/sys/devices/system/node"
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1
+#endif
+#ifndef MPOL_F_NODE
+#define MPOL_F_NODE     (1 << 0)
+#define MPOL_F_ADDR     (1 << 1)
+#endif
+
+/* __numa_read_list() parse a sysfs list like "0-3,8-11" into a cpu set,
+ * return the # of entries
+ */
+static int __numa_read_list(char *path, cpu_set_t *set)
+{
+    char buf[4096], *p, *q;
+    FILE *f;
+    long lo, hi;
+    int nr = 0;
+
+    CPU_ZERO(set);
+    f = fopen(path, "r");
+    if (!f)
+        return -errno;
+    if (!fgets(buf, sizeof(buf), f)) {
+        fclose(f);
+        return -EINVAL;
+    }
+    fclose(f);
+
+    for (p = buf; *p && *p != '\n';) {
+        lo = strtol(p, &q, 10);
+        if (q == p)
+            return -EINVAL;
+        hi = lo;
+        if (*q == '-') {
+            p = q + 1;
+            hi = strtol(p, &q, 10);
+            if (q == p)
+                return -EINVAL;
+        }
+        for (; lo <= hi && lo < CPU_SETSIZE; lo++) {
+            CPU_SET(lo, set);
+            nr++;
+        }
+        p = (*q == ',') ? q + 1 : q;
+    }
+
+    return nr;
+}
+
+int numa_topo_init(struct numa_topo *nt)
+{
+    char path[256];
+    cpu_set_t nodes;
+    int i, n, err;
+
+    memset(nt, 0, sizeof(*nt));
+    n = __numa_read_list(NUMA_SYSFS "/online", &nodes);
+    if (n <= 0)
+        goto single;
+
+    nt->id = xzalloc(n * sizeof(int));
+    nt->cpus = xzalloc(n * sizeof(cpu_set_t));
+    if (!nt->id || !nt->cpus) {
+        numa_topo_destroy(nt);
+        return -ENOMEM;
+    }
+    for (i = 0; i < CPU_SETSIZE && nt->nr < n; i++) {
+        if (!CPU_ISSET(i, &nodes))
+            continue;
+        snprintf(path, sizeof(path), NUMA_SYSFS "/node%d/cpulist", i);
+        err = __numa_read_list(path, &nt->cpus[nt->nr]);
+        if (err <= 0) {
+            /* memory only node, no thread can live there */
+            continue;
+        }
+        nt->id[nt->nr++] = i;
+    }
+    if (nt->nr)
+        return 0;
+    numa_topo_destroy(nt);
+
+single:
+    nt->id = xzalloc(sizeof(int));
+    nt->cpus = xzalloc(sizeof(cpu_set_t));
+    if (!nt->id || !nt->cpus) {
+        numa_topo_destroy(nt);
+        return -ENOMEM;
+    }
+    sched_getaffinity(0, sizeof(cpu_set_t), nt->cpus);
+    nt->nr = 1;
+
+    return 0;
+}
+
+void numa_topo_destroy(struct numa_topo *nt)
+{
+    xfree(nt->id);
+    xfree(nt->cpus);
+    nt->id = NULL;
+    nt->cpus = NULL;
+    nt->nr = 0;
+}
+
+/* numa_topo_bind() run the calling thread on the CPUs of node @idx and
+ * prefer its memory
+ */
+int numa_topo_bind(struct numa_topo *nt, int idx)
+{
+    unsigned long mask[4] = {0,};
+    int err;
+
+    if (idx < 0 || idx >= nt->nr)
+        return -EINVAL;
+
+    err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                 &nt->cpus[idx]);
+    if (err) {
+        gk_err(lib, "bind to node %d cpus failed w/ %d\n", nt->id[idx], err);
+        return -err;
+    }
+    if (nt->id[idx] >= sizeof(mask) * 8)
+        return 0;
+    mask[nt->id[idx] / 64] = 1UL << (nt->id[idx] % 64);
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+                sizeof(mask) * 8 + 1)) {
+        err = -errno;
+        gk_warning(lib, "prefer node %d memory failed w/ %d\n",
+                   nt->id[idx], err);
+    }
+
+    return 0;
+}
+
+/* numa_addr_node() return the node id of the page holding @addr
+ */
+int numa_addr_node(void *addr)
+{
+    int node = -1;
+
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+                MPOL_F_NODE | MPOL_F_ADDR))
+        return -errno;
+
+    return node;
+}
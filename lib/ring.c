@@ -0,0 +1,336 @@
+/**
+ * Copyright (c) 2019 Ma Can <ml.macana@gmail.com>
+ *                           <macan@iie.ac.cn>
+ *
+ * Armed with EMACS.
+ * Time-stamp: <2019-10-18 10:12:45 macan>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "gk.h"
+#include "lib.h"
+
+/* Consistent hash ring with virtual nodes.
+ *
+ * Each member site owns r->vnodes points on a 64-bit ring, a key hash
+ * belongs to the site of the first point clockwise. Points are derived
+ * from the site id only, thus the ring travels as a (version, vnodes,
+ * member list) tuple and every receiver rebuilds the same points.
+ * Adding the N-th site takes over ~1/N of the keyspace, from all the
+ * other sites evenly.
+ */
+
+#define CHRING_SALT     0x5be0cd19137e2179UL
+
+static int __chp_cmp(const void *a, const void *b)
+{
+    const struct chring_point *x = a, *y = b;
+
+    if (x->point != y->point)
+        return (x->point < y->point) ? -1 : 1;
+    /* tie breaker to keep all the replicas of the ring identical */
+    return (x->site_id < y->site_id) ? -1 : (x->site_id > y->site_id);
+}
+
+static int __site_cmp(const void *a, const void *b)
+{
+    u64 x = *(u64 *)a, y = *(u64 *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+int chring_init(struct chring *r, int vnodes)
+{
+    memset(r, 0, sizeof(*r));
+    xrwlock_init(&r->rwlock);
+    r->vnodes = vnodes;
+
+    return 0;
+}
+
+void chring_destroy(struct chring *r)
+{
+    xfree(r->sites);
+    xfree(r->points);
+    r->sites = NULL;
+    r->points = NULL;
+    r->nsite = r->npoint = 0;
+    xrwlock_destroy(&r->rwlock);
+}
+
+/* __chring_rebuild() regenerate the points, hold the wlock
+ */
+static int __chring_rebuild(struct chring *r)
+{
+    struct chring_point *p = NULL;
+    int i, j, n = 0;
+
+    if (r->nsite && r->vnodes > 0) {
+        p = xmalloc(r->nsite * r->vnodes * sizeof(*p));
+        if (!p) {
+            gk_err(lib, "xmalloc() %d ring points failed\n",
+                   r->nsite * r->vnodes);
+            return -ENOMEM;
+        }
+        for (i = 0; i < r->nsite; i++) {
+            for (j = 0; j < r->vnodes; j++) {
+                p[n].point = __murmurhash64a(&r->sites[i], sizeof(u64),
+                                             CHRING_SALT + j);
+                p[n].site_id = r->sites[i];
+                n++;
+            }
+        }
+        qsort(p, n, sizeof(*p), __chp_cmp);
+    }
+    xfree(r->points);
+    r->points = p;
+    r->npoint = n;
+
+    return 0;
+}
+
+/* chring_add_site() return 1 if the site is added, 0 if it already exists
+ */
+int chring_add_site(struct chring *r, u64 site_id)
+{
+    u64 *s;
+    int i, err = 0;
+
+    xrwlock_wlock(&r->rwlock);
+    for (i = 0; i < r->nsite; i++) {
+        if (r->sites[i] == site_id)
+            goto out_unlock;
+    }
+    s = xrealloc(r->sites, (r->nsite + 1) * sizeof(u64));
+    if (!s) {
+        err = -ENOMEM;
+        goto out_unlock;
+    }
+    s[r->nsite++] = site_id;
+    r->sites = s;
+    qsort(r->sites, r->nsite, sizeof(u64), __site_cmp);
+    err = __chring_rebuild(r);
+    if (err) {
+        /* rollback, the member list must match the points */
+        for (i = 0; i < r->nsite; i++) {
+            if (r->sites[i] == site_id) {
+                memmove(&r->sites[i], &r->sites[i + 1],
+                        (r->nsite - i - 1) * sizeof(u64));
+                break;
+            }
+        }
+        r->nsite--;
+        goto out_unlock;
+    }
+    r->version++;
+    err = 1;
+
+out_unlock:
+    xrwlock_wunlock(&r->rwlock);
+
+    return err;
+}
+
+/* chring_del_site() return 1 if the site is removed, 0 if not a member
+ */
+int chring_del_site(struct chring *r, u64 site_id)
+{
+    int i, err = 0;
+
+    xrwlock_wlock(&r->rwlock);
+    for (i = 0; i < r->nsite; i++) {
+        if (r->sites[i] == site_id)
+            break;
+    }
+    if (i == r->nsite)
+        goto out_unlock;
+    memmove(&r->sites[i], &r->sites[i + 1],
+            (r->nsite - i - 1) * sizeof(u64));
+    r->nsite--;
+    err = __chring_rebuild(r);
+    if (!err) {
+        r->version++;
+        err = 1;
+    }
+
+out_unlock:
+    xrwlock_wunlock(&r->rwlock);
+
+    return err;
+}
+
+/* chring_lookup() return the owner site of the hash, or -1UL if the ring
+ * is empty
+ */
+u64 chring_lookup(struct chring *r, u64 hash)
+{
+    u64 site_id = -1UL;
+    int lo, hi, mid;
+
+    xrwlock_rlock(&r->rwlock);
+    if (!r->npoint)
+        goto out_unlock;
+    /* first point >= hash, wrap around to point 0 */
+    lo = 0;
+    hi = r->npoint;
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (r->points[mid].point < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == r->npoint)
+        lo = 0;
+    site_id = r->points[lo].site_id;
+
+out_unlock:
+    xrwlock_runlock(&r->rwlock);
+
+    return site_id;
+}
+
+/* chring_get_sites() return a xmalloc()ed copy of the member list
+ */
+int chring_get_sites(struct chring *r, u64 **sites)
+{
+    int n;
+
+    xrwlock_rlock(&r->rwlock);
+    n = r->nsite;
+    *sites = NULL;
+    if (n) {
+        *sites = xmalloc(n * sizeof(u64));
+        if (*sites)
+            memcpy(*sites, r->sites, n * sizeof(u64));
+        else
+            n = -ENOMEM;
+    }
+    xrwlock_runlock(&r->rwlock);
+
+    return n;
+}
+
+int chring_pack(struct chring *r, void **data, int *len)
+{
+    struct chring_tx *ct;
+
+    xrwlock_rlock(&r->rwlock);
+    *len = sizeof(*ct) + r->nsite * sizeof(u64);
+    ct = xmalloc(*len);
+    if (!ct) {
+        xrwlock_runlock(&r->rwlock);
+        return -ENOMEM;
+    }
+    ct->version = r->version;
+    ct->vnodes = r->vnodes;
+    ct->nsite = r->nsite;
+    memcpy(ct->sites, r->sites, r->nsite * sizeof(u64));
+    xrwlock_runlock(&r->rwlock);
+    *data = ct;
+
+    return 0;
+}
+
+/* chring_unpack() install a packed ring, return 1 if installed, 0 if it
+ * is not newer than the current one
+ */
+int chring_unpack(struct chring *r, void *data, int len)
+{
+    struct chring_tx *ct = data;
+    u64 *s = NULL;
+    int err = 0;
+
+    if (len < sizeof(*ct) ||
+        len < sizeof(*ct) + ct->nsite * sizeof(u64))
+        return -EINVAL;
+
+    if (ct->nsite) {
+        s = xmalloc(ct->nsite * sizeof(u64));
+        if (!s)
+            return -ENOMEM;
+        memcpy(s, ct->sites, ct->nsite * sizeof(u64));
+        qsort(s, ct->nsite, sizeof(u64), __site_cmp);
+    }
+
+    xrwlock_wlock(&r->rwlock);
+    if (r->npoint && ct->version <= r->version) {
+        xfree(s);
+        goto out_unlock;
+    }
+    xfree(r->sites);
+    r->sites = s;
+    r->nsite = ct->nsite;
+    r->vnodes = ct->vnodes;
+    err = __chring_rebuild(r);
+    if (err)
+        goto out_unlock;
+    r->version = ct->version;
+    err = 1;
+
+out_unlock:
+    xrwlock_wunlock(&r->rwlock);
+
+    return err;
+}
+
+#ifdef UNIT_TEST
+/* Check the balance and the moved keyspace of adding one more site */
+int main(int argc, char *argv[])
+{
+    struct chring r;
+    int nsite = 4, vnodes = 128, nkey = 1000000;
+    int i, moved = 0, *cnt;
+    u64 *owner, hash;
+
+    if (argc > 1)
+        nsite = atoi(argv[1]);
+    if (argc > 2)
+        vnodes = atoi(argv[2]);
+
+    owner = xmalloc(nkey * sizeof(u64));
+    cnt = xzalloc((nsite + 1) * sizeof(int));
+    if (!owner || !cnt)
+        return ENOMEM;
+    chring_init(&r, vnodes);
+    for (i = 0; i < nsite; i++)
+        chring_add_site(&r, GK_MDS(i));
+    for (i = 0; i < nkey; i++) {
+        hash = gk_hash_chring(&i, sizeof(i));
+        owner[i] = chring_lookup(&r, hash);
+        cnt[owner[i] & GK_SITE_N_MASK]++;
+    }
+    printf("%d sites x %d vnodes:\n", nsite, vnodes);
+    for (i = 0; i < nsite; i++)
+        printf(" site %d owns %.2f%%\n", i, cnt[i] * 100.0 / nkey);
+
+    chring_add_site(&r, GK_MDS(nsite));
+    for (i = 0; i < nkey; i++) {
+        hash = gk_hash_chring(&i, sizeof(i));
+        if (chring_lookup(&r, hash) != owner[i])
+            moved++;
+    }
+    printf("add site %d: %.2f%% of keys moved (ideal %.2f%%)\n", nsite,
+           moved * 100.0 / nkey, 100.0 / (nsite + 1));
+
+    chring_destroy(&r);
+    xfree(owner);
+    xfree(cnt);
+
+    return 0;
+}
+#endif
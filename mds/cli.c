@@ -41,7 +41,7 @@ int __prepare_xnet_msg(struct xnet_msg *msg, struct xnet_msg **orpy)
 {
     struct xnet_msg *rpy;
     
-    rpy = xnet_alloc_msg(XNET_MSG_NORMAL);
+    rpy = xnet_alloc_msg(XNET_MSG_CACHE);
     if (!rpy) {
         gk_err(mds, "xnet_alloc_msg() reply failed.\n");
         *orpy = NULL;
@@ -80,6 +80,39 @@ void __mds_send_rpy(struct xnet_msg *rpy, int err)
     xnet_free_msg(rpy);
 }
 
+/* __msg_key_hash() return the client precomputed key hash, or 0
+ */
+static inline
+u64 __msg_key_hash(struct xnet_msg *msg)
+{
+    return (msg->tx.flag & XNET_RESERVED_USED) ? msg->tx.reserved : 0;
+}
+
+/* mds_msg_namespace() extract the namespace of a client GET/PUT request
+ * w/o copying, see the ABI of mds_do_put() and mds_do_get().
+ */
+int mds_msg_namespace(struct xnet_msg *msg, struct gstring *ns)
+{
+    if (unlikely(!msg->xm_datacheck))
+        return -EINVAL;
+
+    switch (msg->tx.cmd) {
+    case GK_CLT2MDS_GET:
+        ns->len = msg->tx.arg0;
+        break;
+    case GK_CLT2MDS_PUT:
+        ns->len = msg->tx.arg0 >> 32;
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (unlikely(!ns->len || ns->len > msg->tx.len))
+        return -EINVAL;
+    ns->start = msg->xm_data;
+
+    return 0;
+}
+
 int mds_do_reg(struct xnet_msg *msg)
 {
     struct xnet_msg *rpy;
@@ -158,6 +191,8 @@ int mds_do_put(struct xnet_msg *msg)
     /* ABI:
      * @tx.arg0: len1(namespace) | len2(key)
      * @tx.arg1: len3(value)
+     * @tx.reserved: kvs_key_hash(key) if XNET_RESERVED_USED is set
+     * @tx.err: budget in ms if XNET_DEADLINE is set
      */
     if (likely(msg->xm_datacheck)) {
         data = msg->xm_data;
@@ -194,8 +229,18 @@ int mds_do_put(struct xnet_msg *msg)
     offset += (msg->tx.arg0 & 0xffffffff);
     value.start = data + offset;
     value.len = msg->tx.arg1;
-    
-    err = kvs_put(&namespace, &key, &value);
+
+    if (unlikely(hmo.conf.option & GK_MDS_REPLICA)) {
+        err = -EROFS;
+        goto out;
+    }
+
+    if (mds_spool_expired()) {
+        err = -ETIMEDOUT;
+        goto out;
+    }
+    mds_hotkey_sample(MDS_HK_WRITE, &namespace, &key);
+    err = kvs_put_h(&namespace, &key, &value, __msg_key_hash(msg));
     if (unlikely(err)) {
         gk_err(mds, "kvs_put() failed w/ %d\n", err);
         goto out;
@@ -224,6 +269,12 @@ int mds_do_get(struct xnet_msg *msg)
     /* ABI:
      * @tx.arg0: len1(namespace)
      * @tx.arg1: len2(key)
+     * @tx.reserved: kvs_key_hash(key) if XNET_RESERVED_USED is set
+     * @tx.err: budget in ms if XNET_DEADLINE is set
+     *
+     * Reply ABI:
+     * @tx.arg0: len(value)
+     * @tx.arg1: staleness in ms if served by a follower
      */
     if (msg->xm_datacheck) {
         data = msg->xm_data;
@@ -235,6 +286,15 @@ int mds_do_get(struct xnet_msg *msg)
     {
         struct gstring namespace, key, *value;
         u32 offset = 0;
+        long stale = 0;
+
+        if (unlikely(hmo.conf.option & GK_MDS_REPLICA)) {
+            stale = mds_repl_staleness();
+            if (stale < 0) {
+                err = -EAGAIN;
+                goto out;
+            }
+        }
 
         namespace.start = data;
         namespace.len = msg->tx.arg0;
@@ -242,15 +302,17 @@ int mds_do_get(struct xnet_msg *msg)
         key.start = data + offset;
         key.len = msg->tx.arg1;
 
-        value = kvs_get(&namespace, &key);
+        mds_hotkey_sample(MDS_HK_READ, &namespace, &key);
+        value = kvs_get_h(&namespace, &key, __msg_key_hash(msg));
         if (IS_ERR(value)) {
-            if (PTR_ERR(value) != -ENOENT)
+            if (PTR_ERR(value) != -ENOENT && PTR_ERR(value) != -ETIMEDOUT)
                 gk_err(mds, "kvs_get() failed w/ %ld\n", PTR_ERR(value));
             err = PTR_ERR(value);
             goto out;
         }
         xnet_msg_add_sdata(rpy, value->start, value->len);
         rpy->tx.arg0 = value->len;
+        rpy->tx.arg1 = stale;
     }
 
 out:
@@ -260,3 +322,57 @@ out:
 
     return err;
 }
+
+/* mds_do_get_inline() serve a GET in the receiving thread if it needs no
+ * blocking I/O, i.e. the namespace is loaded and the pair is resident or
+ * known absent. Return -EAGAIN if it should be queued as usual.
+ *
+ * Same ABI as mds_do_get().
+ */
+int mds_do_get_inline(struct xnet_msg *msg)
+{
+    struct xnet_msg *rpy;
+    struct gstring namespace, key, *value;
+    int err;
+
+    if (unlikely(!msg->xm_datacheck || (hmo.conf.option & GK_MDS_REPLICA)))
+        return -EAGAIN;
+    /* forwarding and migration are left to the spool threads */
+    if (unlikely(!mds_migrate_idle() || mds_ring_route(msg)))
+        return -EAGAIN;
+
+    namespace.start = msg->xm_data;
+    namespace.len = msg->tx.arg0;
+    key.start = msg->xm_data + msg->tx.arg0;
+    key.len = msg->tx.arg1;
+    if (unlikely(namespace.len + key.len > msg->tx.len))
+        return -EAGAIN;
+
+    value = kvs_get_mem(&namespace, &key, __msg_key_hash(msg));
+    if (IS_ERR(value) && PTR_ERR(value) == -EAGAIN)
+        return -EAGAIN;
+    mds_hotkey_sample(MDS_HK_READ, &namespace, &key);
+
+    err = __prepare_xnet_msg(msg, &rpy);
+    if (unlikely(err)) {
+        gk_err(mds, "prepare rpy xnet_msg failed w/ %d\n", err);
+        goto out;
+    }
+    if (IS_ERR(value)) {
+        err = PTR_ERR(value);
+    } else {
+        xnet_msg_add_sdata(rpy, value->start, value->len);
+        rpy->tx.arg0 = value->len;
+        rpy->tx.arg1 = 0;
+    }
+    __mds_send_rpy(rpy, err);
+
+out:
+    if (!IS_ERR(value)) {
+        xfree(value->start);
+        xfree(value);
+    }
+    xnet_free_msg(msg);
+
+    return 0;
+}
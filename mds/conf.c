@@ -61,7 +61,7 @@ static int __dconf_write(char *str, int fd)
             goto out;
         }
         bl += bw;
-    } while (bl < sizeof(len));
+    } while (bl < len);
 
 out:
     return err;
@@ -163,6 +163,71 @@ static void __dconf_cmd_action(struct dconf_req *dcr, int fd)
         }
         break;
     }
+    case DCONF_GET_HOTKEYS:
+    {
+        char *p = mds_hotkey_dump(dcr->arg0 & 0xffffffff, dcr->arg0 >> 32);
+
+        if (p)
+            __dconf_write(p, fd);
+        else {
+            snprintf(str, 1023, "Dump hot keys %ld failed!\n",
+                     dcr->arg0 & 0xffffffff);
+            __dconf_write(str, fd);
+        }
+        xfree(p);
+        break;
+    }
+    case DCONF_GET_NS_TOP:
+    {
+        char *p = kvs_ns_top(dcr->arg0 & 0xffffffff, dcr->arg0 >> 32);
+
+        if (p)
+            __dconf_write(p, fd);
+        else {
+            snprintf(str, 1023, "Dump top namespaces by %ld failed!\n",
+                     dcr->arg0 & 0xffffffff);
+            __dconf_write(str, fd);
+        }
+        xfree(p);
+        break;
+    }
+    case DCONF_MIGRATE_NS:
+    {
+        struct gstring ns = {
+            .start = dcr->ns,
+            .len = strnlen(dcr->ns, 256 - sizeof(*dcr)),
+        };
+        int err = mds_migrate_start(&ns, GK_MDS(dcr->arg0));
+
+        if (err)
+            snprintf(str, 1023, "Migrate namespace %.*s to MDS %ld "
+                     "failed w/ %d\n", ns.len, ns.start, dcr->arg0, err);
+        else
+            snprintf(str, 1023, "Migrate namespace %.*s to MDS %ld "
+                     "started\n", ns.len, ns.start, dcr->arg0);
+        __dconf_write(str, fd);
+        break;
+    }
+    case DCONF_GET_MIGRATE:
+    {
+        char *p = mds_migrate_dump();
+
+        if (p)
+            __dconf_write(p, fd);
+        else {
+            snprintf(str, 1023, "Dump migration progress failed!\n");
+            __dconf_write(str, fd);
+        }
+        xfree(p);
+        break;
+    }
+    case DCONF_SET_SPOOL:
+        mds_spool_set_bounds(dcr->arg0 & 0xffffffff, dcr->arg0 >> 32);
+        snprintf(str, 1023, "Spool pool bounds [%d, %d], %ld threads\n",
+                 hmo.conf.spool_min, hmo.conf.spool_max,
+                 atomic64_read(&hmo.prof.misc.spool_nr));
+        __dconf_write(str, fd);
+        break;
     default:
         snprintf(str, 1023, "Unknown commands %ld\n", dcr->cmd);
         __dconf_write(str, fd);
@@ -27,6 +27,8 @@
 
 int __mdsdisp mds_client_dispatch(struct xnet_msg *msg)
 {
+    u64 dsite;
+    int err;
 #ifdef GK_DEBUG_LATENCY
     lib_timer_def();
     lib_timer_B();
@@ -37,10 +39,26 @@ int __mdsdisp mds_client_dispatch(struct xnet_msg *msg)
         mds_do_reg(msg);
         break;
     case GK_CLT2MDS_GET:
-        mds_do_get(msg);
-        break;
     case GK_CLT2MDS_PUT:
-        mds_do_put(msg);
+        /* the namespace is moving or has been moved to another site */
+        if (unlikely(mds_migrate_hold(msg)))
+            break;
+        /* the client holds a stale ring, pass it on to the owner */
+        dsite = mds_ring_route(msg);
+        if (unlikely(dsite)) {
+            err = mds_do_forward(msg, dsite);
+            if (err) {
+                mds_fe_handle_err(msg, err);
+                break;
+            }
+            atomic64_inc(&hmo.prof.ring.reqout);
+            xnet_free_msg(msg);
+            break;
+        }
+        if (msg->tx.cmd == GK_CLT2MDS_GET)
+            mds_do_get(msg);
+        else
+            mds_do_put(msg);
         break;
     default:
         gk_err(mds, "Invalid client2MDS command: %ld from %lx\n", 
@@ -58,6 +76,18 @@ int __mdsdisp mds_client_dispatch(struct xnet_msg *msg)
 int __mdsdisp mds_mds_dispatch(struct xnet_msg *msg)
 {
     switch (msg->tx.cmd) {
+    case GK_MDS2MDS_FWREQ:
+        mds_do_fwreq(msg);
+        break;
+    case GK_MDS2MDS_REPL:
+        mds_do_repl(msg);
+        break;
+    case GK_MDS2MDS_MIGRATE:
+        mds_do_migrate(msg);
+        break;
+    case GK_MDS2MDS_HANDOFF:
+        mds_do_handoff(msg);
+        break;
     default:
         gk_err(mds, "Invalid MDS2MDS request %ld from %lx\n",
                  msg->tx.cmd, msg->tx.ssite_id);
@@ -73,6 +103,9 @@ int __mdsdisp mds_root_dispatch(struct xnet_msg *msg)
     case GK_FR2_AU:
         mds_addr_table_update(msg);
         break;
+    case GK_FR2_RU:
+        mds_ring_update(msg);
+        break;
     default:
         gk_err(mds, "Invalid request %d from R2 %lx.\n",
                  msg->tx.reqno, msg->tx.ssite_id);
@@ -101,6 +101,42 @@ void __simply_send_reply(struct xnet_msg *msg, int err)
     xnet_free_msg(rpy);
 }
 
+/* mds_fe_reject() answer the request w/ @err (if it wants a reply) and
+ * free it, w/o serving it. For -EBUSY, @arg1 is the time in us the client
+ * should retry after.
+ */
+void mds_fe_reject(struct xnet_msg *msg, int err, u64 arg1)
+{
+    struct xnet_msg *rpy;
+
+    if (!(msg->tx.flag & XNET_NEED_REPLY))
+        goto out;
+
+    rpy = xnet_alloc_msg(XNET_MSG_CACHE);
+    if (!rpy) {
+        gk_err(mds, "xnet_alloc_msg() failed\n");
+        goto out;
+    }
+
+    xnet_msg_set_err(rpy, err);
+#ifdef XNET_EAGER_WRITEV
+    xnet_msg_add_sdata(rpy, &rpy->tx, sizeof(rpy->tx));
+#endif
+    xnet_msg_fill_tx(rpy, XNET_MSG_RPY, 0, hmo.site_id,
+                     msg->tx.ssite_id);
+    xnet_msg_fill_reqno(rpy, msg->tx.reqno);
+    xnet_msg_fill_cmd(rpy, XNET_RPY_ACK, 0, arg1);
+    rpy->tx.handle = msg->tx.handle;
+
+    if (xnet_send(hmo.xc, rpy)) {
+        gk_err(mds, "xnet_send() reject reply failed\n");
+    }
+    xnet_free_msg(rpy);
+out:
+    xnet_set_auto_free(msg);
+    xnet_free_msg(msg);
+}
+
 /* mds_fe_handle_err()
  *
  * NOTE: how to handle the err from the dispatcher? We just print the err
@@ -194,6 +230,9 @@ int __mdsdisp mds_do_forward(struct xnet_msg *msg, u64 dsite)
     xnet_msg_set_err(fmsg, err);
     xnet_msg_fill_tx(fmsg, XNET_MSG_REQ, 0, hmo.site_id, dsite);
     xnet_msg_fill_cmd(fmsg, GK_MDS2MDS_FWREQ, 0, 0);
+    /* the client gives up after its budget wherever the request is */
+    if (msg->tx.flag & XNET_DEADLINE)
+        xnet_msg_set_budget(fmsg, mds_spool_budget(msg));
     xnet_msg_add_sdata(fmsg, &msg->tx, sizeof(msg->tx));
 
     if (msg->xm_datacheck) {
@@ -294,6 +333,134 @@ out:
     return 0;
 }
 
+/* mds_ring_update() install the consistent hash ring from R2
+ *
+ * ABI: | u32 len | struct chring_tx |
+ */
+int mds_ring_update(struct xnet_msg *msg)
+{
+    u32 len;
+    int err = 0;
+
+    if (!msg->xm_datacheck || msg->tx.len < sizeof(u32)) {
+        gk_err(mds, "Invalid ring update message, incomplete ring!\n");
+        err = -EINVAL;
+        goto out;
+    }
+    len = *(u32 *)msg->xm_data;
+    if (len > msg->tx.len - sizeof(u32)) {
+        gk_err(mds, "Invalid ring update message, length %d vs %d\n",
+               len, msg->tx.len);
+        err = -EINVAL;
+        goto out;
+    }
+    err = chring_unpack(&hmo.chring, msg->xm_data + sizeof(u32), len);
+    if (err < 0) {
+        gk_err(mds, "install the ring failed w/ %d\n", err);
+        goto out;
+    } else if (err > 0) {
+        atomic64_inc(&hmo.prof.ring.update);
+        atomic64_add(len, &hmo.prof.ring.size);
+        gk_info(mds, "Ring updated to version %ld w/ %d MDS x %d vnodes\n",
+                hmo.chring.version, hmo.chring.nsite, hmo.chring.vnodes);
+        mds_migrate_ring_update();
+    }
+    err = 0;
+
+out:
+    xnet_free_msg(msg);
+
+    return err;
+}
+
+/* mds_ring_route() return the owner MDS of a client GET/PUT if it is not
+ * this site, otherwise 0.
+ *
+ * A forwarded request is always served here, thus a transient ring
+ * disagreement costs at most one extra hop. Replicas serve what their
+ * primary ships to them and never forward. While a site is joining the
+ * ring, the namespaces it takes over are passed on as they are migrated,
+ * see mds_ring_join().
+ */
+u64 __mdsdisp mds_ring_route(struct xnet_msg *msg)
+{
+    struct gstring ns;
+    u64 site_id;
+
+    if (!hmo.chring.npoint || (msg->tx.flag & XNET_FWD) ||
+        (hmo.conf.option & GK_MDS_REPLICA))
+        return 0;
+    if (mds_msg_namespace(msg, &ns))
+        return 0;
+    site_id = chring_lookup(&hmo.chring, gk_hash_chring(ns.start, ns.len));
+    if (site_id == -1UL || site_id == hmo.site_id)
+        /* a new namespace may go to a joining site */
+        return mds_migrate_route(&ns);
+
+    return site_id;
+}
+
+/* mds_fwreq_unwrap() unwrap a request forwarded by mds_do_forward() in
+ * place, the msg looks like the original client request (w/ XNET_FWD) then
+ * and the reply goes to the client directly. Return -EINVAL on a malformed
+ * msg, the caller should free it.
+ *
+ * ABI: | original tx | original data | struct mds_fwd |
+ */
+int mds_fwreq_unwrap(struct xnet_msg *msg)
+{
+    struct xnet_msg_tx *tx;
+    void *p;
+    u32 flag, deadline;
+    int budget;
+
+    if (unlikely(!msg->xm_datacheck || msg->tx.len < sizeof(*tx))) {
+        gk_err(mds, "Invalid forwarded request from %lx\n",
+               msg->tx.ssite_id);
+        return -EINVAL;
+    }
+    p = msg->xm_data;
+    tx = p;
+    if (unlikely(sizeof(*tx) + tx->len + sizeof(struct mds_fwd) >
+                 msg->tx.len)) {
+        gk_err(mds, "Invalid forwarded request from %lx, length %d vs %d\n",
+               msg->tx.ssite_id, tx->len, msg->tx.len);
+        return -EINVAL;
+    }
+
+    flag = msg->tx.flag & XNET_NEED_DATA_FREE;
+    budget = msg->tx.err;
+    deadline = msg->tx.flag & XNET_DEADLINE;
+    memcpy(&msg->tx, tx, sizeof(*tx));
+    /* tx.reserved locates the route info now, see mds_do_forward() */
+    msg->tx.flag &= ~XNET_RESERVED_USED;
+    msg->tx.flag |= flag | XNET_FWD | XNET_PTRESTORE;
+    /* the budget left at the forwarder rather than the original one */
+    if (deadline)
+        xnet_msg_set_budget(msg, budget);
+    msg->tx.reserved = (u64)p;
+    msg->xm_data = p + sizeof(*tx);
+    atomic64_inc(&hmo.prof.ring.reqin);
+
+    return 0;
+}
+
+/* mds_do_fwreq() serve a forwarded request that has not been unwrapped by
+ * the spool, see mds_spool_dispatch()
+ */
+int __mdsdisp mds_do_fwreq(struct xnet_msg *msg)
+{
+    int err;
+
+    err = mds_fwreq_unwrap(msg);
+    if (unlikely(err)) {
+        xnet_free_msg(msg);
+        return err;
+    }
+
+    return mds_client_dispatch(msg);
+}
+
 int mds_addr_table_update(struct xnet_msg *msg)
 {
     if (msg->xm_datacheck) {
@@ -0,0 +1,236 @@
+/**
+ * Copyright (c) 2019 Ma Can <ml.macana@gmail.com>
+ *                           <macan@iie.ac.cn>
+ *
+ * Armed with EMACS.
+ * Time-stamp: <2019-10-14 15:02:11 macan>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "gk.h"
+#include "mds.h"
+
+/* Hot key detection
+ *
+ * One out of hmo.conf.hotkey_sample GET/PUT requests feeds a Count-Min
+ * sketch, whose estimate gates admission into a Space-Saving top-K table
+ * of (namespace, key) pairs. All counters are halved every
+ * hmo.conf.hotkey_window seconds, thus the table tracks recent hotness.
+ */
+
+#define HK_CM_DEPTH     4
+#define HK_CM_WIDTH     4096    /* power of 2 */
+#define HK_TOPK         32
+#define HK_NAME_MAX     64
+
+struct hk_entry
+{
+    u64 hash;
+    u64 count;                  /* sampled count */
+    u64 error;                  /* over-estimation bound */
+    int nslen, klen;            /* original lengths */
+    char name[HK_NAME_MAX];     /* namespace + key, maybe truncated */
+};
+
+struct hk_sketch
+{
+    xlock_t lock;
+    time_t decay_ts;
+    u64 total;                  /* # of sampled requests */
+    int nr;
+    struct hk_entry top[HK_TOPK];
+    u32 cm[HK_CM_DEPTH][HK_CM_WIDTH];
+};
+
+static struct hk_sketch hk_sketch[MDS_HK_MAX];
+
+static __thread u32 hk_tick;
+
+void mds_hotkey_init(void)
+{
+    int i;
+
+    for (i = 0; i < MDS_HK_MAX; i++) {
+        memset(&hk_sketch[i], 0, sizeof(hk_sketch[i]));
+        xlock_init(&hk_sketch[i].lock);
+        hk_sketch[i].decay_ts = time(NULL);
+    }
+}
+
+static inline
+void __hk_decay(struct hk_sketch *hs)
+{
+    int i, j;
+
+    for (i = 0; i < HK_CM_DEPTH; i++)
+        for (j = 0; j < HK_CM_WIDTH; j++)
+            hs->cm[i][j] >>= 1;
+    for (i = 0, j = 0; i < hs->nr; i++) {
+        hs->top[i].count >>= 1;
+        hs->top[i].error >>= 1;
+        /* cooled down entries leave the table */
+        if (hs->top[i].count) {
+            if (i != j)
+                hs->top[j] = hs->top[i];
+            j++;
+        }
+    }
+    hs->nr = j;
+    hs->total >>= 1;
+}
+
+/* __hk_cm_update() add one to the key's counters and return the estimate
+ */
+static inline
+u32 __hk_cm_update(struct hk_sketch *hs, u64 hash)
+{
+    u32 h1 = hash & 0xffffffff, h2 = hash >> 32, est = -1U, *c;
+    int i;
+
+    for (i = 0; i < HK_CM_DEPTH; i++) {
+        c = &hs->cm[i][(h1 + i * h2) & (HK_CM_WIDTH - 1)];
+        if (*c < -1U)
+            (*c)++;
+        est = min(est, *c);
+    }
+
+    return est;
+}
+
+static inline
+void __hk_fill(struct hk_entry *he, u64 hash, struct gstring *ns,
+               struct gstring *key)
+{
+    int l;
+
+    he->hash = hash;
+    he->nslen = ns->len;
+    he->klen = key->len;
+    l = min(ns->len, HK_NAME_MAX);
+    memcpy(he->name, ns->start, l);
+    if (l < HK_NAME_MAX)
+        memcpy(he->name + l, key->start, min(key->len, HK_NAME_MAX - l));
+}
+
+void mds_hotkey_sample(int rw, struct gstring *ns, struct gstring *key)
+{
+    struct hk_sketch *hs = &hk_sketch[rw];
+    struct hk_entry *he, *mhe;
+    time_t now;
+    u64 hash;
+    u32 est;
+    int i;
+
+    if (hmo.conf.option & GK_MDS_NO_HOTKEY)
+        return;
+    if (++hk_tick % hmo.conf.hotkey_sample)
+        return;
+
+    hash = __murmurhash64a(key->start, key->len,
+                           gk_hash_nsht(ns->start, ns->len));
+    now = hmo.tick;
+
+    xlock_lock(&hs->lock);
+    if (now >= hs->decay_ts + hmo.conf.hotkey_window) {
+        __hk_decay(hs);
+        hs->decay_ts = now;
+    }
+    hs->total++;
+    est = __hk_cm_update(hs, hash);
+
+    /* Space-Saving update, the CM estimate gates the replacement */
+    mhe = NULL;
+    for (i = 0; i < hs->nr; i++) {
+        he = &hs->top[i];
+        if (he->hash == hash) {
+            he->count++;
+            goto out_unlock;
+        }
+        if (!mhe || he->count < mhe->count)
+            mhe = he;
+    }
+    if (hs->nr < HK_TOPK) {
+        he = &hs->top[hs->nr++];
+        memset(he, 0, sizeof(*he));
+        __hk_fill(he, hash, ns, key);
+        he->count = est;
+    } else if (est > mhe->count) {
+        u64 error = mhe->count;
+
+        memset(mhe, 0, sizeof(*mhe));
+        __hk_fill(mhe, hash, ns, key);
+        mhe->count = est;
+        mhe->error = error;
+    }
+out_unlock:
+    xlock_unlock(&hs->lock);
+}
+
+static int __hk_cmp(const void *a, const void *b)
+{
+    const struct hk_entry *x = a, *y = b;
+
+    return (x->count < y->count) ? 1 : ((x->count > y->count) ? -1 : 0);
+}
+
+/* mds_hotkey_dump() return the top-N hot keys in a xmalloc()ed string,
+ * counts are scaled back by the sample rate.
+ */
+char *mds_hotkey_dump(int rw, int n)
+{
+    struct hk_entry top[HK_TOPK];
+    char *buf, *p, name[HK_NAME_MAX + 1];
+    u64 total;
+    int nr, i, j, l, size;
+
+    if (rw < 0 || rw >= MDS_HK_MAX)
+        return NULL;
+    xlock_lock(&hk_sketch[rw].lock);
+    nr = hk_sketch[rw].nr;
+    total = hk_sketch[rw].total;
+    memcpy(top, hk_sketch[rw].top, nr * sizeof(struct hk_entry));
+    xlock_unlock(&hk_sketch[rw].lock);
+
+    qsort(top, nr, sizeof(struct hk_entry), __hk_cmp);
+    if (n <= 0 || n > nr)
+        n = nr;
+
+    size = 128 + n * (HK_NAME_MAX + 96);
+    buf = xzalloc(size);
+    if (!buf)
+        return NULL;
+    p = buf;
+    p += sprintf(p, "Hot %s keys (1/%d sampled, %ld samples in window):\n",
+                 rw == MDS_HK_READ ? "READ" : "WRITE",
+                 hmo.conf.hotkey_sample, total);
+    for (i = 0; i < n; i++) {
+        l = min(top[i].nslen + top[i].klen, HK_NAME_MAX);
+        for (j = 0; j < l; j++) {
+            name[j] = isprint(top[i].name[j]) ? top[i].name[j] : '.';
+        }
+        name[l] = '\0';
+        p += sprintf(p, "%3d %.*s@%s%s ~%ld ops (+-%ld) %.2f%%\n", i,
+                     min(top[i].nslen, l), name,
+                     (top[i].nslen < l ? name + top[i].nslen : ""),
+                     (top[i].nslen + top[i].klen > HK_NAME_MAX ? "..." : ""),
+                     top[i].count * hmo.conf.hotkey_sample,
+                     top[i].error * hmo.conf.hotkey_sample,
+                     total ? (double)top[i].count * 100 / total : 0.0);
+    }
+
+    return buf;
+}
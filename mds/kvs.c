@@ -24,6 +24,7 @@
 #include "gk.h"
 #include "xnet.h"
 #include "mds.h"
+#include <dirent.h>
 
 /* This is a memory kv store.
  *
@@ -34,6 +35,9 @@
 
 struct namespace_mgr ns_mgr;
 
+static int __lmdb_shared_init(void);
+static void __lmdb_shared_destroy(void);
+
 static inline
 char *GET_TYPE_STR(struct ns_entry *nse)
 {
@@ -54,10 +58,56 @@ int kvs_dir_is_exist(char *path)
     int err;
 
     err = stat(path, &s);
-    if (err == ENOENT) {
+    if (err) {
+        if (errno != ENOENT)
+            gk_warning(mds, "stat %s failed w/ %d\n", path, errno);
         return 0;
     } else
+        return S_ISDIR(s.st_mode);
+}
+
+/* Negative namespace cache
+ *
+ * Direct mapped by the nsht hash. Each slot packs the high 48 bits of the
+ * hash and a 16-bit second stamp, thus lookup and update are plain word
+ * accesses w/o locking.
+ */
+#define KVS_NNEG_STAMP  0xffffUL
+
+static inline
+int kvs_nneg_lookup(u64 hash)
+{
+    u64 e;
+
+    if (unlikely(!ns_mgr.nneg))
+        return 0;
+    e = ns_mgr.nneg[hash & (KVS_NNEG_SIZE - 1)];
+    if (e && (e & ~KVS_NNEG_STAMP) == (hash & ~KVS_NNEG_STAMP) &&
+        ((time(NULL) - e) & KVS_NNEG_STAMP) < hmo.conf.nneg_ttl)
         return 1;
+
+    return 0;
+}
+
+static inline
+void kvs_nneg_insert(u64 hash)
+{
+    if (unlikely(!ns_mgr.nneg))
+        return;
+    ns_mgr.nneg[hash & (KVS_NNEG_SIZE - 1)] = (hash & ~KVS_NNEG_STAMP) |
+        (time(NULL) & KVS_NNEG_STAMP);
+}
+
+static inline
+void kvs_nneg_remove(u64 hash)
+{
+    u64 *e;
+
+    if (unlikely(!ns_mgr.nneg))
+        return;
+    e = &ns_mgr.nneg[hash & (KVS_NNEG_SIZE - 1)];
+    if ((*e & ~KVS_NNEG_STAMP) == (hash & ~KVS_NNEG_STAMP))
+        *e = 0;
 }
 
 int kvs_dir_make_exist(char *path)
@@ -85,13 +135,14 @@ int kvs_init(void)
     char path[GK_MAX_NAME_LEN] = {0,};
     int err, i;
     
-    if (hmo.conf.nshash_size) {
+    if (!hmo.conf.nshash_size) {
         hmo.conf.nshash_size = MDS_KVS_NSHASH_SIZE;
     }
-    if (hmo.conf.ns_ht_size) {
+    if (!hmo.conf.ns_ht_size) {
         hmo.conf.ns_ht_size = NS_HASH_SIZE;
     }
-    ns_mgr.nsht = xmalloc(hmo.conf.nshash_size * sizeof(struct regular_hash_rw));
+    ns_mgr.nsht = xhugealloc(hmo.conf.nshash_size *
+                             sizeof(struct regular_hash_rw));
     if (!ns_mgr.nsht) {
         gk_err(mds, "alloc namespace hash table (size=%ld) failed.\n",
                hmo.conf.nshash_size * sizeof(struct regular_hash_rw));
@@ -106,6 +157,14 @@ int kvs_init(void)
     INIT_LIST_HEAD(&ns_mgr.lru);
     xlock_init(&ns_mgr.lru_lock);
 
+    if (!(hmo.conf.option & GK_MDS_NO_NEGCACHE)) {
+        ns_mgr.nneg = xzalloc(KVS_NNEG_SIZE * sizeof(u64));
+        if (!ns_mgr.nneg) {
+            gk_warning(mds, "alloc negative namespace cache failed, "
+                       "disable it.\n");
+        }
+    }
+
     /* init the directory */
     err = kvs_dir_make_exist(hmo.conf.kvs_home);
     if (err) {
@@ -113,14 +172,26 @@ int kvs_init(void)
         return -ENOTEXIST;
     }
 
+    if (hmo.conf.lmdb_shared > 0) {
+        err = __lmdb_shared_init();
+        if (err)
+            return err;
+    }
+
     gk_info(mds, "MDS KVS init ok\n");
 
     return err;
 }
 
+/* The LRU is kept at the granularity of the timer tick, thus a hot
+ * namespace does not take the global lru_lock on every lookup.
+ */
 static inline
 void kvs_ns_lru_update(struct ns_entry *nse)
 {
+    if (nse->atime == hmo.tick && !list_empty(&nse->lru))
+        return;
+    nse->atime = hmo.tick;
     xlock_lock(&ns_mgr.lru_lock);
     list_del_init(&nse->lru);
     list_add(&nse->lru, &ns_mgr.lru);
@@ -138,6 +209,27 @@ void __cache_put(struct ns_entry *nse)
     pthread_setspecific(spool_key, nse);
 }
 
+static atomic_t ns_prof_slot_nr;
+static __thread int ns_prof_slot = -1;
+
+static inline
+struct ns_prof_slot *__ns_prof(struct ns_entry *nse)
+{
+    if (unlikely(ns_prof_slot < 0))
+        ns_prof_slot = (u32)atomic_inc_return(&ns_prof_slot_nr) %
+            NS_PROF_SLOTS;
+    return &nse->prof[ns_prof_slot];
+}
+
+static inline
+u64 __kvs_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
 struct ns_entry *kvs_ns_lookup(struct gstring *namespace)
 {
     struct ns_entry *nse;
@@ -389,15 +481,211 @@ out:
     return err;
 }
 
+/* __lmdb_bloom_load() fill the bloom filter w/ all the existing keys
+ */
+static
+void __lmdb_bloom_load(struct ns_entry *nse, MDB_txn *txn)
+{
+    MDB_cursor *cursor;
+    MDB_val key, data;
+    long nr = 0;
+    int err;
+
+    if (!nse->bf.bits)
+        return;
+
+    err = mdb_cursor_open(txn, nse->f.lmdb.dbi, &cursor);
+    if (err) {
+        gk_err(mds, "lmdb cursor open failed w/ %d, disable bloom filter\n",
+               err);
+        bloom_destroy(&nse->bf);
+        return;
+    }
+    while ((err = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
+        bloom_add(&nse->bf, gk_hash_ns(key.mv_data, key.mv_size));
+        nr++;
+    }
+    mdb_cursor_close(cursor);
+    if (err != MDB_NOTFOUND) {
+        gk_err(mds, "lmdb cursor get failed w/ %d, disable bloom filter\n",
+               err);
+        bloom_destroy(&nse->bf);
+        return;
+    }
+    gk_debug(mds, "namespace %.*s bloom filter loaded %ld keys\n",
+             nse->namespace.len, nse->namespace.start, nr);
+}
+
+/* __lmdb_map_init() init the map of an opened env, the map size may
+ * already be larger than the initial size if the data file is.
+ */
+static int __lmdb_map_init(struct lmdb_map *m, MDB_env *env, size_t limit)
+{
+    pthread_rwlockattr_t attr;
+    MDB_envinfo mei;
+    int err;
+
+    err = mdb_env_info(env, &mei);
+    if (err) {
+        gk_err(mds, "lmdb env info failed w/ %d\n", err);
+        return -err;
+    }
+    /* the growth must not starve behind a stream of readers */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&m->rwlock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    m->size = mei.me_mapsize;
+    m->max = max(limit, m->size);
+
+    return 0;
+}
+
+/* __lmdb_map_grow() double the map after a MDB_MAP_FULL, @seen is the map
+ * size the failed txn ran with. Return 0 if the caller should retry.
+ */
+static int __lmdb_map_grow(MDB_env *env, struct lmdb_map *m, size_t seen)
+{
+    size_t size;
+    int err = 0;
+
+    xrwlock_wlock(&m->rwlock);
+    if (m->size != seen) {
+        /* grown by another thread in the mean time */
+        goto out_unlock;
+    }
+    if (m->size >= m->max) {
+        gk_err(mds, "lmdb map of env %p is full at max size %ld\n",
+               env, m->size);
+        err = -ENOSPC;
+        goto out_unlock;
+    }
+    size = min(m->size << 1, m->max);
+    err = mdb_env_set_mapsize(env, size);
+    if (err) {
+        gk_err(mds, "lmdb env set mapsize %ld failed w/ %d\n", size, err);
+        err = -err;
+        goto out_unlock;
+    }
+    gk_info(mds, "lmdb map of env %p grows %ld -> %ld\n", env, m->size, size);
+    m->size = size;
+    atomic64_inc(&hmo.prof.mds.lmdb_grow);
+
+out_unlock:
+    xrwlock_wunlock(&m->rwlock);
+
+    return err;
+}
+
+/* Shared LMDB environments
+ *
+ * W/ hmo.conf.lmdb_shared = N, the namespaces are hosted as named
+ * databases in N environments (kvs_home/.lmdb.<i>) instead of one
+ * environment each, namespace i goes to environment hash(i) % N. This
+ * saves the per-namespace map, lock file and fds, and the wal apply
+ * threads commit the writes to all the namespaces of an environment in
+ * one transaction. The namespace directory is still created, it tells
+ * the namespace exists.
+ */
+static int __lmdb_shared_init(void)
+{
+    char path[GK_MAX_NAME_LEN];
+    MDB_env *env;
+    int err, i;
+
+    ns_mgr.shenv = xzalloc(hmo.conf.lmdb_shared * sizeof(MDB_env *));
+    ns_mgr.shmap = xzalloc(hmo.conf.lmdb_shared * sizeof(struct lmdb_map));
+    if (!ns_mgr.shenv || !ns_mgr.shmap) {
+        gk_err(mds, "alloc %d shared lmdb envs failed\n",
+               hmo.conf.lmdb_shared);
+        return -ENOMEM;
+    }
+    for (i = 0; i < hmo.conf.lmdb_shared; i++) {
+        snprintf(path, sizeof(path), "%s/.lmdb.%d", hmo.conf.kvs_home, i);
+        err = kvs_dir_make_exist(path);
+        if (err) {
+            gk_err(mds, "dir %s does not exist %d.\n", path, err);
+            goto out_close;
+        }
+        err = mdb_env_create(&env);
+        if (err) {
+            gk_err(mds, "lmdb env create failed w %d\n", err);
+            err = -err;
+            goto out_close;
+        }
+        ns_mgr.shenv[i] = env;
+        err = mdb_env_set_mapsize(env, min(hmo.conf.lmdb_map_init,
+                                           hmo.conf.lmdb_shared_size));
+        if (err) {
+            gk_err(mds, "lmdb env set mapsize failed w/ %d\n", err);
+            err = -err;
+            goto out_close;
+        }
+        err = mdb_env_set_maxdbs(env, hmo.conf.lmdb_maxdbs);
+        if (err) {
+            gk_err(mds, "lmdb env set maxdbs failed w/ %d\n", err);
+            err = -err;
+            goto out_close;
+        }
+        err = mdb_env_open(env, path, 0, 0664);
+        if (err) {
+            gk_err(mds, "lmdb env open %s failed w/ %d\n", path, err);
+            err = -err;
+            goto out_close;
+        }
+        err = __lmdb_map_init(&ns_mgr.shmap[i], env,
+                              hmo.conf.lmdb_shared_size);
+        if (err)
+            goto out_close;
+    }
+    gk_info(mds, "%d shared lmdb envs, %d namespaces each at most\n",
+            hmo.conf.lmdb_shared, hmo.conf.lmdb_maxdbs);
+
+    return 0;
+out_close:
+    __lmdb_shared_destroy();
+
+    return err;
+}
+
+static void __lmdb_shared_destroy(void)
+{
+    int i;
+
+    if (!ns_mgr.shenv)
+        return;
+    for (i = 0; i < hmo.conf.lmdb_shared; i++) {
+        if (ns_mgr.shenv[i])
+            mdb_env_close(ns_mgr.shenv[i]);
+        if (ns_mgr.shmap && ns_mgr.shmap[i].size)
+            xrwlock_destroy(&ns_mgr.shmap[i].rwlock);
+    }
+    xfree(ns_mgr.shenv);
+    xfree(ns_mgr.shmap);
+    ns_mgr.shenv = NULL;
+    ns_mgr.shmap = NULL;
+}
+
 /* __lmdb_open() do lmdb file open
  */
 int __lmdb_open(struct ns_entry *nse, char *path)
 {
+    struct lmdb_map *m;
     MDB_env *env;
     MDB_txn *txn;
+    size_t seen;
     int err = 0;
 
     xlock_lock(&nse->lock);
+    if (nse->state == NSE_FREE && ns_mgr.shenv) {
+        int i = gk_hash_nsht(nse->namespace.start, nse->namespace.len) %
+            hmo.conf.lmdb_shared;
+
+        nse->f.lmdb.env = ns_mgr.shenv[i];
+        nse->f.lmdb.map = &ns_mgr.shmap[i];
+        nse->state = NSE_OPEN;
+    }
     if (nse->state == NSE_FREE) {
         err = mdb_env_create(&env);
         if (err) {
@@ -405,67 +693,117 @@ int __lmdb_open(struct ns_entry *nse, char *path)
             err = -err;
             goto out_unlock;
         }
-        err = mdb_env_set_mapsize(env, LMDB_DEFAULT_SIZE);
+        err = mdb_env_set_mapsize(env, min(hmo.conf.lmdb_map_init,
+                                           hmo.conf.lmdb_map_max));
         if (err) {
             gk_err(mds, "lmdb env set mapsize failed w/ %d\n", err);
             err = -err;
-            goto out_unlock;
+            goto out_close;
         }
         err = mdb_env_open(env, path, 0, 0664);
         if (err) {
             gk_err(mds, "lmdb env open %s failed w/ %d\n", path, err);
             err = -err;
-            goto out_unlock;
+            goto out_close;
+        }
+        m = xzalloc(sizeof(*m));
+        if (!m) {
+            gk_err(mds, "xzalloc() lmdb map failed\n");
+            err = -ENOMEM;
+            goto out_close;
+        }
+        err = __lmdb_map_init(m, env, hmo.conf.lmdb_map_max);
+        if (err) {
+            xfree(m);
+            goto out_close;
         }
         gk_warning(mds, "open lmdb file %s w/ env %p\n", path, env);
         nse->state = NSE_OPEN;
         nse->f.lmdb.env = env;
+        nse->f.lmdb.map = m;
     }
     if (nse->state == NSE_OPEN) {
+        m = nse->f.lmdb.map;
+    retry:
+        xrwlock_rlock(&m->rwlock);
+        seen = m->size;
         err = mdb_txn_begin(nse->f.lmdb.env, NULL, 0, &txn);
         if (err) {
+            xrwlock_runlock(&m->rwlock);
             gk_err(mds, "lmdb txn begin failed w/ %d\n", err);
             err = -err;
             goto out_unlock;
         }
-	err = mdb_dbi_open(txn, NULL, 0, &nse->f.lmdb.dbi);
+        if (ns_mgr.shenv)
+            err = mdb_dbi_open(txn, nse->namespace.start, MDB_CREATE,
+                               &nse->f.lmdb.dbi);
+        else
+            err = mdb_dbi_open(txn, NULL, 0, &nse->f.lmdb.dbi);
         if (err) {
+            mdb_txn_abort(txn);
+            xrwlock_runlock(&m->rwlock);
+            if (err == MDB_MAP_FULL &&
+                !__lmdb_map_grow(nse->f.lmdb.env, m, seen))
+                goto retry;
             gk_err(mds, "lmdb dbi open failed w/ %d\n", err);
             err = -err;
             goto out_unlock;
         }
+        __lmdb_bloom_load(nse, txn);
         err = mdb_txn_commit(txn);
+        xrwlock_runlock(&m->rwlock);
         if (err) {
+            if (err == MDB_MAP_FULL &&
+                !__lmdb_map_grow(nse->f.lmdb.env, m, seen))
+                goto retry;
             gk_err(mds, "lmdb txn commit failed w/ %d\n", err);
             err = -err;
             goto out_unlock;
         }
+        /* kvs_get_mem() checks the state w/o nse->lock */
+        __sync_synchronize();
         nse->state = NSE_LMDB;
     }
 out_unlock:
     xlock_unlock(&nse->lock);
 
     return err;
+out_close:
+    mdb_env_close(env);
+    goto out_unlock;
 }
 
 void __lmdb_close(struct ns_entry *nse)
 {
+    /* the shared envs and their handles live until kvs_destroy() */
+    if (ns_mgr.shenv)
+        return;
     mdb_dbi_close(nse->f.lmdb.env, nse->f.lmdb.dbi);
     mdb_env_close(nse->f.lmdb.env);
+    xrwlock_destroy(&nse->f.lmdb.map->rwlock);
+    xfree(nse->f.lmdb.map);
 }
 
 /* __lmdb_write()
  *
+ * On MDB_MAP_FULL the txn is aborted, the map grows and the whole batch
+ * is retried. Any other put error aborts the txn and is returned.
  */
 int __lmdb_write(struct ns_entry *nse, struct kvs_storage_access *ksa)
 {
+    struct lmdb_map *m = nse->f.lmdb.map;
     MDB_val key, data;
     MDB_txn *txn;
+    size_t seen;
     int err = 0, i;
 
     xlock_lock(&nse->lock);
+retry:
+    xrwlock_rlock(&m->rwlock);
+    seen = m->size;
     err = mdb_txn_begin(nse->f.lmdb.env, NULL, 0, &txn);
     if (err) {
+        xrwlock_runlock(&m->rwlock);
         xlock_unlock(&nse->lock);
         gk_err(mds, "lmdb txn begin failed w/ %d\n", err);
         return -err;
@@ -477,13 +815,72 @@ int __lmdb_write(struct ns_entry *nse, struct kvs_storage_access *ksa)
         data.mv_data = ksa->iov[i + 1].iov_base;
     
         err = mdb_put(txn, nse->f.lmdb.dbi, &key, &data, 0);
-        if (err) {
-            gk_err(mds, "lmdb put failed w/ %d\n", err);
-            continue;
-        }
+        if (err)
+            break;
     }
     
+    if (err) {
+        /* the batch is all or nothing, the caller keeps it on error */
+        mdb_txn_abort(txn);
+        if (err != MDB_MAP_FULL)
+            gk_err(mds, "lmdb put failed w/ %d\n", err);
+    } else
+        err = mdb_txn_commit(txn);
+    xrwlock_runlock(&m->rwlock);
+    if (err == MDB_MAP_FULL && !__lmdb_map_grow(nse->f.lmdb.env, m, seen))
+        goto retry;
+    xlock_unlock(&nse->lock);
+    if (err) {
+        gk_err(mds, "lmdb write failed w/ %d\n", err);
+        err = -err;
+    }
+
+    return err;
+}
+
+/* __lmdb_write_reserve() write one pair, the value is copied once into
+ * the space reserved in the map
+ */
+int __lmdb_write_reserve(struct ns_entry *nse, struct gstring *key,
+                         struct gstring *value)
+{
+    struct lmdb_map *m = nse->f.lmdb.map;
+    MDB_val k, data;
+    MDB_txn *txn;
+    size_t seen;
+    int err = 0;
+
+    k.mv_size = key->len;
+    k.mv_data = key->start;
+
+    xlock_lock(&nse->lock);
+retry:
+    xrwlock_rlock(&m->rwlock);
+    seen = m->size;
+    err = mdb_txn_begin(nse->f.lmdb.env, NULL, 0, &txn);
+    if (err) {
+        xrwlock_runlock(&m->rwlock);
+        xlock_unlock(&nse->lock);
+        gk_err(mds, "lmdb txn begin failed w/ %d\n", err);
+        return -err;
+    }
+    data.mv_size = value->len;
+    err = mdb_put(txn, nse->f.lmdb.dbi, &k, &data, MDB_RESERVE);
+    if (err) {
+        mdb_txn_abort(txn);
+        xrwlock_runlock(&m->rwlock);
+        if (err == MDB_MAP_FULL &&
+            !__lmdb_map_grow(nse->f.lmdb.env, m, seen))
+            goto retry;
+        xlock_unlock(&nse->lock);
+        gk_err(mds, "lmdb reserve %d bytes failed w/ %d\n", value->len, err);
+        return -err;
+    }
+    memcpy(data.mv_data, value->start, value->len);
     err = mdb_txn_commit(txn);
+    xrwlock_runlock(&m->rwlock);
+    if (err == MDB_MAP_FULL && !__lmdb_map_grow(nse->f.lmdb.env, m, seen))
+        goto retry;
     xlock_unlock(&nse->lock);
     if (err) {
         gk_err(mds, "lmdb txn commit failed w/ %d\n", err);
@@ -501,8 +898,10 @@ int __lmdb_read(struct ns_entry *nse, struct kvs_storage_access *ksa)
     int err = 0, i;
 
     xlock_lock(&nse->lock);
+    xrwlock_rlock(&nse->f.lmdb.map->rwlock);
     err = mdb_txn_begin(nse->f.lmdb.env, NULL, MDB_RDONLY, &txn);
     if (err) {
+        xrwlock_runlock(&nse->f.lmdb.map->rwlock);
         xlock_unlock(&nse->lock);
         gk_err(mds, "lmdb txn rdonly begin failed w/ %d\n", err);
         return -err;
@@ -513,7 +912,10 @@ int __lmdb_read(struct ns_entry *nse, struct kvs_storage_access *ksa)
         
         err = mdb_get(txn, nse->f.lmdb.dbi, &key, &data);
         if (err) {
-            gk_err(mds, "lmdb get failed w/ %d\n", err);
+            if (err == MDB_NOTFOUND)
+                err = -ENOENT;
+            else
+                gk_err(mds, "lmdb get failed w/ %d\n", err);
             continue;
         }
         _tmp = xmalloc(data.mv_size);
@@ -526,6 +928,7 @@ int __lmdb_read(struct ns_entry *nse, struct kvs_storage_access *ksa)
         ksa->iov[i + 1].iov_base = _tmp;
     }
     mdb_txn_abort(txn);
+    xrwlock_runlock(&nse->f.lmdb.map->rwlock);
     xlock_unlock(&nse->lock);
 
     return err;
@@ -558,10 +961,12 @@ int kvs_ns_init(struct ns_entry *nse)
         break;
     case NSE_F_LMDB:
         sprintf(path, "%s/%s/%s", hmo.conf.kvs_home, nse->namespace.start, GET_TYPE_STR(nse));
-        err = kvs_dir_make_exist(path);
-        if (err) {
-            gk_err(mds, "dir %s does not exist %d.\n", path, err);
-            goto out;
+        if (!ns_mgr.shenv) {
+            err = kvs_dir_make_exist(path);
+            if (err) {
+                gk_err(mds, "dir %s does not exist %d.\n", path, err);
+                goto out;
+            }
         }
         err = __lmdb_open(nse, path);
         if (err) {
@@ -575,6 +980,29 @@ out:
     return err;
 }
 
+static inline
+void __ns_negcache_init(struct ns_entry *nse, short type)
+{
+    memset(&nse->bf, 0, sizeof(nse->bf));
+    nse->kneg = NULL;
+    if (type != NSE_F_LMDB || (hmo.conf.option & GK_MDS_NO_NEGCACHE))
+        return;
+
+    if (bloom_init(&nse->bf, hmo.conf.ns_bloom_bits, NS_BLOOM_K)) {
+        gk_warning(mds, "namespace %.*s bloom filter disabled\n",
+                   nse->namespace.len, nse->namespace.start);
+    }
+    nse->kneg = xzalloc(NS_KNEG_SIZE * sizeof(u64));
+}
+
+static inline
+void __ns_negcache_destroy(struct ns_entry *nse)
+{
+    bloom_destroy(&nse->bf);
+    xfree(nse->kneg);
+    nse->kneg = NULL;
+}
+
 struct ns_entry *kvs_ns_lookup_create(struct gstring *namespace, short type)
 {
     struct ns_entry *nse;
@@ -604,9 +1032,10 @@ relookup:
                 return ERR_PTR(-ENOMEM);
             }
             nse->namespace.len = namespace->len;
-            nse->ht = xmalloc(sizeof(struct regular_hash) * hmo.conf.ns_ht_size);
+            nse->ht = xhugealloc(sizeof(struct regular_hash) *
+                                 hmo.conf.ns_ht_size);
             if (unlikely(!nse->ht)) {
-                gk_err(mds, "xmalloc() ns hash table failed.\n");
+                gk_err(mds, "xhugealloc() ns hash table failed.\n");
                 xfree(nse->namespace.start);
                 xfree(nse);
                 return ERR_PTR(-ENOMEM);
@@ -616,9 +1045,26 @@ relookup:
                 INIT_HLIST_HEAD(&(nse->ht + i)->h);
                 xlock_init(&(nse->ht + i)->lock);
             }
+            __ns_negcache_init(nse, type);
             
+            if (posix_memalign((void **)&nse->prof, 64, NS_PROF_SLOTS *
+                               sizeof(struct ns_prof_slot))) {
+                gk_err(mds, "alloc ns profile slots failed.\n");
+                __ns_negcache_destroy(nse);
+                xfree(nse->namespace.start);
+                xhugefree(nse->ht, sizeof(struct regular_hash) *
+                          hmo.conf.ns_ht_size);
+                xfree(nse);
+                return ERR_PTR(-ENOMEM);
+            }
+            memset(nse->prof, 0, NS_PROF_SLOTS * sizeof(struct ns_prof_slot));
+
             INIT_HLIST_NODE(&nse->list);
             INIT_LIST_HEAD(&nse->lru);
+            nse->atime = 0;
+            atomic_set(&nse->nr, 0);
+            atomic64_set(&nse->kgen, 0);
+            memset(nse->lpend, 0, sizeof(nse->lpend));
             xlock_init(&nse->lock);
             atomic_set(&nse->ref, 1);
             nse->type = type;
@@ -628,12 +1074,16 @@ relookup:
             if (inserted != nse) {
                 gk_warning(mds, "someone insert this nse(%.*s) before us.\n", 
                            namespace->len, namespace->start);
+                __ns_negcache_destroy(nse);
+                free(nse->prof);
                 xfree(nse->namespace.start);
-                xfree(nse->ht);
+                xhugefree(nse->ht, sizeof(struct regular_hash) *
+                          hmo.conf.ns_ht_size);
                 xfree(nse);
                 kvs_ns_put(inserted);
                 goto relookup;
             }
+            kvs_nneg_remove(gk_hash_nsht(namespace->start, namespace->len));
         }
         
         /* Step 2: we should open the backend file now */
@@ -649,6 +1099,9 @@ out_clean:
     /* we should release the nse on error */
     if (atomic_dec_return(&nse->ref) == 0) {
         kvs_ns_remove(nse);
+        __ns_negcache_destroy(nse);
+        free(nse->prof);
+        xhugefree(nse->ht, sizeof(struct regular_hash) * hmo.conf.ns_ht_size);
         xfree(nse);
     }
 
@@ -690,16 +1143,13 @@ int __ns_store_read(struct ns_entry *nse, struct gstring *key, struct gstring *v
         }
         err = __lmdb_read(nse, &ksa);
         if (err) {
-            gk_err(mds, "lmdb read failed w/ %d\n", err);
+            if (err != -ENOENT)
+                gk_err(mds, "lmdb read failed w/ %d\n", err);
             goto out;
         }
+        /* __lmdb_read() has already copied the value out */
         value->len = ksa.iov[1].iov_len;
-        value->start = xmalloc(value->len);
-        if (!value->start) {
-            gk_err(mds, "xmalloc failed\n");
-            goto out;
-        }
-        memcpy(value->start, ksa.iov[1].iov_base, value->len);
+        value->start = ksa.iov[1].iov_base;
         break;
     }
     default:
@@ -788,14 +1238,224 @@ out:
     return err;
 }
 
-/* Insert a kv pair to the ns entry
+/* kvs_ns_store_apply() write a batch of kv pairs (key and value iovs in
+ * turn) to the backend store in one transaction.
  */
-int __ns_insert(struct ns_entry *nse, struct gstring *key, struct gstring *value, int force)
+int kvs_ns_store_apply(struct ns_entry *nse, struct iovec *iov, int iov_nr)
+{
+    struct kvs_storage_access ksa = {
+        .iov = iov,
+        .arg = NULL,
+        .offset = -1,
+        .iov_nr = iov_nr,
+    };
+
+    if (nse->type != NSE_F_LMDB || nse->state < NSE_LMDB) {
+        gk_err(mds, "namespace %.*s apply: invalid type %d state %d\n",
+               nse->namespace.len, nse->namespace.start, nse->type,
+               nse->state);
+        return -EFAULT;
+    }
+
+    return __lmdb_write(nse, &ksa);
+}
+
+/* kvs_store_apply_batch() write the pairs of several namespaces in one
+ * transaction, they must share the store, see kvs_ns_store_env(). A put
+ * error aborts the whole transaction and is returned, thus the WAL keeps
+ * the batch for a retry.
+ */
+int kvs_store_apply_batch(struct kvs_apply *ka, int nr)
+{
+    struct lmdb_map *m;
+    MDB_val key, data;
+    MDB_txn *txn;
+    MDB_env *env;
+    size_t seen;
+    int err, i, j;
+
+    if (nr == 1)
+        return kvs_ns_store_apply(ka[0].nse, ka[0].iov, ka[0].iov_nr);
+
+    env = kvs_ns_store_env(ka[0].nse);
+    for (i = 0; i < nr; i++) {
+        if (ka[i].nse->type != NSE_F_LMDB || ka[i].nse->state < NSE_LMDB ||
+            kvs_ns_store_env(ka[i].nse) != env) {
+            gk_err(mds, "namespace %.*s apply: invalid type %d state %d\n",
+                   ka[i].nse->namespace.len, ka[i].nse->namespace.start,
+                   ka[i].nse->type, ka[i].nse->state);
+            return -EFAULT;
+        }
+    }
+    m = ka[0].nse->f.lmdb.map;
+
+    /* LMDB serializes the writers of the env, no nse->lock here */
+retry:
+    xrwlock_rlock(&m->rwlock);
+    seen = m->size;
+    err = mdb_txn_begin(env, NULL, 0, &txn);
+    if (err) {
+        xrwlock_runlock(&m->rwlock);
+        gk_err(mds, "lmdb txn begin failed w/ %d\n", err);
+        return -err;
+    }
+    for (i = 0; i < nr; i++) {
+        for (j = 0; j < ka[i].iov_nr; j += 2) {
+            key.mv_size = ka[i].iov[j].iov_len;
+            key.mv_data = ka[i].iov[j].iov_base;
+            data.mv_size = ka[i].iov[j + 1].iov_len;
+            data.mv_data = ka[i].iov[j + 1].iov_base;
+
+            err = mdb_put(txn, ka[i].nse->f.lmdb.dbi, &key, &data, 0);
+            if (err)
+                goto out_abort;
+        }
+    }
+    err = mdb_txn_commit(txn);
+    xrwlock_runlock(&m->rwlock);
+    if (err == MDB_MAP_FULL && !__lmdb_map_grow(env, m, seen))
+        goto retry;
+    if (err) {
+        gk_err(mds, "lmdb txn commit failed w/ %d\n", err);
+        err = -err;
+    }
+
+    return err;
+out_abort:
+    mdb_txn_abort(txn);
+    xrwlock_runlock(&m->rwlock);
+    if (err == MDB_MAP_FULL && !__lmdb_map_grow(env, m, seen))
+        goto retry;
+    gk_err(mds, "lmdb put failed w/ %d\n", err);
+
+    return -err;
+}
+
+/* Negative key lookup. Inserts and negative slot updates are serialized
+ * by the bucket lock of the key, and a miss is cached only if no insert
+ * ran since the reader missed the hash table (kgen unchanged), thus a
+ * stale negative slot can not hide a live key.
+ *
+ * Return 1 if the key is definitely not in the backend store.
+ */
+static inline
+int __ns_key_absent(struct ns_entry *nse, u64 hash)
+{
+    if (nse->bf.bits && !bloom_test(&nse->bf, hash)) {
+        atomic64_inc(&hmo.prof.mds.key_bf_hit);
+        return 1;
+    }
+    if (nse->kneg && hash && nse->kneg[hash & (NS_KNEG_SIZE - 1)] == hash) {
+        atomic64_inc(&hmo.prof.mds.key_neg_hit);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* __ns_key_missing() cache a store miss, @gen is the kgen sampled w/ the
+ * hash table miss
+ */
+static inline
+void __ns_key_missing(struct ns_entry *nse, u64 hash, u64 gen)
+{
+    int idx;
+
+    if (!nse->kneg)
+        return;
+    idx = hash % hmo.conf.ns_ht_size;
+    xlock_lock(&(nse->ht + idx)->lock);
+    if (atomic64_read(&nse->kgen) == gen)
+        nse->kneg[hash & (NS_KNEG_SIZE - 1)] = hash;
+    xlock_unlock(&(nse->ht + idx)->lock);
+}
+
+/* __ns_key_present() should be called w/ the bucket lock of @hash held
+ */
+static inline
+void __ns_key_present(struct ns_entry *nse, u64 hash)
+{
+    atomic64_inc(&nse->kgen);
+    if (nse->bf.bits)
+        bloom_add(&nse->bf, hash);
+    if (nse->kneg && nse->kneg[hash & (NS_KNEG_SIZE - 1)] == hash)
+        nse->kneg[hash & (NS_KNEG_SIZE - 1)] = 0;
+}
+
+/* __ns_lpend_busy() return 1 if a large write of @hash is in flight, the
+ * writers of the key should wait for it to finish. Called w/ the bucket
+ * lock of @hash held, which covers the clear of the slot.
+ */
+static inline
+int __ns_lpend_busy(struct ns_entry *nse, u64 hash)
+{
+    return nse->lpend[hash & (NS_LPEND_SIZE - 1)] == (hash | 1);
+}
+
+/* __ns_ship() pass an update on to the followers and to the tail log of
+ * a migration, called under the bucket lock so they see the updates of a
+ * key in the same order
+ */
+static inline
+void __ns_ship(struct ns_entry *nse, struct gstring *key,
+               struct gstring *value)
+{
+    mds_repl_ship(&nse->namespace, key, value);
+    mds_migrate_ship(&nse->namespace, key, value);
+}
+
+/* __ns_insert_undo() rolls back an insert whose wal append failed, so the
+ * unlogged value is not left visible. The value is restored only if it is
+ * still ours (_tmp), a racing update already replaced it otherwise.
+ */
+static
+void __ns_insert_undo(struct ns_entry *nse, struct gstring *key, u64 hash,
+                      char *_tmp, char *old, int olen, int flags)
+{
+    struct nsh_entry *nshe;
+    struct hlist_node *pos, *n;
+    long rbytes = 0;
+    int idx = hash % hmo.conf.ns_ht_size;
+
+    xlock_lock(&(nse->ht + idx)->lock);
+    hlist_for_each_entry_safe(nshe, pos, n, &(nse->ht + idx)->h, list) {
+        if (nshe->hash != hash || nshe->key.len != key->len ||
+            memcmp(nshe->key.start, key->start, key->len) != 0)
+            continue;
+        if (nshe->value.start != _tmp)
+            break;
+        if (old) {
+            rbytes = (long)olen - nshe->value.len;
+            nshe->value.start = old;
+            nshe->value.len = olen;
+            old = NULL;
+            if (flags & KVS_PUT_SHIP)
+                __ns_ship(nse, key, &nshe->value);
+        } else {
+            hlist_del(&nshe->list);
+            atomic_dec(&nse->nr);
+            rbytes = -(long)(sizeof(*nshe) + nshe->key.len + nshe->value.len);
+            xfree(nshe->key.start);
+            xfree(nshe);
+        }
+        xfree(_tmp);
+        break;
+    }
+    xlock_unlock(&(nse->ht + idx)->lock);
+    if (rbytes)
+        atomic64_add(rbytes, &__ns_prof(nse)->rbytes);
+    if (old)
+        xfree(old);
+}
+
+int __ns_insert(struct ns_entry *nse, struct gstring *key, struct gstring *value,
+                u64 hash, int flags)
 {
     struct nsh_entry *nshe, *new;
     struct hlist_node *pos;
-    char *_tmp;
-    int idx, err = 0, found = 0;
+    char *_tmp, *old = NULL;
+    long rbytes = 0;
+    int idx, err = 0, found = 0, collisions = 0, olen = 0;
 
 #if 1
     _tmp = ((_tmp = xmalloc(value->len)) ? memcpy(_tmp, value->start, value->len) : 0);
@@ -828,19 +1488,30 @@ int __ns_insert(struct ns_entry *nse, struct gstring *key, struct gstring *value
     new->key.len = key->len;
     new->value.start = _tmp;
     new->value.len = value->len;
-    
-    idx = gk_hash_ns(key->start, key->len) % hmo.conf.ns_ht_size;
+    new->hash = hash;
+
+    idx = hash % hmo.conf.ns_ht_size;
+retry:
     xlock_lock(&(nse->ht + idx)->lock);
+    if (unlikely(__ns_lpend_busy(nse, hash))) {
+        /* keep the order w/ the large write of the key */
+        xlock_unlock(&(nse->ht + idx)->lock);
+        sched_yield();
+        goto retry;
+    }
     hlist_for_each_entry(nshe, pos, &(nse->ht + idx)->h, list) {
-        atomic64_inc(&hmo.prof.mds.ns_ins_collisions);
-        if ((nshe->key.len == key->len) &&
+        if ((nshe->hash == hash) && (nshe->key.len == key->len) &&
             (memcmp(nshe->key.start, key->start, 
                     min(key->len, nshe->key.len)) == 0)) {
             /* found it: 
-             * if force == 1, update it; otherwise return
+             * if KVS_PUT_FORCE, update it; otherwise return
              * -EEXIST */
-            if (force) {
-                xfree(nshe->value.start);
+            if (flags & KVS_PUT_FORCE) {
+                rbytes = (long)value->len - nshe->value.len;
+                /* keep the old value until the update is logged */
+                old = nshe->value.start;
+                olen = nshe->value.len;
+                xfree(new->key.start);
                 xfree(new);
                 nshe->value.start = _tmp;
                 nshe->value.len = value->len;
@@ -850,23 +1521,54 @@ int __ns_insert(struct ns_entry *nse, struct gstring *key, struct gstring *value
             found = 1;
             break;
         }
+        collisions++;
     }
-    if (!found) {
+    if (!found && unlikely(flags & KVS_PUT_HASHED) &&
+        hash != gk_hash_ns(key->start, key->len)) {
+        /* a caller's hash places a new entry only if it is the true one,
+         * a found entry has matched its key w/ the checked hash already */
+        gk_warning(mds, "bad key hash %lx for key %.*s\n", hash,
+                   key->len, key->start);
+        err = -EINVAL;
+    } else if (!found) {
         /* insert the new entry to the list */
         hlist_add_head(&new->list, &(nse->ht + idx)->h);
         atomic_inc(&nse->nr);
+        rbytes = sizeof(*new) + key->len + value->len;
+    }
+    if (!err) {
+        __ns_key_present(nse, hash);
+        if (flags & KVS_PUT_SHIP)
+            __ns_ship(nse, key, value);
     }
     xlock_unlock(&(nse->ht + idx)->lock);
+    if (collisions)
+        atomic64_add(collisions, &hmo.prof.mds.ns_ins_collisions);
+    if (rbytes)
+        atomic64_add(rbytes, &__ns_prof(nse)->rbytes);
 
 out_free:
     if (unlikely(err)) {
         xfree(_tmp);
-        if (!new->key.start)
+        if (new->key.start)
             xfree(new->key.start);
         xfree(new);
     } else {
-        /* relay the operation to low level storage */
-        err = __ns_store_write(nse, key, value, force);
+        /* relay the operation to low level storage, or log it and let
+         * the wal apply threads do it */
+        if ((hmo.conf.option & GK_MDS_WAL) && nse->type == NSE_F_LMDB) {
+            err = mds_wal_append(nse, key, value);
+            if (err) {
+                gk_err(mds, "namespace %.*s wal append failed w/ %d\n",
+                       nse->namespace.len, nse->namespace.start, err);
+                __ns_insert_undo(nse, key, hash, _tmp, old, olen, flags);
+            } else if (old)
+                xfree(old);
+            return err;
+        }
+        if (old)
+            xfree(old);
+        err = __ns_store_write(nse, key, value, flags & KVS_PUT_FORCE);
         if (err < 0) {
             gk_err(mds, "namespace %.*s store write failed w/ %d\n",
                    nse->namespace.len, nse->namespace.start, err);
@@ -878,41 +1580,164 @@ out_free:
     return err;
 }
 
-/* Return value: follows PTR_ERR ABI
+/* __ns_insert_large() store a large value in LMDB only. The memory table
+ * copy is skipped, a GET reads it from LMDB. An older copy of the key in
+ * the memory table is -EEXIST w/o force, otherwise it is dropped once the
+ * LMDB write commits, thus it is never lost on a failed write.
+ *
+ * The write runs w/o the bucket lock: the key is marked in nse->lpend
+ * instead, and the other writers of the key wait on the mark, thus the
+ * store and the followers still see the updates of a key in order.
  */
-struct gstring *__ns_lookup(struct ns_entry *nse, struct gstring *key)
+static
+int __ns_insert_large(struct ns_entry *nse, struct gstring *key,
+                      struct gstring *value, u64 hash, int flags)
 {
-    struct nsh_entry *nshe;
+    struct nsh_entry *nshe, *old = NULL;
     struct hlist_node *pos;
-    struct gstring *value = NULL;
-    int idx;
+    u64 *slot = &nse->lpend[hash & (NS_LPEND_SIZE - 1)];
+    long rbytes = 0;
+    int idx, err = 0;
+
+    /* the key is not resident, thus a caller's hash is always checked */
+    if ((flags & KVS_PUT_HASHED) &&
+        unlikely(hash != gk_hash_ns(key->start, key->len))) {
+        gk_warning(mds, "bad key hash %lx for key %.*s\n", hash,
+                   key->len, key->start);
+        return -EINVAL;
+    }
 
-    value = xzalloc(sizeof(*value));
-    if (unlikely(!value)) {
-        gk_err(mds, "xmalloc() gstring failed\n");
-        return ERR_PTR(-ENOMEM);
+    idx = hash % hmo.conf.ns_ht_size;
+retry:
+    xlock_lock(&(nse->ht + idx)->lock);
+    hlist_for_each_entry(nshe, pos, &(nse->ht + idx)->h, list) {
+        if ((nshe->hash == hash) && (nshe->key.len == key->len) &&
+            (memcmp(nshe->key.start, key->start, key->len) == 0)) {
+            if (!(flags & KVS_PUT_FORCE))
+                err = -EEXIST;
+            break;
+        }
     }
+    if (!err && !__sync_bool_compare_and_swap(slot, 0, hash | 1)) {
+        /* a large write of this key, or of one sharing the slot */
+        xlock_unlock(&(nse->ht + idx)->lock);
+        sched_yield();
+        goto retry;
+    }
+    xlock_unlock(&(nse->ht + idx)->lock);
+    if (err)
+        return err;
+
+    err = __lmdb_write_reserve(nse, key, value);
 
-    idx = gk_hash_ns(key->start, key->len) % hmo.conf.ns_ht_size;
     xlock_lock(&(nse->ht + idx)->lock);
+    if (!err) {
+        /* lookup again, the older copy may be removed meanwhile */
+        hlist_for_each_entry(nshe, pos, &(nse->ht + idx)->h, list) {
+            if ((nshe->hash == hash) && (nshe->key.len == key->len) &&
+                (memcmp(nshe->key.start, key->start, key->len) == 0)) {
+                hlist_del(&nshe->list);
+                atomic_dec(&nse->nr);
+                rbytes = -(long)(sizeof(*nshe) + nshe->key.len +
+                                 nshe->value.len);
+                old = nshe;
+                break;
+            }
+        }
+        __ns_key_present(nse, hash);
+        if (flags & KVS_PUT_SHIP)
+            __ns_ship(nse, key, value);
+    }
+    *slot = 0;
+    xlock_unlock(&(nse->ht + idx)->lock);
+    if (err)
+        return err;
+    if (old) {
+        xfree(old->key.start);
+        xfree(old->value.start);
+        xfree(old);
+        atomic64_add(rbytes, &__ns_prof(nse)->rbytes);
+    }
+    atomic64_inc(&hmo.prof.mds.large_put);
+
+    return 0;
+}
+
+/* __ns_lookup_ht() copy the value of a resident pair into @value, return
+ * 1 if it is found. @gen is set to the kgen seen under the bucket lock.
+ * W/ @nowait, return -EAGAIN rather than wait for a busy bucket.
+ */
+static inline
+int __ns_lookup_ht(struct ns_entry *nse, struct gstring *key, u64 hash,
+                   struct gstring *value, u64 *gen, int nowait)
+{
+    struct nsh_entry *nshe;
+    struct hlist_node *pos;
+    void *hit = NULL;
+    int idx, collisions = 0;
+
+    idx = hash % hmo.conf.ns_ht_size;
+    if (nowait) {
+        if (xlock_trylock(&(nse->ht + idx)->lock))
+            return -EAGAIN;
+    } else
+        xlock_lock(&(nse->ht + idx)->lock);
     hlist_for_each_entry(nshe, pos, &(nse->ht + idx)->h, list) {
-        atomic64_inc(&hmo.prof.mds.ns_lkp_collisions);
-        if ((nshe->key.len == key->len) &&
+        if ((nshe->hash == hash) && (nshe->key.len == key->len) &&
             (memcmp(nshe->key.start, key->start, 
                     min(key->len, nshe->key.len)) == 0)) {
             /* found it */
             value->start = strndup(nshe->value.start, nshe->value.len);
             value->len = nshe->value.len;
+            hit = nshe;
             break;
         }
+        collisions++;
     }
+    *gen = atomic64_read(&nse->kgen);
     xlock_unlock(&(nse->ht + idx)->lock);
-    if (!value->start && !value->len) {
-        int err = __ns_store_read(nse, key, value);
+    if (hit)
+        mds_spool_numa_sample(hit);
+    if (collisions)
+        atomic64_add(collisions, &hmo.prof.mds.ns_lkp_collisions);
+
+    return hit != NULL;
+}
+
+/* Return value: follows PTR_ERR ABI
+ */
+struct gstring *__ns_lookup(struct ns_entry *nse, struct gstring *key, u64 hash)
+{
+    struct gstring *value = NULL;
+    u64 gen;
+
+    value = xzalloc(sizeof(*value));
+    if (unlikely(!value)) {
+        gk_err(mds, "xmalloc() gstring failed\n");
+        return ERR_PTR(-ENOMEM);
+    }
+
+    if (!__ns_lookup_ht(nse, key, hash, value, &gen, 0)) {
+        int err;
+
+        if (__ns_key_absent(nse, hash)) {
+            xfree(value);
+            return ERR_PTR(-ENOENT);
+        }
+        if (mds_spool_expired()) {
+            xfree(value);
+            return ERR_PTR(-ETIMEDOUT);
+        }
+        err = __ns_store_read(nse, key, value);
         if (err) {
-            gk_err(mds, "__ns_store_read() failed w/ %d\n", err);
+            /* a caller's hash only probes, cache misses of the true one */
+            if (err == -ENOENT &&
+                hash == gk_hash_ns(key->start, key->len))
+                __ns_key_missing(nse, hash, gen);
+            else
+                gk_err(mds, "__ns_store_read() failed w/ %d\n", err);
             xfree(value);
-            value = ERR_PTR(err);
+            return ERR_PTR(err);
         }
     }
     if (unlikely(!value->start && value->len)) {
@@ -928,32 +1753,46 @@ void __ns_remove(struct ns_entry *nse, struct gstring *key)
 {
     struct nsh_entry *nshe;
     struct hlist_node *pos, *n;
+    long rbytes = 0;
+    u64 hash;
     int idx;
     
     if (unlikely(!key))
         return;
 
-    idx = gk_hash_ns(key->start, key->len) % hmo.conf.ns_ht_size;
+    hash = gk_hash_ns(key->start, key->len);
+    idx = hash % hmo.conf.ns_ht_size;
     xlock_lock(&(nse->ht + idx)->lock);
     hlist_for_each_entry_safe(nshe, pos, n, &(nse->ht + idx)->h, list) {
-        if ((nshe->key.len == key->len) &&
+        if ((nshe->hash == hash) && (nshe->key.len == key->len) &&
             (memcmp(nshe->key.start, key->start, 
                     min(key->len, nshe->key.len)) == 0)) {
             hlist_del(&nshe->list);
+            atomic_dec(&nse->nr);
+            rbytes -= sizeof(*nshe) + nshe->key.len + nshe->value.len;
+            xfree(nshe->key.start);
+            xfree(nshe->value.start);
             xfree(nshe);
         }
     }
     xlock_unlock(&(nse->ht + idx)->lock);
+    if (rbytes)
+        atomic64_add(rbytes, &__ns_prof(nse)->rbytes);
 }
 
 /* Return ABI: ERR_PTR
+ *
+ * @hash: gk_hash_ns() of the key, or 0 to let us compute it
  *
  * NOTE: user should free the returned 'value'
  */
-struct gstring *kvs_get(struct gstring *namespace, struct gstring *key)
+struct gstring *kvs_get_h(struct gstring *namespace, struct gstring *key,
+                          u64 hash)
 {
     struct ns_entry *nse;
     struct gstring *value;
+    struct ns_prof_slot *nps;
+    u64 begin = __kvs_now_us();
 
     if (unlikely(!namespace || !key || !namespace->len || !key->len)) {
         return ERR_PTR(-EINVAL);
@@ -963,7 +1802,16 @@ struct gstring *kvs_get(struct gstring *namespace, struct gstring *key)
         if (PTR_ERR(nse) == -ENOENT) {
             /* try to load the namespace? */
             char path[GK_MAX_NAME_LEN] = {0,};
-            sprintf(path, "%s/%s", hmo.conf.kvs_home, namespace->start);
+            u64 nhash = gk_hash_nsht(namespace->start, namespace->len);
+
+            if (kvs_nneg_lookup(nhash)) {
+                atomic64_inc(&hmo.prof.mds.ns_neg_hit);
+                goto out_noent;
+            }
+            if (mds_spool_expired())
+                return ERR_PTR(-ETIMEDOUT);
+            snprintf(path, sizeof(path), "%s/%.*s", hmo.conf.kvs_home,
+                     namespace->len, namespace->start);
             if (kvs_dir_is_exist(path)) {
                 nse = kvs_ns_lookup_create(namespace, NSE_F_LMDB);
                 if (IS_ERR(nse)) {
@@ -971,7 +1819,8 @@ struct gstring *kvs_get(struct gstring *namespace, struct gstring *key)
                            namespace->len, namespace->start, PTR_ERR(nse));
                 } else 
                     goto do_lookup;
-            }
+            } else
+                kvs_nneg_insert(nhash);
         } else {
             gk_err(mds, "kvs_ns_lookup(%.*s) failed w/ %ld\n", 
                    namespace->len, namespace->start, PTR_ERR(nse));
@@ -980,22 +1829,111 @@ struct gstring *kvs_get(struct gstring *namespace, struct gstring *key)
         goto out;
     }
 do_lookup:
-    value = __ns_lookup(nse, key);
+    if (!hash)
+        hash = gk_hash_ns(key->start, key->len);
+    value = __ns_lookup(nse, key, hash);
     if (unlikely(IS_ERR(value))) {
-        gk_err(mds, "__ns_lookup(%.*s@%.*s) failed w/ %ld.\n", 
-               namespace->len, namespace->start, 
-               key->len, key->start, PTR_ERR(value));
+        if (PTR_ERR(value) != -ENOENT && PTR_ERR(value) != -ETIMEDOUT)
+            gk_err(mds, "__ns_lookup(%.*s@%.*s) failed w/ %ld.\n", 
+                   namespace->len, namespace->start, 
+                   key->len, key->start, PTR_ERR(value));
         goto out_put;
     }
 out_put:
+    nps = __ns_prof(nse);
+    atomic64_inc(&nps->get);
+    if (IS_ERR(value))
+        atomic64_inc(&nps->miss);
+    else
+        atomic64_add(value->len, &nps->bout);
+    atomic64_add(__kvs_now_us() - begin, &nps->lat);
+    atomic64_inc(&nps->lat_nr);
     kvs_ns_put(nse);
 out:
+    return value;
+out_noent:
+    return ERR_PTR(-ENOENT);
+}
+
+/* kvs_get_mem() lookup w/o any blocking I/O: the namespace has to be
+ * opened in LMDB, and the pair resident or known absent, otherwise return
+ * ERR_PTR(-EAGAIN) and the caller should go through kvs_get_h().
+ *
+ * NOTE: user should free the returned 'value'
+ */
+struct gstring *kvs_get_mem(struct gstring *namespace, struct gstring *key,
+                            u64 hash)
+{
+    struct ns_entry *nse;
+    struct gstring *value;
+    struct ns_prof_slot *nps;
+    u64 begin = __kvs_now_us(), gen;
+    int err;
+
+    if (unlikely(!namespace || !key || !namespace->len || !key->len))
+        return ERR_PTR(-EINVAL);
+    nse = kvs_ns_lookup(namespace);
+    if (IS_ERR(nse))
+        return ERR_PTR(-EAGAIN);
+    /* the bloom filter and the residency are valid after the open only */
+    if (nse->state != NSE_LMDB) {
+        kvs_ns_put(nse);
+        return ERR_PTR(-EAGAIN);
+    }
+
+    if (!hash)
+        hash = gk_hash_ns(key->start, key->len);
+    value = xzalloc(sizeof(*value));
+    if (unlikely(!value)) {
+        kvs_ns_put(nse);
+        return ERR_PTR(-EAGAIN);
+    }
+    err = __ns_lookup_ht(nse, key, hash, value, &gen, 1);
+    if (unlikely(err < 0)) {
+        /* never wait for a bucket in the reactor */
+        xfree(value);
+        kvs_ns_put(nse);
+        return ERR_PTR(-EAGAIN);
+    }
+    if (err) {
+        if (unlikely(!value->start && value->len)) {
+            xfree(value);
+            value = ERR_PTR(-ENOMEM);
+        }
+    } else {
+        xfree(value);
+        if (!__ns_key_absent(nse, hash)) {
+            /* it may be in the store */
+            kvs_ns_put(nse);
+            return ERR_PTR(-EAGAIN);
+        }
+        value = ERR_PTR(-ENOENT);
+    }
+
+    nps = __ns_prof(nse);
+    atomic64_inc(&nps->get);
+    if (IS_ERR(value))
+        atomic64_inc(&nps->miss);
+    else
+        atomic64_add(value->len, &nps->bout);
+    atomic64_add(__kvs_now_us() - begin, &nps->lat);
+    atomic64_inc(&nps->lat_nr);
+    kvs_ns_put(nse);
+
     return value;
 }
 
-int __kvs_put(struct gstring *namespace, struct gstring *key, struct gstring *value, int force)
+struct gstring *kvs_get(struct gstring *namespace, struct gstring *key)
+{
+    return kvs_get_h(namespace, key, 0);
+}
+
+int __kvs_put(struct gstring *namespace, struct gstring *key, struct gstring *value,
+              u64 hash, int flags)
 {
     struct ns_entry *nse;
+    struct ns_prof_slot *nps;
+    u64 begin = __kvs_now_us();
     int err;
 
     if (unlikely(!namespace || !key || !value || !namespace->len || !key->len || !value->len)) {
@@ -1007,7 +1945,21 @@ int __kvs_put(struct gstring *namespace, struct gstring *key, struct gstring *va
                namespace->len, namespace->start, PTR_ERR(nse));
         return PTR_ERR(nse);
     }
-    err = __ns_insert(nse, key, value, force);
+    /* the hash places the key in the hash table and the bloom filter,
+     * which is rebuilt w/ gk_hash_ns() on reload, thus a caller's is
+     * checked once it would create an entry */
+    if (!hash)
+        hash = gk_hash_ns(key->start, key->len);
+    else
+        flags |= KVS_PUT_HASHED;
+    /* the wal keeps the value in memory until it is applied, thus the
+     * large value path is for the synchronous store only */
+    if (unlikely(value->len >= hmo.conf.large_value) &&
+        nse->type == NSE_F_LMDB && nse->state == NSE_LMDB &&
+        !(hmo.conf.option & GK_MDS_WAL))
+        err = __ns_insert_large(nse, key, value, hash, flags);
+    else
+        err = __ns_insert(nse, key, value, hash, flags);
     if (unlikely(err)) {
         if (err == -EEXIST)
             gk_debug(mds, "__ns_insert(%.*s@%.*s) failed w/ %d\n", 
@@ -1021,6 +1973,11 @@ int __kvs_put(struct gstring *namespace, struct gstring *key, struct gstring *va
     }
 
 out_put:
+    nps = __ns_prof(nse);
+    atomic64_inc(&nps->put);
+    atomic64_add(key->len + value->len, &nps->bin);
+    atomic64_add(__kvs_now_us() - begin, &nps->lat);
+    atomic64_inc(&nps->lat_nr);
     kvs_ns_put(nse);
 
     return err;
@@ -1028,12 +1985,18 @@ out_put:
 
 int kvs_put(struct gstring *namespace, struct gstring *key, struct gstring *value)
 {
-    return __kvs_put(namespace, key, value, 0);
+    return __kvs_put(namespace, key, value, 0, 0);
+}
+
+int kvs_put_h(struct gstring *namespace, struct gstring *key, struct gstring *value,
+              u64 hash)
+{
+    return __kvs_put(namespace, key, value, hash, KVS_PUT_SHIP);
 }
 
 int kvs_update(struct gstring *namespace, struct gstring *key, struct gstring *value)
 {
-    return __kvs_put(namespace, key, value, 1);
+    return __kvs_put(namespace, key, value, 0, KVS_PUT_FORCE);
 }
 
 void kvs_ns_destroy(struct ns_entry *nse)
@@ -1074,6 +2037,10 @@ void kvs_destroy(void)
                     kvs_ns_destroy(nse);
                     hlist_del(&nse->list);
                     list_del(&nse->lru);
+                    __ns_negcache_destroy(nse);
+                    free(nse->prof);
+                    xhugefree(nse->ht, sizeof(struct regular_hash) *
+                              hmo.conf.ns_ht_size);
                     xfree(nse);
                     atomic_dec(&ns_mgr.active);
                 } else {
@@ -1084,4 +2051,405 @@ void kvs_destroy(void)
             xrwlock_wunlock(&(ns_mgr.nsht + i)->lock);
         }
     } while (notdone);
+
+    xfree(ns_mgr.nneg);
+    ns_mgr.nneg = NULL;
+    xhugefree(ns_mgr.nsht, hmo.conf.nshash_size *
+              sizeof(struct regular_hash_rw));
+    ns_mgr.nsht = NULL;
+    __lmdb_shared_destroy();
+}
+
+struct kvs_ns_stat
+{
+    struct ns_entry *nse;
+    u64 v[KVS_NS_TOP_MAX];
+};
+
+static int __kvs_ns_top_metric;
+
+static int __kvs_ns_stat_cmp(const void *a, const void *b)
+{
+    const struct kvs_ns_stat *x = a, *y = b;
+    u64 vx = x->v[__kvs_ns_top_metric], vy = y->v[__kvs_ns_top_metric];
+
+    return (vx < vy) ? 1 : ((vx > vy) ? -1 : 0);
+}
+
+static inline
+void __kvs_ns_stat_fill(struct kvs_ns_stat *ks)
+{
+    struct ns_entry *nse = ks->nse;
+    struct ns_prof_slot *nps;
+    u64 lat = 0, lat_nr = 0;
+    long rbytes = 0;
+    int i;
+
+    for (i = 0; i < NS_PROF_SLOTS; i++) {
+        nps = &nse->prof[i];
+        ks->v[KVS_NS_TOP_GET] += atomic64_read(&nps->get);
+        ks->v[KVS_NS_TOP_PUT] += atomic64_read(&nps->put);
+        ks->v[KVS_NS_TOP_MISS] += atomic64_read(&nps->miss);
+        ks->v[KVS_NS_TOP_BIN] += atomic64_read(&nps->bin);
+        ks->v[KVS_NS_TOP_BOUT] += atomic64_read(&nps->bout);
+        rbytes += atomic64_read(&nps->rbytes);
+        lat += atomic64_read(&nps->lat);
+        lat_nr += atomic64_read(&nps->lat_nr);
+    }
+    ks->v[KVS_NS_TOP_ENTRY] = atomic_read(&nse->nr);
+    ks->v[KVS_NS_TOP_RESIDENT] = rbytes > 0 ? rbytes : 0;
+    ks->v[KVS_NS_TOP_LATENCY] = lat_nr ? lat / lat_nr : 0;
+    if (nse->type == NSE_F_LMDB && nse->state == NSE_LMDB) {
+        struct lmdb_map *m = nse->f.lmdb.map;
+        MDB_envinfo mei;
+        MDB_txn *txn;
+        MDB_stat mst;
+
+        xrwlock_rlock(&m->rwlock);
+        if (ns_mgr.shenv) {
+            if (!mdb_txn_begin(nse->f.lmdb.env, NULL, MDB_RDONLY, &txn)) {
+                if (!mdb_stat(txn, nse->f.lmdb.dbi, &mst))
+                    ks->v[KVS_NS_TOP_DISK] = (mst.ms_branch_pages +
+                                              mst.ms_leaf_pages +
+                                              mst.ms_overflow_pages) *
+                        mst.ms_psize;
+                mdb_txn_abort(txn);
+            }
+        }
+        /* the map and its fill are of the env, maybe shared */
+        if (!mdb_env_info(nse->f.lmdb.env, &mei) &&
+            !mdb_env_stat(nse->f.lmdb.env, &mst)) {
+            if (!ns_mgr.shenv)
+                ks->v[KVS_NS_TOP_DISK] = (mei.me_last_pgno + 1) *
+                    mst.ms_psize;
+            ks->v[KVS_NS_TOP_MAP] = mei.me_mapsize;
+            ks->v[KVS_NS_TOP_FILL] = (mei.me_last_pgno + 1) * mst.ms_psize *
+                1000 / mei.me_mapsize;
+        }
+        xrwlock_runlock(&m->rwlock);
+    }
+}
+
+/* kvs_ns_top() dump the top-N namespaces sorted by metric, return a
+ * xmalloc()ed string.
+ */
+char *kvs_ns_top(int metric, int n)
+{
+    struct kvs_ns_stat *ks = NULL, *nks;
+    struct ns_entry *nse;
+    struct hlist_node *pos;
+    char *buf = NULL, *p;
+    int i, nr = 0, size = 0;
+
+    if (metric < 0 || metric >= KVS_NS_TOP_MAX)
+        return NULL;
+
+    for (i = 0; i < hmo.conf.nshash_size; i++) {
+        if (hlist_empty(&(ns_mgr.nsht + i)->h))
+            continue;
+        xrwlock_rlock(&(ns_mgr.nsht + i)->lock);
+        hlist_for_each_entry(nse, pos, &(ns_mgr.nsht + i)->h, list) {
+            if (nr >= size) {
+                size = size ? size << 1 : 64;
+                nks = xrealloc(ks, size * sizeof(*ks));
+                if (!nks) {
+                    xrwlock_runlock(&(ns_mgr.nsht + i)->lock);
+                    goto out_put;
+                }
+                ks = nks;
+            }
+            atomic_inc(&nse->ref);
+            memset(&ks[nr], 0, sizeof(*ks));
+            ks[nr++].nse = nse;
+        }
+        xrwlock_runlock(&(ns_mgr.nsht + i)->lock);
+    }
+
+    for (i = 0; i < nr; i++)
+        __kvs_ns_stat_fill(&ks[i]);
+    /* only the dconf thread calls us */
+    __kvs_ns_top_metric = metric;
+    qsort(ks, nr, sizeof(*ks), __kvs_ns_stat_cmp);
+    if (n <= 0 || n > nr)
+        n = nr;
+
+    buf = xzalloc(320 + n * 320);
+    if (!buf)
+        goto out_put;
+    p = buf;
+    p += sprintf(p, "Top %d of %d namespaces by metric %d:\n"
+                 "%-24s %10s %10s %10s %12s %12s %10s %12s %12s %8s "
+                 "%14s %6s\n",
+                 n, nr, metric, "namespace", "gets", "puts", "misses",
+                 "bytes_in", "bytes_out", "entries", "resident",
+                 "disk", "lat_us", "map", "fill%");
+    for (i = 0; i < n; i++) {
+        nse = ks[i].nse;
+        p += sprintf(p, "%-24.*s %10ld %10ld %10ld %12ld %12ld %10ld "
+                     "%12ld %12ld %8ld %14ld %6.1f\n",
+                     min(nse->namespace.len, 128), nse->namespace.start,
+                     ks[i].v[KVS_NS_TOP_GET], ks[i].v[KVS_NS_TOP_PUT],
+                     ks[i].v[KVS_NS_TOP_MISS], ks[i].v[KVS_NS_TOP_BIN],
+                     ks[i].v[KVS_NS_TOP_BOUT], ks[i].v[KVS_NS_TOP_ENTRY],
+                     ks[i].v[KVS_NS_TOP_RESIDENT], ks[i].v[KVS_NS_TOP_DISK],
+                     ks[i].v[KVS_NS_TOP_LATENCY], ks[i].v[KVS_NS_TOP_MAP],
+                     ks[i].v[KVS_NS_TOP_FILL] / 10.0);
+    }
+
+out_put:
+    for (i = 0; i < nr; i++)
+        kvs_ns_put(ks[i].nse);
+    xfree(ks);
+
+    return buf;
+}
+
+/* the pairs of a scan are copied out as | int klen | int vlen | key |
+ * value |... and fed to the callback w/o any lock held
+ */
+static int __kvs_scan_add(void **buf, int *len, int *size, void *k, int klen,
+                          void *v, int vlen)
+{
+    int l = 2 * sizeof(int) + klen + vlen;
+    void *p;
+
+    if (*len + l > *size) {
+        p = xrealloc(*buf, max(*size << 1, *len + l));
+        if (!p)
+            return -ENOMEM;
+        *buf = p;
+        *size = max(*size << 1, *len + l);
+    }
+    p = *buf + *len;
+    *(int *)p = klen;
+    *(int *)(p + sizeof(int)) = vlen;
+    memcpy(p + 2 * sizeof(int), k, klen);
+    memcpy(p + 2 * sizeof(int) + klen, v, vlen);
+    *len += l;
+
+    return 0;
+}
+
+static int __kvs_scan_feed(void *buf, int len, kvs_scan_cb_t cb, void *arg)
+{
+    struct gstring key, value;
+    void *p;
+    int err;
+
+    for (p = buf; p < buf + len;
+         p += 2 * sizeof(int) + key.len + value.len) {
+        key.len = *(int *)p;
+        value.len = *(int *)(p + sizeof(int));
+        key.start = p + 2 * sizeof(int);
+        value.start = key.start + key.len;
+        err = cb(arg, &key, &value);
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+/* __kvs_ns_scan_ht() walk the memory table bucket by bucket, the entries
+ * are copied out under the bucket lock, thus the callback may block.
+ */
+static int __kvs_ns_scan_ht(struct ns_entry *nse, kvs_scan_cb_t cb, void *arg)
+{
+    struct nsh_entry *nshe;
+    struct hlist_node *pos;
+    void *buf = NULL;
+    int i, len, size = 0, err = 0;
+
+    for (i = 0; i < hmo.conf.ns_ht_size; i++) {
+        if (hlist_empty(&(nse->ht + i)->h))
+            continue;
+        len = 0;
+        xlock_lock(&(nse->ht + i)->lock);
+        hlist_for_each_entry(nshe, pos, &(nse->ht + i)->h, list) {
+            err = __kvs_scan_add(&buf, &len, &size, nshe->key.start,
+                                 nshe->key.len, nshe->value.start,
+                                 nshe->value.len);
+            if (err)
+                break;
+        }
+        xlock_unlock(&(nse->ht + i)->lock);
+        if (err)
+            break;
+
+        err = __kvs_scan_feed(buf, len, cb, arg);
+        if (err)
+            break;
+    }
+    xfree(buf);
+
+    return err;
+}
+
+/* kvs_ns_scan() feed every pair of a namespace to the callback: firstly
+ * the LMDB content, then the memory table, which has the latest value of
+ * each key written since the namespace is loaded (including the ones not
+ * applied to LMDB yet). LMDB is read in txns of up to KVS_SCAN_CHUNK pairs
+ * or KVS_SCAN_BYTES, which are copied out and fed to the callback after
+ * the txn and the map lock are released, thus a slow callback never blocks
+ * the map growth. Each txn resumes after the last key of the previous
+ * one. A key may be seen twice, the later one wins. A non zero return of
+ * the callback stops the scan.
+ */
+#define KVS_SCAN_CHUNK  1024
+#define KVS_SCAN_BYTES  (8 << 20)
+int kvs_ns_scan(struct gstring *namespace, kvs_scan_cb_t cb, void *arg)
+{
+    struct ns_entry *nse;
+    MDB_txn *txn;
+    MDB_cursor *cursor;
+    MDB_val k, v, last = {0, NULL};
+    MDB_cursor_op op;
+    void *p, *buf = NULL;
+    int err = 0, cerr = 0, nr, len, size = 0;
+
+    nse = kvs_ns_lookup(namespace);
+    if (IS_ERR(nse) && PTR_ERR(nse) == -ENOENT) {
+        char path[GK_MAX_NAME_LEN] = {0,};
+
+        snprintf(path, sizeof(path), "%s/%.*s", hmo.conf.kvs_home,
+                 namespace->len, namespace->start);
+        if (kvs_dir_is_exist(path))
+            nse = kvs_ns_lookup_create(namespace, NSE_F_LMDB);
+    }
+    if (IS_ERR(nse))
+        return PTR_ERR(nse);
+
+    if (nse->type == NSE_F_LMDB && nse->state == NSE_LMDB) {
+    next_chunk:
+        /* readers do not block the writers in LMDB, no nse->lock here */
+        xrwlock_rlock(&nse->f.lmdb.map->rwlock);
+        err = mdb_txn_begin(nse->f.lmdb.env, NULL, MDB_RDONLY, &txn);
+        if (err) {
+            xrwlock_runlock(&nse->f.lmdb.map->rwlock);
+            gk_err(mds, "lmdb txn begin failed w/ %d\n", err);
+            err = -err;
+            goto out_free;
+        }
+        err = mdb_cursor_open(txn, nse->f.lmdb.dbi, &cursor);
+        if (err) {
+            gk_err(mds, "lmdb cursor open failed w/ %d\n", err);
+            mdb_txn_abort(txn);
+            xrwlock_runlock(&nse->f.lmdb.map->rwlock);
+            err = -err;
+            goto out_free;
+        }
+        nr = 0;
+        len = 0;
+        k = last;
+        op = last.mv_data ? MDB_SET_RANGE : MDB_FIRST;
+        while ((err = mdb_cursor_get(cursor, &k, &v, op)) == 0) {
+            op = MDB_NEXT;
+            if (last.mv_data && k.mv_size == last.mv_size &&
+                !memcmp(k.mv_data, last.mv_data, k.mv_size))
+                continue;
+            cerr = __kvs_scan_add(&buf, &len, &size, k.mv_data, k.mv_size,
+                                  v.mv_data, v.mv_size);
+            if (cerr)
+                break;
+            if (++nr >= KVS_SCAN_CHUNK || len >= KVS_SCAN_BYTES) {
+                /* remember the last key and release the map */
+                p = xrealloc(last.mv_data, k.mv_size);
+                if (!p) {
+                    cerr = -ENOMEM;
+                    break;
+                }
+                memcpy(p, k.mv_data, k.mv_size);
+                last.mv_data = p;
+                last.mv_size = k.mv_size;
+                break;
+            }
+        }
+        mdb_cursor_close(cursor);
+        mdb_txn_abort(txn);
+        xrwlock_runlock(&nse->f.lmdb.map->rwlock);
+        if (!cerr)
+            cerr = __kvs_scan_feed(buf, len, cb, arg);
+        if (cerr) {
+            err = cerr;
+            goto out_free;
+        }
+        if (!err)
+            goto next_chunk;
+        if (err != MDB_NOTFOUND) {
+            gk_err(mds, "lmdb cursor get failed w/ %d\n", err);
+            err = -err;
+            goto out_free;
+        }
+        xfree(last.mv_data);
+        last.mv_data = NULL;
+    }
+    xfree(buf);
+    err = __kvs_ns_scan_ht(nse, cb, arg);
+    kvs_ns_put(nse);
+
+    return err;
+out_free:
+    xfree(buf);
+    xfree(last.mv_data);
+    kvs_ns_put(nse);
+
+    return err;
+}
+
+/* kvs_ns_exist() return 1 if the namespace is loaded or on disk
+ */
+int kvs_ns_exist(struct gstring *namespace)
+{
+    char path[GK_MAX_NAME_LEN];
+    struct ns_entry *nse;
+    u64 nhash;
+
+    nse = kvs_ns_lookup(namespace);
+    if (!IS_ERR(nse)) {
+        kvs_ns_put(nse);
+        return 1;
+    }
+    nhash = gk_hash_nsht(namespace->start, namespace->len);
+    if (kvs_nneg_lookup(nhash))
+        return 0;
+    snprintf(path, sizeof(path), "%s/%.*s", hmo.conf.kvs_home,
+             namespace->len, namespace->start);
+    if (kvs_dir_is_exist(path))
+        return 1;
+    kvs_nneg_insert(nhash);
+
+    return 0;
+}
+
+/* kvs_ns_list() feed the name of every namespace on disk to the callback,
+ * a non zero return of the callback stops the listing.
+ */
+int kvs_ns_list(int (*cb)(void *arg, struct gstring *namespace), void *arg)
+{
+    struct gstring ns;
+    struct dirent *de;
+    DIR *dir;
+    int err = 0;
+
+    dir = opendir(hmo.conf.kvs_home);
+    if (!dir) {
+        gk_err(mds, "opendir %s failed w/ %s\n", hmo.conf.kvs_home,
+               strerror(errno));
+        return -errno;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        /* ., .., .wal and the shared .lmdb.N envs */
+        if (de->d_name[0] == '.')
+            continue;
+        if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
+            continue;
+        ns.start = de->d_name;
+        ns.len = strlen(de->d_name);
+        err = cb(arg, &ns);
+        if (err)
+            break;
+    }
+    closedir(dir);
+
+    return err;
 }
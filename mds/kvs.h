@@ -33,6 +33,10 @@ struct namespace_mgr
     atomic_t active;            /* active ns entries */
 #define NS_MGR_MEMLIMIT (2 * 1024 * 1024 * 1024)
     u64 memlimit;
+#define KVS_NNEG_SIZE   (64 * 1024)
+    u64 *nneg;                  /* negative cache of missing namespaces */
+    MDB_env **shenv;            /* shared LMDB envs, hmo.conf.lmdb_shared */
+    struct lmdb_map *shmap;     /* and their maps */
 };
 
 struct gstring
@@ -46,11 +50,25 @@ struct ns_log_file
     loff_t foffset;             /* last seek position */
 };
 
+/* The map of an LMDB env starts at hmo.conf.lmdb_map_init and doubles on
+ * MDB_MAP_FULL. Each txn holds the rlock, the map is only resized w/ the
+ * wlock held, i.e. no txn is active in this process.
+ */
+struct lmdb_map
+{
+#define LMDB_MAP_INIT           (16 * 1024 * 1024UL)
+#define LMDB_MAP_MAX            (1024 * 1024 * 1024 * 1024UL)
+#define LMDB_SHARED_SIZE        (256 * 1024 * 1024 * 1024UL)
+    xrwlock_t rwlock;
+    size_t size;                /* current map size */
+    size_t max;                 /* grow no further than it */
+};
+
 struct ns_lmdb_file
 {
-#define LMDB_DEFAULT_SIZE       (10 * 1024 * 1024 * 1024UL)
     MDB_env *env;
     MDB_dbi dbi;
+    struct lmdb_map *map;       /* own one, or one of ns_mgr.shmap */
 };
 
 union ns_file
@@ -59,10 +77,26 @@ union ns_file
     struct ns_lmdb_file lmdb;
 };
 
+/* Per-namespace statistics. Threads are spread over the slots, thus the
+ * hot path only touches a (mostly) private cache line. Slots are summed
+ * up on reading.
+ */
+struct ns_prof_slot
+{
+    atomic64_t get, put, miss;
+    atomic64_t bin, bout;       /* bytes in (put) and out (get) */
+    atomic64_t rbytes;          /* delta of resident bytes */
+    atomic64_t lat;             /* total latency in us */
+    atomic64_t lat_nr;
+} __attribute__((aligned(64)));
+
+#define NS_PROF_SLOTS   16
+
 struct ns_entry
 {
     struct hlist_node list;
     struct list_head lru;
+    time_t atime;               /* last lru update */
     struct gstring namespace;
 #define NS_HASH_SIZE    (2 * 1024 * 1024) /* for 2M hash list */
     struct regular_hash *ht;    /* hash table for this namespace */
@@ -81,11 +115,24 @@ struct ns_entry
     short state;
 
     union ns_file f;
+
+#define NS_BLOOM_BITS   (8 * 1024 * 1024) /* ~2% fp for 1M keys */
+#define NS_BLOOM_K      4
+    struct ns_prof_slot *prof;  /* NS_PROF_SLOTS statistic slots */
+
+    struct bloom_filter bf;     /* keys in the backend store */
+#define NS_KNEG_SIZE    (4096)
+    u64 *kneg;                  /* negative cache of missing keys */
+    atomic64_t kgen;            /* bumped by inserts, guards kneg */
+#define NS_LPEND_SIZE   (16)
+    u64 lpend[NS_LPEND_SIZE];   /* keys w/ a large write in flight */
 };
 
 struct nsh_entry
 {
     struct hlist_node list;
+    u64 hash;                   /* gk_hash_ns() of key, bucket = hash %
+                                 * ns_ht_size */
     struct gstring key, value;
 };
 
@@ -107,11 +154,71 @@ struct kvs_storage_access
     int iov_nr;
 };
 
+/* kvs_key_hash() is the key hash clients may precompute and pass in
+ * tx.reserved w/ XNET_RESERVED_USED, see mds_do_put() and mds_do_get().
+ * A PUT w/ a wrong hash is rejected w/ -EINVAL, a GET w/ a wrong hash
+ * may miss but never updates the negative caches.
+ */
+static inline
+u64 kvs_key_hash(void *key, int keylen)
+{
+    return gk_hash_ns(key, keylen);
+}
+
+/* __kvs_put() flags */
+#define KVS_PUT_FORCE   0x01    /* update an existing pair */
+#define KVS_PUT_SHIP    0x02    /* a client write, pass it to the followers */
+#define KVS_PUT_HASHED  0x04    /* @hash is a caller's, check it on create */
+
 /* APIs */
 int kvs_init(void);
 void kvs_destroy(void);
 struct gstring *kvs_get(struct gstring *namespace, struct gstring *key);
 int kvs_put(struct gstring *namespace, struct gstring *key, struct gstring *value);
+struct gstring *kvs_get_h(struct gstring *namespace, struct gstring *key, u64 hash);
+struct gstring *kvs_get_mem(struct gstring *namespace, struct gstring *key,
+                            u64 hash);
+int kvs_put_h(struct gstring *namespace, struct gstring *key, struct gstring *value,
+              u64 hash);
 int kvs_update(struct gstring *namespace, struct gstring *key, struct gstring *value);
+int kvs_ns_store_apply(struct ns_entry *nse, struct iovec *iov, int iov_nr);
+
+struct kvs_apply
+{
+    struct ns_entry *nse;
+    struct iovec *iov;          /* key and value iovs in turn */
+    int iov_nr;
+};
+int kvs_store_apply_batch(struct kvs_apply *ka, int nr);
+
+/* kvs_ns_store_env() return the LMDB env of the namespace, namespaces w/
+ * the same env can be applied in one kvs_store_apply_batch()
+ */
+static inline
+void *kvs_ns_store_env(struct ns_entry *nse)
+{
+    return nse->f.lmdb.env;
+}
+int kvs_dir_make_exist(char *path);
+
+#define KVS_NS_TOP_GET          0
+#define KVS_NS_TOP_PUT          1
+#define KVS_NS_TOP_MISS         2
+#define KVS_NS_TOP_BIN          3
+#define KVS_NS_TOP_BOUT         4
+#define KVS_NS_TOP_ENTRY        5
+#define KVS_NS_TOP_RESIDENT     6
+#define KVS_NS_TOP_DISK         7
+#define KVS_NS_TOP_LATENCY      8
+#define KVS_NS_TOP_MAP          9
+#define KVS_NS_TOP_FILL         10 /* permille of the map in use */
+#define KVS_NS_TOP_MAX          11
+char *kvs_ns_top(int metric, int n);
+
+typedef int (*kvs_scan_cb_t)(void *arg, struct gstring *key,
+                            struct gstring *value);
+int kvs_ns_scan(struct gstring *namespace, kvs_scan_cb_t cb, void *arg);
+int kvs_ns_exist(struct gstring *namespace);
+int kvs_ns_list(int (*cb)(void *arg, struct gstring *namespace), void *arg);
 
 #endif
@@ -243,6 +243,7 @@ static void *mds_timer_thread_main(void *arg)
         cur = time(NULL);
         hmo.tick = cur;
         if (hmo.state > HMO_STATE_LAUNCH) {
+            mds_spool_adjust(cur);
         }
         /* then, checking profiling */
         dump_profiling(cur, &hmo.hp);
@@ -393,6 +394,8 @@ void mds_pre_init()
 #endif
     /* setup the state */
     hmo.state = HMO_STATE_INIT;
+    /* empty ring until R2 tells us, all namespaces are local */
+    chring_init(&hmo.chring, 0);
 }
 
 /* make sure the dir exist
@@ -490,7 +493,20 @@ int mds_config(void)
     GK_MDS_GET_ENV_atoi(service_threads, value);
     GK_MDS_GET_ENV_atoi(async_threads, value);
     GK_MDS_GET_ENV_atoi(spool_threads, value);
+    GK_MDS_GET_ENV_atoi(spool_ring, value);
+    GK_MDS_GET_ENV_atoi(spool_wrr_client, value);
+    GK_MDS_GET_ENV_atoi(spool_wrr_amc, value);
+    GK_MDS_GET_ENV_atoi(spool_paused_max, value);
+    GK_MDS_GET_ENV_atoi(spool_affinity_qd, value);
+    GK_MDS_GET_ENV_atoi(spool_min, value);
+    GK_MDS_GET_ENV_atoi(spool_max, value);
+    GK_MDS_GET_ENV_atoi(spool_grow_us, value);
+    GK_MDS_GET_ENV_atoi(spool_idle_to, value);
+    GK_MDS_GET_ENV_atoi(spool_admit_qd, value);
+    GK_MDS_GET_ENV_atoi(spool_client_rate, value);
+    GK_MDS_GET_ENV_atoi(spool_client_burst, value);
     GK_MDS_GET_ENV_atoi(xnet_resend_to, value);
+    GK_MDS_GET_ENV_atoi(xnet_reactors, value);
     GK_MDS_GET_ENV_atoi(async_update_N, value);
     GK_MDS_GET_ENV_atoi(mp_to, value);
     GK_MDS_GET_ENV_atoi(hb_interval, value);
@@ -502,6 +518,35 @@ int mds_config(void)
 
     GK_MDS_GET_ENV_atoi(nshash_size, value);
     GK_MDS_GET_ENV_atoi(ns_ht_size, value);
+    GK_MDS_GET_ENV_atoi(nneg_ttl, value);
+    GK_MDS_GET_kmg(ns_bloom_bits, value);
+    GK_MDS_GET_ENV_option(no_negcache, NO_NEGCACHE, value);
+    GK_MDS_GET_ENV_option(partition, PARTITION, value);
+    GK_MDS_GET_ENV_option(numa, NUMA, value);
+    GK_MDS_GET_ENV_option(no_hugemem, NO_HUGEMEM, value);
+    GK_MDS_GET_ENV_option(affinity, AFFINITY, value);
+    GK_MDS_GET_ENV_option(inline, INLINE, value);
+    GK_MDS_GET_ENV_atoi(hotkey_sample, value);
+    GK_MDS_GET_ENV_atoi(hotkey_window, value);
+    GK_MDS_GET_ENV_option(no_hotkey, NO_HOTKEY, value);
+    GK_MDS_GET_ENV_option(wal, WAL, value);
+    GK_MDS_GET_ENV_atoi(wal_threads, value);
+    GK_MDS_GET_ENV_atoi(wal_batch, value);
+    GK_MDS_GET_kmg(wal_seg_size, value);
+    GK_MDS_GET_ENV_cpy(repl_followers, value);
+    GK_MDS_GET_ENV_option(replica, REPLICA, value);
+    GK_MDS_GET_ENV_atoi(repl_hb, value);
+    GK_MDS_GET_ENV_atoi(repl_max_stale, value);
+    GK_MDS_GET_ENV_atoi(repl_batch, value);
+    GK_MDS_GET_kmg(mig_batch, value);
+    GK_MDS_GET_kmg(large_value, value);
+    GK_MDS_GET_ENV_atoi(lmdb_shared, value);
+    GK_MDS_GET_ENV_atoi(lmdb_maxdbs, value);
+    GK_MDS_GET_kmg(lmdb_shared_size, value);
+    GK_MDS_GET_kmg(lmdb_map_init, value);
+    GK_MDS_GET_kmg(lmdb_map_max, value);
+    GK_MDS_GET_ENV_atoi(mig_cutover, value);
+    GK_MDS_GET_ENV_atoi(mig_rounds, value);
 
     /* default configurations */
     if (!hmo.conf.mds_home) {
@@ -518,10 +563,49 @@ int mds_config(void)
     if (!hmo.conf.loadin_pressure)
         hmo.conf.loadin_pressure = 30;
 
+    if (hmo.conf.option & GK_MDS_NO_HUGEMEM)
+        hugemem_mode = HUGEMEM_OFF;
+
     if (!hmo.conf.nshash_size)
         hmo.conf.nshash_size = MDS_KVS_NSHASH_SIZE;
     if (!hmo.conf.ns_ht_size)
         hmo.conf.ns_ht_size = NS_HASH_SIZE;
+    if (!hmo.conf.nneg_ttl)
+        hmo.conf.nneg_ttl = 5;
+    if (!hmo.conf.ns_bloom_bits)
+        hmo.conf.ns_bloom_bits = NS_BLOOM_BITS;
+    if (hmo.conf.hotkey_sample <= 0)
+        hmo.conf.hotkey_sample = 16;
+    if (!hmo.conf.hotkey_window)
+        hmo.conf.hotkey_window = 10;
+    if (hmo.conf.wal_threads <= 0)
+        hmo.conf.wal_threads = 2;
+    if (hmo.conf.wal_batch <= 0)
+        hmo.conf.wal_batch = 1024;
+    if (!hmo.conf.wal_seg_size)
+        hmo.conf.wal_seg_size = 64 * 1024 * 1024;
+    if (hmo.conf.repl_hb <= 0)
+        hmo.conf.repl_hb = 100;
+    if (hmo.conf.repl_max_stale <= 0)
+        hmo.conf.repl_max_stale = 1000;
+    if (hmo.conf.repl_batch <= 0)
+        hmo.conf.repl_batch = 256;
+    if (!hmo.conf.mig_batch)
+        hmo.conf.mig_batch = 256 * 1024;
+    if (!hmo.conf.large_value)
+        hmo.conf.large_value = 1024 * 1024;
+    if (hmo.conf.lmdb_maxdbs <= 0)
+        hmo.conf.lmdb_maxdbs = 16384;
+    if (!hmo.conf.lmdb_shared_size)
+        hmo.conf.lmdb_shared_size = LMDB_SHARED_SIZE;
+    if (!hmo.conf.lmdb_map_init)
+        hmo.conf.lmdb_map_init = LMDB_MAP_INIT;
+    if (!hmo.conf.lmdb_map_max)
+        hmo.conf.lmdb_map_max = LMDB_MAP_MAX;
+    if (hmo.conf.mig_cutover <= 0)
+        hmo.conf.mig_cutover = 100;
+    if (hmo.conf.mig_rounds <= 0)
+        hmo.conf.mig_rounds = 32;
 
     return 0;
 }
@@ -577,7 +661,23 @@ int mds_init(int bdepth)
     if (err)
         goto out_kvs;
 
+    mds_hotkey_init();
+
+    err = mds_wal_init();
+    if (err)
+        goto out_wal;
+
+    err = mds_repl_init();
+    if (err)
+        goto out_repl;
+
+    err = mds_migrate_init();
+    if (err)
+        goto out_migrate;
+
     /* FIXME: init the xnet subsystem */
+    if (hmo.conf.xnet_reactors > 0)
+        xnet_set_reactors(hmo.conf.xnet_reactors);
 
     /* FIXME: init the profiling subsystem */
 
@@ -614,6 +714,9 @@ int mds_init(int bdepth)
     hmo.uptime = time(NULL);
 
 out_spool:
+out_migrate:
+out_repl:
+out_wal:
 out_kvs:
 out_timers:
 out_signal:
@@ -649,12 +752,20 @@ void mds_destroy(void)
     /* destroy the service thread pool */
     mds_spool_destroy();
 
+    mds_migrate_destroy();
+    mds_repl_destroy();
+
+    /* drain the wal before closing the namespaces */
+    mds_wal_destroy();
+
     /* close the files */
     if (hmo.conf.pf_file)
         fclose(hmo.conf.pf_file);
 
     /* destroy the kvs subsystem */
     kvs_destroy();
+
+    chring_destroy(&hmo.chring);
 }
 
 u64 mds_select_ring(struct gk_mds_object *hmo)
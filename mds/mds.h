@@ -59,9 +59,23 @@ struct mds_conf
                                      initialization */
     int async_threads;          /* # of async threads */
     int spool_threads;          /* # of service threads */
+    int spool_ring;             /* # of entries in spool queue ring */
+    int spool_wrr_client;       /* weight of the client requests */
+    int spool_wrr_amc;          /* weight of the AMC requests */
+    int spool_paused_max;       /* drop client requests if more paused */
+    int spool_affinity_qd;      /* overflow the preferred thread if more
+                                 * requests queued */
+    int spool_min, spool_max;   /* bounds of the elastic spool pool */
+    int spool_grow_us;          /* add threads if the queue wait is above */
+    int spool_idle_to;          /* retire helper threads idle for seconds */
+    int spool_admit_qd;         /* fair share admission if more client
+                                 * requests queued, 0 to disable */
+    int spool_client_rate;      /* per-client requests/s, 0 unlimited */
+    int spool_client_burst;     /* per-client token bucket depth */
 
     /* misc configs */
     int xnet_resend_to;         /* xnet resend timeout */
+    int xnet_reactors;          /* # of xnet receive reactors */
     int async_update_N;         /* default # of processing request */
     int mp_to;                  /* timeout of modify pause */
     int hb_interval;            /* heart beat interval */
@@ -76,6 +90,26 @@ struct mds_conf
 
     int nshash_size;            /* namespace mgr hash table size */
     int ns_ht_size;             /* namespace self's hash table size */
+    int nneg_ttl;               /* ttl of negative namespace entries */
+    u64 ns_bloom_bits;          /* bloom filter bits of one namespace */
+    int hotkey_sample;          /* sample 1 of N requests for hot keys */
+    int hotkey_window;          /* hot key decay interval */
+    int wal_threads;            /* # of wal apply threads */
+    int wal_batch;              /* max # of records in one apply */
+    u64 wal_seg_size;           /* roll wal segment after this size */
+    char *repl_followers;       /* follower MDS ids, e.g. "1,2" */
+    int repl_hb;                /* replication heartbeat in ms */
+    int repl_max_stale;         /* max staleness (ms) of follower reads */
+    int repl_batch;             /* max # of records in one shipment */
+    u64 mig_batch;              /* max bytes of one migration message */
+    u64 large_value;            /* values >= this skip the memory table */
+    int lmdb_shared;            /* # of shared LMDB envs, 0: one per ns */
+    int lmdb_maxdbs;            /* max # of namespaces in a shared env */
+    u64 lmdb_shared_size;       /* max map size of a shared env */
+    u64 lmdb_map_init;          /* initial map size of an LMDB env */
+    u64 lmdb_map_max;           /* max map size of a per-namespace env */
+    int mig_cutover;            /* max cutover pause of migration in ms */
+    int mig_rounds;             /* max tail rounds before giving up */
 
     /* intervals */
     int profiling_thread_interval;
@@ -84,6 +118,15 @@ struct mds_conf
 #define GK_MDS_MEMONLY        0x08 /* memory only service */
 #define GK_MDS_MEMLIMIT       0x10 /* limit the memory usage */
 #define GK_MDS_MDZIP          0x80 /* compress the metadata */
+#define GK_MDS_NO_NEGCACHE    0x100 /* disable negative caches */
+#define GK_MDS_PARTITION      0x200 /* shared-nothing spool partitions */
+#define GK_MDS_NO_HOTKEY      0x400 /* disable hot key detection */
+#define GK_MDS_WAL            0x800 /* ack puts on wal, apply async */
+#define GK_MDS_REPLICA        0x1000 /* read-only follower */
+#define GK_MDS_NUMA           0x2000 /* home namespaces to NUMA nodes */
+#define GK_MDS_NO_HUGEMEM     0x4000 /* 4KB pages for the bucket arrays */
+#define GK_MDS_AFFINITY       0x8000 /* prefer the namespace's spool thread */
+#define GK_MDS_INLINE         0x10000 /* serve resident GETs in the recv thread */
     u64 option;
 };
 
@@ -111,6 +154,7 @@ struct gk_mds_object
     u32 aux_state;
 
     u64 ring_site;
+    struct chring chring;       /* consistent hash ring of MDS sites */
 
     /* the following region is used for threads */
     time_t mp_ts;               /* begin time of modify pause */
@@ -176,8 +220,14 @@ struct dconf_req
 #define DCONF_SET_MDS_FLAG      4
 #define DCONF_SET_XNET_FLAG     5
 #define DCONF_GET_LATENCY       6
+#define DCONF_GET_HOTKEYS       7 /* arg0: N << 32 | MDS_HK_READ/WRITE */
+#define DCONF_GET_NS_TOP        8 /* arg0: N << 32 | KVS_NS_TOP_* */
+#define DCONF_MIGRATE_NS        9 /* arg0: target MDS id, ns: namespace */
+#define DCONF_GET_MIGRATE       10
+#define DCONF_SET_SPOOL         11 /* arg0: max << 32 | min, 0 to keep */
     u64 cmd;
     u64 arg0;
+    char ns[0];                 /* rest of the 256 bytes request */
 };
 
 /* this is the mds forward request header, we should save the route list
@@ -222,10 +272,15 @@ void mds_set_fsid(struct gk_mds_object *hmo, u64 fsid)
 /* for fe.c */
 #define MAX_RELAY_FWD    (0x1000)
 int mds_do_forward(struct xnet_msg *msg, u64 site_id);
+void mds_fe_handle_err(struct xnet_msg *msg, int err);
+void mds_fe_reject(struct xnet_msg *msg, int err, u64 arg1);
 int mds_fe_dispatch(struct xnet_msg *msg);
 int mds_pause(struct xnet_msg *);
 int mds_resume(struct xnet_msg *);
 int mds_ring_update(struct xnet_msg *);
+u64 mds_ring_route(struct xnet_msg *);
+int mds_fwreq_unwrap(struct xnet_msg *msg);
+int mds_do_fwreq(struct xnet_msg *);
 int mds_addr_table_update(struct xnet_msg *msg);
 
 /* for dispatch.c */
@@ -257,12 +312,56 @@ void mds_spool_destroy(void);
 int mds_spool_dispatch(struct xnet_msg *);
 void mds_spool_redispatch(struct xnet_msg *, int sempost);
 int mds_spool_modify_pause(struct xnet_msg *);
+int mds_spool_expired(void);
+u32 mds_spool_budget(struct xnet_msg *msg);
 void mds_spool_mp_check(time_t);
 void mds_spool_provoke(void);
+void mds_spool_prof_sync(void);
+void mds_spool_numa_sample(void *addr);
+void mds_spool_numa_dump(int interval);
+void mds_spool_adjust(time_t t);
+void mds_spool_set_bounds(int min, int max);
 
 /* cli.c */
 int mds_do_reg(struct xnet_msg *);
 int mds_do_put(struct xnet_msg *);
 int mds_do_get(struct xnet_msg *);
+int mds_do_get_inline(struct xnet_msg *);
+int mds_msg_namespace(struct xnet_msg *, struct gstring *);
+
+/* hotkey.c */
+#define MDS_HK_READ     0
+#define MDS_HK_WRITE    1
+#define MDS_HK_MAX      2
+void mds_hotkey_init(void);
+void mds_hotkey_sample(int rw, struct gstring *ns, struct gstring *key);
+char *mds_hotkey_dump(int rw, int n);
+
+/* wal.c */
+int mds_wal_init(void);
+void mds_wal_destroy(void);
+int mds_wal_append(struct ns_entry *, struct gstring *, struct gstring *);
+
+/* repl.c */
+int mds_repl_init(void);
+void mds_repl_destroy(void);
+void mds_repl_ship(struct gstring *, struct gstring *, struct gstring *);
+int mds_do_repl(struct xnet_msg *);
+long mds_repl_staleness(void);
+
+/* migrate.c */
+int mds_migrate_init(void);
+void mds_migrate_destroy(void);
+int mds_migrate_start(struct gstring *, u64);
+int mds_migrate_hold(struct xnet_msg *);
+int mds_migrate_idle(void);
+void mds_migrate_ship(struct gstring *, struct gstring *, struct gstring *);
+int mds_do_migrate(struct xnet_msg *);
+int mds_do_handoff(struct xnet_msg *);
+u64 mds_migrate_route(struct gstring *);
+void mds_migrate_ring_update(void);
+int mds_ring_join(void);
+int mds_migrate_sync(void);
+char *mds_migrate_dump(void);
 
 #endif
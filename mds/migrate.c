@@ -0,0 +1,1737 @@
+/**
+ * Copyright (c) 2019 Ma Can <ml.macana@gmail.com>
+ *                           <macan@iie.ac.cn>
+ *
+ * Armed with EMACS.
+ * Time-stamp: <2019-10-21 09:40:12 macan>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "gk.h"
+#include "xnet.h"
+#include "mds.h"
+
+/* Online namespace migration
+ *
+ * mds_migrate_start() moves one namespace to another MDS while it keeps
+ * serving requests:
+ *
+ * 1. SNAPSHOT: from now on each PUT of the namespace is queued in the
+ *    tail log. The namespace is streamed by kvs_ns_scan(): a consistent
+ *    LMDB snapshot, then the memory table which has the writes not applied
+ *    to LMDB yet (gk_mds_wal=1).
+ * 2. TAIL: the tail log is shipped in rounds until what is left fits in
+ *    one message (hmo.conf.mig_batch bytes).
+ * 3. CUTOVER: new PUTs of the namespace are parked (GETs are still served
+ *    here), the in-flight ones are waited for and the rest of the tail log
+ *    is shipped w/ the COMMIT. If this takes longer than hmo.conf.
+ *    mig_cutover ms, the parked PUTs are served here and we go back to
+ *    TAIL, up to hmo.conf.mig_rounds rounds in total.
+ * 4. After the COMMIT the target owns the namespace, the parked and all
+ *    the later requests are passed on by mds_do_forward().
+ *
+ * Each message is a synchronous request and the target applies it w/
+ * kvs_update() before replying, thus later writes always override the
+ * earlier ones.
+ *
+ * The ownership override is saved in kvs_home/.owners before the moved
+ * namespace is forwarded, and published to R2 (GK_R2_OWNER). On restart
+ * the file is loaded and synced w/ R2 by mds_migrate_sync(), R2 gives it
+ * back if the file is lost. The source data is kept on disk.
+ *
+ * Ring join
+ *
+ * An MDS joins the consistent hash ring explicitly, and only after its
+ * slice of the existing namespaces has been moved to it. mds_ring_join()
+ * sends the ring it would make (the current one plus itself) to every
+ * member w/ MIG_HO_START, then each member
+ *
+ * 1. keeps the new ring pending: a request for a namespace it does not
+ *    have, which the joining site would own, is passed on to that site,
+ *    thus no new namespace is left behind;
+ * 2. migrates the namespaces it has that the joining site would own, one
+ *    at a time as above. Each is served here until its COMMIT, and
+ *    forwarded afterwards.
+ *
+ * The joining site polls all the members w/ MIG_HO_STATUS, and asks R2 to
+ * add it to the ring once all are done. A member drops the pending ring
+ * when a ring w/ the joining site is installed, or on MIG_HO_ABORT.
+ */
+
+#define MIG_IDLE        0
+#define MIG_SNAPSHOT    1
+#define MIG_TAIL        2
+#define MIG_CUTOVER     3
+
+static char *mig_state_str[] = {
+    "IDLE", "SNAPSHOT", "TAIL", "CUTOVER",
+};
+
+#define MIG_OP_DATA     0
+#define MIG_OP_COMMIT   1
+#define MIG_OP_ABORT    2
+
+/* GK_MDS2MDS_HANDOFF ops in tx.arg0 */
+#define MIG_HO_START    0
+#define MIG_HO_STATUS   1
+#define MIG_HO_ABORT    2
+
+#define MIG_HO_IDLE     0
+#define MIG_HO_RUNNING  1
+#define MIG_HO_DONE     2
+
+struct mig_hdr
+{
+    u32 op;
+    u32 nr;                     /* # of records */
+    u32 nslen;                  /* namespace follows this header */
+    u32 len;                    /* record bytes after the namespace */
+};
+
+struct mig_rec_hdr
+{
+    u32 klen, vlen;
+};
+
+struct mig_rec
+{
+    struct list_head list;
+    struct mig_rec_hdr hdr;
+    char data[0];
+};
+
+struct mig_buf
+{
+    void *data;
+    int len, size;
+    u32 nr;
+};
+
+/* a namespace moved to another site */
+struct mig_ovr
+{
+    struct list_head list;
+    u64 site_id;
+    struct gstring ns;
+};
+
+#define MIG_OVR_FILE    ".owners"
+
+/* an override saved on disk or sent to R2, w/ the namespace following */
+struct mig_ovr_rec
+{
+    u64 site_id;
+    u32 len;
+} __attribute__((packed));
+
+struct mig_mgr
+{
+    xlock_t lock;               /* protect state, queue and parked */
+    int state;
+    struct gstring ns;          /* namespace in migration */
+    u64 target;
+    struct list_head queue;     /* tail log */
+    int qnr;
+    long qbytes;
+    struct list_head parked;    /* PUTs parked in cutover */
+    atomic_t inflight;          /* PUTs being served in SNAPSHOT/TAIL */
+    pthread_t thread;
+    int thread_valid;
+    int stop;
+
+    /* progress of the current or the last migration */
+    u64 begin, end;             /* in us */
+    long snap_nr, snap_bytes;
+    long tail_nr, tail_bytes;
+    int rounds, cutovers;
+    long pause;                 /* last cutover pause in us */
+    long rec_ns;                /* ship and apply time of one pair in ns */
+    int err;
+
+    xrwlock_t olock;
+    struct list_head ovr;
+    int onr;
+    int ofile;                  /* the overrides are loaded from the file */
+
+    /* ring join handoff, pring and ho_site are protected by olock */
+    struct chring pring;        /* the ring w/ the joining site */
+    u64 ho_site;                /* the joining site, 0 if none */
+    int ho_state;
+    int ho_err;
+    int ho_stop;
+    long ho_nr;                 /* # of namespaces handed over */
+    pthread_t ho_thread;
+    int ho_thread_valid;
+};
+
+static struct mig_mgr mig_mgr;
+
+static inline
+u64 __mig_now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+static inline
+int __mig_ns_eq(struct gstring *a, struct gstring *b)
+{
+    return a->len == b->len && memcmp(a->start, b->start, a->len) == 0;
+}
+
+/* __mig_ovr_lookup() return the new owner of a moved namespace, or 0
+ */
+static u64 __mig_ovr_lookup(struct gstring *ns)
+{
+    struct mig_ovr *mo;
+    u64 site_id = 0;
+
+    xrwlock_rlock(&mig_mgr.olock);
+    list_for_each_entry(mo, &mig_mgr.ovr, list) {
+        if (__mig_ns_eq(&mo->ns, ns)) {
+            site_id = mo->site_id;
+            break;
+        }
+    }
+    xrwlock_runlock(&mig_mgr.olock);
+
+    return site_id;
+}
+
+/* __mig_ovr_put() set the owner of a namespace in the list, holding olock
+ */
+static int __mig_ovr_put(struct gstring *ns, u64 site_id)
+{
+    struct mig_ovr *mo, *n;
+
+    list_for_each_entry_safe(mo, n, &mig_mgr.ovr, list) {
+        if (__mig_ns_eq(&mo->ns, ns)) {
+            if (site_id) {
+                mo->site_id = site_id;
+            } else {
+                list_del(&mo->list);
+                mig_mgr.onr--;
+                xfree(mo);
+            }
+            return 0;
+        }
+    }
+    if (!site_id)
+        return 0;
+    mo = xmalloc(sizeof(*mo) + ns->len);
+    if (!mo)
+        return -ENOMEM;
+    mo->site_id = site_id;
+    mo->ns.start = (char *)(mo + 1);
+    mo->ns.len = ns->len;
+    memcpy(mo->ns.start, ns->start, ns->len);
+    list_add_tail(&mo->list, &mig_mgr.ovr);
+    mig_mgr.onr++;
+
+    return 0;
+}
+
+/* __mig_ovr_pack() pack the overrides as | struct mig_ovr_rec | ns |...,
+ * holding olock
+ */
+static int __mig_ovr_pack(void **data, int *len)
+{
+    struct mig_ovr_rec *r;
+    struct mig_ovr *mo;
+    void *p;
+    int size = 0;
+
+    list_for_each_entry(mo, &mig_mgr.ovr, list) {
+        size += sizeof(*r) + mo->ns.len;
+    }
+    p = xmalloc(size + 1);
+    if (!p)
+        return -ENOMEM;
+    *data = p;
+    *len = size;
+    list_for_each_entry(mo, &mig_mgr.ovr, list) {
+        r = p;
+        r->site_id = mo->site_id;
+        r->len = mo->ns.len;
+        memcpy(p + sizeof(*r), mo->ns.start, mo->ns.len);
+        p += sizeof(*r) + mo->ns.len;
+    }
+
+    return 0;
+}
+
+/* __mig_ovr_unpack() install the packed overrides, holding olock
+ */
+static int __mig_ovr_unpack(void *data, int len)
+{
+    struct mig_ovr_rec *r;
+    struct gstring ns;
+    void *p = data, *end = data + len;
+    int err;
+
+    while (p < end) {
+        r = p;
+        if (p + sizeof(*r) > end || p + sizeof(*r) + r->len > end ||
+            !r->len || r->len > GK_MAX_NAME_LEN)
+            return -EINVAL;
+        ns.start = p + sizeof(*r);
+        ns.len = r->len;
+        err = __mig_ovr_put(&ns, r->site_id);
+        if (err)
+            return err;
+        p += sizeof(*r) + r->len;
+    }
+
+    return 0;
+}
+
+/* __mig_ovr_save() write the overrides to kvs_home/.owners, holding olock
+ */
+static int __mig_ovr_save(void)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    void *data;
+    int fd, len, bl, bw, err;
+
+    err = __mig_ovr_pack(&data, &len);
+    if (err)
+        return err;
+    snprintf(path, sizeof(path), "%s/%s", hmo.conf.kvs_home, MIG_OVR_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        err = -errno;
+        gk_err(mds, "open %s failed w/ %s\n", tmp, strerror(errno));
+        goto out;
+    }
+    for (bl = 0; bl < len; bl += bw) {
+        bw = write(fd, data + bl, len - bl);
+        if (bw < 0) {
+            err = -errno;
+            gk_err(mds, "write %s failed w/ %s\n", tmp, strerror(errno));
+            close(fd);
+            goto out_unlink;
+        }
+    }
+    if (fsync(fd) < 0) {
+        err = -errno;
+        close(fd);
+        goto out_unlink;
+    }
+    close(fd);
+    if (rename(tmp, path) < 0) {
+        err = -errno;
+        gk_err(mds, "rename %s failed w/ %s\n", tmp, strerror(errno));
+        goto out_unlink;
+    }
+    fd = open(hmo.conf.kvs_home, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    mig_mgr.ofile = 1;
+    goto out;
+
+out_unlink:
+    unlink(tmp);
+out:
+    xfree(data);
+
+    return err;
+}
+
+/* __mig_ovr_load() read the overrides saved by __mig_ovr_save()
+ */
+static int __mig_ovr_load(void)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    void *data;
+    int fd, bl, br, err = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", hmo.conf.kvs_home, MIG_OVR_FILE);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        gk_err(mds, "open %s failed w/ %s\n", path, strerror(errno));
+        return -errno;
+    }
+    if (fstat(fd, &st) < 0) {
+        err = -errno;
+        goto out_close;
+    }
+    data = xmalloc(st.st_size + 1);
+    if (!data) {
+        err = -ENOMEM;
+        goto out_close;
+    }
+    for (bl = 0; bl < st.st_size; bl += br) {
+        br = read(fd, data + bl, st.st_size - bl);
+        if (br <= 0) {
+            err = br ? -errno : -EINVAL;
+            goto out_free;
+        }
+    }
+    err = __mig_ovr_unpack(data, st.st_size);
+    if (err) {
+        gk_err(mds, "load %s failed w/ %d\n", path, err);
+        goto out_free;
+    }
+    mig_mgr.ofile = 1;
+    gk_info(mds, "loaded %d moved namespaces\n", mig_mgr.onr);
+
+out_free:
+    xfree(data);
+out_close:
+    close(fd);
+
+    return err;
+}
+
+static inline u64 __mig_r2_site(void)
+{
+    return hmo.ring_site ? : GK_ROOT(0);
+}
+
+/* __mig_ovr_publish() tell R2 the new owner of a namespace, R2 gets the
+ * whole list on the next mds_migrate_sync() if this one is lost
+ */
+static void __mig_ovr_publish(struct gstring *ns, u64 site_id)
+{
+    struct xnet_msg *msg;
+    int err;
+
+    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    if (!msg) {
+        gk_err(mds, "xnet_alloc_msg() failed\n");
+        return;
+    }
+    xnet_msg_fill_tx(msg, XNET_MSG_REQ, 0, hmo.site_id, __mig_r2_site());
+    xnet_msg_fill_cmd(msg, GK_R2_OWNER, GK_OWNER_SET, site_id);
+#ifdef XNET_EAGER_WRITEV
+    xnet_msg_add_sdata(msg, &msg->tx, sizeof(msg->tx));
+#endif
+    xnet_msg_add_sdata(msg, ns->start, ns->len);
+
+    err = xnet_send(hmo.xc, msg);
+    if (err)
+        gk_warning(mds, "publish owner of %.*s to R2 failed w/ %d\n",
+                   ns->len, ns->start, err);
+    xnet_free_msg(msg);
+}
+
+/* __mig_ovr_set() set the owner of a namespace, site_id 0 means we own it.
+ * It is on disk before return.
+ */
+static int __mig_ovr_set(struct gstring *ns, u64 site_id)
+{
+    int err;
+
+    xrwlock_wlock(&mig_mgr.olock);
+    err = __mig_ovr_put(ns, site_id);
+    if (!err && (site_id || mig_mgr.ofile))
+        err = __mig_ovr_save();
+    xrwlock_wunlock(&mig_mgr.olock);
+    if (!err && hmo.xc)
+        __mig_ovr_publish(ns, site_id);
+
+    return err;
+}
+
+/* mds_migrate_sync() sync the overrides w/ R2 after registration. If they
+ * are loaded from the file, R2 takes ours; otherwise we take what R2 has.
+ */
+int mds_migrate_sync(void)
+{
+    struct xnet_msg *msg;
+    void *data = NULL;
+    int len, err;
+
+    xrwlock_rlock(&mig_mgr.olock);
+    err = __mig_ovr_pack(&data, &len);
+    xrwlock_runlock(&mig_mgr.olock);
+    if (err)
+        return err;
+
+    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    if (!msg) {
+        gk_err(mds, "xnet_alloc_msg() failed\n");
+        err = -ENOMEM;
+        goto out_free;
+    }
+    xnet_msg_fill_tx(msg, XNET_MSG_REQ, XNET_NEED_REPLY, hmo.site_id,
+                     __mig_r2_site());
+    xnet_msg_fill_cmd(msg, GK_R2_OWNER, GK_OWNER_SYNC, mig_mgr.ofile);
+#ifdef XNET_EAGER_WRITEV
+    xnet_msg_add_sdata(msg, &msg->tx, sizeof(msg->tx));
+#endif
+    if (len)
+        xnet_msg_add_sdata(msg, data, len);
+
+    err = xnet_send(hmo.xc, msg);
+    if (err) {
+        gk_err(mds, "sync owners w/ R2 failed w/ %d\n", err);
+        goto out;
+    }
+    ASSERT(msg->pair, mds);
+    err = msg->pair->tx.err;
+    if (err) {
+        gk_err(mds, "R2 sync owners failed w/ %d\n", err);
+        goto out;
+    }
+    if (mig_mgr.ofile || !msg->pair->xm_datacheck)
+        goto out;
+
+    /* the file is lost, take the list kept by R2 */
+    xrwlock_wlock(&mig_mgr.olock);
+    err = __mig_ovr_unpack(msg->pair->xm_data, msg->pair->tx.len);
+    if (!err && mig_mgr.onr)
+        err = __mig_ovr_save();
+    xrwlock_wunlock(&mig_mgr.olock);
+    gk_info(mds, "restored %d moved namespaces from R2 w/ %d\n",
+            mig_mgr.onr, err);
+
+out:
+    xnet_free_msg(msg);
+out_free:
+    xfree(data);
+
+    return err;
+}
+
+static void __mig_forward(struct xnet_msg *msg, u64 dsite)
+{
+    int err;
+
+    err = mds_do_forward(msg, dsite);
+    if (err) {
+        mds_fe_handle_err(msg, err);
+        return;
+    }
+    atomic64_inc(&hmo.prof.mds.mig_fwd);
+    xnet_free_msg(msg);
+}
+
+/* mds_migrate_idle() return true if no namespace is in or has been moved
+ * by a migration, thus mds_migrate_hold() would not take any request
+ */
+int mds_migrate_idle(void)
+{
+    return !mig_mgr.state && !mig_mgr.onr;
+}
+
+/* mds_migrate_hold() return 1 if the client request is taken over by the
+ * migration: forwarded to the new owner, parked in cutover, or served
+ * here w/ the in-flight counter held.
+ */
+int mds_migrate_hold(struct xnet_msg *msg)
+{
+    struct gstring ns;
+    u64 dsite;
+
+    if (likely(!mig_mgr.state && !mig_mgr.onr))
+        return 0;
+    if (mds_msg_namespace(msg, &ns))
+        return 0;
+
+retry:
+    if (mig_mgr.onr) {
+        dsite = __mig_ovr_lookup(&ns);
+        if (dsite) {
+            __mig_forward(msg, dsite);
+            return 1;
+        }
+    }
+    if (msg->tx.cmd != GK_CLT2MDS_PUT || !mig_mgr.state)
+        return 0;
+
+    xlock_lock(&mig_mgr.lock);
+    if (!mig_mgr.state || !__mig_ns_eq(&mig_mgr.ns, &ns)) {
+        int done = !mig_mgr.state;
+
+        xlock_unlock(&mig_mgr.lock);
+        /* cutover may just be done, recheck the new owner */
+        if (done)
+            goto retry;
+        return 0;
+    }
+    if (mig_mgr.state == MIG_CUTOVER) {
+        list_add_tail(&msg->list, &mig_mgr.parked);
+        xlock_unlock(&mig_mgr.lock);
+        return 1;
+    }
+    atomic_inc(&mig_mgr.inflight);
+    xlock_unlock(&mig_mgr.lock);
+
+    mds_do_put(msg);
+    atomic_dec(&mig_mgr.inflight);
+
+    return 1;
+}
+
+/* mds_migrate_ship() queue a write of the migrating namespace in the tail
+ * log, called by kvs under the bucket lock thus the log has the writes of
+ * a key in the order they are applied
+ */
+void mds_migrate_ship(struct gstring *ns, struct gstring *key,
+                      struct gstring *value)
+{
+    struct mig_rec *mr;
+
+    if (likely(!mig_mgr.state))
+        return;
+
+    mr = xmalloc(sizeof(*mr) + key->len + value->len);
+    if (!mr) {
+        gk_err(mds, "xmalloc() migration record failed, abort it\n");
+        mig_mgr.stop = 1;
+        return;
+    }
+    INIT_LIST_HEAD(&mr->list);
+    mr->hdr.klen = key->len;
+    mr->hdr.vlen = value->len;
+    memcpy(mr->data, key->start, key->len);
+    memcpy(mr->data + key->len, value->start, value->len);
+
+    xlock_lock(&mig_mgr.lock);
+    if (mig_mgr.state && __mig_ns_eq(&mig_mgr.ns, ns)) {
+        list_add_tail(&mr->list, &mig_mgr.queue);
+        mig_mgr.qnr++;
+        mig_mgr.qbytes += sizeof(mr->hdr) + key->len + value->len;
+        mr = NULL;
+    }
+    xlock_unlock(&mig_mgr.lock);
+    xfree(mr);
+}
+
+static void __mig_buf_reset(struct mig_buf *mb)
+{
+    mb->len = sizeof(struct mig_hdr) + mig_mgr.ns.len;
+    mb->nr = 0;
+}
+
+static int __mig_buf_init(struct mig_buf *mb)
+{
+    mb->size = sizeof(struct mig_hdr) + mig_mgr.ns.len +
+        hmo.conf.mig_batch;
+    mb->data = xmalloc(mb->size);
+    if (!mb->data)
+        return -ENOMEM;
+    memcpy(mb->data + sizeof(struct mig_hdr), mig_mgr.ns.start,
+           mig_mgr.ns.len);
+    __mig_buf_reset(mb);
+
+    return 0;
+}
+
+static int __mig_buf_add(struct mig_buf *mb, void *key, u32 klen,
+                         void *value, u32 vlen)
+{
+    struct mig_rec_hdr mrh = {.klen = klen, .vlen = vlen,};
+    int l = sizeof(mrh) + klen + vlen;
+    void *p;
+
+    if (mb->len + l > mb->size) {
+        /* a pair larger than mig_batch */
+        p = xrealloc(mb->data, mb->len + l);
+        if (!p)
+            return -ENOMEM;
+        mb->data = p;
+        mb->size = mb->len + l;
+    }
+    p = mb->data + mb->len;
+    memcpy(p, &mrh, sizeof(mrh));
+    memcpy(p + sizeof(mrh), key, klen);
+    memcpy(p + sizeof(mrh) + klen, value, vlen);
+    mb->len += l;
+    mb->nr++;
+
+    return 0;
+}
+
+static int __mig_buf_full(struct mig_buf *mb)
+{
+    return mb->len - sizeof(struct mig_hdr) - mig_mgr.ns.len >=
+        hmo.conf.mig_batch;
+}
+
+/* __mig_send() send the buffer to the target and wait for it to be
+ * applied, the buffer is reset on return.
+ */
+static int __mig_send(struct mig_buf *mb, u32 op)
+{
+    struct mig_hdr *mh = mb->data;
+    struct xnet_msg *msg;
+    u64 begin = __mig_now_us();
+    int err;
+
+    mh->op = op;
+    mh->nr = mb->nr;
+    mh->nslen = mig_mgr.ns.len;
+    mh->len = mb->len - sizeof(*mh) - mig_mgr.ns.len;
+
+    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    if (!msg) {
+        gk_err(mds, "xnet_alloc_msg() failed\n");
+        err = -ENOMEM;
+        goto out;
+    }
+    xnet_msg_fill_tx(msg, XNET_MSG_REQ, XNET_NEED_REPLY, hmo.site_id,
+                     mig_mgr.target);
+    xnet_msg_fill_cmd(msg, GK_MDS2MDS_MIGRATE, 0, 0);
+#ifdef XNET_EAGER_WRITEV
+    xnet_msg_add_sdata(msg, &msg->tx, sizeof(msg->tx));
+#endif
+    xnet_msg_add_sdata(msg, mb->data, mb->len);
+
+    err = xnet_send(hmo.xc, msg);
+    if (err) {
+        gk_err(mds, "send migration msg to %lx failed w/ %d\n",
+               mig_mgr.target, err);
+        goto out_free;
+    }
+    ASSERT(msg->pair, mds);
+    err = msg->pair->tx.err;
+    if (err) {
+        gk_err(mds, "site %lx rejected migration msg w/ %d\n",
+               mig_mgr.target, err);
+        goto out_free;
+    }
+    atomic64_inc(&hmo.prof.mds.mig_ship);
+    if (mb->nr) {
+        long ns = (__mig_now_us() - begin) * 1000 / mb->nr;
+
+        mig_mgr.rec_ns = mig_mgr.rec_ns ? (mig_mgr.rec_ns * 3 + ns) / 4 : ns;
+    }
+
+out_free:
+    xnet_free_msg(msg);
+out:
+    __mig_buf_reset(mb);
+
+    return err;
+}
+
+static int __mig_snapshot_cb(void *arg, struct gstring *key,
+                             struct gstring *value)
+{
+    struct mig_buf *mb = arg;
+    int err;
+
+    if (mig_mgr.stop)
+        return -EINTR;
+    err = __mig_buf_add(mb, key->start, key->len, value->start, value->len);
+    if (err)
+        return err;
+    mig_mgr.snap_nr++;
+    mig_mgr.snap_bytes += key->len + value->len;
+    if (__mig_buf_full(mb))
+        return __mig_send(mb, MIG_OP_DATA);
+
+    return 0;
+}
+
+/* __mig_drain() ship the tail log. W/o commit, stop after the bytes
+ * queued at entry are shipped; otherwise ship everything w/ the COMMIT,
+ * or return -ETIMEDOUT if the deadline passed.
+ */
+static int __mig_drain(struct mig_buf *mb, int commit, u64 deadline)
+{
+    struct mig_rec *mr;
+    long todo = mig_mgr.qbytes, done = 0;
+    int err, last;
+
+    do {
+        xlock_lock(&mig_mgr.lock);
+        while (!list_empty(&mig_mgr.queue) && !__mig_buf_full(mb)) {
+            mr = list_first_entry(&mig_mgr.queue, struct mig_rec, list);
+            err = __mig_buf_add(mb, mr->data, mr->hdr.klen,
+                                mr->data + mr->hdr.klen, mr->hdr.vlen);
+            if (err) {
+                xlock_unlock(&mig_mgr.lock);
+                return err;
+            }
+            list_del(&mr->list);
+            mig_mgr.qnr--;
+            mig_mgr.qbytes -= sizeof(mr->hdr) + mr->hdr.klen + mr->hdr.vlen;
+            done += sizeof(mr->hdr) + mr->hdr.klen + mr->hdr.vlen;
+            mig_mgr.tail_nr++;
+            mig_mgr.tail_bytes += mr->hdr.klen + mr->hdr.vlen;
+            xfree(mr);
+        }
+        last = list_empty(&mig_mgr.queue);
+        xlock_unlock(&mig_mgr.lock);
+
+        if (!commit && !mb->nr)
+            break;
+        err = __mig_send(mb, (commit && last) ? MIG_OP_COMMIT : MIG_OP_DATA);
+        if (err)
+            return err;
+        if (commit && last)
+            break;
+        if (deadline && __mig_now_us() > deadline)
+            return -ETIMEDOUT;
+    } while (commit || (!last && done < todo));
+
+    return 0;
+}
+
+/* __mig_resume() serve the parked PUTs here or pass them on to the new
+ * owner
+ */
+static void __mig_resume(struct list_head *parked, u64 dsite)
+{
+    struct xnet_msg *msg, *n;
+
+    list_for_each_entry_safe(msg, n, parked, list) {
+        list_del_init(&msg->list);
+        if (dsite)
+            __mig_forward(msg, dsite);
+        else
+            mds_client_dispatch(msg);
+    }
+}
+
+/* __mig_cutover() return 0 if the target owns the namespace now, -EAGAIN
+ * if the pause is too long and we are back to TAIL.
+ */
+static int __mig_cutover(struct mig_buf *mb)
+{
+    LIST_HEAD(parked);
+    u64 begin = __mig_now_us();
+    u64 deadline = begin + hmo.conf.mig_cutover * 1000UL;
+    int err = 0;
+
+    mig_mgr.cutovers++;
+    xlock_lock(&mig_mgr.lock);
+    mig_mgr.state = MIG_CUTOVER;
+    xlock_unlock(&mig_mgr.lock);
+
+    while (atomic_read(&mig_mgr.inflight) > 0) {
+        if (__mig_now_us() > deadline) {
+            err = -ETIMEDOUT;
+            goto out;
+        }
+        sched_yield();
+    }
+    err = __mig_drain(mb, 1, deadline);
+    if (err)
+        goto out;
+
+    /* the target has everything, flip the owner */
+    err = __mig_ovr_set(&mig_mgr.ns, mig_mgr.target);
+    if (err) {
+        /* the target owns it anyway */
+        gk_err(mds, "set owner of namespace %.*s failed w/ %d\n",
+               mig_mgr.ns.len, mig_mgr.ns.start, err);
+    }
+    xlock_lock(&mig_mgr.lock);
+    mig_mgr.state = MIG_IDLE;
+    list_splice_init(&mig_mgr.parked, &parked);
+    xlock_unlock(&mig_mgr.lock);
+    mig_mgr.pause = __mig_now_us() - begin;
+    __mig_resume(&parked, mig_mgr.target);
+
+    return 0;
+
+out:
+    xlock_lock(&mig_mgr.lock);
+    mig_mgr.state = MIG_TAIL;
+    list_splice_init(&mig_mgr.parked, &parked);
+    xlock_unlock(&mig_mgr.lock);
+    mig_mgr.pause = __mig_now_us() - begin;
+    __mig_resume(&parked, 0);
+    gk_warning(mds, "cutover of namespace %.*s paused %ld us w/ %d, "
+               "retry later\n", mig_mgr.ns.len, mig_mgr.ns.start,
+               mig_mgr.pause, err);
+
+    return err == -ETIMEDOUT ? -EAGAIN : err;
+}
+
+static void __mig_abort(struct mig_buf *mb)
+{
+    struct mig_rec *mr, *n;
+    LIST_HEAD(parked);
+    LIST_HEAD(queue);
+
+    xlock_lock(&mig_mgr.lock);
+    mig_mgr.state = MIG_IDLE;
+    list_splice_init(&mig_mgr.parked, &parked);
+    list_splice_init(&mig_mgr.queue, &queue);
+    mig_mgr.qnr = 0;
+    mig_mgr.qbytes = 0;
+    xlock_unlock(&mig_mgr.lock);
+    __mig_resume(&parked, 0);
+    list_for_each_entry_safe(mr, n, &queue, list) {
+        list_del(&mr->list);
+        xfree(mr);
+    }
+    /* let the target know, the copied pairs are left there */
+    if (mb->data) {
+        __mig_buf_reset(mb);
+        __mig_send(mb, MIG_OP_ABORT);
+    }
+}
+
+static void *mig_main(void *arg)
+{
+    struct mig_buf mb = {.data = NULL,};
+    sigset_t set;
+    int err;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigaddset(&set, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    err = __mig_buf_init(&mb);
+    if (err)
+        goto out_abort;
+
+    err = kvs_ns_scan(&mig_mgr.ns, __mig_snapshot_cb, &mb);
+    if (!err && mb.nr)
+        err = __mig_send(&mb, MIG_OP_DATA);
+    if (err) {
+        gk_err(mds, "snapshot namespace %.*s failed w/ %d\n",
+               mig_mgr.ns.len, mig_mgr.ns.start, err);
+        goto out_abort;
+    }
+    gk_info(mds, "namespace %.*s snapshot shipped: %ld pairs %ld bytes\n",
+            mig_mgr.ns.len, mig_mgr.ns.start, mig_mgr.snap_nr,
+            mig_mgr.snap_bytes);
+
+    xlock_lock(&mig_mgr.lock);
+    mig_mgr.state = MIG_TAIL;
+    xlock_unlock(&mig_mgr.lock);
+
+    while (1) {
+        if (mig_mgr.stop) {
+            err = -EINTR;
+            goto out_abort;
+        }
+        if (mig_mgr.rounds >= hmo.conf.mig_rounds) {
+            gk_err(mds, "namespace %.*s does not converge in %d rounds\n",
+                   mig_mgr.ns.len, mig_mgr.ns.start, mig_mgr.rounds);
+            err = -ETIMEDOUT;
+            goto out_abort;
+        }
+        mig_mgr.rounds++;
+        /* the rest must be applied within half of the pause budget */
+        if (mig_mgr.qbytes <= hmo.conf.mig_batch &&
+            mig_mgr.qnr * mig_mgr.rec_ns / 1000 <=
+            hmo.conf.mig_cutover * 500L) {
+            err = __mig_cutover(&mb);
+            if (!err)
+                break;
+            if (err != -EAGAIN)
+                goto out_abort;
+        }
+        err = __mig_drain(&mb, 0, 0);
+        if (err)
+            goto out_abort;
+    }
+    mig_mgr.err = 0;
+    __sync_synchronize();
+    mig_mgr.end = __mig_now_us();
+    gk_info(mds, "namespace %.*s migrated to %lx in %ld ms, %d rounds, "
+            "cutover paused %ld us\n", mig_mgr.ns.len, mig_mgr.ns.start,
+            mig_mgr.target, (mig_mgr.end - mig_mgr.begin) / 1000,
+            mig_mgr.rounds, mig_mgr.pause);
+    xfree(mb.data);
+
+    pthread_exit(0);
+
+out_abort:
+    __mig_abort(&mb);
+    /* __mig_wait() reads err once end is set */
+    mig_mgr.err = err;
+    __sync_synchronize();
+    mig_mgr.end = __mig_now_us();
+    gk_err(mds, "migrate namespace %.*s to %lx aborted w/ %d\n",
+           mig_mgr.ns.len, mig_mgr.ns.start, mig_mgr.target, err);
+    xfree(mb.data);
+
+    pthread_exit(0);
+}
+
+/* mds_migrate_start() start moving a namespace to the target site, one
+ * migration at a time
+ */
+int mds_migrate_start(struct gstring *ns, u64 target)
+{
+    int err;
+
+    if (!ns->len || ns->len >= GK_MAX_NAME_LEN || !GK_IS_MDS(target) ||
+        target == hmo.site_id)
+        return -EINVAL;
+    if (hmo.conf.option & GK_MDS_REPLICA)
+        return -EROFS;
+    if (__mig_ovr_lookup(ns))
+        return -EEXIST;
+
+    xlock_lock(&mig_mgr.lock);
+    if (mig_mgr.state) {
+        xlock_unlock(&mig_mgr.lock);
+        return -EBUSY;
+    }
+    if (mig_mgr.thread_valid) {
+        /* the last one has finished */
+        pthread_join(mig_mgr.thread, NULL);
+        mig_mgr.thread_valid = 0;
+    }
+    xfree(mig_mgr.ns.start);
+    mig_mgr.ns.start = xmalloc(ns->len);
+    if (!mig_mgr.ns.start) {
+        mig_mgr.ns.len = 0;
+        xlock_unlock(&mig_mgr.lock);
+        return -ENOMEM;
+    }
+    memcpy(mig_mgr.ns.start, ns->start, ns->len);
+    mig_mgr.ns.len = ns->len;
+    mig_mgr.target = target;
+    mig_mgr.stop = 0;
+    mig_mgr.begin = __mig_now_us();
+    mig_mgr.end = 0;
+    mig_mgr.snap_nr = mig_mgr.snap_bytes = 0;
+    mig_mgr.tail_nr = mig_mgr.tail_bytes = 0;
+    mig_mgr.rounds = mig_mgr.cutovers = 0;
+    mig_mgr.pause = 0;
+    mig_mgr.rec_ns = 0;
+    mig_mgr.err = 0;
+    /* queue the writes before taking the snapshot */
+    mig_mgr.state = MIG_SNAPSHOT;
+    xlock_unlock(&mig_mgr.lock);
+
+    err = pthread_create(&mig_mgr.thread, NULL, &mig_main, NULL);
+    if (err) {
+        gk_err(mds, "create migration thread failed w/ %s\n",
+               strerror(err));
+        xlock_lock(&mig_mgr.lock);
+        mig_mgr.state = MIG_IDLE;
+        xlock_unlock(&mig_mgr.lock);
+        return -err;
+    }
+    mig_mgr.thread_valid = 1;
+    gk_info(mds, "start migrating namespace %.*s to %lx\n",
+            ns->len, ns->start, target);
+
+    return 0;
+}
+
+static void __mig_reply(struct xnet_msg *msg, int err)
+{
+    struct xnet_msg *rpy = xnet_alloc_msg(XNET_MSG_CACHE);
+
+    if (!rpy) {
+        gk_err(mds, "xnet_alloc_msg() failed\n");
+        return;
+    }
+    xnet_msg_set_err(rpy, err);
+#ifdef XNET_EAGER_WRITEV
+    xnet_msg_add_sdata(rpy, &rpy->tx, sizeof(rpy->tx));
+#endif
+    xnet_msg_fill_tx(rpy, XNET_MSG_RPY, 0, hmo.site_id, msg->tx.ssite_id);
+    xnet_msg_fill_reqno(rpy, msg->tx.reqno);
+    xnet_msg_fill_cmd(rpy, XNET_RPY_ACK, 0, 0);
+    rpy->tx.handle = msg->tx.handle;
+
+    if (xnet_send(hmo.xc, rpy)) {
+        gk_err(mds, "xnet_send() REPLY failed\n");
+    }
+    xnet_free_msg(rpy);
+}
+
+/* mds_do_migrate() apply a migration message on the target site
+ */
+int mds_do_migrate(struct xnet_msg *msg)
+{
+    struct mig_hdr *mh;
+    struct mig_rec_hdr *mrh;
+    struct gstring ns, key, value;
+    void *p, *end;
+    int i, err = 0;
+
+    if (!msg->xm_datacheck || msg->tx.len < sizeof(*mh)) {
+        err = -EINVAL;
+        goto out;
+    }
+    mh = msg->xm_data;
+    if (sizeof(*mh) + mh->nslen + mh->len > msg->tx.len || !mh->nslen) {
+        err = -EINVAL;
+        goto out;
+    }
+    if (hmo.conf.option & GK_MDS_REPLICA) {
+        err = -EROFS;
+        goto out;
+    }
+    ns.start = msg->xm_data + sizeof(*mh);
+    ns.len = mh->nslen;
+    p = ns.start + ns.len;
+    end = p + mh->len;
+
+    for (i = 0; i < mh->nr; i++) {
+        mrh = p;
+        if (p + sizeof(*mrh) > end ||
+            p + sizeof(*mrh) + mrh->klen + mrh->vlen > end) {
+            err = -EINVAL;
+            break;
+        }
+        key.start = p + sizeof(*mrh);
+        key.len = mrh->klen;
+        value.start = key.start + key.len;
+        value.len = mrh->vlen;
+        err = kvs_update(&ns, &key, &value);
+        if (err) {
+            gk_err(mds, "apply migrated pair of %.*s failed w/ %d\n",
+                   ns.len, ns.start, err);
+            break;
+        }
+        p += sizeof(*mrh) + key.len + value.len;
+    }
+    atomic64_add(i, &hmo.prof.mds.mig_apply);
+    if (err)
+        goto out;
+
+    switch (mh->op) {
+    case MIG_OP_COMMIT:
+        /* it may be moved back, we own it now */
+        err = __mig_ovr_set(&ns, 0);
+        gk_info(mds, "namespace %.*s migrated from %lx\n",
+                ns.len, ns.start, msg->tx.ssite_id);
+        break;
+    case MIG_OP_ABORT:
+        gk_warning(mds, "migration of namespace %.*s from %lx aborted\n",
+                   ns.len, ns.start, msg->tx.ssite_id);
+        break;
+    }
+
+out:
+    if (err)
+        gk_err(mds, "Invalid migration msg from %lx w/ %d\n",
+               msg->tx.ssite_id, err);
+    __mig_reply(msg, err);
+    xnet_free_msg(msg);
+
+    return err;
+}
+
+/* __mig_wait() wait for the migration just started by mds_migrate_start(),
+ * return its result
+ */
+static int __mig_wait(void)
+{
+    while (!mig_mgr.end) {
+        if (mig_mgr.ho_stop)
+            return -EINTR;
+        usleep(10000);
+    }
+    __sync_synchronize();
+
+    return mig_mgr.err;
+}
+
+/* __mig_ho_owned() return 1 if the joining site would own the namespace,
+ * holding olock
+ */
+static inline
+int __mig_ho_owned(struct gstring *ns)
+{
+    return mig_mgr.ho_site &&
+        chring_lookup(&mig_mgr.pring, gk_hash_chring(ns->start, ns->len)) ==
+        mig_mgr.ho_site;
+}
+
+/* mds_migrate_route() return the joining site if it should serve a request
+ * for the namespace we own, see the ring join above. Otherwise 0.
+ */
+u64 mds_migrate_route(struct gstring *ns)
+{
+    u64 site_id = 0;
+
+    if (likely(!mig_mgr.ho_site))
+        return 0;
+    xrwlock_rlock(&mig_mgr.olock);
+    if (__mig_ho_owned(ns))
+        site_id = mig_mgr.ho_site;
+    xrwlock_runlock(&mig_mgr.olock);
+    /* the ones we have are served here until they are migrated */
+    if (site_id && kvs_ns_exist(ns))
+        site_id = 0;
+
+    return site_id;
+}
+
+/* mds_migrate_ring_update() drop the pending ring once the joining site is
+ * in the installed one
+ */
+void mds_migrate_ring_update(void)
+{
+    u64 *sites;
+    int i, nr;
+
+    if (likely(!mig_mgr.ho_site) || mig_mgr.ho_state == MIG_HO_RUNNING)
+        return;
+    nr = chring_get_sites(&hmo.chring, &sites);
+    if (nr <= 0)
+        return;
+    xrwlock_wlock(&mig_mgr.olock);
+    for (i = 0; i < nr; i++) {
+        if (sites[i] == mig_mgr.ho_site) {
+            gk_info(mds, "site %lx joined the ring, %ld namespaces handed "
+                    "over\n", mig_mgr.ho_site, mig_mgr.ho_nr);
+            mig_mgr.ho_site = 0;
+            break;
+        }
+    }
+    xrwlock_wunlock(&mig_mgr.olock);
+    xfree(sites);
+}
+
+struct mig_ho_list
+{
+    struct gstring *ns;
+    int nr, size;
+};
+
+static int __mig_ho_collect(void *arg, struct gstring *ns)
+{
+    struct mig_ho_list *hl = arg;
+    struct gstring *p;
+    int owned;
+
+    xrwlock_rlock(&mig_mgr.olock);
+    owned = __mig_ho_owned(ns);
+    xrwlock_runlock(&mig_mgr.olock);
+    if (!owned || __mig_ovr_lookup(ns))
+        return 0;
+    if (hl->nr >= hl->size) {
+        hl->size = hl->size ? hl->size << 1 : 64;
+        p = xrealloc(hl->ns, hl->size * sizeof(*p));
+        if (!p)
+            return -ENOMEM;
+        hl->ns = p;
+    }
+    hl->ns[hl->nr].start = strndup(ns->start, ns->len);
+    if (!hl->ns[hl->nr].start)
+        return -ENOMEM;
+    hl->ns[hl->nr++].len = ns->len;
+
+    return 0;
+}
+
+/* mig_ho_main() migrate the namespaces the joining site would own. The
+ * second pass picks up the ones created while the pending ring was being
+ * installed.
+ */
+static void *mig_ho_main(void *arg)
+{
+    struct mig_ho_list hl = {.ns = NULL,};
+    u64 site_id = mig_mgr.ho_site;
+    sigset_t set;
+    int pass, i, err = 0;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigaddset(&set, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (pass = 0; pass < 2 && !err; pass++) {
+        hl.nr = 0;
+        err = kvs_ns_list(__mig_ho_collect, &hl);
+        for (i = 0; i < hl.nr && !err; i++) {
+        retry:
+            if (mig_mgr.ho_stop) {
+                err = -EINTR;
+                break;
+            }
+            err = mds_migrate_start(&hl.ns[i], site_id);
+            if (err == -EBUSY) {
+                /* another migration is running */
+                usleep(100000);
+                goto retry;
+            } else if (err == -EEXIST) {
+                err = 0;
+                continue;
+            } else if (err)
+                break;
+            err = __mig_wait();
+            if (!err)
+                mig_mgr.ho_nr++;
+        }
+        for (i = 0; i < hl.nr; i++)
+            free(hl.ns[i].start);
+    }
+    xfree(hl.ns);
+
+    if (err)
+        gk_err(mds, "hand namespaces over to %lx failed w/ %d\n",
+               site_id, err);
+    else
+        gk_info(mds, "handed %ld namespaces over to %lx\n", mig_mgr.ho_nr,
+                site_id);
+    mig_mgr.ho_err = err;
+    __sync_synchronize();
+    mig_mgr.ho_state = MIG_HO_DONE;
+    /* the joining site may be in the ring already */
+    mds_migrate_ring_update();
+
+    pthread_exit(0);
+}
+
+/* __mig_ho_start() install the pending ring and start the handoff
+ */
+static int __mig_ho_start(u64 site_id, void *data, int len)
+{
+    int err;
+
+    xrwlock_wlock(&mig_mgr.olock);
+    if (mig_mgr.ho_site && mig_mgr.ho_site != site_id) {
+        xrwlock_wunlock(&mig_mgr.olock);
+        return -EBUSY;
+    }
+    if (mig_mgr.ho_site == site_id && mig_mgr.ho_state == MIG_HO_RUNNING) {
+        /* a retried START */
+        xrwlock_wunlock(&mig_mgr.olock);
+        return 0;
+    }
+    chring_destroy(&mig_mgr.pring);
+    chring_init(&mig_mgr.pring, 0);
+    err = chring_unpack(&mig_mgr.pring, data, len);
+    if (err < 0) {
+        xrwlock_wunlock(&mig_mgr.olock);
+        return err;
+    }
+    if (mig_mgr.ho_thread_valid) {
+        pthread_join(mig_mgr.ho_thread, NULL);
+        mig_mgr.ho_thread_valid = 0;
+    }
+    mig_mgr.ho_site = site_id;
+    mig_mgr.ho_state = MIG_HO_RUNNING;
+    mig_mgr.ho_err = 0;
+    mig_mgr.ho_stop = 0;
+    mig_mgr.ho_nr = 0;
+    xrwlock_wunlock(&mig_mgr.olock);
+
+    err = pthread_create(&mig_mgr.ho_thread, NULL, &mig_ho_main, NULL);
+    if (err) {
+        gk_err(mds, "create handoff thread failed w/ %s\n", strerror(err));
+        xrwlock_wlock(&mig_mgr.olock);
+        mig_mgr.ho_site = 0;
+        mig_mgr.ho_state = MIG_HO_IDLE;
+        xrwlock_wunlock(&mig_mgr.olock);
+        return -err;
+    }
+    mig_mgr.ho_thread_valid = 1;
+    gk_info(mds, "start handing namespaces over to %lx\n", site_id);
+
+    return 0;
+}
+
+/* mds_do_handoff() handle a ring join handoff request of a joining site
+ *
+ * ABI:
+ * @tx.arg0: MIG_HO_START, MIG_HO_STATUS or MIG_HO_ABORT
+ * @xm_data: | u32 len | struct chring_tx | of the new ring for START
+ *
+ * Reply ABI:
+ * @tx.err: -EINPROGRESS if the handoff is running, or its result
+ */
+int mds_do_handoff(struct xnet_msg *msg)
+{
+    u64 site_id = msg->tx.ssite_id;
+    u32 len;
+    int err = 0;
+
+    if (hmo.conf.option & GK_MDS_REPLICA) {
+        err = -EROFS;
+        goto out;
+    }
+    switch (msg->tx.arg0) {
+    case MIG_HO_START:
+        if (!msg->xm_datacheck || msg->tx.len < sizeof(u32)) {
+            err = -EINVAL;
+            break;
+        }
+        len = *(u32 *)msg->xm_data;
+        if (len > msg->tx.len - sizeof(u32)) {
+            err = -EINVAL;
+            break;
+        }
+        err = __mig_ho_start(site_id, msg->xm_data + sizeof(u32), len);
+        break;
+    case MIG_HO_STATUS:
+        if (mig_mgr.ho_site != site_id)
+            err = -ENOENT;
+        else if (mig_mgr.ho_state == MIG_HO_RUNNING)
+            err = -EINPROGRESS;
+        else {
+            __sync_synchronize();
+            err = mig_mgr.ho_err;
+        }
+        break;
+    case MIG_HO_ABORT:
+        xrwlock_wlock(&mig_mgr.olock);
+        if (mig_mgr.ho_site == site_id) {
+            mig_mgr.ho_stop = 1;
+            mig_mgr.ho_site = 0;
+            gk_warning(mds, "handoff to %lx aborted\n", site_id);
+        }
+        xrwlock_wunlock(&mig_mgr.olock);
+        break;
+    default:
+        err = -EINVAL;
+    }
+
+out:
+    if (err && err != -EINPROGRESS)
+        gk_err(mds, "handoff op %ld from %lx failed w/ %d\n",
+               msg->tx.arg0, site_id, err);
+    __mig_reply(msg, err);
+    xnet_free_msg(msg);
+
+    return err;
+}
+
+static int __mig_ho_send(u64 site_id, u64 op, void *data, int len)
+{
+    struct xnet_msg *msg;
+    u32 l = len;
+    int err;
+
+    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    if (!msg) {
+        gk_err(mds, "xnet_alloc_msg() failed\n");
+        return -ENOMEM;
+    }
+    xnet_msg_fill_tx(msg, XNET_MSG_REQ, XNET_NEED_REPLY, hmo.site_id,
+                     site_id);
+    xnet_msg_fill_cmd(msg, GK_MDS2MDS_HANDOFF, op, 0);
+#ifdef XNET_EAGER_WRITEV
+    xnet_msg_add_sdata(msg, &msg->tx, sizeof(msg->tx));
+#endif
+    if (data) {
+        xnet_msg_add_sdata(msg, &l, sizeof(l));
+        xnet_msg_add_sdata(msg, data, len);
+    }
+
+    err = xnet_send(hmo.xc, msg);
+    if (err) {
+        gk_err(mds, "send handoff op %ld to %lx failed w/ %d\n",
+               op, site_id, err);
+        goto out;
+    }
+    ASSERT(msg->pair, mds);
+    err = msg->pair->tx.err;
+
+out:
+    xnet_free_msg(msg);
+
+    return err;
+}
+
+/* mds_ring_join() take our slice of the namespaces over from the current
+ * ring members, call it before asking R2 to join the ring (GK_R2_JOIN)
+ */
+int mds_ring_join(void)
+{
+    struct chring r;
+    u64 *sites = NULL;
+    u8 *done = NULL;
+    void *data = NULL;
+    int len, nr, left, i, err = 0;
+
+    nr = chring_get_sites(&hmo.chring, &sites);
+    if (nr <= 0)
+        return nr;
+    for (i = 0; i < nr; i++) {
+        if (sites[i] == hmo.site_id) {
+            /* a member already, our namespaces are here */
+            xfree(sites);
+            return 0;
+        }
+    }
+
+    chring_init(&r, 0);
+    err = chring_pack(&hmo.chring, &data, &len);
+    if (err)
+        goto out;
+    err = chring_unpack(&r, data, len);
+    xfree(data);
+    data = NULL;
+    if (err < 0)
+        goto out;
+    err = chring_add_site(&r, hmo.site_id);
+    if (err < 0)
+        goto out;
+    err = chring_pack(&r, &data, &len);
+    if (err)
+        goto out;
+    done = xzalloc(nr);
+    if (!done) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < nr; i++) {
+        err = __mig_ho_send(sites[i], MIG_HO_START, data, len);
+        if (err)
+            goto out_abort;
+    }
+    gk_info(mds, "ring version %ld: %d members hand over our namespaces\n",
+            hmo.chring.version, nr);
+    for (left = nr; left > 0; ) {
+        usleep(100000);
+        for (i = 0; i < nr; i++) {
+            if (done[i])
+                continue;
+            err = __mig_ho_send(sites[i], MIG_HO_STATUS, NULL, 0);
+            if (err == -EINPROGRESS)
+                continue;
+            if (err)
+                goto out_abort;
+            done[i] = 1;
+            left--;
+        }
+    }
+    err = 0;
+    goto out;
+
+out_abort:
+    gk_err(mds, "ring join failed w/ %d, abort the handoff\n", err);
+    for (i = 0; i < nr; i++)
+        __mig_ho_send(sites[i], MIG_HO_ABORT, NULL, 0);
+out:
+    xfree(done);
+    xfree(data);
+    xfree(sites);
+    chring_destroy(&r);
+
+    return err;
+}
+
+/* mds_migrate_dump() return the migration progress in a xmalloc()ed
+ * string
+ */
+char *mds_migrate_dump(void)
+{
+    struct mig_ovr *mo;
+    char *buf, *p;
+    u64 now = __mig_now_us();
+    int size;
+
+    xrwlock_rlock(&mig_mgr.olock);
+    size = 1024 + mig_mgr.onr * (GK_MAX_NAME_LEN + 64);
+    buf = xzalloc(size);
+    if (!buf) {
+        xrwlock_runlock(&mig_mgr.olock);
+        return NULL;
+    }
+    p = buf;
+    p += sprintf(p, "Migration: %s namespace %.*s -> %lx\n"
+                 " snapshot %ld pairs %ld bytes, tail %ld pairs %ld bytes, "
+                 "queued %d pairs %ld bytes\n"
+                 " rounds %d cutovers %d last pause %ld us, "
+                 "%ld ns/pair, elapsed %ld ms, result %d\n",
+                 mig_state_str[mig_mgr.state],
+                 min(mig_mgr.ns.len, 128), mig_mgr.ns.start ? : "",
+                 mig_mgr.target, mig_mgr.snap_nr, mig_mgr.snap_bytes,
+                 mig_mgr.tail_nr, mig_mgr.tail_bytes, mig_mgr.qnr,
+                 mig_mgr.qbytes, mig_mgr.rounds, mig_mgr.cutovers,
+                 mig_mgr.pause, mig_mgr.rec_ns,
+                 mig_mgr.begin ? ((mig_mgr.end ? : now) - mig_mgr.begin) /
+                 1000 : 0, mig_mgr.err);
+    p += sprintf(p, "Moved namespaces: %d\n", mig_mgr.onr);
+    list_for_each_entry(mo, &mig_mgr.ovr, list) {
+        p += sprintf(p, " %.*s -> %lx\n", mo->ns.len, mo->ns.start,
+                     mo->site_id);
+    }
+    xrwlock_runlock(&mig_mgr.olock);
+
+    return buf;
+}
+
+int mds_migrate_init(void)
+{
+    memset(&mig_mgr, 0, sizeof(mig_mgr));
+    xlock_init(&mig_mgr.lock);
+    xrwlock_init(&mig_mgr.olock);
+    INIT_LIST_HEAD(&mig_mgr.queue);
+    INIT_LIST_HEAD(&mig_mgr.parked);
+    INIT_LIST_HEAD(&mig_mgr.ovr);
+    atomic_set(&mig_mgr.inflight, 0);
+    chring_init(&mig_mgr.pring, 0);
+
+    return __mig_ovr_load();
+}
+
+void mds_migrate_destroy(void)
+{
+    struct mig_ovr *mo, *n;
+
+    mig_mgr.stop = 1;
+    mig_mgr.ho_stop = 1;
+    if (mig_mgr.ho_thread_valid) {
+        pthread_join(mig_mgr.ho_thread, NULL);
+        mig_mgr.ho_thread_valid = 0;
+    }
+    if (mig_mgr.thread_valid) {
+        pthread_join(mig_mgr.thread, NULL);
+        mig_mgr.thread_valid = 0;
+    }
+    chring_destroy(&mig_mgr.pring);
+    list_for_each_entry_safe(mo, n, &mig_mgr.ovr, list) {
+        list_del(&mo->list);
+        xfree(mo);
+    }
+    mig_mgr.onr = 0;
+    xfree(mig_mgr.ns.start);
+    mig_mgr.ns.start = NULL;
+    xlock_destroy(&mig_mgr.lock);
+    xrwlock_destroy(&mig_mgr.olock);
+}
+
+#ifdef UNIT_TEST
+/* A ring join handoff w/o any namespace to move: the requests for a new
+ * namespace the joining site would own are passed on to it, the ones we
+ * have are served here, and the pending ring is dropped once the joining
+ * site is in the installed ring.
+ */
+#define UT_HOME         "/tmp/gk_mig_ut"
+#define UT_SELF         GK_MDS(0)
+#define UT_JOIN         GK_MDS(1)
+#define UT_OTHER        GK_MDS(2)
+
+/* __ut_ns() find a namespace the pending ring places on @site
+ */
+static void __ut_ns(struct gstring *ns, char *buf, u64 site, int from)
+{
+    int i;
+
+    for (i = from; ; i++) {
+        ns->len = sprintf(buf, "mig_ut%d", i);
+        ns->start = buf;
+        if (chring_lookup(&mig_mgr.pring,
+                          gk_hash_chring(ns->start, ns->len)) == site)
+            return;
+    }
+}
+
+static int __ut_handoff(void)
+{
+    struct chring r;
+    struct gstring ns_j, ns_s, ns_n, key = {.start = "k", .len = 1};
+    char bj[32], bs[32], bn[32];
+    void *data;
+    int len, i, err;
+
+    chring_init(&r, 64);
+    chring_add_site(&r, UT_SELF);
+    chring_add_site(&r, UT_JOIN);
+    err = chring_pack(&r, &data, &len);
+    chring_destroy(&r);
+    if (err)
+        return err;
+
+    err = __mig_ho_start(UT_JOIN, data, len);
+    if (err) {
+        printf("start handoff failed w/ %d\n", err);
+        goto out;
+    }
+    for (i = 0; i < 1000 && mig_mgr.ho_state == MIG_HO_RUNNING; i++)
+        usleep(1000);
+    if (mig_mgr.ho_state != MIG_HO_DONE || mig_mgr.ho_err ||
+        mig_mgr.ho_nr) {
+        printf("handoff state %d err %d nr %ld\n", mig_mgr.ho_state,
+               mig_mgr.ho_err, mig_mgr.ho_nr);
+        err = -EFAULT;
+        goto out;
+    }
+    if (__mig_ho_start(UT_OTHER, data, len) != -EBUSY) {
+        printf("a second joining site is not -EBUSY\n");
+        err = -EFAULT;
+        goto out;
+    }
+
+    __ut_ns(&ns_j, bj, UT_JOIN, 0);
+    __ut_ns(&ns_s, bs, UT_SELF, 0);
+    __ut_ns(&ns_n, bn, UT_JOIN, atoi(bj + 6) + 1);
+    if (mds_migrate_route(&ns_j) != UT_JOIN ||
+        mds_migrate_route(&ns_s) != 0) {
+        printf("a new namespace is not routed by the pending ring\n");
+        err = -EFAULT;
+        goto out;
+    }
+    /* created here meanwhile, it is ours until it is migrated */
+    err = kvs_put(&ns_j, &key, &key);
+    if (err) {
+        printf("put failed w/ %d\n", err);
+        goto out;
+    }
+    if (mds_migrate_route(&ns_j) != 0) {
+        printf("an existing namespace is routed away\n");
+        err = -EFAULT;
+        goto out;
+    }
+
+    chring_add_site(&hmo.chring, UT_JOIN);
+    mds_migrate_ring_update();
+    if (mig_mgr.ho_site || mds_migrate_route(&ns_n) != 0) {
+        printf("the pending ring is kept after the join\n");
+        err = -EFAULT;
+    }
+
+out:
+    xfree(data);
+
+    return err;
+}
+
+int main(int argc, char *argv[])
+{
+    struct ns_entry *nse;
+    int err;
+
+    lib_init();
+    pthread_key_create(&spool_key, NULL);
+    mds_config();
+    hmo.conf.kvs_home = UT_HOME;
+    hmo.site_id = UT_SELF;
+    if (system("rm -rf " UT_HOME)) {
+        printf("clean %s failed\n", UT_HOME);
+        return 1;
+    }
+    chring_init(&hmo.chring, 64);
+    chring_add_site(&hmo.chring, UT_SELF);
+
+    err = kvs_init();
+    err = err ? : mds_migrate_init();
+    err = err ? : __ut_handoff();
+    printf("Ring join handoff: %s\n", err ? "FAILED" : "OK");
+
+    mds_migrate_destroy();
+    nse = pthread_getspecific(spool_key);
+    if (nse)
+        kvs_ns_put(nse);
+    kvs_destroy();
+    chring_destroy(&hmo.chring);
+
+    return !!err;
+}
+#endif
@@ -69,21 +69,93 @@ void dump_profiling_plot(time_t t)
         return;
     }
     hmo.prof.ts = t;
+    /* time series: ts, spool threads, queue wait, queue depth, handled */
+    gk_pf("PLOT %ld %ld %ld %ld %ld\n", t,
+          atomic64_read(&hmo.prof.misc.spool_nr),
+          atomic64_read(&hmo.prof.misc.spool_qwait),
+          atomic64_read(&hmo.prof.misc.reqin_qd),
+          atomic64_read(&hmo.prof.misc.reqin_handle));
 }
 
 static inline
 void dump_profiling_human(time_t t)
 {
+    int interval, i;
+
     if (!hmo.conf.profiling_thread_interval)
         return;
     if (t < hmo.prof.ts + hmo.conf.profiling_thread_interval) {
         return;
     }
+    interval = hmo.prof.ts ? t - hmo.prof.ts : 0;
     hmo.prof.ts = t;
-    gk_info(mds, "ts %ld ns_ins_collisions=%ld ns_lkp_collisions=%ld\n", t,
+    gk_info(mds, "ts %ld ns_ins_collisions=%ld ns_lkp_collisions=%ld "
+            "ns_neg_hit=%ld key_bf_hit=%ld key_neg_hit=%ld "
+            "wal_append=%ld wal_sync=%ld wal_apply=%ld "
+            "repl_ship=%ld repl_apply=%ld repl_dup=%ld "
+            "mig_ship=%ld mig_apply=%ld mig_fwd=%ld large_put=%ld "
+            "lmdb_grow=%ld reqin_wakeup=%ld reqin_batch=%ld "
+            "aff_local=%ld aff_overflow=%ld reqin_busy=%ld reqin_drop=%ld reqin_inline=%ld reqin_expired=%ld "
+            "spool_nr=%ld spool_qwait=%ld spool_grow=%ld spool_retire=%ld "
+            "ring_fwd_out=%ld ring_fwd_in=%ld ring_update=%ld "
+            "xnet_inmsgs=%ld xnet_recvs=%ld "
+            "xnet_msg_alloc=%ld xnet_msg_hit=%ld "
+            "xnet_buf_alloc=%ld xnet_buf_hit=%ld\n", t,
             atomic64_read(&hmo.prof.mds.ns_ins_collisions),
-            atomic64_read(&hmo.prof.mds.ns_lkp_collisions)
+            atomic64_read(&hmo.prof.mds.ns_lkp_collisions),
+            atomic64_read(&hmo.prof.mds.ns_neg_hit),
+            atomic64_read(&hmo.prof.mds.key_bf_hit),
+            atomic64_read(&hmo.prof.mds.key_neg_hit),
+            atomic64_read(&hmo.prof.mds.wal_append),
+            atomic64_read(&hmo.prof.mds.wal_sync),
+            atomic64_read(&hmo.prof.mds.wal_apply),
+            atomic64_read(&hmo.prof.mds.repl_ship),
+            atomic64_read(&hmo.prof.mds.repl_apply),
+            atomic64_read(&hmo.prof.mds.repl_dup),
+            atomic64_read(&hmo.prof.mds.mig_ship),
+            atomic64_read(&hmo.prof.mds.mig_apply),
+            atomic64_read(&hmo.prof.mds.mig_fwd),
+            atomic64_read(&hmo.prof.mds.large_put),
+            atomic64_read(&hmo.prof.mds.lmdb_grow),
+            atomic64_read(&hmo.prof.misc.reqin_wakeup),
+            atomic64_read(&hmo.prof.misc.reqin_batch),
+            atomic64_read(&hmo.prof.misc.aff_local),
+            atomic64_read(&hmo.prof.misc.aff_overflow),
+            atomic64_read(&hmo.prof.misc.reqin_busy),
+            atomic64_read(&hmo.prof.misc.reqin_drop),
+            atomic64_read(&hmo.prof.misc.reqin_inline),
+            atomic64_read(&hmo.prof.misc.reqin_expired),
+            atomic64_read(&hmo.prof.misc.spool_nr),
+            atomic64_read(&hmo.prof.misc.spool_qwait),
+            atomic64_read(&hmo.prof.misc.spool_grow),
+            atomic64_read(&hmo.prof.misc.spool_retire),
+            atomic64_read(&hmo.prof.ring.reqout),
+            atomic64_read(&hmo.prof.ring.reqin),
+            atomic64_read(&hmo.prof.ring.update),
+            hmo.prof.xnet ? atomic64_read(&hmo.prof.xnet->inmsgs) : 0,
+            hmo.prof.xnet ? atomic64_read(&hmo.prof.xnet->recvs) : 0,
+            hmo.prof.xnet ? atomic64_read(&hmo.prof.xnet->msg_alloc) : 0,
+            hmo.prof.xnet ? atomic64_read(&hmo.prof.xnet->msg_cache_hit) : 0,
+            hmo.prof.xnet ? atomic64_read(&hmo.prof.xnet->buf_alloc) : 0,
+            hmo.prof.xnet ? atomic64_read(&hmo.prof.xnet->buf_cache_hit) : 0
         );
+    for (i = 0; hmo.prof.misc.spool && i < hmo.conf.spool_threads; i++) {
+        gk_info(mds, "spool thread %d: qd=%ld steal=%ld steal_batch=%ld\n",
+                i, atomic64_read(&hmo.prof.misc.spool[i].qd),
+                atomic64_read(&hmo.prof.misc.spool[i].steal),
+                atomic64_read(&hmo.prof.misc.spool[i].steal_batch));
+    }
+    for (i = 0; i < MDS_QCLASS_NR; i++) {
+        struct mds_qclass_prof *qp = &hmo.prof.misc.qclass[i];
+        u64 nr = atomic64_read(&qp->nr);
+
+        gk_info(mds, "qclass %s: nr=%ld qtime avg=%.1fus max=%ldus\n",
+                i == MDS_QCLASS_CTRL ? "ctrl" :
+                (i == MDS_QCLASS_CLIENT ? "client" : "amc"), nr,
+                nr ? (double)atomic64_read(&qp->qtime) / nr : 0.0,
+                atomic64_read(&qp->qtime_max));
+    }
+    mds_spool_numa_dump(interval);
 }
 
 void dump_profiling(time_t t, struct gk_profile *hp)
@@ -91,6 +163,8 @@ void dump_profiling(time_t t, struct gk_profile *hp)
     if (hmo.state < HMO_STATE_LAUNCH)
         return;
 
+    mds_spool_prof_sync();
+
     switch (hmo.conf.prof_plot) {
     case MDS_PROF_PLOT:
         dump_profiling_plot(t);
@@ -41,7 +41,8 @@ struct mds_client_prof
 
 struct mds_ring_prof 
 {
-    atomic64_t reqout;
+    atomic64_t reqout;          /* # of requests forwarded to the owner */
+    atomic64_t reqin;           /* # of forwarded requests served */
     atomic64_t update;          /* # of ring update msg */
     atomic64_t size;            /* total size of ring update msgs */
 };
@@ -52,6 +53,20 @@ struct mds_mds_prof
     atomic64_t ns_lkp_collisions;
     atomic64_t loop_fwd;
     atomic64_t paused_mreq;
+    atomic64_t ns_neg_hit;      /* # of missing ns answered by cache */
+    atomic64_t key_bf_hit;      /* # of missing keys answered by bloom */
+    atomic64_t key_neg_hit;     /* # of missing keys answered by cache */
+    atomic64_t wal_append;      /* # of records written to wal */
+    atomic64_t wal_sync;        /* # of wal group commits */
+    atomic64_t wal_apply;       /* # of wal records applied */
+    atomic64_t repl_ship;       /* # of replication msgs shipped */
+    atomic64_t repl_apply;      /* # of replicated records applied */
+    atomic64_t repl_dup;        /* # of replication msgs dropped as dup */
+    atomic64_t mig_ship;        /* # of migration msgs shipped */
+    atomic64_t mig_apply;       /* # of migrated records applied */
+    atomic64_t mig_fwd;         /* # of reqs forwarded to the new owner */
+    atomic64_t large_put;       /* # of large values w/o memory copy */
+    atomic64_t lmdb_grow;       /* # of LMDB map growths */
 };
 
 struct mds_mdsl_prof
@@ -95,6 +110,29 @@ struct mds_itb_prof
     atomic64_t split_local;     /* # of splited ITBs in local site */
 };
 
+/* Request classes of the spool, the control plane (R2, MDS and the
+ * other servers) is served in strict priority, the client classes share
+ * the rest by weight.
+ */
+#define MDS_QCLASS_CTRL         0
+#define MDS_QCLASS_CLIENT       1
+#define MDS_QCLASS_AMC          2
+#define MDS_QCLASS_NR           3
+
+struct mds_qclass_prof
+{
+    atomic64_t nr;              /* # of dequeued requests */
+    atomic64_t qtime;           /* total queue time in us */
+    atomic64_t qtime_max;       /* max queue time in us */
+};
+
+struct mds_spool_prof
+{
+    atomic64_t qd;              /* # of queued requests */
+    atomic64_t steal;           /* # of requests stolen by this thread */
+    atomic64_t steal_batch;     /* # of steals by this thread */
+};
+
 struct mds_misc_prof
 {
     atomic64_t reqin_total;     /* # of total requests coming in */
@@ -106,6 +144,20 @@ struct mds_misc_prof
     atomic64_t au_ddr;          /* # of dir delta reply */
     atomic64_t reqin_drop;      /* # of dropped requets */
     atomic64_t reqin_qd;        /* # of queued requests */
+    atomic64_t reqin_busy;      /* # of requests rejected w/ -EBUSY */
+    atomic64_t reqin_inline;    /* # of GETs served in the recv thread */
+    atomic64_t reqin_expired;   /* # of requests dropped w/ -ETIMEDOUT */
+    atomic64_t reqin_wakeup;    /* # of service thread wakeups */
+    atomic64_t reqin_batch;     /* # of batched dequeues */
+    atomic64_t aff_local;       /* # of requests queued to the preferred
+                                 * thread */
+    atomic64_t aff_overflow;    /* # of requests overflowed to others */
+    atomic64_t spool_nr;        /* # of spool threads */
+    atomic64_t spool_qwait;     /* avg queue wait in us, last period */
+    atomic64_t spool_grow;      /* # of helper threads started */
+    atomic64_t spool_retire;    /* # of helper threads retired */
+    struct mds_spool_prof *spool; /* per spool thread */
+    struct mds_qclass_prof qclass[MDS_QCLASS_NR];
 };
 
 struct mds_storage_prof
@@ -0,0 +1,598 @@
+/**
+ * Copyright (c) 2019 Ma Can <ml.macana@gmail.com>
+ *                           <macan@iie.ac.cn>
+ *
+ * Armed with EMACS.
+ * Time-stamp: <2019-10-17 16:40:05 macan>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "gk.h"
+#include "xnet.h"
+#include "mds.h"
+
+/* Asynchronous read replicas
+ *
+ * The primary (gk_mds_repl_followers=1,2,...) queues each acknowledged
+ * PUT in the replication log. The shipper thread packs the queued records
+ * into one GK_MDS2MDS_REPL message and sends it to every follower, every
+ * hmo.conf.repl_hb ms an empty message is sent if there is nothing to
+ * ship. Each message carries the sequence number of its first record, the
+ * epoch of the primary (its start time, the seqs restart from 0 w/ a new
+ * epoch) and the primary's time when it was packed, i.e. all writes
+ * acknowledged before that time are in this or an earlier message.
+ *
+ * A follower (gk_mds_replica=1) applies the messages in sequence order,
+ * out of order ones are stashed and already applied ones (a catch-up
+ * resend) are dropped. A newer epoch restarts the sequence, messages of
+ * an older one are dropped. Its staleness is the time elapsed since
+ * the pack time of the last applied message. GETs are served only if the
+ * staleness is within hmo.conf.repl_max_stale ms (otherwise -EAGAIN and
+ * the client goes to the primary), and the staleness is reported in the
+ * reply. Client PUTs are rejected w/ -EROFS.
+ *
+ * The last REPL_MAX_KEEP non-empty messages are kept by the primary. A
+ * follower that misses a message (the send failed) is behind, it is
+ * caught up from the kept messages on each heartbeat. If the message it
+ * needs is not kept anymore, it is dropped and has to be reseeded and
+ * restarted.
+ *
+ * NOTE: staleness relies on synchronized clocks between the sites.
+ */
+
+struct repl_batch_hdr
+{
+    u64 epoch;                  /* start time of the primary in us */
+    u64 seq;                    /* seq of the first record */
+    u64 ts;                     /* pack time in us */
+    u32 nr;                     /* # of records */
+    u32 len;                    /* payload length after this header */
+};
+
+struct repl_rec_hdr
+{
+    u32 nslen, klen, vlen;
+};
+
+struct repl_rec
+{
+    struct list_head list;
+    u64 ts;                     /* queue time in us */
+    struct repl_rec_hdr hdr;
+    char data[0];
+};
+
+#define REPL_MAX_FOLLOWERS      16
+#define REPL_MAX_STASH          1024
+#define REPL_MAX_KEEP           1024
+
+/* a shipped message kept for the catch-up */
+struct repl_kept
+{
+    struct list_head list;
+    u64 seq;
+    int len;
+    void *buf;
+};
+
+#define REPL_F_OK               0
+#define REPL_F_BEHIND           1 /* missed messages, catch it up */
+#define REPL_F_DROPPED          2 /* can not be caught up */
+
+#define REPL_MAX_BACKOFF        30000 /* ms between two catch-up tries */
+
+struct repl_mgr
+{
+    /* primary */
+    xlock_t lock;
+    struct list_head queue;
+    int qnr;
+    u64 epoch;                  /* our start time in us */
+    u64 seq;                    /* next seq to ship */
+    sem_t sem;
+    pthread_t thread;
+    int stop;
+    int fnr;
+    u64 followers[REPL_MAX_FOLLOWERS];
+    u8 fstate[REPL_MAX_FOLLOWERS];
+    u64 fnext[REPL_MAX_FOLLOWERS]; /* next seq a behind follower needs */
+    u64 fretry[REPL_MAX_FOLLOWERS]; /* time of the next catch-up try */
+    int fbackoff[REPL_MAX_FOLLOWERS]; /* in ms */
+    struct list_head kept;      /* oldest first */
+    int knr;
+
+    /* follower */
+    xlock_t flock;
+    u64 fepoch;                 /* epoch of the primary we follow */
+    u64 next_seq;               /* next seq to apply */
+    u64 applied_ts;             /* pack time of the last applied batch */
+    struct list_head stash;     /* out of order messages */
+    int snr;
+    int lost;                   /* gap can not be filled, need resync */
+};
+
+static struct repl_mgr repl_mgr;
+
+static inline
+u64 __repl_now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+/* mds_repl_ship() queue an acknowledged write for the followers. It is
+ * called under the bucket lock of the key, thus the queue order is the
+ * order the updates hit the memory table.
+ */
+void mds_repl_ship(struct gstring *ns, struct gstring *key,
+                   struct gstring *value)
+{
+    struct repl_rec *rr;
+
+    if (!repl_mgr.fnr)
+        return;
+
+    rr = xmalloc(sizeof(*rr) + ns->len + key->len + value->len);
+    if (!rr) {
+        gk_err(mds, "xmalloc() repl record failed, followers will "
+               "diverge\n");
+        return;
+    }
+    INIT_LIST_HEAD(&rr->list);
+    rr->hdr.nslen = ns->len;
+    rr->hdr.klen = key->len;
+    rr->hdr.vlen = value->len;
+    memcpy(rr->data, ns->start, ns->len);
+    memcpy(rr->data + ns->len, key->start, key->len);
+    memcpy(rr->data + ns->len + key->len, value->start, value->len);
+
+    xlock_lock(&repl_mgr.lock);
+    rr->ts = __repl_now_us();
+    list_add_tail(&rr->list, &repl_mgr.queue);
+    repl_mgr.qnr++;
+    xlock_unlock(&repl_mgr.lock);
+    if (repl_mgr.qnr >= hmo.conf.repl_batch)
+        sem_post(&repl_mgr.sem);
+}
+
+static int __repl_send_one(int i, void *data, int len)
+{
+    struct xnet_msg *msg;
+    int err;
+
+    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    if (!msg) {
+        gk_err(mds, "xnet_alloc_msg() failed\n");
+        return -ENOMEM;
+    }
+    xnet_msg_fill_tx(msg, XNET_MSG_REQ, 0, hmo.site_id,
+                     repl_mgr.followers[i]);
+    xnet_msg_fill_cmd(msg, GK_MDS2MDS_REPL, 0, 0);
+#ifdef XNET_EAGER_WRITEV
+    xnet_msg_add_sdata(msg, &msg->tx, sizeof(msg->tx));
+#endif
+    xnet_msg_add_sdata(msg, data, len);
+
+    err = xnet_send(hmo.xc, msg);
+    if (!err)
+        atomic64_inc(&hmo.prof.mds.repl_ship);
+    xnet_free_msg(msg);
+
+    return err;
+}
+
+static void __repl_send(void *data, int len)
+{
+    struct repl_batch_hdr *rbh = data;
+    int i, err;
+
+    for (i = 0; i < repl_mgr.fnr; i++) {
+        if (repl_mgr.fstate[i] != REPL_F_OK)
+            continue;
+        err = __repl_send_one(i, data, len);
+        if (err) {
+            gk_err(mds, "ship replication log to %lx failed w/ %d, "
+                   "catch it up from seq %ld\n", repl_mgr.followers[i],
+                   err, rbh->seq);
+            repl_mgr.fstate[i] = REPL_F_BEHIND;
+            repl_mgr.fnext[i] = rbh->seq;
+            repl_mgr.fbackoff[i] = hmo.conf.repl_hb;
+            repl_mgr.fretry[i] = __repl_now_us() +
+                repl_mgr.fbackoff[i] * 1000UL;
+        }
+    }
+}
+
+/* __repl_keep() keep a shipped message for the catch-up, consume buf
+ */
+static void __repl_keep(void *buf, int len)
+{
+    struct repl_batch_hdr *rbh = buf;
+    struct repl_kept *rk;
+
+    if (!rbh->nr)
+        goto out_free;
+    rk = xmalloc(sizeof(*rk));
+    if (!rk)
+        goto out_free;
+    rk->seq = rbh->seq;
+    rk->len = len;
+    rk->buf = buf;
+    list_add_tail(&rk->list, &repl_mgr.kept);
+    if (++repl_mgr.knr > REPL_MAX_KEEP) {
+        rk = list_first_entry(&repl_mgr.kept, struct repl_kept, list);
+        list_del(&rk->list);
+        repl_mgr.knr--;
+        xfree(rk->buf);
+        xfree(rk);
+    }
+    return;
+
+out_free:
+    xfree(buf);
+}
+
+/* __repl_catchup() resend the kept messages to the behind followers. A
+ * send to a dead site may block in connect, thus the tries are backed off
+ * to not stall the shipping to the others.
+ */
+static void __repl_catchup(void)
+{
+    struct repl_kept *rk;
+    int i, found, err = 0;
+
+    for (i = 0; i < repl_mgr.fnr; i++) {
+        if (repl_mgr.fstate[i] != REPL_F_BEHIND ||
+            __repl_now_us() < repl_mgr.fretry[i])
+            continue;
+        if (repl_mgr.fnext[i] >= repl_mgr.seq) {
+            repl_mgr.fstate[i] = REPL_F_OK;
+            continue;
+        }
+        found = 0;
+        list_for_each_entry(rk, &repl_mgr.kept, list) {
+            if (rk->seq < repl_mgr.fnext[i])
+                continue;
+            if (rk->seq > repl_mgr.fnext[i])
+                break;
+            found = 1;
+            err = __repl_send_one(i, rk->buf, rk->len);
+            if (err)
+                break;
+            repl_mgr.fnext[i] = rk->seq +
+                ((struct repl_batch_hdr *)rk->buf)->nr;
+        }
+        if (err) {
+            repl_mgr.fbackoff[i] = min(repl_mgr.fbackoff[i] * 2,
+                                       REPL_MAX_BACKOFF);
+            repl_mgr.fretry[i] = __repl_now_us() +
+                repl_mgr.fbackoff[i] * 1000UL;
+            err = 0;
+        } else if (!found) {
+            gk_err(mds, "replication log @ %ld is not kept anymore, drop "
+                   "follower %lx, reseed and restart it\n",
+                   repl_mgr.fnext[i], repl_mgr.followers[i]);
+            repl_mgr.fstate[i] = REPL_F_DROPPED;
+        } else if (repl_mgr.fnext[i] >= repl_mgr.seq) {
+            gk_info(mds, "follower %lx caught up @ %ld\n",
+                    repl_mgr.followers[i], repl_mgr.seq);
+            repl_mgr.fstate[i] = REPL_F_OK;
+        }
+    }
+}
+
+/* __repl_pack() pack up to repl_batch queued records into a message
+ * buffer, return the buffer length.
+ */
+static int __repl_pack(void **obuf)
+{
+    struct repl_batch_hdr *rbh;
+    struct repl_rec *rr, *n;
+    LIST_HEAD(batch);
+    void *buf, *p;
+    u64 ts;
+    int nr = 0, len = 0;
+
+    xlock_lock(&repl_mgr.lock);
+    list_for_each_entry_safe(rr, n, &repl_mgr.queue, list) {
+        list_move_tail(&rr->list, &batch);
+        len += sizeof(rr->hdr) + rr->hdr.nslen + rr->hdr.klen +
+            rr->hdr.vlen;
+        if (++nr >= hmo.conf.repl_batch)
+            break;
+    }
+    repl_mgr.qnr -= nr;
+    /* writes queued before ts are in this or an earlier batch */
+    if (list_empty(&repl_mgr.queue))
+        ts = __repl_now_us();
+    else
+        ts = list_first_entry(&repl_mgr.queue, struct repl_rec, list)->ts;
+    xlock_unlock(&repl_mgr.lock);
+
+    buf = xmalloc(sizeof(*rbh) + len);
+    if (!buf) {
+        gk_err(mds, "xmalloc() repl batch failed, drop %d records\n", nr);
+        list_for_each_entry_safe(rr, n, &batch, list) {
+            list_del(&rr->list);
+            xfree(rr);
+        }
+        /* the followers will see a gap */
+        repl_mgr.seq += nr;
+        return -ENOMEM;
+    }
+    rbh = buf;
+    rbh->epoch = repl_mgr.epoch;
+    rbh->seq = repl_mgr.seq;
+    rbh->ts = ts;
+    rbh->nr = nr;
+    rbh->len = len;
+    p = buf + sizeof(*rbh);
+    list_for_each_entry_safe(rr, n, &batch, list) {
+        int l = rr->hdr.nslen + rr->hdr.klen + rr->hdr.vlen;
+
+        memcpy(p, &rr->hdr, sizeof(rr->hdr));
+        memcpy(p + sizeof(rr->hdr), rr->data, l);
+        p += sizeof(rr->hdr) + l;
+        list_del(&rr->list);
+        xfree(rr);
+    }
+    repl_mgr.seq += nr;
+    *obuf = buf;
+
+    return sizeof(*rbh) + len;
+}
+
+static void *repl_ship_main(void *arg)
+{
+    struct timespec ts;
+    sigset_t set;
+    void *buf;
+    int len;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigaddset(&set, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while (!repl_mgr.stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += hmo.conf.repl_hb * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        sem_timedwait(&repl_mgr.sem, &ts);
+        /* ship everything queued, an empty batch is the heartbeat */
+        do {
+            len = __repl_pack(&buf);
+            if (len < 0)
+                break;
+            __repl_send(buf, len);
+            __repl_keep(buf, len);
+        } while (repl_mgr.qnr > 0);
+        __repl_catchup();
+    }
+
+    pthread_exit(0);
+}
+
+/* __repl_apply() redo one batch, holding the follower lock
+ */
+static void __repl_apply(struct xnet_msg *msg)
+{
+    struct repl_batch_hdr *rbh = msg->xm_data;
+    struct repl_rec_hdr *rrh;
+    struct gstring ns, key, value;
+    void *p = msg->xm_data + sizeof(*rbh), *end = p + rbh->len;
+    int i, err;
+
+    for (i = 0; i < rbh->nr; i++) {
+        rrh = p;
+        if (p + sizeof(*rrh) > end ||
+            (u64)rrh->nslen + rrh->klen + rrh->vlen >
+            end - (p + sizeof(*rrh))) {
+            /* the stream is broken, nothing later can be trusted */
+            gk_err(mds, "replication record %ld overruns the message, "
+                   "stop serving reads\n", rbh->seq + i);
+            repl_mgr.lost = 1;
+            break;
+        }
+        ns.start = p + sizeof(*rrh);
+        ns.len = rrh->nslen;
+        key.start = ns.start + ns.len;
+        key.len = rrh->klen;
+        value.start = key.start + key.len;
+        value.len = rrh->vlen;
+        err = kvs_update(&ns, &key, &value);
+        if (err) {
+            gk_err(mds, "apply replication record %ld failed w/ %d\n",
+                   rbh->seq + i, err);
+        }
+        p += sizeof(*rrh) + ns.len + key.len + value.len;
+    }
+    atomic64_add(rbh->nr, &hmo.prof.mds.repl_apply);
+    repl_mgr.next_seq = rbh->seq + rbh->nr;
+    if (rbh->ts > repl_mgr.applied_ts)
+        repl_mgr.applied_ts = rbh->ts;
+}
+
+/* mds_do_repl() handle a replication log message from the primary
+ */
+int mds_do_repl(struct xnet_msg *msg)
+{
+    struct repl_batch_hdr *rbh;
+    struct xnet_msg *pos, *n;
+    int found;
+
+    if (!(hmo.conf.option & GK_MDS_REPLICA) || !msg->xm_datacheck ||
+        msg->tx.len < sizeof(*rbh) ||
+        sizeof(*rbh) + (u64)((struct repl_batch_hdr *)msg->xm_data)->len >
+        msg->tx.len) {
+        gk_err(mds, "Invalid replication log from %lx\n", msg->tx.ssite_id);
+        xnet_free_msg(msg);
+        return -EINVAL;
+    }
+    rbh = msg->xm_data;
+
+    xlock_lock(&repl_mgr.flock);
+    if (rbh->epoch > repl_mgr.fepoch) {
+        if (repl_mgr.fepoch) {
+            /* the primary restarted, follow the new stream */
+            gk_warning(mds, "replication epoch %ld -> %ld, primary "
+                       "restarted, follow it from seq %ld\n",
+                       repl_mgr.fepoch, rbh->epoch, rbh->seq);
+            repl_mgr.next_seq = rbh->seq;
+            list_for_each_entry_safe(pos, n, &repl_mgr.stash, list) {
+                list_del(&pos->list);
+                xnet_free_msg(pos);
+            }
+            repl_mgr.snr = 0;
+        }
+        repl_mgr.fepoch = rbh->epoch;
+    } else if (rbh->epoch < repl_mgr.fepoch ||
+               rbh->seq < repl_mgr.next_seq) {
+        /* an older stream, or a resend we have applied */
+        atomic64_inc(&hmo.prof.mds.repl_dup);
+        xlock_unlock(&repl_mgr.flock);
+        xnet_free_msg(msg);
+        return 0;
+    }
+    if (rbh->seq != repl_mgr.next_seq) {
+        if (repl_mgr.snr >= REPL_MAX_STASH) {
+            if (!repl_mgr.lost)
+                gk_err(mds, "replication gap @ %ld can not be filled, "
+                       "stop serving reads\n", repl_mgr.next_seq);
+            repl_mgr.lost = 1;
+            xlock_unlock(&repl_mgr.flock);
+            xnet_free_msg(msg);
+            return -EINVAL;
+        }
+        list_add_tail(&msg->list, &repl_mgr.stash);
+        repl_mgr.snr++;
+        xlock_unlock(&repl_mgr.flock);
+        return 0;
+    }
+    __repl_apply(msg);
+    xnet_free_msg(msg);
+    /* drain the stashed ones */
+    do {
+        found = 0;
+        list_for_each_entry_safe(pos, n, &repl_mgr.stash, list) {
+            rbh = pos->xm_data;
+            if (rbh->seq < repl_mgr.next_seq) {
+                /* a resend stashed twice */
+                list_del(&pos->list);
+                repl_mgr.snr--;
+                atomic64_inc(&hmo.prof.mds.repl_dup);
+                xnet_free_msg(pos);
+                continue;
+            }
+            if (rbh->seq == repl_mgr.next_seq) {
+                list_del(&pos->list);
+                repl_mgr.snr--;
+                __repl_apply(pos);
+                xnet_free_msg(pos);
+                found = 1;
+                break;
+            }
+        }
+    } while (found);
+    xlock_unlock(&repl_mgr.flock);
+
+    return 0;
+}
+
+/* mds_repl_staleness() return the staleness of this follower in ms, or
+ * -1 if it should not serve reads.
+ */
+long mds_repl_staleness(void)
+{
+    long stale;
+
+    if (repl_mgr.lost || !repl_mgr.applied_ts)
+        return -1;
+    stale = ((long)(__repl_now_us() - repl_mgr.applied_ts)) / 1000;
+    if (stale < 0)
+        stale = 0;
+    if (stale > hmo.conf.repl_max_stale)
+        return -1;
+
+    return stale;
+}
+
+int mds_repl_init(void)
+{
+    char *p, *s, *e;
+    int err = 0;
+
+    memset(&repl_mgr, 0, sizeof(repl_mgr));
+    xlock_init(&repl_mgr.lock);
+    xlock_init(&repl_mgr.flock);
+    INIT_LIST_HEAD(&repl_mgr.queue);
+    INIT_LIST_HEAD(&repl_mgr.stash);
+    INIT_LIST_HEAD(&repl_mgr.kept);
+    repl_mgr.epoch = __repl_now_us();
+
+    if (!hmo.conf.repl_followers)
+        return 0;
+
+    /* parse the follower MDS ids, e.g. "1,2" */
+    s = strdup(hmo.conf.repl_followers);
+    if (!s)
+        return -ENOMEM;
+    for (p = strtok_r(s, ",", &e); p; p = strtok_r(NULL, ",", &e)) {
+        if (repl_mgr.fnr >= REPL_MAX_FOLLOWERS) {
+            gk_warning(mds, "too many followers, ignore %s\n", p);
+            continue;
+        }
+        repl_mgr.followers[repl_mgr.fnr++] = GK_MDS(atoi(p));
+    }
+    free(s);
+    if (!repl_mgr.fnr)
+        return 0;
+
+    sem_init(&repl_mgr.sem, 0, 0);
+    err = pthread_create(&repl_mgr.thread, NULL, &repl_ship_main, NULL);
+    if (err) {
+        gk_err(mds, "create replication shipper failed w/ %d\n", err);
+        repl_mgr.fnr = 0;
+        return -err;
+    }
+    gk_info(mds, "replicate to %d followers, heartbeat %d ms\n",
+            repl_mgr.fnr, hmo.conf.repl_hb);
+
+    return 0;
+}
+
+void mds_repl_destroy(void)
+{
+    struct repl_kept *rk, *n;
+
+    if (!repl_mgr.fnr)
+        return;
+    repl_mgr.stop = 1;
+    sem_post(&repl_mgr.sem);
+    pthread_join(repl_mgr.thread, NULL);
+    sem_destroy(&repl_mgr.sem);
+    list_for_each_entry_safe(rk, n, &repl_mgr.kept, list) {
+        list_del(&rk->list);
+        xfree(rk->buf);
+        xfree(rk);
+    }
+    repl_mgr.knr = 0;
+    repl_mgr.fnr = 0;
+}
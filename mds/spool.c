@@ -27,45 +27,698 @@
 #include "lib.h"
 #include "kvs.h"
 
+/* Request queue: a lock-free ring plus a locked overflow list for the
+ * (rare) full ring. Once the list has a request, the later ones go to
+ * the list as well until it is drained, and the ring is always drained
+ * first, thus the queue stays FIFO.
+ */
+struct spool_queue
+{
+    struct lfq ring;
+    struct list_head reqin;     /* overflow of the ring */
+    xlock_t lock;
+    atomic64_t qd;              /* # of queued requests */
+};
+
+/* Control plane requests (from R2, MDS and the other servers) go to the
+ * ctrl queue, which every thread checks before each request, thus
+ * heartbeats and ring updates never wait behind the client requests.
+ *
+ * Each service thread owns a work queue per client class. A request goes
+ * to a sleeping thread if any, or to the next thread in round robin. A
+ * thread serves its client classes in deficit round robin by weight,
+ * then steals half of the longest work queue of the others (up to a
+ * batch), then the unclaimed requests of the batch of another thread,
+ * which may be blocked w/ them, and only sleeps if there is nothing to
+ * steal. A sleeping
+ * thread holds a token in @sleepers, and a producer posts the semaphore
+ * only if it takes a token, thus busy threads cost no wakeups.
+ *
+ * In the shared-nothing (partition) mode, client requests are routed to
+ * the pin queues of the thread owning the namespace, thus namespace
+ * entries, their hash tables and backend write transactions are only
+ * touched by the owner. Pin queues are never stolen.
+ *
+ * In the affinity mode, client requests go to the work queue of the
+ * namespace's preferred thread, unless it has spool_affinity_qd or more
+ * requests queued. The namespace then stays hot in the cache of one
+ * core, while the overflow and stealing keep hot namespaces from
+ * stalling on one thread.
+ *
+ * The pool is elastic: the spool_threads base threads own the queues,
+ * helper threads own none. They serve the ctrl queue and steal, thus
+ * they take over the work queues while the base threads are blocked
+ * (e.g. on LMDB fsyncs). mds_spool_adjust() adds a helper while the
+ * queue wait is above spool_grow_us and rising and the CPUs are not
+ * saturated, a helper idle for spool_idle_to seconds retires. The
+ * total is kept in [spool_min, spool_max].
+ *
+ * Admission: client requests are counted per client in a slot table
+ * hashed by the site id (colliding clients share a slot, thus a share).
+ * If enabled (spool_admit_qd > 0, off by default), once spool_admit_qd
+ * or more client requests are queued, a client holding its fair share
+ * (spool_admit_qd / active clients) or more is rejected w/ -EBUSY, and
+ * the reply carries a retry hint in arg1 (us).
+ * A client may also be rate limited by a token bucket of
+ * spool_client_rate requests/s and spool_client_burst depth. Rejection
+ * happens before queueing, thus a noisy client can not fill the queues
+ * and grow the queue wait of the others.
+ *
+ * In the inline mode (GK_MDS_INLINE), a client GET which needs no
+ * blocking I/O is served by the receiving thread right away, w/o the
+ * queue, the wakeup and the context switch. Everything else, and every
+ * GET that might touch the store, is queued as before.
+ *
+ * Deadlines: a request w/ XNET_DEADLINE carries the budget of its
+ * client, which gives up after that. The budget is turned into an
+ * absolute deadline on receiving, and an expired request is answered
+ * w/ -ETIMEDOUT at dequeue, or by mds_spool_expired() checks before
+ * the store I/O, rather than served for nobody.
+ */
+#define SPOOL_CCLASS_NR         (MDS_QCLASS_NR - 1) /* client classes */
+
+#define SPOOL_BATCH             16
+
+struct spool_thread
+{
+    struct spool_queue pin[SPOOL_CCLASS_NR]; /* affinity routed requests */
+    struct spool_queue work[SPOOL_CCLASS_NR]; /* the others, stealable */
+    sem_t sem;
+    atomic_t sleepers;          /* sleeper tokens */
+    int state;                  /* SPOOL_SLOT_* */
+    int cur;                    /* current client class, owner only */
+    int credit[SPOOL_CCLASS_NR]; /* deficit of the classes, owner only */
+    u64 handled;                /* # of handled requests, owner only */
+    /* the batch dequeued by the thread. The requests not claimed yet may
+     * be stolen while it is blocked, unless they come from a pin queue.
+     * @bword is gen:31 | pin:1 | nr:16 | next:16, see
+     * __spool_batch_claim(). */
+    struct xnet_msg *batch[SPOOL_BATCH];
+    atomic64_t bword;
+} __attribute__((aligned(64)));
+
+#define SPOOL_HELPER_MAX        64 /* max # of helper threads */
+
+#define SPOOL_SLOT_FREE         0
+#define SPOOL_SLOT_RUN          1
+#define SPOOL_SLOT_EXIT         2 /* retired, to be joined */
+
+/* Per-node statistics in the NUMA mode
+ */
+struct spool_node
+{
+    atomic64_t local, remote;   /* sampled accesses to the stored pairs */
+    u64 last_handled;           /* for the throughput, prof dumper only */
+} __attribute__((aligned(64)));
+
+#define SPOOL_NUMA_SAMPLE       64 /* sample 1 of 64 lookups */
+
+/* Per-client admission state
+ */
+struct spool_client
+{
+    atomic_t inflight;          /* # of queued requests */
+    xlock_t lock;               /* protect the token bucket */
+    double tokens;
+    u64 last;                   /* last refill time in us, 0 for full */
+    u64 next;                   /* next free retry time in us */
+};
+
+#define SPOOL_CLIENT_SLOTS      4096
+
 struct spool_mgr
 {
-    struct list_head reqin;
+    struct spool_queue ctrl;    /* control plane requests */
+    struct spool_thread *st;    /* per-thread queues */
+    int quantum[SPOOL_CCLASS_NR]; /* # of requests per round */
     struct list_head modify_req; /* for suspending modify requests */
     struct list_head paused_req; /* for paused pending request */
-    xlock_t rin_lock;
+    xlock_t rin_lock;           /* protect paused_req */
     xlock_t pmreq_lock;
-    sem_t rin_sem;
+    int partition;              /* shared-nothing mode */
+    int nr_slot;                /* # of slots, base and helpers */
+    atomic_t nr;                /* # of running threads */
+    atomic_t hwm;               /* high water mark of the running slots */
+    xlock_t adjust_lock;        /* protect the slots */
+    struct spool_thread_arg *sta;
+    /* for mds_spool_adjust() */
+    time_t last_adjust;
+    double last_cpu;            /* process cpu seconds */
+    u64 last_qnr, last_qtime;
+    u64 qwait;                  /* avg queue wait in the last period */
+    int affinity;               /* soft namespace affinity mode */
+    atomic_t rr;                /* round robin cursor for work queues */
+    atomic_t paused_nr;         /* # of requests in paused_req */
+    struct numa_topo topo;      /* the nodes in the NUMA mode */
+    struct spool_node *node;    /* per-node stats, NULL if not NUMA mode */
+    struct spool_client *client; /* admission slots, NULL if disabled */
+    atomic_t client_qd;         /* # of queued client requests */
+    atomic_t active;            /* # of slots w/ queued requests */
 };
 
 struct spool_thread_arg
 {
     int tid;
+    int node;                   /* index in spool_mgr.topo, or -1 */
 };
 
 static struct spool_mgr spool_mgr;
 
+static __thread int spool_node_idx = -1;
+
+/* deadline of the request being served by this thread, 0 for none */
+static __thread u64 spool_deadline;
+
 pthread_key_t spool_key;
 
+/* NUMA mode
+ *
+ * Thread i runs on node i % N and prefers its memory. A namespace is
+ * homed to node hash % N and owned by one of the threads of that node,
+ * thus its entries, hash table and pairs are allocated (by the owner) and
+ * accessed on the home node.
+ */
+static inline
+int __spool_numa_partition(u64 hash)
+{
+    int nr = spool_mgr.topo.nr, home = hash % nr;
+    int cnt = (hmo.conf.spool_threads - home + nr - 1) / nr;
+
+    if (cnt <= 0)
+        return hash % hmo.conf.spool_threads;
+
+    return home + ((hash / nr) % cnt) * nr;
+}
+
+/* __spool_class() classify the request by its command, the site type
+ * only tells AMC requests from the R2 ones sharing the same cmd space. A
+ * forwarded request has been unwrapped by mds_spool_dispatch() already.
+ */
+static inline
+int __spool_class(struct xnet_msg *msg)
+{
+    if (msg->tx.cmd & GK_CLT2MDS_BASE)
+        return GK_IS_AMC(msg->tx.ssite_id) ? MDS_QCLASS_AMC :
+            MDS_QCLASS_CLIENT;
+    if ((msg->tx.cmd == GK_AMC2MDS_REQ || msg->tx.cmd == GK_AMC2MDS_EXT) &&
+        GK_IS_AMC(msg->tx.ssite_id))
+        return MDS_QCLASS_AMC;
+    return MDS_QCLASS_CTRL;
+}
+
+/* __spool_partition() return the owner (or preferred) thread of this
+ * request, or -1 if it can be handled by any thread
+ */
+static inline
+int __spool_partition(struct xnet_msg *msg)
+{
+    struct gstring ns;
+    u64 hash;
+
+    if (__spool_class(msg) == MDS_QCLASS_CTRL)
+        return -1;
+    if (mds_msg_namespace(msg, &ns))
+        return -1;
+
+    hash = gk_hash_nsht(ns.start, ns.len);
+    if (spool_mgr.node)
+        return __spool_numa_partition(hash);
+
+    return hash % hmo.conf.spool_threads;
+}
+
+static int __spool_queue_init(struct spool_queue *q)
+{
+    int err;
+
+    err = lfq_init(&q->ring, hmo.conf.spool_ring);
+    if (err)
+        return err;
+    INIT_LIST_HEAD(&q->reqin);
+    xlock_init(&q->lock);
+    atomic64_set(&q->qd, 0);
+
+    return 0;
+}
+
+static void __spool_queue_destroy(struct spool_queue *q)
+{
+    lfq_destroy(&q->ring);
+}
+
+static int __spool_thread_init(struct spool_thread *st)
+{
+    int err, i;
+
+    for (i = 0; i < SPOOL_CCLASS_NR; i++) {
+        err = __spool_queue_init(&st->pin[i]);
+        if (err)
+            goto out_clean;
+        err = __spool_queue_init(&st->work[i]);
+        if (err) {
+            __spool_queue_destroy(&st->pin[i]);
+            goto out_clean;
+        }
+        st->credit[i] = 0;
+    }
+    sem_init(&st->sem, 0, 0);
+    atomic_set(&st->sleepers, 0);
+    st->cur = 0;
+    st->handled = 0;
+    atomic64_set(&st->bword, 0);
+
+    return 0;
+out_clean:
+    while (--i >= 0) {
+        __spool_queue_destroy(&st->work[i]);
+        __spool_queue_destroy(&st->pin[i]);
+    }
+    return err;
+}
+
+static void __spool_thread_destroy(struct spool_thread *st)
+{
+    int i;
+
+    sem_destroy(&st->sem);
+    for (i = 0; i < SPOOL_CCLASS_NR; i++) {
+        __spool_queue_destroy(&st->work[i]);
+        __spool_queue_destroy(&st->pin[i]);
+    }
+}
+
+static inline
+u64 __spool_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* __spool_qtime() account the queue time of a request leaving the queues
+ */
+static inline
+void __spool_qtime(struct xnet_msg *msg)
+{
+    struct mds_qclass_prof *qp = &hmo.prof.misc.qclass[__spool_class(msg)];
+    s64 t = __spool_now() - msg->qts, max;
+
+    if (t < 0)
+        t = 0;
+    atomic64_inc(&qp->nr);
+    atomic64_add(t, &qp->qtime);
+    max = atomic64_read(&qp->qtime_max);
+    while (t > max) {
+        if (__sync_bool_compare_and_swap(&qp->qtime_max.counter, max, t))
+            break;
+        max = atomic64_read(&qp->qtime_max);
+    }
+}
+
+static inline
+struct spool_client *__spool_client(struct xnet_msg *msg)
+{
+    return &spool_mgr.client[(msg->tx.ssite_id * 0x9e3779b97f4a7c15UL) >>
+                             (64 - 12)];
+}
+
+/* __spool_admit_in() and __spool_admit_out() account a client request
+ * entering and leaving the queues
+ */
+static inline
+void __spool_admit_in(struct xnet_msg *msg)
+{
+    if (!spool_mgr.client)
+        return;
+    if (atomic_inc_return(&__spool_client(msg)->inflight) == 1)
+        atomic_inc(&spool_mgr.active);
+    atomic_inc(&spool_mgr.client_qd);
+}
+
+static inline
+void __spool_admit_out(struct xnet_msg *msg)
+{
+    if (!spool_mgr.client || __spool_class(msg) == MDS_QCLASS_CTRL)
+        return;
+    if (atomic_dec_return(&__spool_client(msg)->inflight) == 0)
+        atomic_dec(&spool_mgr.active);
+    atomic_dec(&spool_mgr.client_qd);
+}
+
+/* __spool_admit() return 0 to admit the client request, or the retry hint
+ * in us
+ */
+static inline
+u64 __spool_admit(struct xnet_msg *msg)
+{
+    struct spool_client *sc;
+    u64 now, wait = 0;
+    int active, share, inflight;
+
+    if (!spool_mgr.client || __spool_class(msg) == MDS_QCLASS_CTRL)
+        return 0;
+    sc = __spool_client(msg);
+
+    if (hmo.conf.spool_admit_qd > 0 &&
+        atomic_read(&spool_mgr.client_qd) >= hmo.conf.spool_admit_qd) {
+        active = max(1, atomic_read(&spool_mgr.active));
+        share = max(1, hmo.conf.spool_admit_qd / active);
+        inflight = atomic_read(&sc->inflight);
+        if (inflight >= share) {
+            /* the further over its share, the longer it backs off */
+            wait = max((u64)1000, spool_mgr.qwait) * inflight / share;
+            return min((u64)100000, wait);
+        }
+    }
+
+    if (hmo.conf.spool_client_rate > 0) {
+        now = __spool_now();
+        xlock_lock(&sc->lock);
+        if (!sc->last)
+            sc->tokens = hmo.conf.spool_client_burst;
+        else
+            sc->tokens += (double)(now - sc->last) *
+                hmo.conf.spool_client_rate / 1000000;
+        if (sc->tokens > hmo.conf.spool_client_burst)
+            sc->tokens = hmo.conf.spool_client_burst;
+        sc->last = now;
+        if (sc->tokens < 1.0) {
+            /* hand out distinct retry times, one token interval apart,
+             * thus the retries do not collide on the next token */
+            wait = (1.0 - sc->tokens) * 1000000 /
+                hmo.conf.spool_client_rate + 1;
+            if (sc->next < now + wait)
+                sc->next = now + wait;
+            wait = sc->next - now;
+            sc->next += 1000000 / hmo.conf.spool_client_rate;
+        } else
+            sc->tokens -= 1.0;
+        xlock_unlock(&sc->lock);
+    }
+
+    return wait;
+}
+
+static inline
+void __spool_queue_add(struct spool_queue *q, struct xnet_msg *msg)
+{
+    /* do not pass the ones in the overflow list */
+    if (unlikely(!list_empty(&q->reqin)) || unlikely(lfq_enqueue(&q->ring,
+                                                                 msg))) {
+        xlock_lock(&q->lock);
+        list_add_tail(&msg->list, &q->reqin);
+        xlock_unlock(&q->lock);
+    }
+    atomic64_inc(&q->qd);
+}
+
+/* __spool_queue_get() pop a batch of up to @nr requests
+ */
+static inline
+int __spool_queue_get(struct spool_queue *q, struct xnet_msg **msgs, int nr)
+{
+    struct xnet_msg *pos, *n;
+    int i;
+
+    i = lfq_dequeue_batch(&q->ring, (void **)msgs, nr);
+    if (i < nr && unlikely(!list_empty(&q->reqin))) {
+        xlock_lock(&q->lock);
+        list_for_each_entry_safe(pos, n, &q->reqin, list) {
+            list_del_init(&pos->list);
+            msgs[i++] = pos;
+            if (i == nr)
+                break;
+        }
+        xlock_unlock(&q->lock);
+    }
+    if (i)
+        atomic64_sub(i, &q->qd);
+
+    return i;
+}
+
+static inline
+int __spool_queue_empty(struct spool_queue *q)
+{
+    return lfq_empty(&q->ring) && list_empty(&q->reqin);
+}
+
+/* __spool_wake() wake up the thread if it is sleeping, return 1 if the
+ * semaphore is posted
+ */
+static inline
+int __spool_wake(struct spool_thread *st)
+{
+    /* pairs w/ the barrier in __spool_idle() */
+    __sync_synchronize();
+    if (atomic_read(&st->sleepers) > 0 &&
+        atomic_dec_if_positive(&st->sleepers) >= 0) {
+        atomic64_inc(&hmo.prof.misc.reqin_wakeup);
+        sem_post(&st->sem);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* __spool_pick() return a sleeping thread from @rr on, or @rr
+ */
+static inline
+int __spool_pick(u32 rr)
+{
+    int i, t;
+
+    for (i = 0; i < hmo.conf.spool_threads; i++) {
+        t = (rr + i) % hmo.conf.spool_threads;
+        if (atomic_read(&spool_mgr.st[t].sleepers) > 0)
+            return t;
+    }
+
+    return rr % hmo.conf.spool_threads;
+}
+
+static inline
+void __spool_enqueue(struct xnet_msg *msg, int sempost)
+{
+    u32 rr;
+    int p = -1, i, c, nr;
+
+    msg->qts = __spool_now();
+    c = __spool_class(msg);
+    if (c == MDS_QCLASS_CTRL) {
+        __spool_queue_add(&spool_mgr.ctrl, msg);
+        if (!sempost)
+            return;
+        rr = atomic_inc_return(&spool_mgr.rr);
+        p = __spool_pick(rr);
+        if (__spool_wake(&spool_mgr.st[p]))
+            return;
+        nr = atomic_read(&spool_mgr.hwm);
+        for (i = hmo.conf.spool_threads; i < nr; i++) {
+            if (__spool_wake(&spool_mgr.st[i]))
+                break;
+        }
+        return;
+    }
+    c--;
+    __spool_admit_in(msg);
+
+    if (spool_mgr.partition)
+        p = __spool_partition(msg);
+    if (p >= 0) {
+        __spool_queue_add(&spool_mgr.st[p].pin[c], msg);
+        if (sempost)
+            __spool_wake(&spool_mgr.st[p]);
+        return;
+    }
+
+    if (spool_mgr.affinity) {
+        p = __spool_partition(msg);
+        if (p >= 0) {
+            if (atomic64_read(&spool_mgr.st[p].work[c].qd) <
+                hmo.conf.spool_affinity_qd) {
+                atomic64_inc(&hmo.prof.misc.aff_local);
+                goto queue;
+            }
+            atomic64_inc(&hmo.prof.misc.aff_overflow);
+        }
+    }
+
+    rr = atomic_inc_return(&spool_mgr.rr);
+    p = sempost ? __spool_pick(rr) : rr % hmo.conf.spool_threads;
+queue:
+    __spool_queue_add(&spool_mgr.st[p].work[c], msg);
+    if (!sempost || __spool_wake(&spool_mgr.st[p]))
+        return;
+    /* the owner is busy, wake a thief (or a helper) if any */
+    nr = atomic_read(&spool_mgr.hwm);
+    for (i = 1; i < nr; i++) {
+        if (__spool_wake(&spool_mgr.st[(p + i) % nr]))
+            break;
+    }
+}
+
 int mds_spool_dispatch(struct xnet_msg *msg)
 {
-    xlock_lock(&spool_mgr.rin_lock);
-    list_add_tail(&msg->list, &spool_mgr.reqin);
-    xlock_unlock(&spool_mgr.rin_lock);
+    u64 retry;
+
     atomic64_inc(&hmo.prof.misc.reqin_total);
-    atomic64_inc(&hmo.prof.misc.reqin_qd);
-    sem_post(&spool_mgr.rin_sem);
+    /* serve a forwarded request as the client request it wraps, so that it
+     * is classified, admitted and pinned like that one */
+    if (msg->tx.cmd == GK_MDS2MDS_FWREQ && GK_IS_MDS(msg->tx.ssite_id)) {
+        if (unlikely(mds_fwreq_unwrap(msg))) {
+            xnet_free_msg(msg);
+            return 0;
+        }
+    }
+    msg->deadline = 0;
+    if (msg->tx.flag & XNET_DEADLINE)
+        msg->deadline = __spool_now() + (u64)(u32)msg->tx.err * 1000;
+    retry = __spool_admit(msg);
+    if (unlikely(retry)) {
+        atomic64_inc(&hmo.prof.misc.reqin_busy);
+        mds_fe_reject(msg, -EBUSY, retry);
+        return 0;
+    }
+    if ((hmo.conf.option & GK_MDS_INLINE) &&
+        msg->tx.cmd == GK_CLT2MDS_GET &&
+        __spool_class(msg) == MDS_QCLASS_CLIENT &&
+        hmo.state == HMO_STATE_RUNNING &&
+        !(hmo.reqin_drop | hmo.reqin_pause)) {
+        if (!mds_do_get_inline(msg)) {
+            atomic64_inc(&hmo.prof.misc.reqin_inline);
+            return 0;
+        }
+    }
+    __spool_enqueue(msg, 1);
 
     return 0;
 }
 
 void mds_spool_redispatch(struct xnet_msg *msg, int sempost)
 {
-    xlock_lock(&spool_mgr.rin_lock);
-    list_add_tail(&msg->list, &spool_mgr.reqin);
-    xlock_unlock(&spool_mgr.rin_lock);
-    atomic64_inc(&hmo.prof.misc.reqin_qd);
-    if (sempost)
-        sem_post(&spool_mgr.rin_sem);
+    __spool_enqueue(msg, sempost);
+}
+
+/* mds_spool_budget() return the budget left to the request in ms, at
+ * least 1 for a request not expired yet, to pass it on w/ XNET_DEADLINE
+ */
+u32 mds_spool_budget(struct xnet_msg *msg)
+{
+    u64 now;
+
+    if (!msg->deadline)
+        return (u32)msg->tx.err;
+    now = __spool_now();
+    if (now >= msg->deadline)
+        return 1;
+
+    return max(1UL, (msg->deadline - now) / 1000);
+}
+
+/* mds_spool_expired() return true if the client of the request being
+ * served has given up, the caller should answer -ETIMEDOUT w/o doing
+ * the (blocking) work
+ */
+int mds_spool_expired(void)
+{
+    if (likely(!spool_deadline) || __spool_now() <= spool_deadline)
+        return 0;
+    atomic64_inc(&hmo.prof.misc.reqin_expired);
+
+    return 1;
+}
+
+/* mds_spool_prof_sync() fold the per-thread counters into the global
+ * profile, called by the profiling dumper.
+ */
+/* __spool_qd() return the # of queued requests
+ */
+static inline
+u64 __spool_qd(void)
+{
+    u64 qd;
+    int i, c;
+
+    qd = atomic64_read(&spool_mgr.ctrl.qd);
+    for (i = 0; spool_mgr.st && i < hmo.conf.spool_threads; i++) {
+        for (c = 0; c < SPOOL_CCLASS_NR; c++) {
+            qd += atomic64_read(&spool_mgr.st[i].pin[c].qd) +
+                atomic64_read(&spool_mgr.st[i].work[c].qd);
+        }
+    }
+
+    return qd;
+}
+
+void mds_spool_prof_sync(void)
+{
+    u64 qd, handled = 0, tqd;
+    int i, c;
+
+    if (!spool_mgr.st)
+        return;
+    qd = atomic64_read(&spool_mgr.ctrl.qd);
+    for (i = 0; i < hmo.conf.spool_threads; i++) {
+        tqd = 0;
+        for (c = 0; c < SPOOL_CCLASS_NR; c++) {
+            tqd += atomic64_read(&spool_mgr.st[i].pin[c].qd) +
+                atomic64_read(&spool_mgr.st[i].work[c].qd);
+        }
+        atomic64_set(&hmo.prof.misc.spool[i].qd, tqd);
+        qd += tqd;
+        handled += spool_mgr.st[i].handled;
+    }
+    atomic64_set(&hmo.prof.misc.reqin_qd, qd);
+    atomic64_set(&hmo.prof.misc.reqin_handle, handled);
+}
+
+/* mds_spool_numa_sample() account an access to the stored data at @addr
+ * by the calling thread, local or remote to its node
+ */
+void mds_spool_numa_sample(void *addr)
+{
+    static __thread u32 tick;
+    int node;
+
+    if (!spool_mgr.node || spool_node_idx < 0 ||
+        (++tick & (SPOOL_NUMA_SAMPLE - 1)))
+        return;
+    node = numa_addr_node(addr);
+    if (node < 0)
+        return;
+    if (node == spool_mgr.topo.id[spool_node_idx])
+        atomic64_inc(&spool_mgr.node[spool_node_idx].local);
+    else
+        atomic64_inc(&spool_mgr.node[spool_node_idx].remote);
+}
+
+/* mds_spool_numa_dump() log the throughput and the remote access ratio
+ * of each node, @interval is seconds since the last call
+ */
+void mds_spool_numa_dump(int interval)
+{
+    struct spool_node *sn;
+    u64 handled, local, remote;
+    int i, j;
+
+    if (!spool_mgr.node || interval <= 0)
+        return;
+    for (i = 0; i < spool_mgr.topo.nr; i++) {
+        sn = &spool_mgr.node[i];
+        handled = 0;
+        for (j = i; j < hmo.conf.spool_threads; j += spool_mgr.topo.nr)
+            handled += spool_mgr.st[j].handled;
+        local = atomic64_read(&sn->local);
+        remote = atomic64_read(&sn->remote);
+        gk_info(mds, "numa node %d: %.1f req/s, sampled local=%ld "
+                "remote=%ld (%.2f%% remote)\n", spool_mgr.topo.id[i],
+                (double)(handled - sn->last_handled) / interval,
+                local, remote,
+                (local + remote) ? remote * 100.0 / (local + remote) : 0.0);
+        sn->last_handled = handled;
+    }
 }
 
 int mds_spool_modify_pause(struct xnet_msg *msg)
@@ -79,9 +732,15 @@ int mds_spool_modify_pause(struct xnet_msg *msg)
     return 0;
 }
 
+static inline
+void __spool_kick(int tid)
+{
+    __spool_wake(&spool_mgr.st[tid]);
+}
+
 void mds_spool_provoke(void)
 {
-    sem_post(&spool_mgr.rin_sem);
+    __spool_kick(0);
 }
 
 static inline
@@ -90,7 +749,7 @@ void mds_spool_modify_resume(void)
     int i;
 
     for (i = 0; i < hmo.conf.spool_threads; i++) {
-        sem_post(&spool_mgr.rin_sem);
+        __spool_kick(i);
     }
 }
 
@@ -101,8 +760,329 @@ void mds_spool_mp_check(time_t t)
 {
 }
 
+/* __spool_victim() return the thread w/ the longest work queue other
+ * than @tid and the queue in @q, or -1 if there is nothing to steal
+ */
+static inline
+int __spool_victim(int tid, struct spool_queue **q, s64 *qd)
+{
+    s64 max = 0, n;
+    int i, c, t, v = -1;
+
+    for (i = 0; i < hmo.conf.spool_threads; i++) {
+        t = (tid + i) % hmo.conf.spool_threads;
+        if (t == tid)
+            continue;
+        for (c = 0; c < SPOOL_CCLASS_NR; c++) {
+            n = atomic64_read(&spool_mgr.st[t].work[c].qd);
+            if (n > max) {
+                max = n;
+                v = t;
+                *q = &spool_mgr.st[t].work[c];
+            }
+        }
+    }
+    *qd = max;
+
+    return v;
+}
+
+#define SPOOL_BW_NEXT(w)        ((w) & 0xffff)
+#define SPOOL_BW_NR(w)          (((w) >> 16) & 0xffff)
+#define SPOOL_BW_PIN            (1UL << 32)
+#define SPOOL_BW_GEN_SHIFT      33
+
+/* __spool_batch_claim() claim the next request of the batch of @st, or
+ * return NULL. The owner and the thieves claim by cmpxchg of @bword, and
+ * the owner refills only after all are claimed, w/ a new generation, thus
+ * a request is never claimed twice. A thief (!@owner) never claims from a
+ * batch popped from a pin queue, the pin bit is checked in the same word.
+ */
+static inline
+struct xnet_msg *__spool_batch_claim(struct spool_thread *st, int owner)
+{
+    struct xnet_msg *msg;
+    long w;
+
+    do {
+        w = atomic64_read(&st->bword);
+        if (SPOOL_BW_NEXT(w) >= SPOOL_BW_NR(w))
+            return NULL;
+        if (!owner && (w & SPOOL_BW_PIN))
+            return NULL;
+        msg = st->batch[SPOOL_BW_NEXT(w)];
+    } while (cmpxchg(&st->bword.counter, w, w + 1) != w);
+
+    return msg;
+}
+
+/* __spool_batch_set() publish the @n requests just popped to the batch
+ */
+static inline
+void __spool_batch_set(struct spool_thread *st, int n, int pin)
+{
+    long w = atomic64_read(&st->bword);
+
+    /* the requests are stored before the word is published */
+    __sync_synchronize();
+    atomic64_set(&st->bword,
+                 (((w >> SPOOL_BW_GEN_SHIFT) + 1) << SPOOL_BW_GEN_SHIFT) |
+                 (pin ? SPOOL_BW_PIN : 0) | ((long)n << 16));
+}
+
+/* __spool_batch_left() return the # of requests of the batch of @st left
+ * to claim, always 0 to a thief (!@owner) of a pinned batch
+ */
+static inline
+int __spool_batch_left(struct spool_thread *st, int owner)
+{
+    long w = atomic64_read(&st->bword);
+
+    if (!owner && (w & SPOOL_BW_PIN))
+        return 0;
+
+    return SPOOL_BW_NR(w) - SPOOL_BW_NEXT(w);
+}
+
+/* __spool_batch_steal() claim a request from the batch of another thread,
+ * which may be blocked w/ the rest of it
+ */
+static inline
+struct xnet_msg *__spool_batch_steal(int tid)
+{
+    struct spool_thread *st;
+    struct xnet_msg *msg;
+    int i, t, nr = atomic_read(&spool_mgr.hwm);
+
+    for (i = 1; i < nr; i++) {
+        t = (tid + i) % nr;
+        st = &spool_mgr.st[t];
+        if (!__spool_batch_left(st, 0))
+            continue;
+        msg = __spool_batch_claim(st, 0);
+        if (msg) {
+            atomic64_inc(&hmo.prof.misc.spool[tid].steal);
+            return msg;
+        }
+    }
+
+    return NULL;
+}
+
+/* __spool_steal() take half of the victim's work queue, up to a batch
+ */
+static inline
+int __spool_steal(int tid)
+{
+    struct spool_queue *q;
+    s64 qd;
+    int n;
+
+    if (__spool_victim(tid, &q, &qd) < 0)
+        return 0;
+    n = __spool_queue_get(q, spool_mgr.st[tid].batch,
+                          (int)min((s64)SPOOL_BATCH, (qd + 1) / 2));
+    if (n) {
+        atomic64_add(n, &hmo.prof.misc.spool[tid].steal);
+        atomic64_inc(&hmo.prof.misc.spool[tid].steal_batch);
+    }
+
+    return n;
+}
+
+/* __spool_refill() pop a batch of the client classes in deficit round
+ * robin, a class w/o requests loses its credit
+ */
+static inline
+int __spool_refill(struct spool_thread *st, int *pin)
+{
+    int i, c, n;
+
+    for (i = 0; i <= SPOOL_CCLASS_NR; i++) {
+        c = st->cur;
+        if (st->credit[c] > 0) {
+            *pin = 1;
+            n = __spool_queue_get(&st->pin[c], st->batch,
+                                  min(SPOOL_BATCH, st->credit[c]));
+            if (!n) {
+                *pin = 0;
+                n = __spool_queue_get(&st->work[c], st->batch,
+                                      min(SPOOL_BATCH, st->credit[c]));
+            }
+            if (n) {
+                st->credit[c] -= n;
+                return n;
+            }
+        }
+        st->cur = (c + 1) % SPOOL_CCLASS_NR;
+        st->credit[st->cur] = spool_mgr.quantum[st->cur];
+    }
+
+    return 0;
+}
+
+/* __spool_dequeue() fetch the next request: the control plane first,
+ * then the batch of this thread, refill it from the own queues first,
+ * then steal
+ */
+static inline
+struct xnet_msg *__spool_dequeue(int tid)
+{
+    struct spool_thread *st = &spool_mgr.st[tid];
+    struct xnet_msg *msg;
+    int n, pin = 0;
+
+    if (unlikely(!__spool_queue_empty(&spool_mgr.ctrl))) {
+        if (__spool_queue_get(&spool_mgr.ctrl, &msg, 1)) {
+            st->handled++;
+            goto out;
+        }
+    }
+
+    msg = __spool_batch_claim(st, 1);
+    if (msg)
+        goto out;
+
+    n = tid < hmo.conf.spool_threads ? __spool_refill(st, &pin) : 0;
+    if (!n) {
+        pin = 0;
+        n = __spool_steal(tid);
+    }
+    if (!n) {
+        msg = __spool_batch_steal(tid);
+        if (!msg)
+            return NULL;
+        st->handled++;
+        goto out;
+    }
+    st->handled += n;
+    atomic64_inc(&hmo.prof.misc.reqin_batch);
+    __spool_batch_set(st, n, pin);
+    msg = __spool_batch_claim(st, 1);
+    if (!msg)
+        /* all stolen already */
+        return NULL;
+out:
+    __spool_qtime(msg);
+    __spool_admit_out(msg);
+    return msg;
+}
+
+/* __spool_pending() return true if this thread has work to do, including
+ * the work it can steal
+ */
+static inline
+int __spool_pending(int tid)
+{
+    struct spool_thread *st = &spool_mgr.st[tid];
+    struct spool_queue *q;
+    s64 qd;
+    int c, t, nr = atomic_read(&spool_mgr.hwm);
+
+    if (__spool_batch_left(st, 1))
+        return 1;
+    for (t = 0; t < nr; t++) {
+        if (t != tid && __spool_batch_left(&spool_mgr.st[t], 0))
+            return 1;
+    }
+    if (!__spool_queue_empty(&spool_mgr.ctrl))
+        return 1;
+    for (c = 0; tid < hmo.conf.spool_threads && c < SPOOL_CCLASS_NR; c++) {
+        if (!__spool_queue_empty(&st->pin[c]) ||
+            !__spool_queue_empty(&st->work[c]))
+            return 1;
+    }
+    if (__spool_victim(tid, &q, &qd) >= 0)
+        return 1;
+    if (!hmo.spool_modify_pause && !list_empty(&spool_mgr.modify_req))
+        return 1;
+    if (!hmo.reqin_pause && !list_empty(&spool_mgr.paused_req))
+        return 1;
+
+    return 0;
+}
+
+/* __spool_helper_retire() return 1 if the helper @tid should retire,
+ * @idle is true if it has been idle for spool_idle_to seconds
+ */
+static inline
+int __spool_helper_retire(int tid, int idle)
+{
+    int nr;
+
+    if (tid < hmo.conf.spool_threads || hmo.spool_thread_stop)
+        return 0;
+    do {
+        nr = atomic_read(&spool_mgr.nr);
+        if (nr <= hmo.conf.spool_min)
+            return 0;
+        if (!idle && nr <= hmo.conf.spool_max)
+            return 0;
+    } while (__sync_val_compare_and_swap(&spool_mgr.nr.counter, nr,
+                                          nr - 1) != nr);
+    atomic64_inc(&hmo.prof.misc.spool_retire);
+
+    return 1;
+}
+
+/* __spool_idle() sleep until there is something to do, return 1 if the
+ * helper thread retires
+ */
+static inline
+int __spool_idle(int tid)
+{
+    struct spool_thread *st = &spool_mgr.st[tid];
+    struct timespec ts;
+
+    atomic_inc(&st->sleepers);
+    /* pairs w/ the barrier in __spool_wake() */
+    __sync_synchronize();
+    if (__spool_pending(tid) || hmo.spool_thread_stop) {
+        /* retract the token, or eat the post bound to it */
+        if (atomic_dec_if_positive(&st->sleepers) < 0)
+            sem_wait(&st->sem);
+        if (hmo.state < HMO_STATE_RUNNING) {
+            /* requests are requeued until we are running, do not spin */
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 10 * 1000 * 1000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            atomic_inc(&st->sleepers);
+            __sync_synchronize();
+            if (sem_timedwait(&st->sem, &ts) &&
+                atomic_dec_if_positive(&st->sleepers) < 0)
+                sem_wait(&st->sem);
+        }
+        return 0;
+    }
+    if (tid < hmo.conf.spool_threads) {
+        sem_wait(&st->sem);
+        return 0;
+    }
+
+    /* helpers sleep w/ a timeout, then retire */
+    if (__spool_helper_retire(tid, 0))
+        goto retire;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += hmo.conf.spool_idle_to;
+    if (!sem_timedwait(&st->sem, &ts))
+        return 0;
+    if (!__spool_helper_retire(tid, 1)) {
+        if (atomic_dec_if_positive(&st->sleepers) < 0)
+            sem_wait(&st->sem);
+        return 0;
+    }
+retire:
+    /* the request bound to a taken token stays in the (stealable) queues */
+    if (atomic_dec_if_positive(&st->sleepers) < 0)
+        sem_wait(&st->sem);
+    return 1;
+}
+
 static inline
-int __serv_request(void)
+int __serv_request(int tid)
 {
     struct xnet_msg *msg = NULL, *pos, *n;
 
@@ -117,54 +1097,67 @@ int __serv_request(void)
             xlock_unlock(&spool_mgr.pmreq_lock);
             if (msg) {
                 atomic64_dec(&hmo.prof.misc.reqin_qd);
+                spool_deadline = msg->deadline;
                 return msg->xc->ops.dispatcher(msg);
             }
         }
     }
     if (likely(!hmo.reqin_pause)) {
         if (unlikely(!list_empty(&spool_mgr.paused_req))) {
+            LIST_HEAD(paused);
+
             xlock_lock(&spool_mgr.rin_lock);
-            list_splice_init(&spool_mgr.paused_req, &spool_mgr.reqin);
+            list_splice_init(&spool_mgr.paused_req, &paused);
+            atomic_set(&spool_mgr.paused_nr, 0);
             xlock_unlock(&spool_mgr.rin_lock);
+            /* route them back to the owner partitions */
+            list_for_each_entry_safe(pos, n, &paused, list) {
+                list_del_init(&pos->list);
+                __spool_enqueue(pos, 1);
+            }
         }
     }
     
-    xlock_lock(&spool_mgr.rin_lock);
-    list_for_each_entry_safe(pos, n, &spool_mgr.reqin, list) {
-        list_del_init(&pos->list);
-        msg = pos;
-        break;
-    }
-    xlock_unlock(&spool_mgr.rin_lock);
-
+    msg = __spool_dequeue(tid);
     if (!msg)
         return -EHSTOP;
+    if (unlikely(msg->deadline) && __spool_now() > msg->deadline) {
+        atomic64_inc(&hmo.prof.misc.reqin_expired);
+        mds_fe_reject(msg, -ETIMEDOUT, 0);
+        return 0;
+    }
+    spool_deadline = msg->deadline;
 
     /* ok, deal with it, we just calling the secondary dispatcher */
     /* NOTE: important!
      *
-     * reqin_pause will aggr many incoming request, if we have 256 or more
-     * requests pending, we begin dropping request. Thus, it is important to
+     * reqin_pause will aggr many incoming request, if we have
+     * spool_paused_max or more requests pending, we begin dropping
+     * request. Thus, it is important to
      * place hmo.reqin_drop branch BEFORE hmo.reqin_pause!
      */
     if (likely(!(hmo.reqin_drop | hmo.reqin_pause))) {
     dispatch:
-        atomic64_dec(&hmo.prof.misc.reqin_qd);
-        atomic64_inc(&hmo.prof.misc.reqin_handle);
         return msg->xc->ops.dispatcher(msg);
     } else if (hmo.reqin_drop) {
-        if (GK_IS_CLIENT(msg->tx.ssite_id) ||
-            GK_IS_AMC(msg->tx.ssite_id)) {
+        if (__spool_class(msg) != MDS_QCLASS_CTRL) {
+            /* tell the client to back off rather than let it time out */
             atomic64_inc(&hmo.prof.misc.reqin_drop);
-            xnet_free_msg(msg);
+            atomic64_inc(&hmo.prof.misc.reqin_busy);
+            mds_fe_reject(msg, -EBUSY, 100000);
         } else {
             goto dispatch;
         }
     } else if (hmo.reqin_pause) {
         /* we should iterate on reqin list to drain R2 messages! */
-        if (GK_IS_CLIENT(msg->tx.ssite_id) ||
-            GK_IS_AMC(msg->tx.ssite_id)) {
-            if (atomic64_read(&hmo.prof.misc.reqin_qd) > 256) {
+        if (__spool_class(msg) != MDS_QCLASS_CTRL) {
+            u64 paused = atomic_inc_return(&spool_mgr.paused_nr);
+
+            /* the partitions bound the paused requests only, otherwise
+             * count the queued ones too, as the shared reqin did */
+            if (!(hmo.conf.option & GK_MDS_PARTITION))
+                paused += __spool_qd();
+            if (paused > hmo.conf.spool_paused_max) {
                 hmo.reqin_drop = 1;
             }
             /* re-insert this request to paused req list */
@@ -193,16 +1186,21 @@ void *spool_main(void *arg)
     sigaddset(&set, SIGCHLD);
     pthread_sigmask(SIG_BLOCK, &set, NULL); /* oh, we do not care about the
                                              * errs */
+    if (sta->node >= 0) {
+        err = numa_topo_bind(&spool_mgr.topo, sta->node);
+        if (err)
+            gk_warning(mds, "Service thread %d stays unbound w/ %d\n",
+                       sta->tid, err);
+        else
+            spool_node_idx = sta->node;
+    }
     
     while (!hmo.spool_thread_stop) {
-        err = sem_wait(&spool_mgr.rin_sem);
-        if (err == EINTR)
-            continue;
-        gk_debug(mds, "Service thread %d wakeup to handle the requests.\n",
-                   sta->tid);
-        /* trying to handle more and more requsts. */
-        while (1) {
-            err = __serv_request();
+        /* trying to handle more and more requsts, there is no wakeup for
+         * the requests queued while we are busy, thus __spool_idle()
+         * re-checks the queues before sleeping */
+        while (!hmo.spool_thread_stop) {
+            err = __serv_request(sta->tid);
             if (err == -EHSTOP)
                 break;
             else if (err) {
@@ -211,50 +1209,326 @@ void *spool_main(void *arg)
                 break;
             }
         }
+        if (hmo.spool_thread_stop)
+            break;
+        if (__spool_idle(sta->tid)) {
+            gk_debug(mds, "Service thread %d retires.\n", sta->tid);
+            break;
+        }
+        gk_debug(mds, "Service thread %d wakeup to handle the requests.\n",
+                   sta->tid);
     }
     nse = (struct ns_entry *)pthread_getspecific(spool_key);
     if (nse) {
         kvs_ns_put(nse);
     }
+    if (sta->tid >= hmo.conf.spool_threads) {
+        /* pairs w/ the barrier in __spool_reap() */
+        __sync_synchronize();
+        spool_mgr.st[sta->tid].state = SPOOL_SLOT_EXIT;
+    }
 
     pthread_exit(0);
 }
 
+/* __spool_spawn() start a helper thread in a free slot
+ */
+static int __spool_spawn(void)
+{
+    struct spool_thread *st;
+    int i, err;
+
+    for (i = hmo.conf.spool_threads; i < spool_mgr.nr_slot; i++) {
+        if (spool_mgr.st[i].state == SPOOL_SLOT_FREE)
+            break;
+    }
+    if (i >= spool_mgr.nr_slot)
+        return -EBUSY;
+
+    st = &spool_mgr.st[i];
+    atomic_set(&st->sleepers, 0);
+    atomic64_set(&st->bword, 0);
+    st->state = SPOOL_SLOT_RUN;
+    if (i + 1 > atomic_read(&spool_mgr.hwm))
+        atomic_set(&spool_mgr.hwm, i + 1);
+    atomic_inc(&spool_mgr.nr);
+    spool_mgr.sta[i].tid = i;
+    spool_mgr.sta[i].node = spool_mgr.node ? i % spool_mgr.topo.nr : -1;
+    err = pthread_create(hmo.spool_thread + i, NULL, &spool_main,
+                         spool_mgr.sta + i);
+    if (err) {
+        gk_err(mds, "create helper thread %d failed w/ %d\n", i, err);
+        atomic_dec(&spool_mgr.nr);
+        st->state = SPOOL_SLOT_FREE;
+        return -err;
+    }
+    atomic64_inc(&hmo.prof.misc.spool_grow);
+    gk_debug(mds, "Start helper thread %d, %d threads now\n", i,
+             atomic_read(&spool_mgr.nr));
+
+    return 0;
+}
+
+/* __spool_reap() join the retired helpers and free their slots
+ */
+static void __spool_reap(void)
+{
+    int i, hwm = hmo.conf.spool_threads;
+
+    for (i = hmo.conf.spool_threads; i < spool_mgr.nr_slot; i++) {
+        if (spool_mgr.st[i].state == SPOOL_SLOT_EXIT) {
+            /* pairs w/ the barrier in spool_main() */
+            __sync_synchronize();
+            pthread_join(*(hmo.spool_thread + i), NULL);
+            spool_mgr.st[i].state = SPOOL_SLOT_FREE;
+        }
+        if (spool_mgr.st[i].state != SPOOL_SLOT_FREE)
+            hwm = i + 1;
+    }
+    atomic_set(&spool_mgr.hwm, hwm);
+}
+
+/* mds_spool_adjust() resize the pool by the queue wait and the cpu usage
+ * of the last period, called by the timer thread
+ */
+void mds_spool_adjust(time_t t)
+{
+    struct rusage ru;
+    double cpu, util = 0.0;
+    u64 qnr = 0, qtime = 0, qwait = 0, prev;
+    s64 qd;
+    int i, c, nr, ncpu;
+
+    if (!spool_mgr.st || hmo.spool_thread_stop ||
+        t <= spool_mgr.last_adjust)
+        return;
+
+    xlock_lock(&spool_mgr.adjust_lock);
+    __spool_reap();
+
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+        memset(&ru, 0, sizeof(ru));
+    cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+    for (i = MDS_QCLASS_CLIENT; i < MDS_QCLASS_NR; i++) {
+        qnr += atomic64_read(&hmo.prof.misc.qclass[i].nr);
+        qtime += atomic64_read(&hmo.prof.misc.qclass[i].qtime);
+    }
+    qd = atomic64_read(&spool_mgr.ctrl.qd);
+    for (i = 0; i < hmo.conf.spool_threads; i++) {
+        for (c = 0; c < SPOOL_CCLASS_NR; c++) {
+            qd += atomic64_read(&spool_mgr.st[i].pin[c].qd) +
+                atomic64_read(&spool_mgr.st[i].work[c].qd);
+        }
+    }
+    if (!spool_mgr.last_adjust)
+        goto out_save;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 0)
+        ncpu = 1;
+    util = (cpu - spool_mgr.last_cpu) /
+        ((t - spool_mgr.last_adjust) * ncpu);
+    if (qnr > spool_mgr.last_qnr)
+        qwait = (qtime - spool_mgr.last_qtime) / (qnr - spool_mgr.last_qnr);
+    else if (qd > 0)
+        /* nothing dequeued, they have waited for the whole period */
+        qwait = (t - spool_mgr.last_adjust) * 1000000UL;
+    prev = spool_mgr.qwait;
+    spool_mgr.qwait = qwait;
+
+    nr = atomic_read(&spool_mgr.nr);
+    if (nr < hmo.conf.spool_min) {
+        for (; nr < hmo.conf.spool_min; nr++) {
+            if (__spool_spawn())
+                break;
+        }
+    } else if (nr < hmo.conf.spool_max &&
+               qwait > hmo.conf.spool_grow_us && qwait >= prev &&
+               util < 0.9) {
+        __spool_spawn();
+    }
+
+out_save:
+    spool_mgr.last_adjust = t;
+    spool_mgr.last_cpu = cpu;
+    spool_mgr.last_qnr = qnr;
+    spool_mgr.last_qtime = qtime;
+    atomic64_set(&hmo.prof.misc.spool_nr, atomic_read(&spool_mgr.nr));
+    atomic64_set(&hmo.prof.misc.spool_qwait, spool_mgr.qwait);
+    xlock_unlock(&spool_mgr.adjust_lock);
+}
+
+/* mds_spool_set_bounds() change the pool bounds at runtime, the base
+ * threads are the floor
+ */
+void mds_spool_set_bounds(int min, int max)
+{
+    if (min > 0)
+        hmo.conf.spool_min = min;
+    if (max > 0)
+        hmo.conf.spool_max = max;
+    if (hmo.conf.spool_min < hmo.conf.spool_threads)
+        hmo.conf.spool_min = hmo.conf.spool_threads;
+    if (hmo.conf.spool_max > spool_mgr.nr_slot)
+        hmo.conf.spool_max = spool_mgr.nr_slot;
+    if (hmo.conf.spool_max < hmo.conf.spool_min)
+        hmo.conf.spool_max = hmo.conf.spool_min;
+    gk_info(mds, "Spool pool bounds [%d, %d]\n", hmo.conf.spool_min,
+            hmo.conf.spool_max);
+}
+
 int mds_spool_create(void)
 {
     struct spool_thread_arg *sta;
     int i, err = 0;
     
+    /* init service threads' pool */
+    if (!hmo.conf.spool_threads)
+        hmo.conf.spool_threads = 4;
+    if (hmo.conf.spool_ring <= 0)
+        hmo.conf.spool_ring = 4096;
+    if (hmo.conf.spool_wrr_client <= 0)
+        hmo.conf.spool_wrr_client = 4;
+    if (hmo.conf.spool_wrr_amc <= 0)
+        hmo.conf.spool_wrr_amc = 1;
+    if (hmo.conf.spool_paused_max <= 0)
+        hmo.conf.spool_paused_max = 256;
+    if (hmo.conf.spool_affinity_qd <= 0)
+        hmo.conf.spool_affinity_qd = 64;
+    if (hmo.conf.spool_max <= 0)
+        hmo.conf.spool_max = hmo.conf.spool_threads * 2;
+    if (hmo.conf.spool_grow_us <= 0)
+        hmo.conf.spool_grow_us = 1000;
+    if (hmo.conf.spool_idle_to <= 0)
+        hmo.conf.spool_idle_to = 5;
+    if (hmo.conf.spool_client_burst <= 0)
+        hmo.conf.spool_client_burst = max(1, hmo.conf.spool_client_rate);
+    spool_mgr.quantum[MDS_QCLASS_CLIENT - 1] = hmo.conf.spool_wrr_client *
+        SPOOL_BATCH;
+    spool_mgr.quantum[MDS_QCLASS_AMC - 1] = hmo.conf.spool_wrr_amc *
+        SPOOL_BATCH;
+
     /* init the mgr struct */
-    INIT_LIST_HEAD(&spool_mgr.reqin);
+    err = __spool_queue_init(&spool_mgr.ctrl);
+    if (err) {
+        gk_err(mds, "init the ctrl queue failed w/ %d\n", err);
+        return err;
+    }
     INIT_LIST_HEAD(&spool_mgr.modify_req);
     INIT_LIST_HEAD(&spool_mgr.paused_req);
     xlock_init(&spool_mgr.rin_lock);
     xlock_init(&spool_mgr.pmreq_lock);
-    sem_init(&spool_mgr.rin_sem, 0, 0);
     hmo.spool_modify_pause = 0;
 
     pthread_key_create(&spool_key, NULL);
 
-    /* init service threads' pool */
-    if (!hmo.conf.spool_threads)
-        hmo.conf.spool_threads = 4;
-
-    hmo.spool_thread = xzalloc(hmo.conf.spool_threads * sizeof(pthread_t));
+    spool_mgr.nr_slot = hmo.conf.spool_threads + SPOOL_HELPER_MAX;
+    hmo.spool_thread = xzalloc(spool_mgr.nr_slot * sizeof(pthread_t));
     if (!hmo.spool_thread) {
         gk_err(mds, "xzalloc() pthread_t failed\n");
         return -ENOMEM;
     }
 
-    sta = xzalloc(hmo.conf.spool_threads * sizeof(struct spool_thread_arg));
+    if (hmo.conf.option & GK_MDS_NUMA) {
+        err = numa_topo_init(&spool_mgr.topo);
+        if (err) {
+            gk_err(mds, "numa topology init failed w/ %d\n", err);
+            goto out_free;
+        }
+        err = posix_memalign((void **)&spool_mgr.node, 64,
+                             spool_mgr.topo.nr * sizeof(struct spool_node));
+        if (err) {
+            gk_err(mds, "alloc numa node stats failed w/ %d\n", err);
+            numa_topo_destroy(&spool_mgr.topo);
+            spool_mgr.node = NULL;
+            err = -ENOMEM;
+            goto out_free;
+        }
+        memset(spool_mgr.node, 0,
+               spool_mgr.topo.nr * sizeof(struct spool_node));
+        /* homing namespaces needs the owner threads */
+        hmo.conf.option |= GK_MDS_PARTITION;
+        gk_info(mds, "Spool in NUMA mode w/ %d nodes\n", spool_mgr.topo.nr);
+    }
+
+    err = posix_memalign((void **)&spool_mgr.st, 64, spool_mgr.nr_slot *
+                         sizeof(struct spool_thread));
+    if (err) {
+        gk_err(mds, "alloc spool thread queues failed w/ %d\n", err);
+        spool_mgr.st = NULL;
+        err = -ENOMEM;
+        goto out_free;
+    }
+    memset(spool_mgr.st, 0, spool_mgr.nr_slot * sizeof(struct spool_thread));
+    for (i = 0; i < hmo.conf.spool_threads; i++) {
+        err = __spool_thread_init(&spool_mgr.st[i]);
+        if (err) {
+            gk_err(mds, "init spool thread %d queues failed w/ %d\n",
+                   i, err);
+            while (--i >= 0)
+                __spool_thread_destroy(&spool_mgr.st[i]);
+            goto out_free_st;
+        }
+        spool_mgr.st[i].state = SPOOL_SLOT_RUN;
+    }
+    for (; i < spool_mgr.nr_slot; i++) {
+        /* helpers own no queue */
+        sem_init(&spool_mgr.st[i].sem, 0, 0);
+        atomic_set(&spool_mgr.st[i].sleepers, 0);
+        spool_mgr.st[i].state = SPOOL_SLOT_FREE;
+        spool_mgr.st[i].handled = 0;
+        atomic64_set(&spool_mgr.st[i].bword, 0);
+    }
+    hmo.prof.misc.spool = xzalloc(spool_mgr.nr_slot *
+                                  sizeof(struct mds_spool_prof));
+    if (!hmo.prof.misc.spool) {
+        gk_err(mds, "xzalloc() spool thread prof failed\n");
+        for (i = 0; i < hmo.conf.spool_threads; i++)
+            __spool_thread_destroy(&spool_mgr.st[i]);
+        err = -ENOMEM;
+        goto out_free_st;
+    }
+    atomic_set(&spool_mgr.rr, 0);
+    if (hmo.conf.option & GK_MDS_PARTITION) {
+        spool_mgr.partition = 1;
+        gk_info(mds, "Spool in shared-nothing mode w/ %d partitions\n",
+                hmo.conf.spool_threads);
+    } else if (hmo.conf.option & GK_MDS_AFFINITY) {
+        spool_mgr.affinity = 1;
+        gk_info(mds, "Spool in namespace affinity mode, overflow at %d\n",
+                hmo.conf.spool_affinity_qd);
+    }
+    if (hmo.conf.spool_admit_qd > 0 || hmo.conf.spool_client_rate > 0) {
+        spool_mgr.client = xzalloc(SPOOL_CLIENT_SLOTS *
+                                   sizeof(struct spool_client));
+        if (!spool_mgr.client) {
+            /* not fatal, run w/o admission control */
+            gk_warning(mds, "xzalloc() admission slots failed\n");
+        } else {
+            for (i = 0; i < SPOOL_CLIENT_SLOTS; i++)
+                xlock_init(&spool_mgr.client[i].lock);
+            gk_info(mds, "Spool admission: fair share over %d queued, "
+                    "%d req/s per client\n", hmo.conf.spool_admit_qd,
+                    hmo.conf.spool_client_rate);
+        }
+    }
+
+    sta = xzalloc(spool_mgr.nr_slot * sizeof(struct spool_thread_arg));
     if (!sta) {
         gk_err(mds, "xzalloc() struct spool_thread_arg failed\n");
         err = -ENOMEM;
         goto out_free;
     }
+    spool_mgr.sta = sta;
+    atomic_set(&spool_mgr.nr, hmo.conf.spool_threads);
+    atomic_set(&spool_mgr.hwm, hmo.conf.spool_threads);
+    xlock_init(&spool_mgr.adjust_lock);
+    mds_spool_set_bounds(hmo.conf.spool_min, hmo.conf.spool_max);
 
     for (i = 0; i < hmo.conf.spool_threads; i++) {
         (sta + i)->tid = i;
+        (sta + i)->node = spool_mgr.node ? i % spool_mgr.topo.nr : -1;
         err = pthread_create(hmo.spool_thread + i, NULL, &spool_main,
                              sta + i);
         if (err)
@@ -263,6 +1537,9 @@ int mds_spool_create(void)
 
 out:
     return err;
+out_free_st:
+    free(spool_mgr.st);
+    spool_mgr.st = NULL;
 out_free:
     xfree(hmo.spool_thread);
     goto out;
@@ -273,11 +1550,31 @@ void mds_spool_destroy(void)
     int i;
 
     hmo.spool_thread_stop = 1;
-    for (i = 0; i < hmo.conf.spool_threads; i++) {
-        sem_post(&spool_mgr.rin_sem);
+    for (i = 0; i < spool_mgr.nr_slot; i++) {
+        /* post unconditionally, the sleeper tokens do not matter now */
+        if (spool_mgr.st[i].state != SPOOL_SLOT_FREE)
+            sem_post(&spool_mgr.st[i].sem);
+    }
+    for (i = 0; i < spool_mgr.nr_slot; i++) {
+        if (spool_mgr.st[i].state != SPOOL_SLOT_FREE)
+            pthread_join(*(hmo.spool_thread + i), NULL);
     }
     for (i = 0; i < hmo.conf.spool_threads; i++) {
-        pthread_join(*(hmo.spool_thread + i), NULL);
+        __spool_thread_destroy(&spool_mgr.st[i]);
+    }
+    for (; i < spool_mgr.nr_slot; i++) {
+        sem_destroy(&spool_mgr.st[i].sem);
+    }
+    free(spool_mgr.st);
+    spool_mgr.st = NULL;
+    __spool_queue_destroy(&spool_mgr.ctrl);
+    xfree(hmo.prof.misc.spool);
+    hmo.prof.misc.spool = NULL;
+    xfree(spool_mgr.client);
+    spool_mgr.client = NULL;
+    if (spool_mgr.node) {
+        free(spool_mgr.node);
+        spool_mgr.node = NULL;
+        numa_topo_destroy(&spool_mgr.topo);
     }
-    sem_destroy(&spool_mgr.rin_sem);
 }
@@ -0,0 +1,934 @@
+/**
+ * Copyright (c) 2019 Ma Can <ml.macana@gmail.com>
+ *                           <macan@iie.ac.cn>
+ *
+ * Armed with EMACS.
+ * Time-stamp: <2019-10-16 10:21:37 macan>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "gk.h"
+#include "mds.h"
+#include <dirent.h>
+
+/* Write-ahead log
+ *
+ * With GK_MDS_WAL, a PUT is acknowledged once its record is in the WAL
+ * and fdatasync()ed. Concurrent appenders are group committed: the first
+ * waiter becomes the leader and writes all staged records w/ one
+ * writev() + fdatasync(). Durable records are handed to the apply
+ * threads (a namespace always goes to the same thread, thus the apply
+ * order is the log order), which write them into LMDB in large sorted
+ * batches.
+ *
+ * The log is split into segments of hmo.conf.wal_seg_size bytes. Sealed
+ * segments are unlinked in log order once all their records have been
+ * applied, this is the checkpoint. A segment w/ a failed apply is kept,
+ * and so are all the later ones, since replaying it alone would roll back
+ * the keys they overwrote. On startup, the remaining segments are
+ * replayed through the normal put path.
+ */
+
+#define WAL_MAGIC       0x57414c31 /* WAL1 */
+#define WAL_APPLY_RETRY 3
+
+struct wal_rhdr
+{
+    u32 magic;
+    u32 crc;                    /* crc32c of header (crc = 0) and data */
+    u64 lsn;
+    u32 nslen, klen, vlen;
+    u32 pad;
+};
+
+struct wal_seg
+{
+    struct list_head list;
+    u64 seq;
+    off_t size;
+    int pending;                /* # of records not applied yet */
+    int failed;                 /* an apply failed, keep it for replay,
+                                 * 2 if reported */
+};
+
+struct wal_rec
+{
+    struct list_head list;
+    struct ns_entry *nse;
+    struct wal_seg *seg;
+    struct gstring key, value;
+    /* status of the appender waiting for the flush, 0: staged, 1: durable,
+     * < 0: error. It lives on the appender's stack, as a durable record is
+     * freed by its apply thread while the appender may not have woken up */
+    int *state;
+    /* on-disk image: header, namespace, key, value */
+    struct wal_rhdr hdr;
+    char data[0];
+};
+
+struct wal_aq
+{
+    struct list_head list;
+    xlock_t lock;
+    sem_t sem;
+    pthread_t thread;
+    int tid;
+} __attribute__((aligned(64)));
+
+struct wal_mgr
+{
+    xcond_t cond;               /* protect and signal all the following */
+    int fd;
+    int flushing;
+    u64 lsn;                    /* last assigned lsn */
+    struct wal_seg *cur;        /* current segment */
+    struct wal_seg *replay;     /* segment being replayed */
+    struct list_head segs;
+    struct list_head staged;    /* records waiting for group commit */
+
+    struct wal_aq *aq;
+    int stop;
+};
+
+static struct wal_mgr wal_mgr;
+
+#ifdef UNIT_TEST
+static int wal_fail_apply = 0;  /* fail every apply w/o retry */
+#endif
+
+static inline
+void __wal_seg_path(char *path, u64 seq)
+{
+    snprintf(path, GK_MAX_NAME_LEN, "%s/.wal/%016lx.log",
+             hmo.conf.kvs_home, seq);
+}
+
+static inline
+u32 __wal_rec_crc(struct wal_rhdr *hdr)
+{
+    struct wal_rhdr h = *hdr;
+
+    h.crc = 0;
+    return crc32c(crc32c(~0U, (const u8 *)&h, sizeof(h)),
+                  (const u8 *)(hdr + 1), h.nslen + h.klen + h.vlen);
+}
+
+static inline
+int __wal_rec_size(struct wal_rec *rec)
+{
+    return sizeof(rec->hdr) + rec->hdr.nslen + rec->hdr.klen +
+        rec->hdr.vlen;
+}
+
+/* __wal_dir_sync() make a segment creation durable
+ */
+static int __wal_dir_sync(void)
+{
+    char path[GK_MAX_NAME_LEN];
+    int fd, err = 0;
+
+    snprintf(path, GK_MAX_NAME_LEN, "%s/.wal", hmo.conf.kvs_home);
+    fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        gk_err(mds, "open wal dir %s failed w/ %s\n", path, strerror(errno));
+        return -errno;
+    }
+    if (fsync(fd)) {
+        gk_err(mds, "fsync wal dir %s failed w/ %s\n", path, strerror(errno));
+        err = -errno;
+    }
+    close(fd);
+
+    return err;
+}
+
+/* __wal_seg_open() create a new segment and make it current, holding
+ * the wal lock.
+ */
+static int __wal_seg_open(u64 seq)
+{
+    char path[GK_MAX_NAME_LEN];
+    struct wal_seg *seg;
+    int fd, err;
+
+    seg = xzalloc(sizeof(*seg));
+    if (!seg) {
+        gk_err(mds, "xzalloc() wal segment failed\n");
+        return -ENOMEM;
+    }
+    __wal_seg_path(path, seq);
+    fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644);
+    if (fd < 0) {
+        gk_err(mds, "open wal segment %s failed w/ %s\n",
+               path, strerror(errno));
+        xfree(seg);
+        return -errno;
+    }
+    /* the records synced to it are lost if the entry is not */
+    err = __wal_dir_sync();
+    if (err) {
+        close(fd);
+        unlink(path);
+        xfree(seg);
+        return err;
+    }
+    INIT_LIST_HEAD(&seg->list);
+    seg->seq = seq;
+    list_add_tail(&seg->list, &wal_mgr.segs);
+    if (wal_mgr.fd > 0)
+        close(wal_mgr.fd);
+    wal_mgr.fd = fd;
+    wal_mgr.cur = seg;
+
+    return 0;
+}
+
+/* __wal_checkpoint() unlink the oldest segments which are sealed and
+ * fully applied, holding the wal lock. A failed segment stops it for good.
+ */
+static void __wal_checkpoint(void)
+{
+    char path[GK_MAX_NAME_LEN];
+    struct wal_seg *seg, *n;
+
+    list_for_each_entry_safe(seg, n, &wal_mgr.segs, list) {
+        if (seg == wal_mgr.cur || seg == wal_mgr.replay || seg->pending)
+            break;
+        __wal_seg_path(path, seg->seq);
+        if (seg->failed) {
+            if (seg->failed == 1)
+                gk_warning(mds, "wal segment %s has unapplied records, keep "
+                           "it and the later ones for replay on restart\n",
+                           path);
+            seg->failed = 2;
+            break;
+        }
+        if (unlink(path)) {
+            gk_warning(mds, "unlink wal segment %s failed w/ %s\n",
+                       path, strerror(errno));
+        }
+        gk_debug(mds, "checkpoint wal segment %lx (%ld bytes)\n",
+                 seg->seq, (long)seg->size);
+        list_del(&seg->list);
+        xfree(seg);
+    }
+}
+
+static inline
+void __wal_submit(struct wal_rec *rec)
+{
+    struct wal_aq *aq = wal_mgr.aq + (gk_hash_nsht(rec->nse->namespace.start,
+                                                   rec->nse->namespace.len) %
+                                      hmo.conf.wal_threads);
+
+    xlock_lock(&aq->lock);
+    list_add_tail(&rec->list, &aq->list);
+    xlock_unlock(&aq->lock);
+    sem_post(&aq->sem);
+}
+
+/* __wal_flush() write and sync the staged records, holding the wal lock
+ * on entry and exit.
+ */
+static void __wal_flush(void)
+{
+    struct iovec iov[64];
+    struct wal_rec *rec, *n;
+    LIST_HEAD(batch);
+    struct wal_seg *seg;
+    ssize_t bw;
+    off_t len = 0;
+    int nr = 0, i, err = 0;
+
+    list_splice_init(&wal_mgr.staged, &batch);
+    if (wal_mgr.cur->size >= hmo.conf.wal_seg_size) {
+        struct wal_seg *old = wal_mgr.cur;
+
+        err = __wal_seg_open(old->seq + 1);
+        if (err) {
+            gk_err(mds, "roll wal segment failed w/ %d, keep writing "
+                   "segment %lx\n", err, old->seq);
+            err = 0;
+        } else
+            __wal_checkpoint();
+    }
+    seg = wal_mgr.cur;
+    wal_mgr.flushing = 1;
+    xcond_unlock(&wal_mgr.cond);
+
+    /* write the batch in chunks of iov */
+    rec = list_first_entry(&batch, struct wal_rec, list);
+    while (&rec->list != &batch) {
+        size_t clen = 0;
+
+        for (i = 0; i < 64 && &rec->list != &batch; i++) {
+            iov[i].iov_base = &rec->hdr;
+            iov[i].iov_len = __wal_rec_size(rec);
+            clen += iov[i].iov_len;
+            rec = list_entry(rec->list.next, struct wal_rec, list);
+            nr++;
+        }
+        bw = writev(wal_mgr.fd, iov, i);
+        if (bw < 0) {
+            gk_err(mds, "write wal segment %lx failed w/ %s\n",
+                   seg->seq, strerror(errno));
+            err = -errno;
+            break;
+        }
+        len += bw;
+        /* O_APPEND regular file, short write means ENOSPC */
+        if (bw < clen) {
+            gk_err(mds, "short write wal segment %lx, %ld < %ld\n",
+                   seg->seq, (long)bw, (long)clen);
+            err = -ENOSPC;
+            break;
+        }
+    }
+    if (!err && fdatasync(wal_mgr.fd)) {
+        gk_err(mds, "fdatasync wal segment %lx failed w/ %s\n",
+               seg->seq, strerror(errno));
+        err = -errno;
+    }
+    atomic64_inc(&hmo.prof.mds.wal_sync);
+    atomic64_add(nr, &hmo.prof.mds.wal_append);
+
+    xcond_lock(&wal_mgr.cond);
+    wal_mgr.flushing = 0;
+    seg->size += len;
+    if (err) {
+        /* do not append after a torn record, roll on next flush */
+        seg->size = max(seg->size, (off_t)hmo.conf.wal_seg_size);
+    }
+    list_for_each_entry_safe(rec, n, &batch, list) {
+        list_del_init(&rec->list);
+        if (err) {
+            /* the appender frees the record */
+            *rec->state = err;
+            continue;
+        }
+        *rec->state = 1;
+        rec->state = NULL;
+        rec->seg = seg;
+        seg->pending++;
+        /* the apply thread frees the record, keep lsn order */
+        __wal_submit(rec);
+    }
+    xcond_broadcast(&wal_mgr.cond);
+}
+
+/* mds_wal_append() log a kv pair of the namespace, return after the
+ * record is durable.
+ */
+int mds_wal_append(struct ns_entry *nse, struct gstring *key,
+                   struct gstring *value)
+{
+    struct wal_rec *rec;
+    int state = 0;
+
+    rec = xmalloc(sizeof(*rec) + nse->namespace.len + key->len + value->len);
+    if (!rec) {
+        gk_err(mds, "xmalloc() wal record failed\n");
+        return -ENOMEM;
+    }
+    INIT_LIST_HEAD(&rec->list);
+    rec->nse = nse;
+    rec->seg = NULL;
+    rec->state = &state;
+    rec->hdr.magic = WAL_MAGIC;
+    rec->hdr.nslen = nse->namespace.len;
+    rec->hdr.klen = key->len;
+    rec->hdr.vlen = value->len;
+    rec->hdr.pad = 0;
+    memcpy(rec->data, nse->namespace.start, nse->namespace.len);
+    rec->key.start = rec->data + nse->namespace.len;
+    rec->key.len = key->len;
+    memcpy(rec->key.start, key->start, key->len);
+    rec->value.start = rec->key.start + key->len;
+    rec->value.len = value->len;
+    memcpy(rec->value.start, value->start, value->len);
+    /* the record pins the namespace until applied */
+    atomic_inc(&nse->ref);
+
+    xcond_lock(&wal_mgr.cond);
+    rec->hdr.lsn = ++wal_mgr.lsn;
+    rec->hdr.crc = __wal_rec_crc(&rec->hdr);
+    if (unlikely(wal_mgr.replay)) {
+        /* already on disk */
+        rec->state = NULL;
+        rec->seg = wal_mgr.replay;
+        wal_mgr.replay->pending++;
+        __wal_submit(rec);
+        xcond_unlock(&wal_mgr.cond);
+        return 0;
+    }
+    list_add_tail(&rec->list, &wal_mgr.staged);
+    /* do not touch @rec once it is durable */
+    while (!state) {
+        if (!wal_mgr.flushing)
+            __wal_flush();
+        else
+            xcond_wait(&wal_mgr.cond);
+    }
+    xcond_unlock(&wal_mgr.cond);
+
+    if (state < 0) {
+        kvs_ns_put(nse);
+        xfree(rec);
+        return state;
+    }
+
+    return 0;
+}
+
+static int __wal_rec_cmp(const void *a, const void *b)
+{
+    struct wal_rec *x = *(struct wal_rec **)a, *y = *(struct wal_rec **)b;
+    void *ex = kvs_ns_store_env(x->nse), *ey = kvs_ns_store_env(y->nse);
+    int r;
+
+    if (ex != ey)
+        return ex < ey ? -1 : 1;
+    if (x->nse != y->nse)
+        return x->nse < y->nse ? -1 : 1;
+    r = memcmp(x->key.start, y->key.start, min(x->key.len, y->key.len));
+    if (r)
+        return r;
+    if (x->key.len != y->key.len)
+        return x->key.len < y->key.len ? -1 : 1;
+    return x->hdr.lsn < y->hdr.lsn ? -1 : (x->hdr.lsn > y->hdr.lsn);
+}
+
+/* __wal_apply() write a batch of records to LMDB, one transaction for
+ * each env (i.e. each namespace unless the envs are shared), keys sorted
+ * and only the last version kept.
+ */
+static void __wal_apply(struct wal_rec **recs, struct iovec *iov,
+                        struct kvs_apply *ka, int nr)
+{
+    int i, j, e, k, n, err;
+
+    qsort(recs, nr, sizeof(*recs), __wal_rec_cmp);
+    for (i = 0; i < nr; i = e) {
+        for (e = i, k = 0, n = 0; e < nr &&
+                 kvs_ns_store_env(recs[e]->nse) ==
+                 kvs_ns_store_env(recs[i]->nse); e = j, n++) {
+            ka[n].nse = recs[e]->nse;
+            ka[n].iov = iov + k;
+            for (j = e; j < nr && recs[j]->nse == recs[e]->nse; j++) {
+                if (j + 1 < nr && recs[j + 1]->nse == recs[j]->nse &&
+                    recs[j + 1]->key.len == recs[j]->key.len &&
+                    !memcmp(recs[j + 1]->key.start, recs[j]->key.start,
+                            recs[j]->key.len))
+                    continue;
+                iov[k].iov_base = recs[j]->key.start;
+                iov[k++].iov_len = recs[j]->key.len;
+                iov[k].iov_base = recs[j]->value.start;
+                iov[k++].iov_len = recs[j]->value.len;
+            }
+            ka[n].iov_nr = iov + k - ka[n].iov;
+        }
+        /* the batch is all or nothing, retry transient errors */
+        for (k = 0; k < WAL_APPLY_RETRY; k++) {
+#ifdef UNIT_TEST
+            if (wal_fail_apply) {
+                err = -EIO;
+                break;
+            }
+#endif
+            err = kvs_store_apply_batch(ka, n);
+            if (!err)
+                break;
+            usleep(10000 << k);
+        }
+        if (err) {
+            gk_err(mds, "apply %d wal records to %d namespaces (%.*s...) "
+                   "failed w/ %d, keep the segments for replay\n", e - i,
+                   n, recs[i]->nse->namespace.len,
+                   recs[i]->nse->namespace.start, err);
+            xcond_lock(&wal_mgr.cond);
+            for (k = i; k < e; k++) {
+                if (!recs[k]->seg->failed)
+                    recs[k]->seg->failed = 1;
+            }
+            xcond_unlock(&wal_mgr.cond);
+        }
+    }
+
+    atomic64_add(nr, &hmo.prof.mds.wal_apply);
+    xcond_lock(&wal_mgr.cond);
+    for (i = 0; i < nr; i++)
+        recs[i]->seg->pending--;
+    __wal_checkpoint();
+    xcond_unlock(&wal_mgr.cond);
+    for (i = 0; i < nr; i++) {
+        kvs_ns_put(recs[i]->nse);
+        xfree(recs[i]);
+    }
+}
+
+static void *wal_apply_main(void *arg)
+{
+    struct wal_aq *aq = arg;
+    struct wal_rec **recs, *rec, *n;
+    struct iovec *iov;
+    struct kvs_apply *ka;
+    sigset_t set;
+    int nr;
+
+    /* first, let us block the SIGALRM */
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigaddset(&set, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    recs = xmalloc(hmo.conf.wal_batch * sizeof(*recs));
+    iov = xmalloc(hmo.conf.wal_batch * 2 * sizeof(*iov));
+    ka = xmalloc(hmo.conf.wal_batch * sizeof(*ka));
+    if (!recs || !iov || !ka) {
+        gk_err(mds, "alloc wal apply batch failed, thread %d exits\n",
+               aq->tid);
+        xfree(recs);
+        xfree(iov);
+        xfree(ka);
+        pthread_exit(0);
+    }
+
+    while (1) {
+        if (sem_wait(&aq->sem) && errno == EINTR)
+            continue;
+        do {
+            nr = 0;
+            xlock_lock(&aq->lock);
+            list_for_each_entry_safe(rec, n, &aq->list, list) {
+                list_del_init(&rec->list);
+                recs[nr++] = rec;
+                if (nr >= hmo.conf.wal_batch)
+                    break;
+            }
+            xlock_unlock(&aq->lock);
+            if (nr)
+                __wal_apply(recs, iov, ka, nr);
+        } while (nr >= hmo.conf.wal_batch);
+        if (wal_mgr.stop && list_empty(&aq->list))
+            break;
+    }
+    xfree(recs);
+    xfree(iov);
+    xfree(ka);
+
+    pthread_exit(0);
+}
+
+static int __wal_seq_cmp(const void *a, const void *b)
+{
+    u64 x = *(u64 *)a, y = *(u64 *)b;
+
+    return x < y ? -1 : (x > y);
+}
+
+/* __wal_replay_seg() redo the valid records of one segment, stop at the
+ * first torn or corrupted record.
+ */
+static int __wal_replay_seg(u64 seq, long *nr)
+{
+    char path[GK_MAX_NAME_LEN];
+    struct wal_rhdr *hdr;
+    struct gstring ns, key, value;
+    struct wal_seg *seg;
+    struct stat st;
+    void *data;
+    off_t off = 0;
+    int fd, err = 0;
+
+    __wal_seg_path(path, seq);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        gk_err(mds, "open wal segment %s failed w/ %s\n",
+               path, strerror(errno));
+        return -errno;
+    }
+    if (fstat(fd, &st)) {
+        err = -errno;
+        goto out_close;
+    }
+    seg = xzalloc(sizeof(*seg));
+    if (!seg) {
+        err = -ENOMEM;
+        goto out_close;
+    }
+    INIT_LIST_HEAD(&seg->list);
+    seg->seq = seq;
+    seg->size = st.st_size;
+    list_add_tail(&seg->list, &wal_mgr.segs);
+    if (!st.st_size)
+        goto out_check;
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        gk_err(mds, "mmap wal segment %s failed w/ %s\n",
+               path, strerror(errno));
+        err = -errno;
+        goto out_check;
+    }
+    wal_mgr.replay = seg;
+    while (off + sizeof(*hdr) <= st.st_size) {
+        hdr = data + off;
+        if (hdr->magic != WAL_MAGIC ||
+            off + sizeof(*hdr) + hdr->nslen + hdr->klen + hdr->vlen >
+            st.st_size ||
+            __wal_rec_crc(hdr) != hdr->crc) {
+            gk_warning(mds, "wal segment %s has a torn record @ %ld, "
+                       "ignore the tail\n", path, (long)off);
+            break;
+        }
+        ns.start = (char *)(hdr + 1);
+        ns.len = hdr->nslen;
+        key.start = ns.start + ns.len;
+        key.len = hdr->klen;
+        value.start = key.start + key.len;
+        value.len = hdr->vlen;
+        err = kvs_update(&ns, &key, &value);
+        if (err) {
+            gk_err(mds, "redo wal record %ld failed w/ %d\n", hdr->lsn, err);
+            break;
+        }
+        if (hdr->lsn > wal_mgr.lsn)
+            wal_mgr.lsn = hdr->lsn;
+        off += sizeof(*hdr) + hdr->nslen + hdr->klen + hdr->vlen;
+        (*nr)++;
+    }
+    wal_mgr.replay = NULL;
+    munmap(data, st.st_size);
+
+out_check:
+    if (!err) {
+        xcond_lock(&wal_mgr.cond);
+        __wal_checkpoint();
+        xcond_unlock(&wal_mgr.cond);
+    }
+out_close:
+    close(fd);
+
+    return err;
+}
+
+static int __wal_replay(u64 *next)
+{
+    char path[GK_MAX_NAME_LEN];
+    struct dirent *de;
+    DIR *dir;
+    u64 *seqs = NULL, *p;
+    long recs = 0;
+    int nr = 0, size = 0, i, err = 0;
+
+    snprintf(path, sizeof(path), "%s/.wal", hmo.conf.kvs_home);
+    dir = opendir(path);
+    if (!dir) {
+        gk_err(mds, "opendir %s failed w/ %s\n", path, strerror(errno));
+        return -errno;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        u64 seq;
+        char *end;
+
+        seq = strtoul(de->d_name, &end, 16);
+        if (end == de->d_name || strcmp(end, ".log"))
+            continue;
+        if (nr >= size) {
+            size = size ? size << 1 : 16;
+            p = xrealloc(seqs, size * sizeof(u64));
+            if (!p) {
+                err = -ENOMEM;
+                goto out;
+            }
+            seqs = p;
+        }
+        seqs[nr++] = seq;
+    }
+    qsort(seqs, nr, sizeof(u64), __wal_seq_cmp);
+
+    for (i = 0; i < nr; i++) {
+        err = __wal_replay_seg(seqs[i], &recs);
+        if (err) {
+            gk_err(mds, "replay wal segment %lx failed w/ %d\n",
+                   seqs[i], err);
+            goto out;
+        }
+    }
+    *next = nr ? seqs[nr - 1] + 1 : 0;
+    if (nr)
+        gk_info(mds, "replayed %ld wal records from %d segments\n",
+                recs, nr);
+out:
+    closedir(dir);
+    xfree(seqs);
+
+    return err;
+}
+
+int mds_wal_init(void)
+{
+    char path[GK_MAX_NAME_LEN];
+    u64 next = 0;
+    int i, err = 0;
+
+    if (!(hmo.conf.option & GK_MDS_WAL))
+        return 0;
+
+    memset(&wal_mgr, 0, sizeof(wal_mgr));
+    xcond_init(&wal_mgr.cond);
+    INIT_LIST_HEAD(&wal_mgr.segs);
+    INIT_LIST_HEAD(&wal_mgr.staged);
+    wal_mgr.fd = -1;
+
+    snprintf(path, sizeof(path), "%s/.wal", hmo.conf.kvs_home);
+    err = kvs_dir_make_exist(path);
+    if (err) {
+        gk_err(mds, "dir %s does not exist %d.\n", path, err);
+        return err;
+    }
+
+    if (posix_memalign((void **)&wal_mgr.aq, 64,
+                       hmo.conf.wal_threads * sizeof(struct wal_aq))) {
+        gk_err(mds, "alloc wal apply queues failed\n");
+        return -ENOMEM;
+    }
+    for (i = 0; i < hmo.conf.wal_threads; i++) {
+        struct wal_aq *aq = wal_mgr.aq + i;
+
+        memset(aq, 0, sizeof(*aq));
+        INIT_LIST_HEAD(&aq->list);
+        xlock_init(&aq->lock);
+        sem_init(&aq->sem, 0, 0);
+        aq->tid = i;
+        err = pthread_create(&aq->thread, NULL, &wal_apply_main, aq);
+        if (err) {
+            gk_err(mds, "create wal apply thread %d failed w/ %d\n", i, err);
+            hmo.conf.wal_threads = i;
+            goto out_destroy;
+        }
+    }
+
+    /* redo the records which may not reach LMDB */
+    err = __wal_replay(&next);
+    if (err)
+        goto out_destroy;
+
+    xcond_lock(&wal_mgr.cond);
+    err = __wal_seg_open(next);
+    xcond_unlock(&wal_mgr.cond);
+    if (err)
+        goto out_destroy;
+
+    gk_info(mds, "MDS WAL init ok, segment %lx lsn %ld, %d apply threads\n",
+            next, wal_mgr.lsn, hmo.conf.wal_threads);
+
+    return 0;
+out_destroy:
+    hmo.conf.option &= ~GK_MDS_WAL;
+    mds_wal_destroy();
+
+    return err;
+}
+
+/* mds_wal_destroy() drain the apply queues, the fully applied segments
+ * are removed.
+ */
+void mds_wal_destroy(void)
+{
+    struct wal_seg *seg, *n;
+    int i;
+
+    if (!wal_mgr.aq)
+        return;
+    hmo.conf.option &= ~GK_MDS_WAL;
+
+    wal_mgr.stop = 1;
+    for (i = 0; i < hmo.conf.wal_threads; i++)
+        sem_post(&wal_mgr.aq[i].sem);
+    for (i = 0; i < hmo.conf.wal_threads; i++) {
+        pthread_join(wal_mgr.aq[i].thread, NULL);
+        sem_destroy(&wal_mgr.aq[i].sem);
+    }
+    free(wal_mgr.aq);
+    wal_mgr.aq = NULL;
+
+    xcond_lock(&wal_mgr.cond);
+    wal_mgr.cur = NULL;
+    __wal_checkpoint();
+    /* the rest are kept on disk for replay */
+    list_for_each_entry_safe(seg, n, &wal_mgr.segs, list) {
+        list_del(&seg->list);
+        xfree(seg);
+    }
+    xcond_unlock(&wal_mgr.cond);
+    if (wal_mgr.fd > 0)
+        close(wal_mgr.fd);
+    wal_mgr.fd = -1;
+}
+
+#ifdef UNIT_TEST
+#include <sys/wait.h>
+
+/* A failed apply, an overwrite of the key applied from a later segment,
+ * then a restart: the replay has to end w/ the overwrite, in memory and
+ * in LMDB.
+ */
+#define UT_HOME         "/tmp/gk_wal_ut"
+
+static struct gstring ut_ns = {.start = "walut", .len = 5};
+static struct gstring ut_key = {.start = "key", .len = 3};
+static struct gstring ut_key2 = {.start = "key2", .len = 4};
+static struct gstring ut_v1 = {.start = "old value", .len = 9};
+static struct gstring ut_v2 = {.start = "new value", .len = 9};
+
+static void __ut_wait_apply(long nr)
+{
+    while (atomic64_read(&hmo.prof.mds.wal_apply) < nr)
+        usleep(1000);
+}
+
+/* __ut_uncache() drop the namespace ref of the thread local cache, as a
+ * spool thread does on exit
+ */
+static void __ut_uncache(void)
+{
+    struct ns_entry *nse = pthread_getspecific(spool_key);
+
+    if (nse) {
+        kvs_ns_put(nse);
+        pthread_setspecific(spool_key, NULL);
+    }
+}
+
+static int __ut_check(char *phase)
+{
+    struct gstring *v;
+    int err = 0;
+
+    v = kvs_get(&ut_ns, &ut_key);
+    if (IS_ERR(v)) {
+        printf("%s: get failed w/ %ld\n", phase, PTR_ERR(v));
+        return 1;
+    }
+    if (v->len != ut_v2.len || memcmp(v->start, ut_v2.start, v->len)) {
+        printf("%s: got '%.*s', expect '%.*s'\n", phase, v->len,
+               (char *)v->start, ut_v2.len, ut_v2.start);
+        err = 1;
+    }
+    xfree(v->start);
+    xfree(v);
+
+    return err;
+}
+
+/* __ut_run() run a phase in a child, as a process of the MDS
+ */
+static int __ut_run(int (*phase)(void))
+{
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if (pid < 0)
+        return 1;
+    if (!pid)
+        exit(phase());
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+        return 1;
+
+    return WEXITSTATUS(status);
+}
+
+static int __ut_write(void)
+{
+    int err;
+
+    if (kvs_init() || mds_wal_init())
+        return 1;
+    /* segment 0: the apply fails, it is kept for replay */
+    wal_fail_apply = 1;
+    err = kvs_put(&ut_ns, &ut_key, &ut_v1);
+    __ut_wait_apply(1);
+    wal_fail_apply = 0;
+    /* segment 1: the overwrite is applied, segment 2 seals it */
+    err = err ? : kvs_update(&ut_ns, &ut_key, &ut_v2);
+    __ut_wait_apply(2);
+    err = err ? : kvs_put(&ut_ns, &ut_key2, &ut_v1);
+    __ut_wait_apply(3);
+    if (err)
+        printf("write: put failed w/ %d\n", err);
+    mds_wal_destroy();
+    __ut_uncache();
+    kvs_destroy();
+
+    return !!err;
+}
+
+static int __ut_replay(void)
+{
+    int err;
+
+    if (kvs_init() || mds_wal_init())
+        return 1;
+    err = __ut_check("replay");
+    mds_wal_destroy();
+    __ut_uncache();
+    kvs_destroy();
+
+    return err;
+}
+
+static int __ut_store(void)
+{
+    int err;
+
+    hmo.conf.option &= ~GK_MDS_WAL;
+    if (kvs_init())
+        return 1;
+    err = __ut_check("store");
+    __ut_uncache();
+    kvs_destroy();
+
+    return err;
+}
+
+int main(int argc, char *argv[])
+{
+    int err;
+
+    lib_init();
+    pthread_key_create(&spool_key, NULL);
+    mds_config();
+    hmo.conf.kvs_home = UT_HOME;
+    hmo.conf.option |= GK_MDS_WAL;
+    hmo.conf.wal_threads = 1;
+    /* roll the segment on every flush */
+    hmo.conf.wal_seg_size = 1;
+    if (system("rm -rf " UT_HOME)) {
+        printf("clean %s failed\n", UT_HOME);
+        return 1;
+    }
+
+    err = __ut_run(__ut_write);
+    err = err ? : __ut_run(__ut_replay);
+    err = err ? : __ut_run(__ut_store);
+    printf("WAL replay after a failed apply: %s\n", err ? "FAILED" : "OK");
+
+    return err;
+}
+#endif
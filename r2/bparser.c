@@ -71,3 +71,20 @@ int bparse_addr(void *data, struct gk_site_tx **hst)
 
     return len + sizeof(u32);
 }
+
+int bparse_ring(void *data, struct chring_tx **ct)
+{
+    u32 len;
+
+    if (!data || !ct)
+        return -EINVAL;
+
+    len = *(int *)data;
+    if (len < sizeof(struct chring_tx)) {
+        gk_err(root, "bparse ring failed, ring length mismatch!\n");
+        return -EINVAL;
+    }
+    *ct = data + sizeof(u32);
+
+    return len + sizeof(u32);
+}
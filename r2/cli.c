@@ -101,6 +101,124 @@ out:
     return ERR_PTR(err);
 }
 
+struct ring_args
+{
+    u64 site_id;                /* site id filled by traverse function */
+    u32 state;                  /* site state filled by traverse function */
+
+    int len;
+    void *data;                 /* | u32 len | struct chring_tx | */
+};
+
+void *__cli_send_ring(void *args)
+{
+    struct xnet_msg *msg;
+    struct ring_args *ra = (struct ring_args *)args;
+    int err = 0;
+
+    if (ra->state != SE_STATE_NORMAL)
+        return NULL;
+    if (!GK_IS_MDS(ra->site_id) && !GK_IS_CLIENT(ra->site_id))
+        return NULL;
+
+    gk_debug(root, "Send ring to %lx len %d\n", ra->site_id, ra->len);
+
+    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    if (!msg) {
+        gk_err(root, "xnet_alloc_msg() failed\n");
+        err = -ENOMEM;
+        goto out;
+    }
+    xnet_msg_fill_tx(msg, XNET_MSG_REQ, 0,
+                     hro.xc->site_id, ra->site_id);
+    xnet_msg_fill_cmd(msg, GK_FR2_RU, 0, 0);
+#ifdef XNET_EAGER_WRITEV
+    xnet_msg_add_sdata(msg, &msg->tx, sizeof(msg->tx));
+#endif
+    xnet_msg_add_sdata(msg, ra->data, ra->len);
+
+    err = xnet_send(hro.xc, msg);
+    if (err) {
+        gk_err(root, "xnet_send() to %lx failed\n", ra->site_id);
+    }
+    xnet_free_msg(msg);
+out:
+    return ERR_PTR(err);
+}
+
+/* cli_bcast_ring() push the MDS ring of the address entry to all the
+ * active MDS and client sites
+ */
+int cli_bcast_ring(struct addr_entry *ae)
+{
+    struct ring_args ra;
+    void *data;
+    int len, err = 0;
+
+    err = chring_pack(&ae->ring, &data, &len);
+    if (err) {
+        gk_err(root, "pack ring for fsid %ld failed w/ %d\n",
+               ae->fsid, err);
+        goto out;
+    }
+    ra.len = sizeof(u32) + len;
+    ra.data = xmalloc(ra.len);
+    if (!ra.data) {
+        xfree(data);
+        err = -ENOMEM;
+        goto out;
+    }
+    *(u32 *)ra.data = len;
+    memcpy(ra.data + sizeof(u32), data, len);
+    xfree(data);
+
+    gk_info(root, "Broadcast ring version %ld w/ %d MDS for fsid %ld\n",
+            ae->ring.version, ae->ring.nsite, ae->fsid);
+    err = site_mgr_traverse(&hro.site, __cli_send_ring, &ra);
+    if (err) {
+        gk_err(root, "bcast the ring failed w/ %d\n", err);
+    }
+    xfree(ra.data);
+
+out:
+    return err;
+}
+
+/* cli_check_ring() broadcast the changed rings of all the address entries.
+ *
+ * Called from the timer thread, thus a burst of MDS registrations results in
+ * one broadcast and the spool threads never do the fan-out.
+ */
+void cli_check_ring(void)
+{
+    struct addr_entry *pos, *ae;
+    struct hlist_node *n;
+    struct regular_hash *rh;
+    int i;
+
+    for (i = 0; i < hro.conf.addr_mgr_htsize; i++) {
+        rh = hro.addr.rht + i;
+    retry:
+        ae = NULL;
+        xlock_lock(&rh->lock);
+        hlist_for_each_entry(pos, n, &rh->h, hlist) {
+            if (pos->ring.version != pos->ring_bcast) {
+                ae = pos;
+                break;
+            }
+        }
+        xlock_unlock(&rh->lock);
+
+        if (ae) {
+            /* record the version before packing, a concurrent change
+             * is picked up by the next round */
+            ae->ring_bcast = ae->ring.version;
+            cli_bcast_ring(ae);
+            goto retry;
+        }
+    }
+}
+
 /* cli_do_addsite manipulate the address table!
  */
 int cli_do_addsite(struct sockaddr_in *sin, u64 fsid, u64 site_id)
@@ -210,6 +328,11 @@ int cli_do_rmvsite(struct sockaddr_in *sin, u64 fsid, u64 site_id)
             goto out;
         }
 
+        /* a removed MDS hands its slice of the ring to the neighbours,
+         * the timer thread broadcasts the new ring */
+        if (GK_IS_MDS(site_id))
+            chring_del_site(&ae->ring, site_id);
+
         /* trigger an addr table update now */
 #if 0
         /* DO NOT TRIGGER it 2019.8.22 */
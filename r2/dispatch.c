@@ -65,6 +65,12 @@ int root_dispatch(struct xnet_msg *msg)
     case GK_R2_GETASITE:
         err = root_do_getasite(msg);
         break;
+    case GK_R2_JOIN:
+        err = root_do_join(msg);
+        break;
+    case GK_R2_OWNER:
+        err = root_do_owner(msg);
+        break;
     default:
         gk_err(root, "R2 core dispatcher handle INVALID "
                  "request <0x%lx %d>\n",
@@ -308,6 +308,8 @@ struct addr_entry *addr_mgr_alloc_ae()
         xrwlock_init(&ae->rwlock);
         ae->used_addr = 0;
         ae->active_site = 0;
+        chring_init(&ae->ring, hro.conf.ring_vnodes);
+        INIT_LIST_HEAD(&ae->owners);
     }
 
     return ae;
@@ -315,9 +317,110 @@ struct addr_entry *addr_mgr_alloc_ae()
 
 void addr_mgr_free_ae(struct addr_entry *ae)
 {
+    struct owner_entry *oe, *n;
+
+    list_for_each_entry_safe(oe, n, &ae->owners, list) {
+        list_del(&oe->list);
+        xfree(oe);
+    }
+    chring_destroy(&ae->ring);
     xfree(ae);
 }
 
+/* addr_mgr_owner_set() record that MDS source moved a namespace to
+ * site_id, site_id 0 drops the record
+ */
+int addr_mgr_owner_set(struct addr_entry *ae, u64 source, char *ns, u32 len,
+                       u64 site_id)
+{
+    struct owner_entry *oe, *n;
+    int err = 0;
+
+    xrwlock_wlock(&ae->rwlock);
+    list_for_each_entry_safe(oe, n, &ae->owners, list) {
+        if (oe->source == source && oe->len == len &&
+            memcmp(oe->ns, ns, len) == 0) {
+            if (site_id) {
+                oe->site_id = site_id;
+            } else {
+                list_del(&oe->list);
+                ae->onr--;
+                xfree(oe);
+            }
+            goto out_unlock;
+        }
+    }
+    if (!site_id)
+        goto out_unlock;
+    oe = xmalloc(sizeof(*oe) + len);
+    if (!oe) {
+        err = -ENOMEM;
+        goto out_unlock;
+    }
+    oe->source = source;
+    oe->site_id = site_id;
+    oe->len = len;
+    memcpy(oe->ns, ns, len);
+    list_add_tail(&oe->list, &ae->owners);
+    ae->onr++;
+out_unlock:
+    xrwlock_wunlock(&ae->rwlock);
+
+    return err;
+}
+
+/* addr_mgr_owner_clear() drop all the records of MDS source
+ */
+void addr_mgr_owner_clear(struct addr_entry *ae, u64 source)
+{
+    struct owner_entry *oe, *n;
+
+    xrwlock_wlock(&ae->rwlock);
+    list_for_each_entry_safe(oe, n, &ae->owners, list) {
+        if (oe->source == source) {
+            list_del(&oe->list);
+            ae->onr--;
+            xfree(oe);
+        }
+    }
+    xrwlock_wunlock(&ae->rwlock);
+}
+
+/* addr_mgr_owner_pack() pack the records of MDS source as
+ * | u64 site_id | u32 len | namespace |...
+ */
+int addr_mgr_owner_pack(struct addr_entry *ae, u64 source, void **data,
+                        int *len)
+{
+    struct owner_entry *oe;
+    void *p;
+    int size = 0;
+
+    xrwlock_rlock(&ae->rwlock);
+    list_for_each_entry(oe, &ae->owners, list) {
+        if (oe->source == source)
+            size += sizeof(u64) + sizeof(u32) + oe->len;
+    }
+    p = xmalloc(size + 1);
+    if (!p) {
+        xrwlock_runlock(&ae->rwlock);
+        return -ENOMEM;
+    }
+    *data = p;
+    *len = size;
+    list_for_each_entry(oe, &ae->owners, list) {
+        if (oe->source != source)
+            continue;
+        *(u64 *)p = oe->site_id;
+        *(u32 *)(p + sizeof(u64)) = oe->len;
+        memcpy(p + sizeof(u64) + sizeof(u32), oe->ns, oe->len);
+        p += sizeof(u64) + sizeof(u32) + oe->len;
+    }
+    xrwlock_runlock(&ae->rwlock);
+
+    return 0;
+}
+
 /* addr_mgr_lookup() */
 struct addr_entry *addr_mgr_lookup(struct addr_mgr *am, u64 fsid)
 {
@@ -123,6 +123,20 @@ struct addr_entry
     u32 used_addr;              /* # of used addr */
     u32 active_site;            /* # of active site */
     u64 fsid;
+    struct chring ring;         /* consistent hash ring of MDS sites */
+    u64 ring_bcast;             /* ring version last broadcasted */
+    struct list_head owners;    /* namespaces moved off their ring owner */
+    int onr;
+};
+
+/* a namespace moved by MDS source to site_id, see GK_R2_OWNER */
+struct owner_entry
+{
+    struct list_head list;
+    u64 source;
+    u64 site_id;
+    u32 len;
+    char ns[0];
 };
 
 /* APIs */
@@ -140,6 +154,9 @@ struct root_entry *root_mgr_lookup(struct root_mgr *, u64);
 int addr_mgr_compact(struct addr_entry *, void **, int *);
 int addr_mgr_compact_one(struct addr_entry *, u64, u32, void **, int *);
 int addr_mgr_update_one(struct addr_entry *, u32, u64, void *);
+int addr_mgr_owner_set(struct addr_entry *, u64, char *, u32, u64);
+void addr_mgr_owner_clear(struct addr_entry *, u64);
+int addr_mgr_owner_pack(struct addr_entry *, u64, void **, int *);
 struct addr_entry *addr_mgr_lookup(struct addr_mgr *, u64);
 int addr_mgr_lookup_create(struct addr_mgr *, u64, struct addr_entry **);
 struct site_entry *site_mgr_lookup(struct site_mgr *, u64);
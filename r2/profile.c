@@ -233,6 +233,8 @@ int root_info_root(u64 arg, void **buf)
                  atomic64_read(&hro.prof.misc.reqin_total));
     p += sprintf(p, " -> %20s\t\t%ld\n", "misc.reqin_handle", 
                  atomic64_read(&hro.prof.misc.reqin_handle));
+    p += sprintf(p, " -> %20s\t\t%ld\n", "misc.reqin_steal", 
+                 atomic64_read(&hro.prof.misc.reqin_steal));
     p += sprintf(p, " -> %20s\t\t%ld\n", "osd.objrep_recved", 
                  atomic64_read(&hro.prof.osd.objrep_recved));
     p += sprintf(p, " -> %20s\t\t%ld\n", "osd.objrep_handled", 
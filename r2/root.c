@@ -191,6 +191,7 @@ int root_config(void)
     GK_ROOT_GET_ENV_atoi(log_print_interval, value);
     GK_ROOT_GET_ENV_atoi(sync_interval, value);
     GK_ROOT_GET_ENV_atoi(prof_plot, value);
+    GK_ROOT_GET_ENV_atoi(ring_vnodes, value);
 
     GK_ROOT_GET_ENV_option(opt_memonly, MEMONLY, value);
 
@@ -264,6 +265,9 @@ int root_config(void)
     if (!hro.conf.sync_interval) {
         hro.conf.sync_interval = 0; /* do not do sync actually */
     }
+    if (!hro.conf.ring_vnodes) {
+        hro.conf.ring_vnodes = 128;
+    }
 
 out:
     return err;
@@ -328,6 +332,8 @@ static void *root_timer_thread_main(void *arg)
             /* ok, check the site entry state now */
             site_mgr_check(cur);
             site_mgr_check2(cur);
+            /* push the changed MDS rings */
+            cli_check_ring();
             /* write profile? */
             if (hro.conf.prof_plot == ROOT_PROF_PLOT) {
                 root_profile_flush(cur);
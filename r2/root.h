@@ -73,6 +73,7 @@ struct root_conf
     u32 sync_interval;          /* interval to do self sync */
     u32 profile_interval;       /* interval to do profile */
     u32 log_print_interval;     /* interval to dump sth */
+    u32 ring_vnodes;            /* # of virtual nodes per MDS on the ring */
 
 #define ROOT_PROF_NONE          0x00
 #define ROOT_PROF_PLOT          0x01
@@ -180,6 +181,8 @@ int root_do_reg(struct xnet_msg *);
 int root_do_unreg(struct xnet_msg *);
 int root_do_update(struct xnet_msg *);
 int root_do_hb(struct xnet_msg *);
+int root_do_join(struct xnet_msg *);
+int root_do_owner(struct xnet_msg *);
 int root_do_ftreport(struct xnet_msg *);
 int root_do_shutdown(struct xnet_msg *);
 int root_do_profile(struct xnet_msg *);
@@ -188,10 +191,13 @@ int root_do_info(struct xnet_msg *);
 int bparse_hxi(void *, union gk_x_info **);
 int bparse_root(void *, struct root_tx **);
 int bparse_addr(void *, struct gk_site_tx **);
+int bparse_ring(void *, struct chring_tx **);
 
 /* cli.c */
 int cli_do_addsite(struct sockaddr_in *, u64, u64);
 int cli_do_rmvsite(struct sockaddr_in *, u64, u64);
+int cli_bcast_ring(struct addr_entry *);
+void cli_check_ring(void);
 int root_info_site(u64 arg, void **buf);
 
 /* profile.c */
@@ -44,6 +44,7 @@ struct root_misc_prof
 {
     atomic64_t reqin_total;     /* # of total requests coming in */
     atomic64_t reqin_handle;    /* # of handled requests */
+    atomic64_t reqin_steal;     /* # of requests stolen by idle threads */
 };
 
 struct root_osd_prof
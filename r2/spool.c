@@ -26,11 +26,31 @@
 #include "xnet.h"
 #include "lib.h"
 
+/* Each service thread owns a request queue: a lock-free ring plus a
+ * locked overflow list for the (rare) full ring. A request goes to a
+ * sleeping thread if any, or to the next thread in round robin. A thread
+ * drains its own queue in batches, then steals half of the longest queue
+ * of the others (up to a batch), and only sleeps if there is nothing to
+ * steal. Producers post the semaphore only if they take the sleeper
+ * token of the thread.
+ */
+struct spool_thread
+{
+    struct lfq ring;
+    struct list_head reqin;     /* overflow of the ring */
+    xlock_t lock;
+    atomic64_t qd;              /* # of queued requests */
+    sem_t sem;
+    atomic_t sleepers;          /* sleeper tokens */
+} __attribute__((aligned(64)));
+
+#define SPOOL_RING              1024
+#define SPOOL_BATCH             16
+
 struct spool_mgr
 {
-    struct list_head reqin;
-    xlock_t rin_lock;
-    sem_t rin_sem;
+    struct spool_thread *st;
+    atomic_t rr;                /* round robin cursor */
 };
 
 struct spool_thread_arg
@@ -40,30 +60,137 @@ struct spool_thread_arg
 
 static struct spool_mgr spool_mgr;
 
+/* the batch dequeued by this thread */
+static __thread struct xnet_msg *spool_batch[SPOOL_BATCH];
+static __thread int spool_batch_nr, spool_batch_idx;
+
+static inline
+int __spool_wake(struct spool_thread *st)
+{
+    /* pairs w/ the barrier in spool_main() */
+    __sync_synchronize();
+    if (atomic_read(&st->sleepers) > 0 &&
+        atomic_dec_if_positive(&st->sleepers) >= 0) {
+        sem_post(&st->sem);
+        return 1;
+    }
+
+    return 0;
+}
+
 int root_spool_dispatch(struct xnet_msg *msg)
 {
-    xlock_lock(&spool_mgr.rin_lock);
-    list_add_tail(&msg->list, &spool_mgr.reqin);
-    xlock_unlock(&spool_mgr.rin_lock);
+    struct spool_thread *st;
+    int nr = hro.conf.service_threads, i, t;
+    u32 rr;
+
     atomic64_inc(&hro.prof.misc.reqin_total);
-    sem_post(&spool_mgr.rin_sem);
+
+    /* prefer a sleeping thread */
+    rr = atomic_inc_return(&spool_mgr.rr);
+    t = rr % nr;
+    for (i = 0; i < nr; i++) {
+        if (atomic_read(&spool_mgr.st[(rr + i) % nr].sleepers) > 0) {
+            t = (rr + i) % nr;
+            break;
+        }
+    }
+    st = &spool_mgr.st[t];
+    if (unlikely(lfq_enqueue(&st->ring, msg))) {
+        xlock_lock(&st->lock);
+        list_add_tail(&msg->list, &st->reqin);
+        xlock_unlock(&st->lock);
+    }
+    atomic64_inc(&st->qd);
+    if (__spool_wake(st))
+        return 0;
+    /* the owner is busy, wake a thief if any */
+    for (i = 1; i < nr; i++) {
+        if (__spool_wake(&spool_mgr.st[(t + i) % nr]))
+            break;
+    }
 
     return 0;
 }
 
 static inline
-int __serv_request(void)
+int __spool_get(struct spool_thread *st, struct xnet_msg **msgs, int nr)
 {
-    struct xnet_msg *msg = NULL, *pos, *n;
+    struct xnet_msg *pos, *n;
+    int i;
+
+    i = lfq_dequeue_batch(&st->ring, (void **)msgs, nr);
+    if (i < nr && unlikely(!list_empty(&st->reqin))) {
+        xlock_lock(&st->lock);
+        list_for_each_entry_safe(pos, n, &st->reqin, list) {
+            list_del_init(&pos->list);
+            msgs[i++] = pos;
+            if (i == nr)
+                break;
+        }
+        xlock_unlock(&st->lock);
+    }
+    if (i)
+        atomic64_sub(i, &st->qd);
+
+    return i;
+}
+
+/* __spool_victim() return the thread w/ the longest queue other than
+ * @tid, or -1 if there is nothing to steal
+ */
+static inline
+int __spool_victim(int tid, s64 *qd)
+{
+    s64 max = 0, n;
+    int i, t, v = -1;
 
-    xlock_lock(&spool_mgr.rin_lock);
-    list_for_each_entry_safe(pos, n, &spool_mgr.reqin, list) {
-        list_del_init(&pos->list);
-        msg = pos;
-        break;
+    for (i = 1; i < hro.conf.service_threads; i++) {
+        t = (tid + i) % hro.conf.service_threads;
+        n = atomic64_read(&spool_mgr.st[t].qd);
+        if (n > max) {
+            max = n;
+            v = t;
+        }
     }
-    xlock_unlock(&spool_mgr.rin_lock);
+    *qd = max;
+
+    return v;
+}
+
+static inline
+struct xnet_msg *__spool_dequeue(int tid)
+{
+    s64 qd;
+    int n, v;
+
+    if (spool_batch_idx < spool_batch_nr)
+        goto out;
 
+    n = __spool_get(&spool_mgr.st[tid], spool_batch, SPOOL_BATCH);
+    if (!n) {
+        v = __spool_victim(tid, &qd);
+        if (v < 0)
+            return NULL;
+        n = __spool_get(&spool_mgr.st[v], spool_batch,
+                        (int)min((s64)SPOOL_BATCH, (qd + 1) / 2));
+        if (!n)
+            return NULL;
+        atomic64_add(n, &hro.prof.misc.reqin_steal);
+    }
+    spool_batch_nr = n;
+    spool_batch_idx = 0;
+
+out:
+    return spool_batch[spool_batch_idx++];
+}
+
+static inline
+int __serv_request(int tid)
+{
+    struct xnet_msg *msg;
+
+    msg = __spool_dequeue(tid);
     if (!msg)
         return -EHSTOP;
 
@@ -74,10 +201,21 @@ int __serv_request(void)
     return msg->xc->ops.dispatcher(msg);
 }
 
+static inline
+int __spool_pending(int tid)
+{
+    s64 qd;
+
+    return spool_batch_idx < spool_batch_nr ||
+        atomic64_read(&spool_mgr.st[tid].qd) > 0 ||
+        __spool_victim(tid, &qd) >= 0;
+}
+
 static
 void *spool_main(void *arg)
 {
     struct spool_thread_arg *sta = (struct spool_thread_arg *)arg;
+    struct spool_thread *st = &spool_mgr.st[sta->tid];
     sigset_t set;
     int err = 0;
 
@@ -88,14 +226,9 @@ void *spool_main(void *arg)
     pthread_sigmask(SIG_BLOCK, &set, NULL); /* oh, we do not care about the
                                              * errs */
     while (!hro.spool_thread_stop) {
-        err = sem_wait(&spool_mgr.rin_sem);
-        if (err == EINTR)
-            continue;
-        gk_debug(root, "Service thread %d wakeup to handle the requests.\n",
-                   sta->tid);
         /* trying to handle more and more requsts. */
         while (1) {
-            err = __serv_request();
+            err = __serv_request(sta->tid);
             if (err == -EHSTOP)
                 break;
             else if (err) {
@@ -103,6 +236,20 @@ void *spool_main(void *arg)
                          err);
             }
         }
+        atomic_inc(&st->sleepers);
+        /* pairs w/ the barrier in __spool_wake() */
+        __sync_synchronize();
+        if (__spool_pending(sta->tid) || hro.spool_thread_stop) {
+            /* retract the token, or eat the post bound to it */
+            if (atomic_dec_if_positive(&st->sleepers) < 0)
+                sem_wait(&st->sem);
+            continue;
+        }
+        err = sem_wait(&st->sem);
+        if (err == EINTR)
+            continue;
+        gk_debug(root, "Service thread %d wakeup to handle the requests.\n",
+                   sta->tid);
     }
     pthread_exit(0);
 }
@@ -112,15 +259,39 @@ int root_spool_create(void)
     struct spool_thread_arg *sta;
     int i, err = 0;
     
-    /* init the mgr struct */
-    INIT_LIST_HEAD(&spool_mgr.reqin);
-    xlock_init(&spool_mgr.rin_lock);
-    sem_init(&spool_mgr.rin_sem, 0, 0);
-
     /* init service threads' pool */
     if (!hro.conf.service_threads)
         hro.conf.service_threads = 4;
 
+    /* init the mgr struct */
+    err = posix_memalign((void **)&spool_mgr.st, 64,
+                         hro.conf.service_threads *
+                         sizeof(struct spool_thread));
+    if (err) {
+        gk_err(root, "alloc spool thread queues failed w/ %d\n", err);
+        spool_mgr.st = NULL;
+        return -ENOMEM;
+    }
+    for (i = 0; i < hro.conf.service_threads; i++) {
+        struct spool_thread *st = &spool_mgr.st[i];
+
+        err = lfq_init(&st->ring, SPOOL_RING);
+        if (err) {
+            gk_err(root, "init spool thread %d ring failed w/ %d\n", i, err);
+            while (--i >= 0)
+                lfq_destroy(&spool_mgr.st[i].ring);
+            free(spool_mgr.st);
+            spool_mgr.st = NULL;
+            return err;
+        }
+        INIT_LIST_HEAD(&st->reqin);
+        xlock_init(&st->lock);
+        atomic64_set(&st->qd, 0);
+        sem_init(&st->sem, 0, 0);
+        atomic_set(&st->sleepers, 0);
+    }
+    atomic_set(&spool_mgr.rr, 0);
+
     hro.spool_thread = xzalloc(hro.conf.service_threads * sizeof(pthread_t));
     if (!hro.spool_thread) {
         gk_err(root, "xzalloc() pthread_t failed\n");
@@ -155,10 +326,15 @@ void root_spool_destroy(void)
 
     hro.spool_thread_stop = 1;
     for (i = 0; i < hro.conf.service_threads; i++) {
-        sem_post(&spool_mgr.rin_sem);
+        sem_post(&spool_mgr.st[i].sem);
     }
     for (i = 0; i < hro.conf.service_threads; i++) {
         pthread_join(*(hro.spool_thread + i), NULL);
     }
-    sem_destroy(&spool_mgr.rin_sem);
+    for (i = 0; i < hro.conf.service_threads; i++) {
+        sem_destroy(&spool_mgr.st[i].sem);
+        lfq_destroy(&spool_mgr.st[i].ring);
+    }
+    free(spool_mgr.st);
+    spool_mgr.st = NULL;
 }
@@ -122,7 +122,10 @@ void __simply_send_reply(struct xnet_msg *msg, int err)
  * fashion. If the site state is TRANSIENT, we should just wait a moment for
  * the state change. If the site state is ERROR, we should do a recover process.
  *
- * Return ABI: | hxi info(fixed size) | root info | site_table |
+ * Return ABI: | hxi info(fixed size) | root info | site_table | ring |
+ *
+ * The requester gets the consistent hash ring of its fsid in the reply.
+ * Registering does not join the ring, see root_do_join().
  */
 int root_do_reg(struct xnet_msg *msg)
 {
@@ -132,9 +135,9 @@ int root_do_reg(struct xnet_msg *msg)
     struct addr_entry *addr;
     struct root_tx *root_tx;
     u64 nsite;
-    void *addr_data = NULL;
+    void *addr_data = NULL, *ring_data = NULL;
     u64 fsid;
-    int addr_len;
+    int addr_len, ring_len;
     int err = 0, saved_err = 0;
 
     err = __prepare_xnet_msg(msg, &rpy);
@@ -312,6 +315,19 @@ relookup_addr:
         goto send_rpy;
     }
     err = __pack_msg(rpy, addr_data, addr_len);
+    if (err) {
+        gk_err(root, "pack addr table failed w/ %d\n", err);
+        goto send_rpy;
+    }
+
+    /* pack the consistent hash ring */
+    err = chring_pack(&addr->ring, &ring_data, &ring_len);
+    if (err) {
+        gk_err(root, "pack the ring for %lx failed w/ %d\n",
+               nsite, err);
+        goto send_rpy;
+    }
+    err = __pack_msg(rpy, ring_data, ring_len);
     
     if (err) {
         /* if we got the ERECOVER error, we should send the data region to the
@@ -328,6 +344,7 @@ send_rpy:
         __root_send_rpy(rpy, err);
     /* free the allocated resources */
     xfree(addr_data);
+    xfree(ring_data);
     
 out:
     xnet_free_msg(msg);
@@ -663,6 +680,183 @@ out:
     return err;
 }
 
+/* root_do_join() add an MDS to the consistent hash ring of its fsid.
+ *
+ * Only an active MDS registered in group GK_GID_RING may join, and it asks
+ * only after the members handed its slice of the namespaces over (see
+ * mds_ring_join()). Membership is sticky across unreg/reg and only an
+ * address table removal (cli_do_rmvsite) takes it out. The other active
+ * sites get the new ring by the timer (cli_check_ring).
+ */
+int root_do_join(struct xnet_msg *msg)
+{
+    struct site_entry *se;
+    struct addr_entry *addr;
+    struct xnet_msg *rpy;
+    int err = 0;
+
+    /* ABI:
+     * tx.ssite_id: the joining MDS
+     *
+     * Reply ABI:
+     * tx.arg0: the ring version
+     */
+    err = __prepare_xnet_msg(msg, &rpy);
+    if (err) {
+        gk_err(root, "prepare reply msg failed w/ %d\n", err);
+        goto out_free;
+    }
+
+    if (!GK_IS_MDS(msg->tx.ssite_id)) {
+        err = -EINVAL;
+        goto out;
+    }
+    se = site_mgr_lookup(&hro.site, msg->tx.ssite_id);
+    if (IS_ERR(se)) {
+        gk_err(root, "site mgr lookup %lx failed w/ %ld\n",
+               msg->tx.ssite_id, PTR_ERR(se));
+        err = PTR_ERR(se);
+        goto out;
+    }
+    if (se->state != SE_STATE_NORMAL || se->gid != GK_GID_RING) {
+        gk_err(root, "site %lx in state %x group %d can not join the "
+               "ring\n", se->site_id, se->state, se->gid);
+        err = -EINVAL;
+        goto out;
+    }
+    addr = addr_mgr_lookup(&hro.addr, se->fsid);
+    if (IS_ERR(addr)) {
+        gk_err(root, "lookup addr for fsid %ld failed w/ %ld\n",
+               se->fsid, PTR_ERR(addr));
+        err = PTR_ERR(addr);
+        goto out;
+    }
+    err = chring_add_site(&addr->ring, se->site_id);
+    if (err < 0) {
+        gk_err(root, "add site %lx to the ring failed w/ %d\n",
+               se->site_id, err);
+        goto out;
+    }
+    if (err)
+        gk_info(root, "site %lx joined the ring of fsid %ld, version %ld\n",
+                se->site_id, se->fsid, addr->ring.version);
+    rpy->tx.arg0 = addr->ring.version;
+    err = 0;
+
+out:
+    __root_send_rpy(rpy, err);
+out_free:
+    xnet_free_msg(msg);
+
+    return err;
+}
+
+/* root_do_owner() keep the namespaces moved off their ring owner. R2 holds
+ * them for an MDS which lost its own copy, see mds_migrate_sync().
+ */
+int root_do_owner(struct xnet_msg *msg)
+{
+    struct site_entry *se;
+    struct addr_entry *addr;
+    struct xnet_msg *rpy = NULL;
+    void *p, *end, *data = NULL;
+    u32 len;
+    int dlen, err = 0;
+
+    /* ABI:
+     * tx.ssite_id: the source MDS
+     * tx.arg0: GK_OWNER_SET or GK_OWNER_SYNC
+     * SET:  tx.arg1: the new owner, 0 if the source owns it again
+     *       xm_data: the namespace
+     * SYNC: tx.arg1: 1 if the source has its own copy, which replaces ours
+     *       xm_data: | u64 site_id | u32 len | namespace |...
+     *
+     * Reply ABI (SYNC):
+     * xm_data: the records kept for the source
+     */
+    if (msg->tx.flag & XNET_NEED_REPLY) {
+        err = __prepare_xnet_msg(msg, &rpy);
+        if (err) {
+            gk_err(root, "prepare reply msg failed w/ %d\n", err);
+            goto out_free;
+        }
+    }
+
+    se = site_mgr_lookup(&hro.site, msg->tx.ssite_id);
+    if (IS_ERR(se)) {
+        gk_err(root, "site mgr lookup %lx failed w/ %ld\n",
+               msg->tx.ssite_id, PTR_ERR(se));
+        err = PTR_ERR(se);
+        goto out;
+    }
+    addr = addr_mgr_lookup(&hro.addr, se->fsid);
+    if (IS_ERR(addr)) {
+        gk_err(root, "lookup addr for fsid %ld failed w/ %ld\n",
+               se->fsid, PTR_ERR(addr));
+        err = PTR_ERR(addr);
+        goto out;
+    }
+
+    switch (msg->tx.arg0) {
+    case GK_OWNER_SET:
+        if (!msg->xm_datacheck || !msg->tx.len) {
+            err = -EINVAL;
+            break;
+        }
+        err = addr_mgr_owner_set(addr, se->site_id, msg->xm_data,
+                                 msg->tx.len, msg->tx.arg1);
+        break;
+    case GK_OWNER_SYNC:
+        if (!msg->tx.arg1)
+            goto pack;
+        addr_mgr_owner_clear(addr, se->site_id);
+        p = msg->xm_datacheck ? msg->xm_data : NULL;
+        end = p + (p ? msg->tx.len : 0);
+        while (p < end) {
+            if (p + sizeof(u64) + sizeof(u32) > end) {
+                err = -EINVAL;
+                break;
+            }
+            len = *(u32 *)(p + sizeof(u64));
+            if (!len || p + sizeof(u64) + sizeof(u32) + len > end) {
+                err = -EINVAL;
+                break;
+            }
+            err = addr_mgr_owner_set(addr, se->site_id,
+                                     p + sizeof(u64) + sizeof(u32), len,
+                                     *(u64 *)p);
+            if (err)
+                break;
+            p += sizeof(u64) + sizeof(u32) + len;
+        }
+        if (err)
+            break;
+    pack:
+        if (!rpy)
+            break;
+        err = addr_mgr_owner_pack(addr, se->site_id, &data, &dlen);
+        if (!err && dlen)
+            xnet_msg_add_sdata(rpy, data, dlen);
+        gk_info(root, "synced moved namespaces of %lx, %d in fsid %ld\n",
+                se->site_id, addr->onr, se->fsid);
+        break;
+    default:
+        err = -EINVAL;
+    }
+    if (err)
+        gk_err(root, "owner op %ld from %lx failed w/ %d\n",
+               msg->tx.arg0, msg->tx.ssite_id, err);
+
+out:
+    if (rpy)
+        __root_send_rpy(rpy, err);
+    xfree(data);
+out_free:
+    xnet_free_msg(msg);
+
+    return err;
+}
+
 /* root_do_prof() merge the per-MDS stats together
  */
 int root_do_prof(struct xnet_msg *msg)
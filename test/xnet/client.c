@@ -98,6 +98,127 @@ int msg_wait()
 }
 
 int cli_do_put(u64, char *, char *, char *);
+int cli_do_get(u64, char *, char *, char *);
+
+/* # of namespaces to spread the keys over */
+static int nsnr = 1;
+/* pad keys to keylen bytes, send precomputed key hash if khash */
+static int keylen = 0;
+static int khash = 0;
+/* value length of PUTs */
+static int vlen = 127;
+/* spread GETs over MDS 0 (primary) and the following N replicas */
+static int replicas = 0;
+static atomic64_t repl_fallback;
+static long repl_max_stale = 0;
+/* # of requests rejected w/ -EBUSY by the MDS admission control */
+static atomic64_t busy_retry;
+/* # of requests dropped by the MDS w/ -ETIMEDOUT as the budget ran out */
+static atomic64_t expired;
+/* budget of GET/PUT in ms, -1 for the xnet send timeout, 0 for none */
+static int budget = -1;
+/* lookup latency histogram, LKP_HIST_RES us per bucket */
+#define LKP_HIST_RES    5
+#define LKP_HIST_MAX    20000
+static atomic64_t lkp_hist[LKP_HIST_MAX];
+/* route by the ring cached from R2, or send all to MDS 0 to forward */
+static int cring = 1;
+static u64 mds_regmap[(GK_SITE_N_MASK + 1) / 64];
+static xlock_t mds_reg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int cli_do_reg(u64, char *, int);
+
+/* __mds_reg() register to the MDS once, it needs our address to reply
+ */
+static inline
+int __mds_reg(u64 site_id)
+{
+    u64 n = site_id & GK_SITE_N_MASK, bit = 1UL << (n & 63);
+    int err = 0;
+
+    if (mds_regmap[n >> 6] & bit)
+        return 0;
+    xlock_lock(&mds_reg_lock);
+    if (!(mds_regmap[n >> 6] & bit)) {
+        err = cli_do_reg(site_id, ipaddr[0], port[1]);
+        if (err) {
+            gk_err(xnet, "reg self %lx to MDS %lx failed w/ %d\n",
+                   hmo.xc->site_id, site_id, err);
+        } else
+            mds_regmap[n >> 6] |= bit;
+    }
+    xlock_unlock(&mds_reg_lock);
+
+    return err;
+}
+
+static inline
+u64 __ns_owner(char *ns)
+{
+    u64 site_id = -1UL;
+
+    if (cring)
+        site_id = chring_lookup(&hmo.chring,
+                                gk_hash_chring(ns, strlen(ns)));
+    if (site_id == -1UL)
+        site_id = GK_MDS(0);
+    __mds_reg(site_id);
+
+    return site_id;
+}
+
+static inline
+char *__ns_name(char *buf, int i)
+{
+    if (nsnr <= 1)
+        return "ik141000000";
+    sprintf(buf, "ik1410%05d", i % nsnr);
+    return buf;
+}
+
+static inline
+char *__key_name(char *buf, int i)
+{
+    if (keylen > 16)
+        sprintf(buf, "key.%0*d", keylen - 4, i);
+    else
+        sprintf(buf, "key.%d", i);
+    return buf;
+}
+
+static inline
+u64 __now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static inline
+void __lkp_hist_add(u64 us)
+{
+    us /= LKP_HIST_RES;
+    atomic64_inc(&lkp_hist[min(us, (u64)LKP_HIST_MAX - 1)]);
+}
+
+/* __lkp_hist_pct() return the @pct percentile of the lookup latency in us
+ */
+static long __lkp_hist_pct(double pct)
+{
+    long total = 0, sum = 0;
+    int i;
+
+    for (i = 0; i < LKP_HIST_MAX; i++)
+        total += atomic64_read(&lkp_hist[i]);
+    for (i = 0; i < LKP_HIST_MAX; i++) {
+        sum += atomic64_read(&lkp_hist[i]);
+        if (sum >= total * pct)
+            break;
+    }
+
+    return (long)(i + 1) * LKP_HIST_RES;
+}
 
 static inline
 void __random_set(char *buf, int len)
@@ -113,33 +234,58 @@ int msg_send(int entry, int op, int base)
 {
     lib_timer_def();
     int i, err = 0;
-    char key[32], value[128];
+    char key[256], value[128], ns[32], *n, *v = value;
 
     switch (op) {
     case OP_CREATE:
+        if (vlen >= sizeof(value)) {
+            v = xzalloc(vlen + 1);
+            if (!v)
+                return -ENOMEM;
+        }
         lib_timer_B();
         for (i = 0; i < entry; i++) {
             memset(key, 0, sizeof(key));
             memset(value, 0, sizeof(value));
-            sprintf(key, "key.%d", base + i);
-            __random_set(value, 127);
-            cli_do_put(GK_MDS(0), "ik141000000",
-                       key, value);
+            __key_name(key, base + i);
+            __random_set(v, vlen);
+            n = __ns_name(ns, base + i);
+            do {
+                err = cli_do_put(__ns_owner(n), n, key, v);
+            } while (err == -EBUSY);
         }
         lib_timer_E();
         lib_timer_O(entry, "Create Latency: ");
+        if (v != value)
+            xfree(v);
         break;
     case OP_LOOKUP:
         lib_timer_B();
         for (i = 0; i < entry; i++) {
+            u64 begin = __now_us();
+
             memset(key, 0, sizeof(key));
             memset(value, 0, sizeof(value));
-            sprintf(key, "key.%d", base + i);
-            cli_do_get(GK_MDS(0), "ik141000000",
-                       key, NULL);
+            __key_name(key, base + i);
+            n = __ns_name(ns, base + i);
+            do {
+                err = cli_do_get(replicas ? GK_MDS(i % (replicas + 1)) :
+                                 __ns_owner(n), n, key, NULL);
+            } while (err == -EBUSY);
+            if (err == -EAGAIN) {
+                /* the replica is too stale, go to the primary */
+                atomic64_inc(&repl_fallback);
+                err = cli_do_get(GK_MDS(0), __ns_name(ns, base + i),
+                                 key, NULL);
+            }
+            __lkp_hist_add(__now_us() - begin);
         }
         lib_timer_E();
         lib_timer_O(entry, "Lookup Latency: ");
+        if (replicas)
+            gk_info(xnet, "Replica reads: fallback %ld, max staleness "
+                    "%ld ms\n", atomic64_read(&repl_fallback),
+                    repl_max_stale);
         break;
     default:;
     }
@@ -232,7 +378,7 @@ int r2cli_do_hb(u64 request_site, u64 root_site, u64 fsid, u32 gid)
     hxi = (union gk_x_info *)&hci;
     
     /* alloc one msg and send it to the peer site */
-    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    msg = xnet_alloc_msg(XNET_MSG_CACHE);
     if (!msg) {
         gk_err(xnet, "xnet_alloc_msg() failed\n");
         err = -ENOMEM;
@@ -290,7 +436,7 @@ int cli_do_reg(u64 request_site, char *ip, int port)
     }
 
     /* alloc one msg and send it to the peer site */
-    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    msg = xnet_alloc_msg(XNET_MSG_CACHE);
     if (!msg) {
         gk_err(xnet, "xnet_alloc_msg() failed\n");
         err = -ENOMEM;
@@ -345,7 +491,7 @@ int cli_do_put(u64 request_site, char *namespace, char *key, char *value)
         l3 = strlen(value);
 
     /* alloc one msg and send it to the peer site */
-    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    msg = xnet_alloc_msg(XNET_MSG_CACHE);
     if (!msg) {
         gk_err(xnet, "xnet_alloc_msg() failed\n");
         err = -ENOMEM;
@@ -355,6 +501,12 @@ int cli_do_put(u64 request_site, char *namespace, char *key, char *value)
     xnet_msg_fill_tx(msg, XNET_MSG_REQ, XNET_NEED_REPLY,
                      hmo.xc->site_id, request_site);
     xnet_msg_fill_cmd(msg, GK_CLT2MDS_PUT, ((u64)l1 << 32) | l2, l3);
+    if (budget)
+        xnet_msg_set_budget(msg, budget);
+    if (khash) {
+        msg->tx.flag |= XNET_RESERVED_USED;
+        msg->tx.reserved = kvs_key_hash(key, l2);
+    }
 #ifdef XNET_EAGER_WRITEV
     xnet_msg_add_sdata(msg, &msg->tx, sizeof(msg->tx));
 #endif
@@ -367,6 +519,15 @@ int cli_do_put(u64 request_site, char *namespace, char *key, char *value)
         gk_err(xnet, "xnet_send() failed w/ %d\n", err);
         goto out;
     }
+    if (msg->pair && msg->pair->tx.err == -EBUSY) {
+        /* rejected by the admission control, back off as told */
+        atomic64_inc(&busy_retry);
+        usleep(msg->pair->tx.arg1);
+        err = -EBUSY;
+    } else if (msg->pair && msg->pair->tx.err == -ETIMEDOUT) {
+        atomic64_inc(&expired);
+        err = -ETIMEDOUT;
+    }
 
 out:
     xnet_free_msg(msg);
@@ -392,7 +553,7 @@ int cli_do_get(u64 request_site, char *namespace, char *key, char *value2check)
         l2 = strlen(key);
 
     /* alloc one msg and send it to the peer site */
-    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    msg = xnet_alloc_msg(XNET_MSG_CACHE);
     if (unlikely(!msg)) {
         gk_err(xnet, "xnet_alloc_msg() failed\n");
         err = -ENOMEM;
@@ -402,6 +563,12 @@ int cli_do_get(u64 request_site, char *namespace, char *key, char *value2check)
     xnet_msg_fill_tx(msg, XNET_MSG_REQ, XNET_NEED_REPLY,
                      hmo.xc->site_id, request_site);
     xnet_msg_fill_cmd(msg, GK_CLT2MDS_GET, l1, l2);
+    if (budget)
+        xnet_msg_set_budget(msg, budget);
+    if (khash) {
+        msg->tx.flag |= XNET_RESERVED_USED;
+        msg->tx.reserved = kvs_key_hash(key, l2);
+    }
 #ifdef XNET_EAGER_WRITEV
     xnet_msg_add_sdata(msg, &msg->tx, sizeof(msg->tx));
 #endif
@@ -416,12 +583,24 @@ int cli_do_get(u64 request_site, char *namespace, char *key, char *value2check)
 
     /* parse and check the result */
     ASSERT(msg->pair, xnet);
+    if (unlikely(msg->pair->tx.err == -EBUSY)) {
+        /* rejected by the admission control, back off as told */
+        atomic64_inc(&busy_retry);
+        usleep(msg->pair->tx.arg1);
+        err = -EBUSY;
+        goto out;
+    }
+    if (unlikely(msg->pair->tx.err == -ETIMEDOUT))
+        atomic64_inc(&expired);
     if (unlikely(msg->pair->tx.err)) {
-        gk_err(xnet, "get(%s@%s) failed w/ %s\n",
-               namespace, key, strerror(-msg->pair->tx.err));
+        if (msg->pair->tx.err != -EAGAIN && msg->pair->tx.err != -ETIMEDOUT)
+            gk_err(xnet, "get(%s@%s) failed w/ %s\n",
+                   namespace, key, strerror(-msg->pair->tx.err));
         err = msg->pair->tx.err;
         goto out;
     }
+    if (msg->pair->tx.arg1 > repl_max_stale)
+        repl_max_stale = msg->pair->tx.arg1;
     if (msg->pair->xm_datacheck) {
         char *data = msg->pair->xm_data;
 
@@ -463,7 +642,7 @@ int r2cli_do_reg(u64 request_site, u64 root_site, u64 fsid, u32 gid,
     }
 
     /* alloc one msg and send it to the peer site */
-    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    msg = xnet_alloc_msg(XNET_MSG_CACHE);
     if (!msg) {
         gk_err(xnet, "xnet_alloc_msg() failed\n");
         err = -ENOMEM;
@@ -545,12 +724,28 @@ resend:
             gk_err(root, "bparse addr failed w/ %d\n", err);
             goto out;
         }
+        data += err;
         /* add the site table to the xnet */
         err = hst_to_xsst(hst, err - sizeof(u32));
         if (err) {
             gk_err(root, "hst to xsst failed w/ %d\n", err);
         }
 
+        /* parse the consistent hash ring */
+        if (data < msg->pair->xm_data + msg->pair->tx.len) {
+            struct chring_tx *ct;
+            int len;
+
+            len = bparse_ring(data, &ct);
+            if (len < 0) {
+                gk_err(root, "bparse ring failed w/ %d\n", len);
+            } else if (chring_unpack(&hmo.chring, ct,
+                                     len - sizeof(u32)) > 0) {
+                gk_info(root, "ring version %ld w/ %d MDS\n",
+                        hmo.chring.version, hmo.chring.nsite);
+            }
+        }
+
         /* set network magic */
         xnet_set_magic(msg->pair->tx.arg0);
 
@@ -577,7 +772,7 @@ int r2cli_do_unreg(u64 request_site, u64 root_site, u64 fsid, u32 gid)
     hxi = (union gk_x_info *)&hci;
 
     /* alloc one msg and send it to the perr site */
-    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    msg = xnet_alloc_msg(XNET_MSG_CACHE);
     if (!msg) {
         gk_err(xnet, "xnet_alloc_msg() failed\n");
         err = -ENOMEM;
@@ -660,6 +855,9 @@ int client_dispatch(struct xnet_msg *msg)
     case GK_FR2_AU:
         err = mds_addr_table_update(msg);
         break;
+    case GK_FR2_RU:
+        err = mds_ring_update(msg);
+        break;
     default:
         gk_err(xnet, "Client core dispatcher handle INVALID "
                  "request <0x%lx %d>\n",
@@ -673,12 +871,12 @@ int client_dispatch(struct xnet_msg *msg)
 int main(int argc, char *argv[])
 {
     struct xnet_type_ops ops = {
-        .buf_alloc = NULL,
-        .buf_free = NULL,
+        .buf_alloc = xnet_buf_alloc,
+        .buf_free = xnet_buf_free,
         .recv_handler = client_dispatch,
     };
     int err = 0;
-    int self, sport = -1, thread;
+    int self, sport = -1, thread, i;
     long entry;
     int op;
     char *value;
@@ -705,6 +903,45 @@ int main(int argc, char *argv[])
     } else {
         thread = 1;
     }
+    value = getenv("nsnr");
+    if (value) {
+        nsnr = atoi(value);
+    }
+    value = getenv("keylen");
+    if (value) {
+        keylen = min(atoi(value), 255);
+    }
+    value = getenv("khash");
+    if (value) {
+        khash = atoi(value);
+    }
+    value = getenv("vlen");
+    if (value) {
+        vlen = atoi(value);
+    }
+    value = getenv("replicas");
+    if (value) {
+        replicas = atoi(value);
+    }
+    value = getenv("cring");
+    if (value) {
+        cring = atoi(value);
+    }
+    value = getenv("budget");
+    if (value) {
+        budget = atoi(value);
+    }
+    value = getenv("port");
+    if (value) {
+        /* run several clients on one host */
+        port[1] = atoi(value);
+    }
+    value = getenv("bufpool");
+    if (value && !atoi(value)) {
+        /* plain xmalloc()ed payload buffers */
+        ops.buf_alloc = NULL;
+        ops.buf_free = NULL;
+    }
     value = getenv("LOG_DIR");
     if (value) {
         log_home = strdup(value);
@@ -722,6 +959,8 @@ int main(int argc, char *argv[])
     hmo.gossip_thread_stop = 1;
     if (hmo.conf.xnet_resend_to)
         g_xnet_conf.resend_timeout = hmo.conf.xnet_resend_to;
+    if (budget < 0)
+        budget = g_xnet_conf.send_timeout * 1000;
     
     //SET_TRACING_FLAG(xnet, GK_DEBUG);
     //SET_TRACING_FLAG(mds, GK_DEBUG | GK_VERBOSE);
@@ -768,11 +1007,25 @@ int main(int argc, char *argv[])
         goto out;
     }
 
-    err = cli_do_reg(GK_MDS(0), ipaddr[0], port[1]);
-    if (err) {
-        gk_err(xnet, "reg self %lx to MDS %x failed w/ %d\n",
-               hmo.xc->site_id, GK_MDS(0), err);
-        goto out;
+    for (i = 0; i <= replicas; i++) {
+        err = __mds_reg(GK_MDS(i));
+        if (err)
+            goto out;
+    }
+    /* any ring member may reply, even if we send to MDS 0 only */
+    {
+        u64 *sites;
+        int n;
+
+        n = chring_get_sites(&hmo.chring, &sites);
+        for (i = 0; i < n; i++) {
+            err = __mds_reg(sites[i]);
+            if (err)
+                break;
+        }
+        xfree(sites);
+        if (err)
+            goto out;
     }
     
     {
@@ -794,6 +1047,35 @@ int main(int argc, char *argv[])
         lib_timer_A(&acc);
         gk_info(xnet, "Aggr IOPS [op=%d]: %lf\n", op,
                   (double)entry * 1000000.0 / acc);
+        if (op == OP_LOOKUP)
+            gk_info(xnet, "Lookup latency p50 %ld us p99 %ld us\n",
+                    __lkp_hist_pct(0.5), __lkp_hist_pct(0.99));
+        if (atomic64_read(&expired))
+            gk_info(xnet, "Expired requests: %ld\n",
+                    atomic64_read(&expired));
+        if (atomic64_read(&busy_retry))
+            gk_info(xnet, "Busy retries: %ld\n",
+                    atomic64_read(&busy_retry));
+        gk_info(xnet, "Recv %ld msgs w/ %ld syscalls (%.2f/msg), "
+                "in %.1f MB/s out %.1f MB/s\n",
+                atomic64_read(&g_xnet_prof.inmsgs),
+                atomic64_read(&g_xnet_prof.recvs),
+                atomic64_read(&g_xnet_prof.inmsgs) ?
+                (double)atomic64_read(&g_xnet_prof.recvs) /
+                atomic64_read(&g_xnet_prof.inmsgs) : 0.0,
+                atomic64_read(&g_xnet_prof.inbytes) / acc,
+                atomic64_read(&g_xnet_prof.outbytes) / acc);
+        gk_info(xnet, "Msg alloc %ld free %ld cache hit %.1f%%, "
+                "buf alloc %ld cache hit %.1f%%\n",
+                atomic64_read(&g_xnet_prof.msg_alloc),
+                atomic64_read(&g_xnet_prof.msg_free),
+                atomic64_read(&g_xnet_prof.msg_alloc) ?
+                100.0 * atomic64_read(&g_xnet_prof.msg_cache_hit) /
+                atomic64_read(&g_xnet_prof.msg_alloc) : 0.0,
+                atomic64_read(&g_xnet_prof.buf_alloc),
+                atomic64_read(&g_xnet_prof.buf_alloc) ?
+                100.0 * atomic64_read(&g_xnet_prof.buf_cache_hit) /
+                atomic64_read(&g_xnet_prof.buf_alloc) : 0.0);
     }
     
     sleep(200);
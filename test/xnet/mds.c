@@ -33,6 +33,8 @@
 #define TYPE_ROOT       3
 
 u64 fsid = 0;
+/* replicas register out of the ring group */
+u32 gid = GK_GID_RING;
 
 char *ipaddr[] = {
     "127.0.0.1",              /* root */
@@ -181,12 +183,28 @@ resend:
             gk_err(root, "bparse addr failed w/ %d\n", err);
             goto out;
         }
+        data += err;
         /* add the site table to the xnet */
         err = hst_to_xsst(hst, err - sizeof(u32));
         if (err) {
             gk_err(root, "hst to xsst failed w/ %d\n", err);
         }
 
+        /* parse the consistent hash ring */
+        if (data < msg->pair->xm_data + msg->pair->tx.len) {
+            struct chring_tx *ct;
+            int len;
+
+            len = bparse_ring(data, &ct);
+            if (len < 0) {
+                gk_err(root, "bparse ring failed w/ %d\n", len);
+            } else if (chring_unpack(&hmo.chring, ct,
+                                     len - sizeof(u32)) > 0) {
+                gk_info(root, "ring version %ld w/ %d MDS\n",
+                        hmo.chring.version, hmo.chring.nsite);
+            }
+        }
+
         /* set network magic */
         xnet_set_magic(msg->pair->tx.arg0);
     }
@@ -251,6 +269,49 @@ out_nofree:
     return err;
 }
 
+/* r2cli_do_join() ask R2 to add this MDS to the ring, after mds_ring_join()
+ */
+static
+int r2cli_do_join(u64 root_site)
+{
+    struct xnet_msg *msg;
+    int err = 0;
+
+    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    if (!msg) {
+        gk_err(xnet, "xnet_alloc_msg() failed\n");
+        err = -ENOMEM;
+        goto out_nofree;
+    }
+
+    xnet_msg_fill_tx(msg, XNET_MSG_REQ, XNET_NEED_REPLY,
+                     hmo.xc->site_id, root_site);
+    xnet_msg_fill_cmd(msg, GK_R2_JOIN, 0, 0);
+#ifdef XNET_EAGER_WRITEV
+    xnet_msg_add_sdata(msg, &msg->tx, sizeof(msg->tx));
+#endif
+
+    err = xnet_send(hmo.xc, msg);
+    if (err) {
+        gk_err(xnet, "xnet_send() failed\n");
+        goto out;
+    }
+
+    ASSERT(msg->pair, xnet);
+    if (msg->pair->tx.err) {
+        gk_err(xnet, "Join site %lx failed w/ %d\n", hmo.xc->site_id,
+               msg->pair->tx.err);
+        err = msg->pair->tx.err;
+        goto out;
+    }
+    gk_info(xnet, "Joined the ring version %ld\n", msg->pair->tx.arg0);
+
+out:
+    xnet_free_msg(msg);
+out_nofree:
+    return err;
+}
+
 /* r2cli_do_hb()
  *
  * @gid: already right shift 2 bits
@@ -298,7 +359,7 @@ void mds_cb_exit(void *arg)
 {
     int err = 0;
 
-    err = r2cli_do_unreg(hmo.xc->site_id, GK_RING(0), fsid, 0);
+    err = r2cli_do_unreg(hmo.xc->site_id, GK_RING(0), fsid, gid);
     if (err) {
         gk_err(xnet, "unreg self %lx w/ r2 %x failed w/ %d\n",
                  hmo.xc->site_id, GK_RING(0), err);
@@ -312,7 +373,7 @@ void mds_cb_hb(void *arg)
     int err = 0;
 
     ring_site = mds_select_ring(&hmo);
-    err = r2cli_do_hb(hmo.xc->site_id, ring_site, fsid, 0);
+    err = r2cli_do_hb(hmo.xc->site_id, ring_site, fsid, gid);
     if (err) {
         gk_err(xnet, "hb %lx w/ r2 %x failed w/ %d\n",
                  hmo.xc->site_id, GK_RING(0), err);
@@ -343,11 +404,35 @@ out:
     return;
 }
 
+/* migrate_main() move namespace $migrate to MDS $migrate_to after
+ * $migrate_delay seconds, the clients keep running against us
+ */
+static void *migrate_main(void *arg)
+{
+    struct gstring ns;
+    char *value;
+    int delay = 5, err;
+
+    value = getenv("migrate_delay");
+    if (value)
+        delay = atoi(value);
+    sleep(delay);
+
+    ns.start = getenv("migrate");
+    ns.len = strlen(ns.start);
+    err = mds_migrate_start(&ns, GK_MDS(atoi(getenv("migrate_to"))));
+    if (err) {
+        gk_err(xnet, "migrate namespace %s failed w/ %d\n", ns.start, err);
+    }
+
+    return NULL;
+}
+
 int main(int argc, char *argv[])
 {
     struct xnet_type_ops ops = {
-        .buf_alloc = NULL,
-        .buf_free = NULL,
+        .buf_alloc = xnet_buf_alloc,
+        .buf_free = xnet_buf_free,
         .recv_handler = mds_spool_dispatch,
         .dispatcher = mds_fe_dispatch,
     };
@@ -379,6 +464,12 @@ int main(int argc, char *argv[])
     } else
         plot_method = MDS_PROF_PLOT;
 
+    value = getenv("bufpool");
+    if (value && !atoi(value)) {
+        /* plain xmalloc()ed payload buffers */
+        ops.buf_alloc = NULL;
+        ops.buf_free = NULL;
+    }
     value = getenv("LOG_DIR");
     if (value) {
         log_home = strdup(value);
@@ -415,6 +506,9 @@ int main(int argc, char *argv[])
 
     xnet_update_ipaddr(GK_ROOT(0), 1, &ipaddr[0], (short *)(&port[0]));
     sport = port[1];
+    value = getenv("port");
+    if (value)
+        sport = atoi(value);
 
     hmo.xc = xnet_register_type(0, sport, self, &ops);
     if (IS_ERR(hmo.xc)) {
@@ -428,7 +522,9 @@ int main(int argc, char *argv[])
     hmo.cb_addr_table_update = mds_cb_addr_table_update;
 
     /* use root info to init the mds */
-    err = r2cli_do_reg(self, GK_ROOT(0), fsid, 0);
+    if (hmo.conf.option & GK_MDS_REPLICA)
+        gid = GK_GID_REPLICA;
+    err = r2cli_do_reg(self, GK_ROOT(0), fsid, gid);
     if (err) {
         gk_err(xnet, "reg self %x w/ r2 %x failed w/ %d\n",
                self, GK_ROOT(0), err);
@@ -444,8 +540,34 @@ int main(int argc, char *argv[])
         goto out;
     }
 
+    /* the moved namespaces are kept by R2 as well */
+    if (!(hmo.conf.option & GK_MDS_REPLICA)) {
+        err = mds_migrate_sync();
+        if (err)
+            gk_warning(xnet, "sync moved namespaces w/ R2 failed w/ %d\n",
+                       err);
+    }
+
+    /* join the ring w/ our slice of the namespaces */
+    if (getenv("ring") && !(hmo.conf.option & GK_MDS_REPLICA)) {
+        err = mds_ring_join();
+        if (!err)
+            err = r2cli_do_join(GK_ROOT(0));
+        if (err) {
+            gk_err(xnet, "join the ring failed w/ %d\n", err);
+            goto out;
+        }
+    }
+
     gk_info(xnet, "MDS is UP for serving requests now.\n");
 
+    if (getenv("migrate") && getenv("migrate_to")) {
+        pthread_t mt;
+
+        pthread_create(&mt, NULL, migrate_main, NULL);
+        pthread_detach(mt);
+    }
+
     msg_wait();
 
     xnet_unregister_type(hmo.xc);
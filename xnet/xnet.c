@@ -23,6 +23,8 @@
 
 #include "gk.h"
 #include "xnet.h"
+#include "lib.h"
+#include <malloc.h>
 
 TRACING_FLAG(xnet, GK_DEFAULT_LEVEL);
 void xnet_reset_tracing_flags(u64 flag)
@@ -30,9 +32,222 @@ void xnet_reset_tracing_flags(u64 flag)
     gk_xnet_tracing_flags = flag;
 }
 
+/* Object pools: a freed xnet_msg or payload buffer is cached in a per
+ * thread magazine. Full magazines are exchanged w/ a global depot under a
+ * lock, thus a receive thread which only allocates and a spool thread
+ * which only frees still hit the cache.
+ *
+ * Payload buffers are size-classed by power of two from 64B to 64KB. A
+ * buffer is pooled by its usable size, thus any buffer from xmalloc() may
+ * be freed into the pools, and a pool buffer may be released by xfree().
+ */
+#define XNET_POOL_MSG           0
+#define XNET_POOL_BUF_MIN       6       /* 64B */
+#define XNET_POOL_BUF_MAX       16      /* 64KB */
+#define XNET_POOL_NR            (XNET_POOL_BUF_MAX - XNET_POOL_BUF_MIN + 2)
+#define XNET_POOL_DEPOT         16      /* full magazines per pool */
+#define XNET_POOL_MAG_BYTES     (256 * 1024)
+
+#ifdef USE_JEMALLOC
+#define __xnet_usable_size(p)   JEMALLOC_P(malloc_usable_size)(p)
+#else
+#define __xnet_usable_size(p)   malloc_usable_size(p)
+#endif
+
+struct xnet_mag
+{
+    void *head;                 /* objects chained by their first word */
+    int nr;
+};
+
+struct xnet_pool
+{
+    xlock_t lock;
+    int nr;                     /* # of full magazines in the depot */
+    void *depot[XNET_POOL_DEPOT];
+};
+
+static struct xnet_pool xnet_pool[XNET_POOL_NR] = {
+    [0 ... XNET_POOL_NR - 1] = { .lock = XLOCK_INITIALIZER, },
+};
+static __thread struct xnet_mag xnet_tc[XNET_POOL_NR];
+static __thread int xnet_tc_armed = 0;
+static pthread_key_t xnet_tc_key;
+static pthread_once_t xnet_tc_once = PTHREAD_ONCE_INIT;
+
+/* __xnet_pool_mag() return the # of objects per magazine of pool @i
+ */
+static inline
+int __xnet_pool_mag(int i)
+{
+    int nr;
+
+    if (i == XNET_POOL_MSG)
+        return 64;
+    nr = XNET_POOL_MAG_BYTES >> (XNET_POOL_BUF_MIN + i - 1);
+
+    return max(4, min(64, nr));
+}
+
+/* __xnet_tc_destroy() release the cached objects of an exiting thread
+ */
+static void __xnet_tc_destroy(void *arg)
+{
+    struct xnet_mag *m = arg;
+    void *o;
+    int i;
+
+    for (i = 0; i < XNET_POOL_NR; i++) {
+        while (m[i].head) {
+            o = m[i].head;
+            m[i].head = *(void **)o;
+            xfree(o);
+        }
+        m[i].nr = 0;
+    }
+}
+
+static void __xnet_tc_key_init(void)
+{
+    pthread_key_create(&xnet_tc_key, __xnet_tc_destroy);
+}
+
+/* __xnet_tc_arm() register the magazines of this thread to be released on
+ * its exit, before it caches any object
+ */
+static inline
+void __xnet_tc_arm(void)
+{
+    if (unlikely(!xnet_tc_armed)) {
+        pthread_once(&xnet_tc_once, __xnet_tc_key_init);
+        pthread_setspecific(xnet_tc_key, xnet_tc);
+        xnet_tc_armed = 1;
+    }
+}
+
+static void *__xnet_pool_get(int i)
+{
+    struct xnet_mag *m = &xnet_tc[i];
+    struct xnet_pool *p = &xnet_pool[i];
+    void *o;
+
+    if (unlikely(!m->head)) {
+        if (!p->nr)
+            return NULL;
+        __xnet_tc_arm();
+        xlock_lock(&p->lock);
+        if (p->nr) {
+            m->head = p->depot[--p->nr];
+            m->nr = __xnet_pool_mag(i);
+        }
+        xlock_unlock(&p->lock);
+        if (!m->head)
+            return NULL;
+    }
+    o = m->head;
+    m->head = *(void **)o;
+    m->nr--;
+
+    return o;
+}
+
+/* __xnet_pool_put() return 0 if @o is cached, otherwise the caller should
+ * free it
+ */
+static int __xnet_pool_put(int i, void *o)
+{
+    struct xnet_mag *m = &xnet_tc[i];
+    struct xnet_pool *p = &xnet_pool[i];
+
+    __xnet_tc_arm();
+    if (unlikely(m->nr >= __xnet_pool_mag(i))) {
+        xlock_lock(&p->lock);
+        if (p->nr < XNET_POOL_DEPOT) {
+            p->depot[p->nr++] = m->head;
+            m->head = NULL;
+            m->nr = 0;
+        }
+        xlock_unlock(&p->lock);
+        if (m->nr)
+            return -ENOSPC;
+    }
+    *(void **)o = m->head;
+    m->head = o;
+    m->nr++;
+
+    return 0;
+}
+
+/* xnet_pool_drain() release the full magazines in the depot, the thread
+ * magazines are released as their threads exit
+ */
+void xnet_pool_drain(void)
+{
+    struct xnet_pool *p;
+    void *m, *o;
+    int i;
+
+    for (i = 0; i < XNET_POOL_NR; i++) {
+        p = &xnet_pool[i];
+        xlock_lock(&p->lock);
+        while (p->nr) {
+            m = p->depot[--p->nr];
+            while (m) {
+                o = m;
+                m = *(void **)o;
+                xfree(o);
+            }
+        }
+        xlock_unlock(&p->lock);
+    }
+}
+
+/* xnet_buf_alloc() allocate a payload buffer from the size-classed pools,
+ * it is a xnet_type_ops.buf_alloc callback
+ */
+void *xnet_buf_alloc(size_t size, int alloc_flag)
+{
+    void *buf;
+    int s;
+
+#ifdef USE_XNET_SIMPLE
+    atomic64_inc(&g_xnet_prof.buf_alloc);
+#endif
+    if (unlikely(size > (1UL << XNET_POOL_BUF_MAX)))
+        return xmalloc(size);
+    s = size <= (1UL << XNET_POOL_BUF_MIN) ? XNET_POOL_BUF_MIN :
+        fls64(size - 1) + 1;
+    buf = __xnet_pool_get(s - XNET_POOL_BUF_MIN + 1);
+    if (buf) {
+#ifdef USE_XNET_SIMPLE
+        atomic64_inc(&g_xnet_prof.buf_cache_hit);
+#endif
+        return buf;
+    }
+
+    return xmalloc(1UL << s);
+}
+
+/* xnet_buf_free() cache a buffer in the pool of its usable size, it is a
+ * xnet_type_ops.buf_free callback
+ */
+void xnet_buf_free(void *buf, int alloc_flag)
+{
+    size_t usable;
+    int s;
+
+    if (unlikely(!buf))
+        return;
+    usable = __xnet_usable_size(buf);
+    s = fls64(usable);
+    if (s < XNET_POOL_BUF_MIN || s > XNET_POOL_BUF_MAX ||
+        __xnet_pool_put(s - XNET_POOL_BUF_MIN + 1, buf))
+        xfree(buf);
+}
+
 struct xnet_msg *xnet_alloc_msg(u8 alloc_flag)
 {
-    struct xnet_msg *msg;
+    struct xnet_msg *msg = NULL;
 
 #ifndef USE_XNET_SIMPLE
     /* fast method */
@@ -44,13 +259,25 @@ struct xnet_msg *xnet_alloc_msg(u8 alloc_flag)
         return NULL;
 #endif
 
-    msg = xzalloc(sizeof(struct xnet_msg));
-    if (unlikely(!msg)) {
-        gk_err(xnet, "xzalloc() struct xnet_msg failed\n");
-        return NULL;
+    if (alloc_flag == XNET_MSG_CACHE) {
+        msg = __xnet_pool_get(XNET_POOL_MSG);
+        if (msg) {
+            memset(msg, 0, sizeof(struct xnet_msg));
+#ifdef USE_XNET_SIMPLE
+            atomic64_inc(&g_xnet_prof.msg_cache_hit);
+#endif
+        }
+    }
+    if (!msg) {
+        msg = xzalloc(sizeof(struct xnet_msg));
+        if (unlikely(!msg)) {
+            gk_err(xnet, "xzalloc() struct xnet_msg failed\n");
+            return NULL;
+        }
     }
 
     INIT_LIST_HEAD(&msg->list);
+    msg->alloc_flag = alloc_flag;
 
 #ifdef USE_XNET_SIMPLE
     sem_init(&msg->event, 0, 0);
@@ -64,8 +291,8 @@ struct xnet_msg *xnet_alloc_msg(u8 alloc_flag)
 void xnet_raw_free_msg(struct xnet_msg *msg)
 {
     if (atomic_dec_return(&msg->ref) == 0) {
-        /* FIXME: check whether this msg is in the cache */
-        xfree(msg);
+        if (__xnet_pool_put(XNET_POOL_MSG, msg))
+            xfree(msg);
 #ifdef USE_XNET_SIMPLE
         atomic64_inc(&g_xnet_prof.msg_free);
 #endif
@@ -108,7 +335,8 @@ void xnet_free_msg(struct xnet_msg *msg)
         if (msg->riov)
             xfree(msg->riov);
     }
-    xfree(msg);
+    if (__xnet_pool_put(XNET_POOL_MSG, msg))
+        xfree(msg);
 #ifdef USE_XNET_SIMPLE
     atomic64_inc(&g_xnet_prof.msg_free);
 #endif
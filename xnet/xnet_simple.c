@@ -53,6 +53,7 @@ struct xnet_conf g_xnet_conf = {
     .enable_resend = 0,
     .pause = 0,
     .use_rpy_cache = 0,
+    .reactors = 1,
 };
 
 void xnet_set_magic(u8 magic)
@@ -124,25 +125,204 @@ struct active_conn
     int sockfd;
 };
 
+/* Receive reactors: each one waits on its own epoll set and receives the
+ * messages of its connections. A connection is sharded to reactor
+ * fd % nr, thus any thread finds the epoll set of a fd w/o a lookup, and
+ * the messages of one connection are received in order by one thread.
+ * Reactor 0 also owns the listening socket and accepts for the others.
+ */
+struct xnet_reactor
+{
+    pthread_t thread;
+    int epfd;
+    int id;
+};
+
+#define XNET_REACTOR_MAX        64
+#define XNET_EPOLL_EVENTS       64
+
+static struct xnet_reactor xnet_reactor[XNET_REACTOR_MAX];
+static int xnet_reactor_nr = 1;
+
 struct site_table gst;
-pthread_t pollin_thread;        /* poll-in any requests */
 pthread_t resend_thread;        /* resend the pending requests */
 LIST_HEAD(accept_list);         /* recored the accepted sockets */
+xlock_t accept_lock = XLOCK_INITIALIZER; /* protect accept_list */
 LIST_HEAD(active_list);         /* recored the actived sockets */
 xlock_t active_list_lock;
 int lsock = 0;                  /* local listening socket */
-int epfd = 0;
+int epfd = 0;                   /* epoll set of reactor 0 */
 int pollin_thread_stop = 0;
 int resend_thread_stop = 0;
 atomic_t global_reqno;
 LIST_HEAD(global_xc_list);
 
+void xnet_set_reactors(int nr)
+{
+    if (nr < 1)
+        nr = 1;
+    if (nr > XNET_REACTOR_MAX)
+        nr = XNET_REACTOR_MAX;
+    g_xnet_conf.reactors = nr;
+}
+
+/* __xnet_epfd() return the epoll set of the reactor owning @fd
+ */
+static inline
+int __xnet_epfd(int fd)
+{
+    return xnet_reactor[fd % xnet_reactor_nr].epfd;
+}
+
+/* Receive buffers: each connection owns a ring filled by one large
+ * non-blocking read, thus a burst of small messages costs one recv()
+ * instead of two per message. Messages are parsed out of the buffer
+ * while they are complete, a partial one stays buffered until the next
+ * event. Only the owner reactor touches the buffer of a fd; the other
+ * threads closing a connection bump the generation of the fd, and the
+ * owner drops the stale bytes once it sees the new generation.
+ */
+#define XNET_RBUF_SIZE          (64 * 1024)
+#define XNET_RBUF_FDS           (64 * 1024)
+
+struct xnet_rbuf
+{
+    u32 head, tail;             /* unparsed bytes are [head, tail) */
+    int drained;                /* a short read emptied the socket */
+    u32 gen;                    /* generation of the fd the bytes are of */
+    char buf[XNET_RBUF_SIZE];
+};
+
+static struct xnet_rbuf *xnet_rbuf[XNET_RBUF_FDS];
+static u32 xnet_rbuf_gen[XNET_RBUF_FDS];
+
+/* __xnet_rbuf_get() return the buffer of @fd, or NULL to read unbuffered
+ */
+static inline
+struct xnet_rbuf *__xnet_rbuf_get(int fd)
+{
+    struct xnet_rbuf *rb;
+    u32 gen;
+
+    if (unlikely(fd < 0 || fd >= XNET_RBUF_FDS))
+        return NULL;
+    gen = *(volatile u32 *)&xnet_rbuf_gen[fd];
+    rb = xnet_rbuf[fd];
+    if (unlikely(!rb)) {
+        rb = xmalloc(sizeof(*rb));
+        if (!rb)
+            return NULL;
+        rb->gen = gen - 1;
+        xnet_rbuf[fd] = rb;
+    }
+    if (unlikely(rb->gen != gen)) {
+        /* a new connection reuses the fd */
+        rb->head = rb->tail = 0;
+        rb->drained = 0;
+        rb->gen = gen;
+    }
+
+    return rb;
+}
+
+/* __xnet_rbuf_reset() retire the buffered bytes of @fd before it is
+ * closed by any thread, the owner reactor resets the buffer lazily
+ */
+static inline
+void __xnet_rbuf_reset(int fd)
+{
+    if (fd >= 0 && fd < XNET_RBUF_FDS)
+        __sync_fetch_and_add(&xnet_rbuf_gen[fd], 1);
+}
+
+/* __xnet_rbuf_free() release the buffer of @fd, called by the owner
+ * reactor tearing the connection down, or after the reactors exit
+ */
+static inline
+void __xnet_rbuf_free(int fd)
+{
+    if (fd >= 0 && fd < XNET_RBUF_FDS && xnet_rbuf[fd]) {
+        xfree(xnet_rbuf[fd]);
+        xnet_rbuf[fd] = NULL;
+    }
+}
+
+/* __xnet_rbuf_arm() a new edge of @fd, the socket may have data again
+ */
+static inline
+void __xnet_rbuf_arm(int fd)
+{
+    if (fd >= 0 && fd < XNET_RBUF_FDS && xnet_rbuf[fd])
+        xnet_rbuf[fd]->drained = 0;
+}
+
+/* __xnet_rbuf_fill() read until @want bytes are buffered. Return 1 if
+ * they are, 0 on EAGAIN (the partial bytes are kept), -1 if the
+ * connection is broken.
+ *
+ * A read shorter than the free space has emptied the socket, thus we
+ * return 0 w/o the EAGAIN read; the next arriving bytes raise a new
+ * edge, which re-arms the buffer.
+ */
+static
+int __xnet_rbuf_fill(int fd, struct xnet_rbuf *rb, u32 want)
+{
+    int bt;
+
+    while (rb->tail - rb->head < want) {
+        if (rb->drained)
+            return 0;
+        if (rb->head && rb->head + want > XNET_RBUF_SIZE) {
+            memmove(rb->buf, rb->buf + rb->head, rb->tail - rb->head);
+            rb->tail -= rb->head;
+            rb->head = 0;
+        }
+        bt = recv(fd, rb->buf + rb->tail, XNET_RBUF_SIZE - rb->tail,
+                  MSG_DONTWAIT | MSG_NOSIGNAL);
+        atomic64_inc(&g_xnet_prof.recvs);
+        if (bt < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return 0;
+            gk_verbose(xnet, "read() err %d w/ %u buffered\n",
+                       errno, rb->tail - rb->head);
+            return -1;
+        } else if (bt == 0) {
+            /* EOF of the socket stream */
+            return -1;
+        }
+        if (bt < XNET_RBUF_SIZE - rb->tail)
+            rb->drained = 1;
+        rb->tail += bt;
+    }
+
+    return 1;
+}
+
+/* __xnet_rbuf_copy() move up to @len buffered bytes to @buf, return the
+ * # of bytes moved
+ */
+static inline
+u32 __xnet_rbuf_copy(struct xnet_rbuf *rb, void *buf, u64 len)
+{
+    u32 n = min(len, (u64)(rb->tail - rb->head));
+
+    memcpy(buf, rb->buf + rb->head, n);
+    rb->head += n;
+    if (rb->head == rb->tail)
+        rb->head = rb->tail = 0;
+
+    return n;
+}
+
 static inline
 int accept_lookup(int fd)
 {
     struct accept_conn *pos, *n;
     int ret = 0;
 
+    xlock_lock(&accept_lock);
     list_for_each_entry_safe(pos, n, &accept_list, list) {
         if (pos->sockfd == fd) {
             ret = 1;
@@ -151,6 +331,7 @@ int accept_lookup(int fd)
             break;
         }
     }
+    xlock_unlock(&accept_lock);
 
     return ret;
 }
@@ -347,6 +528,7 @@ int __xnet_handle_tx(int fd)
 {
     struct xnet_msg *msg, *req;
     struct xnet_context *xc;
+    struct xnet_rbuf *rb;
     u32 br;
     int bt;
     int next = 1;               /* this means we should retry the read */
@@ -356,8 +538,30 @@ int __xnet_handle_tx(int fd)
     lib_timer_def();
     lib_timer_B();
 #endif
+
+    rb = __xnet_rbuf_get(fd);
+    if (likely(rb)) {
+        struct xnet_msg_tx *tx;
+        u64 len;
+
+        /* parse the next message only if it is complete, large payloads
+         * are read directly into their buffer below */
+        next = __xnet_rbuf_fill(fd, rb, sizeof(struct xnet_msg_tx));
+        if (next <= 0)
+            return next;
+        tx = (struct xnet_msg_tx *)(rb->buf + rb->head);
+        len = tx->len;
+#ifndef XNET_EAGER_WRITEV
+        len += sizeof(struct xnet_msg_tx);
+#endif
+        if (len <= XNET_RBUF_SIZE) {
+            next = __xnet_rbuf_fill(fd, rb, len);
+            if (next <= 0)
+                return next;
+        }
+    }
     
-    msg = xnet_alloc_msg(XNET_MSG_NORMAL);
+    msg = xnet_alloc_msg(XNET_MSG_CACHE);
     if (unlikely(!msg)) {
         gk_err(xnet, "xnet_alloc_msg() failed\n");
         /* FIXME: we should put this fd in the retry queue, we can retry the
@@ -368,9 +572,12 @@ int __xnet_handle_tx(int fd)
     msg->state = XNET_MSG_RX;
     /* receive the tx */
     br = 0;
-    do {
+    if (likely(rb))
+        br = __xnet_rbuf_copy(rb, &msg->tx, sizeof(struct xnet_msg_tx));
+    while (br < sizeof(struct xnet_msg_tx)) {
         bt = recv(fd, ((void *)&msg->tx) + br, 
                   sizeof(struct xnet_msg_tx) - br, flag | MSG_NOSIGNAL);
+        atomic64_inc(&g_xnet_prof.recvs);
         if (unlikely(bt < 0)) {
             if (errno == EAGAIN && !br) {
                 /* pseudo calling, just return */
@@ -391,8 +598,9 @@ int __xnet_handle_tx(int fd)
         }
         br += bt;
         flag = 0;
-    } while (br < sizeof(struct xnet_msg_tx));
+    }
     atomic64_add(br, &g_xnet_prof.inbytes);
+    atomic64_inc(&g_xnet_prof.inmsgs);
 
     gk_debug(xnet, "We have recieved the MSG_TX from %lx dpayload %u\n",
              msg->tx.ssite_id, msg->tx.len);
@@ -440,7 +648,7 @@ int __xnet_handle_tx(int fd)
                         /* shutdown the connection now */
                         struct epoll_event ev;
                         
-                        err = epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+                        err = epoll_ctl(__xnet_epfd(fd), EPOLL_CTL_DEL, fd, &ev);
                         if (err) {
                             gk_err(xnet, "epoll_ctl del fd %d failed w/ %s\n",
                                    fd, strerror(errno));
@@ -500,6 +708,9 @@ int __xnet_handle_tx(int fd)
         }
     }
 
+    /* the payload goes back to xc->ops.buf_free() */
+    msg->xc = xc;
+
     /* receive the data if exists */
 #ifdef XNET_EAGER_WRITEV
     msg->tx.len -= sizeof(struct xnet_msg_tx);
@@ -513,7 +724,8 @@ int __xnet_handle_tx(int fd)
         if (xc->ops.buf_alloc)
             buf = xc->ops.buf_alloc(msg->tx.len, msg->tx.cmd);
         else {
-            buf = xzalloc(msg->tx.len);
+            /* fully overwritten by recv(), do not zero it */
+            buf = xmalloc(msg->tx.len);
         }
         /* we should default to free all the resource from xnet. */
         xnet_set_auto_free(msg);
@@ -525,8 +737,11 @@ int __xnet_handle_tx(int fd)
             goto out_raw_free;
         }
         br = 0;
-        do {
+        if (likely(rb))
+            br = __xnet_rbuf_copy(rb, buf, msg->tx.len);
+        while (br < msg->tx.len) {
             bt = recv(fd, buf + br, msg->tx.len - br, MSG_WAITALL | MSG_NOSIGNAL);
+            atomic64_inc(&g_xnet_prof.recvs);
             if (unlikely(bt < 0)) {
                 gk_verbose(xnet, "read() err %d w/ br %d(%d)\n", 
                              errno, br, msg->tx.len);
@@ -544,7 +759,7 @@ int __xnet_handle_tx(int fd)
                 goto out_raw_free;
             }
             br += bt;
-        } while (br < msg->tx.len);
+        }
 
         /* add the data to the riov */
         xnet_msg_add_rdata(msg, buf, br);
@@ -559,7 +774,8 @@ int __xnet_handle_tx(int fd)
         if (xc->ops.buf_alloc)
             buf = xc->ops.buf_alloc(msg->tx.len, msg->tx.cmd);
         else {
-            buf = xzalloc(msg->tx.len);
+            /* fully overwritten by recv(), do not zero it */
+            buf = xmalloc(msg->tx.len);
         }
         /* we should default to free all the resource from xnet. */
         xnet_set_auto_free(msg);
@@ -571,13 +787,16 @@ int __xnet_handle_tx(int fd)
             goto out_raw_free;
         }
 
-        do {
+        if (likely(rb))
+            recved = __xnet_rbuf_copy(rb, buf, msg->tx.len);
+        while (recved < msg->tx.len) {
             len = min(__MAX_MSG_SIZE, msg->tx.len - recved);
             
             br = 0;
             do {
                 bt = recv(fd, buf + br + recved, len - br, 
                           MSG_WAITALL | MSG_NOSIGNAL);
+                atomic64_inc(&g_xnet_prof.recvs);
                 if (bt < 0) {
                     gk_verbose(xnet, "read() err %d w/ br %d(%ld)\n", 
                                  errno, br, len);
@@ -598,7 +817,7 @@ int __xnet_handle_tx(int fd)
                 br += bt;
             } while (br < len);
             recved += len;
-        } while (recved < msg->tx.len);
+        }
         /* add the data to the riov */
         xnet_msg_add_rdata(msg, buf, msg->tx.len);
         atomic64_add(msg->tx.len, &g_xnet_prof.inbytes);
@@ -764,13 +983,14 @@ out:
 
 void *pollin_thread_main(void *arg)
 {
-    struct epoll_event ev, events[10];
+    struct xnet_reactor *r = (struct xnet_reactor *)arg;
+    struct epoll_event ev, events[XNET_EPOLL_EVENTS];
     struct sockaddr_in addr = {0,};
     socklen_t addrlen = sizeof(struct sockaddr_in);
     struct accept_conn *ac;
     sigset_t set;
     int asock, i;
-    int err, nfds;
+    int err = 0, nfds;
     
     /* first, let us block the SIGALRM */
     sigemptyset(&set);
@@ -779,18 +999,21 @@ void *pollin_thread_main(void *arg)
     pthread_sigmask(SIG_BLOCK, &set, NULL);
 
     memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLIN;
-    ev.data.fd = lsock;
-    err = epoll_ctl(epfd, EPOLL_CTL_ADD, lsock, &ev);
-    if (err < 0) {
-        gk_err(xnet, "epoll_ctl() add fd %d failed %d\n", lsock, errno);
-        err = -errno;
-        goto out;
+    if (r->id == 0) {
+        ev.events = EPOLLIN;
+        ev.data.fd = lsock;
+        err = epoll_ctl(r->epfd, EPOLL_CTL_ADD, lsock, &ev);
+        if (err < 0) {
+            gk_err(xnet, "epoll_ctl() add fd %d failed %d\n", lsock, errno);
+            err = -errno;
+            goto out;
+        }
     }
     
-    gk_debug(xnet, "POLL-IN thread running, waiting for any request in...\n");
+    gk_debug(xnet, "POLL-IN thread %d running, waiting for any request in...\n",
+             r->id);
     for (; !pollin_thread_stop;) {
-        nfds = epoll_wait(epfd, events, 10, 50);
+        nfds = epoll_wait(r->epfd, events, XNET_EPOLL_EVENTS, 50);
         if (nfds == -1) {
             gk_debug(xnet, "epoll_wait() failed %d\n", errno);
             continue;
@@ -810,13 +1033,16 @@ void *pollin_thread_main(void *arg)
                 }
                 INIT_LIST_HEAD(&ac->list);
                 ac->sockfd = asock;
+                /* before the owner reactor may see its hello message */
+                xlock_lock(&accept_lock);
                 list_add_tail(&ac->list, &accept_list);
+                xlock_unlock(&accept_lock);
                 
                 setnonblocking(asock);
                 setnodelay(asock);
                 ev.events = EPOLLIN | EPOLLET;
                 ev.data.fd = asock;
-                err = epoll_ctl(epfd, EPOLL_CTL_ADD, asock, &ev);
+                err = epoll_ctl(__xnet_epfd(asock), EPOLL_CTL_ADD, asock, &ev);
                 if (err < 0) {
                     gk_err(xnet, "epoll_ctl() add fd %d failed %d\n",
                              asock, errno);
@@ -836,17 +1062,20 @@ void *pollin_thread_main(void *arg)
                 if (events[i].events & EPOLLERR) {
                     gk_err(xnet, "Hoo, the connection %d is broken.\n",
                              events[i].data.fd);
-                    epoll_ctl(epfd, EPOLL_CTL_DEL, events[i].data.fd, &ev);
+                    epoll_ctl(r->epfd, EPOLL_CTL_DEL, events[i].data.fd, &ev);
+                    __xnet_rbuf_free(events[i].data.fd);
                     st_clean_sockfd(&gst, events[i].data.fd);
                     continue;
                 }
+                __xnet_rbuf_arm(events[i].data.fd);
                 do {
                     next = __xnet_handle_tx(events[i].data.fd);
                     if (next < 0) {
                         /* this means the connection is shutdown */
                         gk_err(xnet, "connection %d is shutdown.\n",
                                  events[i].data.fd);
-                        epoll_ctl(epfd, EPOLL_CTL_DEL, events[i].data.fd, &ev);
+                        epoll_ctl(r->epfd, EPOLL_CTL_DEL, events[i].data.fd, &ev);
+                        __xnet_rbuf_free(events[i].data.fd);
                         st_clean_sockfd(&gst, events[i].data.fd);
                         break;
                     }
@@ -865,8 +1094,13 @@ int st_init(void)
     memset(&gst, 0, sizeof(gst));
     atomic64_set(&g_xnet_prof.msg_alloc, 0);
     atomic64_set(&g_xnet_prof.msg_free, 0);
+    atomic64_set(&g_xnet_prof.msg_cache_hit, 0);
+    atomic64_set(&g_xnet_prof.buf_alloc, 0);
+    atomic64_set(&g_xnet_prof.buf_cache_hit, 0);
     atomic64_set(&g_xnet_prof.inbytes, 0);
     atomic64_set(&g_xnet_prof.outbytes, 0);
+    atomic64_set(&g_xnet_prof.recvs, 0);
+    atomic64_set(&g_xnet_prof.inmsgs, 0);
     xlock_init(&active_list_lock);
 
     return 0;
@@ -1057,7 +1291,7 @@ int gst_update_sockfd(int fd, u64 dsid)
         /* shutdown the connection now */
         struct epoll_event ev;
         
-        err = epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+        err = epoll_ctl(__xnet_epfd(fd), EPOLL_CTL_DEL, fd, &ev);
         if (err) {
             gk_err(xnet, "epoll_ctl del fd %d failed w/ %s\n",
                    fd, strerror(errno));
@@ -1143,6 +1377,7 @@ int st_clean_sockfd(struct site_table *st, int fd)
     /* FIXME: should we dump the site table? */
     /* st_dump(st); */
     accept_lookup(fd);
+    __xnet_rbuf_reset(fd);
     close(fd);
     return 0;
 }
@@ -1319,7 +1554,7 @@ struct xnet_context *xnet_register_type(u8 type, u16 port, u64 site_id,
     struct sockaddr addr;
     struct sockaddr_in *ia = (struct sockaddr_in *)&addr;
     int val = 1;
-    int err;
+    int err, i, started = 0;
 
     /* init the global_reqno */
     atomic_set(&global_reqno, -1);
@@ -1410,26 +1645,39 @@ struct xnet_context *xnet_register_type(u8 type, u16 port, u64 site_id,
     gk_debug(xnet, "Listener start @ %s %d\n", inet_ntoa(ia->sin_addr),
                port);
     
-    /* create the epfd */
-    err = epoll_create(100);
-    if (err < 0) {
-        gk_err(xnet, "epoll_create1() failed %d\n", errno);
-        err = -errno;
-        goto out_close;
+    /* create the epfd of each reactor */
+    xnet_reactor_nr = g_xnet_conf.reactors;
+    for (i = 0; i < xnet_reactor_nr; i++) {
+        err = epoll_create(100);
+        if (err < 0) {
+            gk_err(xnet, "epoll_create1() failed %d\n", errno);
+            err = -errno;
+            goto out_close;
+        }
+        xnet_reactor[i].epfd = err;
+        xnet_reactor[i].id = i;
     }
-    epfd = err;
+    epfd = xnet_reactor[0].epfd;
 
-    /* we should create one thread to accept connections */
-    err = pthread_create(&pollin_thread, NULL, pollin_thread_main, NULL);
-    if (err) {
-        gk_err(xnet, "pthread_create() failed %d\n", err);
-        goto out_close;
+    /* reactor 0 also accepts the connections */
+    for (i = 0; i < xnet_reactor_nr; i++) {
+        err = pthread_create(&xnet_reactor[i].thread, NULL,
+                             pollin_thread_main, &xnet_reactor[i]);
+        if (err) {
+            gk_err(xnet, "pthread_create() failed %d\n", err);
+            err = -err;
+            goto out_close;
+        }
+        started++;
     }
+    if (xnet_reactor_nr > 1)
+        gk_info(xnet, "XNET receives w/ %d reactors\n", xnet_reactor_nr);
 
     /* we should create one thread to resend the requests */
     err = pthread_create(&resend_thread, NULL, resend_thread_main, xc);
     if (err) {
         gk_err(xnet, "pthread_create() failed %d\n", err);
+        err = -err;
         goto out_close;
     }
     
@@ -1437,7 +1685,21 @@ struct xnet_context *xnet_register_type(u8 type, u16 port, u64 site_id,
 
     return xc;
 out_close:
+    /* stop the reactors started, then close their epoll sets */
+    pollin_thread_stop = 1;
+    for (i = 0; i < started; i++) {
+        pthread_kill(xnet_reactor[i].thread, SIGUSR1);
+        pthread_join(xnet_reactor[i].thread, NULL);
+    }
+    pollin_thread_stop = 0;
+    for (i = 0; i < xnet_reactor_nr; i++) {
+        if (xnet_reactor[i].epfd)
+            close(xnet_reactor[i].epfd);
+        xnet_reactor[i].epfd = 0;
+    }
+    epfd = 0;
     close(lsock);
+    lsock = 0;
 out_free:
     xfree(xc);
     return ERR_PTR(err);
@@ -1445,10 +1707,14 @@ out_free:
 
 int xnet_unregister_type(struct xnet_context *xc)
 {
+    int i;
+
     /* waiting for the disconnections */
     pollin_thread_stop = 1;
-    pthread_kill(pollin_thread, SIGUSR1);
-    pthread_join(pollin_thread, NULL);
+    for (i = 0; i < xnet_reactor_nr; i++) {
+        pthread_kill(xnet_reactor[i].thread, SIGUSR1);
+        pthread_join(xnet_reactor[i].thread, NULL);
+    }
     resend_thread_stop = 1;
     pthread_kill(resend_thread, SIGUSR1);
     /* FIXME: if we do join, there is glibc memory corruption */
@@ -1456,12 +1722,21 @@ int xnet_unregister_type(struct xnet_context *xc)
     
     sem_destroy(&xc->wait);
 
+    /* the reactors are gone, nobody reads the buffers now */
+    for (i = 0; i < XNET_RBUF_FDS; i++)
+        __xnet_rbuf_free(i);
+    xnet_pool_drain();
+
     if (xc)
         xfree(xc);
     if (lsock)
         close(lsock);
-    if (epfd)
-        close(epfd);
+    for (i = 0; i < xnet_reactor_nr; i++) {
+        if (xnet_reactor[i].epfd)
+            close(xnet_reactor[i].epfd);
+        xnet_reactor[i].epfd = 0;
+    }
+    epfd = 0;
     return 0;
 }
 
@@ -1758,7 +2033,8 @@ retry:
                     /* if the orignal message is a random site
                      * message, pad the peer's recv fd to the
                      * request */
-                    if (htx.reserved > 0) {
+                    if (htx.reserved > 0 &&
+                        !(msg->tx.flag & XNET_RESERVED_USED)) {
                         msg->tx.reserved |= (htx.reserved << 32);
                     }
                 }
@@ -1768,12 +2044,12 @@ retry:
                 setnodelay(csock);
                 ev.events = EPOLLIN | EPOLLET;
                 ev.data.fd = csock;
-                err = epoll_ctl(epfd, EPOLL_CTL_ADD, csock, &ev);
+                err = epoll_ctl(__xnet_epfd(csock), EPOLL_CTL_ADD, csock, &ev);
                 if (err < 0) {
                     xlock_unlock(&xa->clock);
                     gk_err(xnet, "epoll_ctl() add fd %d to SET(%d) "
                              "failed %d\n", 
-                             csock, epfd, errno);
+                             csock, __xnet_epfd(csock), errno);
                     close(csock);
                     csock = 0;
                     sleep(1);
@@ -2110,7 +2386,8 @@ retry:
                     /* if the orignal message is a random site message
                      * or the first message, pad the peer's recv fd to
                      * the request */
-                    if (htx.reserved > 0) {
+                    if (htx.reserved > 0 &&
+                        !(msg->tx.flag & XNET_RESERVED_USED)) {
                         msg->tx.reserved |= (htx.reserved << 32);
                     }
                 }
@@ -2120,12 +2397,12 @@ retry:
                 setnodelay(csock);
                 ev.events = EPOLLIN | EPOLLET;
                 ev.data.fd = csock;
-                err = epoll_ctl(epfd, EPOLL_CTL_ADD, csock, &ev);
+                err = epoll_ctl(__xnet_epfd(csock), EPOLL_CTL_ADD, csock, &ev);
                 if (err < 0) {
                     xlock_unlock(&xa->clock);
                     gk_err(xnet, "epoll_ctl() add fd %d to SET(%d) "
                              "failed %d\n", 
-                             csock, epfd, errno);
+                             csock, __xnet_epfd(csock), errno);
                     close(csock);
                     csock = 0;
                     sleep(1);
@@ -2511,7 +2788,10 @@ void xnet_msg_free_rdata(struct xnet_msg *msg)
     }
     for (i = 0; i < msg->riov_ulen; i++) {
         ASSERT(msg->riov[i].iov_base, xnet);
-        xfree(msg->riov[i].iov_base);
+        if (msg->xc && msg->xc->ops.buf_free)
+            msg->xc->ops.buf_free(msg->riov[i].iov_base, msg->tx.cmd);
+        else
+            xfree(msg->riov[i].iov_base);
     }
     xfree(msg->riov);
 }